@@ -2,6 +2,7 @@
 <html><head>
 <?php
 
+$objconvertd_socket = '/tmp/objconvertd.sock';
 $show_main = TRUE;
 $show_head = TRUE;
 $del_dir = NULL;
@@ -37,6 +38,31 @@ function del($path)
     return unlink($path);
   }
 }
+// Runs objcompress with $args in the current directory, printing its
+// output. Goes through objconvertd when it listens on $socket (saving
+// the process start, and answering repeated uploads from its cache),
+// else starts the process.
+function objcompress($args, $socket, &$retval)
+{
+  $sock = @stream_socket_client("unix://$socket", $errno, $errstr);
+  if ($sock === FALSE)
+  {
+    system('objcompress '.implode(' ', array_map('escapeshellarg', $args)).' 2>&1', $retval);
+    return;
+  }
+  $request = 'dir '.getcwd()."\n";
+  foreach ($args as $arg) $request .= "arg $arg\n";
+  fwrite($sock, "$request\n");
+  $retval = 1;
+  while (($line = fgets($sock)) !== FALSE)
+  {
+    echo htmlentities($line);
+    flush();
+    if (strncmp($line, 'ok ', 3) == 0)    { $retval = 0; break; }
+    if (strncmp($line, 'error ', 6) == 0) { break; }
+  }
+  fclose($sock);
+}
 function file_size($file)
 {
   $bytes = filesize($file);
@@ -99,7 +125,6 @@ if ($upload)
   $obj_cmd = substr(escapeshellarg($objname), 1, -1);
   $mtl_cmd = substr(escapeshellarg($mtlname), 1, -1);
   $tmp_cmd = substr(escapeshellarg($tmp), 1, -1);
-  $name_cmd = substr(escapeshellarg($name), 1, -1);
 
   // Setup
   if (!mkdir($dir, 0775))                                                             { $errors[] = 'Server Issue: unable to create directory'; goto end; }
@@ -121,12 +146,14 @@ if ($upload)
   }
 
   // Compression
-  $w = $has_mtl?'':'-w ';
-  $cmd = "objcompress $w'$obj_cmd' '$name_cmd.utf8' 3>&1 1>'$name_cmd.js' 2>&3";
+  // Also writes the .gz copies and the tarred UTF8 files while compressing
+  $args = array('-gz', '-tar', "$name.utf8.tar", '-js', "$name.js", $objname, "$name.utf8");
+  if (!$has_mtl) array_unshift($args, '-w');
+  $cmd = "objcompress ".implode(' ', array_map('escapeshellarg', $args));
   echo '<p>Compressing... (<code>'.htmlentities($cmd).'</code>)</p><pre>';
   flush();
   $start = microtime(true);
-  system($cmd, $retval);
+  objcompress($args, $objconvertd_socket, $retval);
   $end = microtime(true);
   echo '</pre><p>Finished in '.($end-$start).' seconds</p>';
   if ($retval != 0)                                                                   { $errors[] = "Failed to compress the OBJ file ($retval)"; goto end; }
@@ -135,19 +162,17 @@ if ($upload)
   if ($normalize && (!unlink($objname) || !rename($tmp, $objname)))                   { $errors[] = 'Server Issue: unable to remove temp file'; goto end; }
 
   // Packaging
-  echo '<p>Compressing and packaging... (just some tar/gzip commands to save things for faster and easier downloading)</p><pre>';
+  // Packaging (the converted files were already gzipped and tarred by objcompress)
+  echo '<p>Compressing and packaging... (just some gzip commands to save the originals for faster and easier downloading)</p><pre>';
   flush();
   $start = microtime(true);
-  system("gzip -cv9 '$name_cmd.js' 3>&1 1>'$name_cmd.js.gz' 2>&3");
-  system('find . -type f -name \'*.utf8\' -exec sh -c \'gzip -cv9 "{}" > "{}.gz"\' \; 2>&1');
-  system("tar -cvf '$name_cmd.utf8.tar' *.utf8 2>&1", $retval);
-  system("gzip -v9 '$name_cmd.utf8.tar' 2>&1", $retval2);
-  system("gzip -v9 '$obj_cmd' 2>&1", $retval3);
-  if ($has_mtl) system("gzip -v9 '$mtl_cmd' 2>&1", $retval4);
-  else          $retval4 = 0;
+  $retval = unlink("$name.utf8.tar") ? 0 : 1;
+  system("gzip -v9 '$obj_cmd' 2>&1", $retval2);
+  if ($has_mtl) system("gzip -v9 '$mtl_cmd' 2>&1", $retval3);
+  else          $retval3 = 0;
   $end = microtime(true);
   echo '</pre><p>Finished in '.($end-$start).' seconds</p>';
-  if ($retval != 0 || $retval2 != 0 || $retval3 != 0 || $retval4 != 0)                { $errors[] = "Failed to package the files ($retval/$retval2/$retval3/$retval4)"; goto end; }
+  if ($retval != 0 || $retval2 != 0 || $retval3 != 0)                                 { $errors[] = "Failed to package the files ($retval/$retval2/$retval3)"; goto end; }
 
   // Add to Database
   $st = $db->prepare('INSERT INTO models (name, file) VALUES (?,?)'); // TODO: check error
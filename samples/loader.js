@@ -6,17 +6,76 @@
 //   decodeParams: {
 //     decodeOffsets: [ ... ],
 //     decodeScales: [ ... ],
+//     quantizationBits: [ ... ],
+//     octNormals: true,  // optional
 //   },
+//   frames: #,  // optional, number of animation frames
 //   urls: {
 //     'url': [
 //       { material: 'material_name',
+//         layout: 'PNT',  // which of position, normal, texcoord, color
+//         mode: 'LINES',  // optional, 'LINES' or 'POINTS' (else triangles)
 //         attribRange: [#, #],
-//         indexRange: [#, #],
+//         indexRange: [#, #],  // start, number of primitives
+//         morphTargets: [#, ...],  // with frames, one per later frame
 //         names: [ 'object names' ... ],
 //         lengths: [#, #, # ... ]
 //       }
 //     ],
 //     ...
+//   },
+//   lods: [  // optional, coarsest first
+//     { triangles: #,
+//       urls: { ... }
+//     },
+//     ...
+//   ],
+//   tiles: [  // optional, with urls left empty
+//     { path: 'octants',
+//       bounds: [minX, minY, minZ, maxX, maxY, maxZ],
+//       decodeParams: { ... },
+//       urls: { ... },
+//       lods: [ ... ]  // optional
+//     },
+//     ...
+//   ],
+//   objects: {  // optional, with urls left empty
+//     'object name': {
+//       bounds: [minX, minY, minZ, maxX, maxY, maxZ],
+//       urls: { ... },
+//       lods: [ ... ]  // optional
+//     },
+//     ...
+//   },
+//   shared: {  // optional, with urls left empty
+//     url: 'url',
+//     layout: 'PNT',  // of the one vertex stream
+//     attribRange: [0, #],  // number of vertices
+//     indexRange: [#, #],  // start, number of indices
+//     meshes: [
+//       { material: 'material_name',
+//         mode: 'LINES',  // optional
+//         indexRange: [#, #],  // first index, number of primitives
+//         names: [ 'object names' ... ],
+//         lengths: [#, #, # ... ]
+//       },
+//       ...
+//     ]
+//   },
+//   instances: {  // optional
+//     urls: { ... },  // one prototype per shape
+//     shapes: [  // for each name in urls, in order
+//       { names: [ 'group names' ... ],
+//         transforms: [scale, x, y, z, ...]  // one per name
+//       },
+//       ...
+//     ]
+//   },
+//   bvh: {  // groups numbered in the order their names appear above,
+//           then the instances' in the order of their shapes' names
+//     url: 'url',
+//     nodes: #,
+//     groups: #
 //   }
 // }
 var MODELS = {};
@@ -35,6 +94,33 @@ var DEFAULT_DECODE_PARAMS = {
   // 5) Morphing
 };
 
+// Output channels of each vertex layout, in the order they are
+// stored. Absent attributes decode as zeros. Colors (r, g, b) are
+// channels 8 to 10, which decodeParams only list for models that
+// have them.
+var LAYOUT_CHANNELS = {
+  P: [0, 1, 2],
+  PT: [0, 1, 2, 3, 4],
+  PN: [0, 1, 2, 5, 6, 7],
+  PNT: [0, 1, 2, 3, 4, 5, 6, 7],
+  PC: [0, 1, 2, 8, 9, 10],
+  PTC: [0, 1, 2, 3, 4, 8, 9, 10],
+  PNC: [0, 1, 2, 5, 6, 7, 8, 9, 10],
+  PNTC: [0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10]
+};
+
+// Indices per primitive of each mesh mode, triangles if absent.
+var PRIMITIVE_SIZES = {
+  TRIANGLES: 3,
+  LINES: 2,
+  POINTS: 1
+};
+
+function meshNumIndices_(meshParams) {
+  return PRIMITIVE_SIZES[meshParams.mode || 'TRIANGLES'] *
+      meshParams.indexRange[1];
+}
+
 // Triangle strips!
 
 // TODO: will it be an optimization to specialize this method at
@@ -52,6 +138,33 @@ function decompressAttribsInner_(str, inputStart, inputEnd,
   }
 }
 
+// Normals with octNormals are stored as two octahedral components,
+// which decompressAttribsInner_ decodes into the first two normal
+// slots. This unfolds them into unit vectors in place; the (-1, -1)
+// corner is the zero normal.
+function decodeOctNormals_(attribs, numVerts, stride, offset, decodeScale) {
+  var zeroLimit = 0.5*decodeScale - 2;
+  var end = stride * numVerts;
+  for (var i = offset; i < end; i += stride) {
+    var x = attribs[i];
+    var y = attribs[i + 1];
+    if (x + y < zeroLimit) {
+      attribs[i] = attribs[i + 1] = attribs[i + 2] = 0;
+      continue;
+    }
+    var z = 1 - Math.abs(x) - Math.abs(y);
+    if (z < 0) {
+      var foldedX = x;
+      x = (1 - Math.abs(y)) * (foldedX < 0 ? -1 : 1);
+      y = (1 - Math.abs(foldedX)) * (y < 0 ? -1 : 1);
+    }
+    var scale = 1 / Math.sqrt(x*x + y*y + z*z);
+    attribs[i] = x * scale;
+    attribs[i + 1] = y * scale;
+    attribs[i + 2] = z * scale;
+  }
+}
+
 function decompressIndices_(str, inputStart, numIndices,
                             output, outputStart) {
   var highest = 0;
@@ -64,6 +177,29 @@ function decompressIndices_(str, inputStart, numIndices,
   }
 }
 
+// Indices into a shared vertex stream may pass 16 bits, so the
+// distances below the high water mark come in 14-bit pieces, low bits
+// first, with 0x4000 set on all but the last.
+function decompressLongIndices_(str, inputStart, numIndices) {
+  var output = new Uint32Array(numIndices);
+  var highest = 0;
+  for (var i = 0; i < numIndices; i++) {
+    var code = 0;
+    var shift = 0;
+    var word;
+    do {
+      word = str.charCodeAt(inputStart++);
+      code += (word & 0x3FFF) * Math.pow(2, shift);
+      shift += 14;
+    } while (word & 0x4000);
+    output[i] = highest - code;
+    if (code == 0) {
+      highest++;
+    }
+  }
+  return output;
+}
+
 function decompressAABBs_(str, inputStart, numBBoxen,
                           decodeOffsets, decodeScales) {
   var numFloats = 6 * numBBoxen;
@@ -87,18 +223,58 @@ function decompressAABBs_(str, inputStart, numBBoxen,
   return bboxen;
 }
 
-function decompressMesh(str, meshParams, decodeParams, callback) {
-  // Extract conversion parameters from attribArrays.
-  var stride = decodeParams.decodeScales.length;
+// Decodes the positions of every later frame of an animated mesh. Each
+// is stored as deltas against the frame before, starting from the
+// quantized positions of the first frame.
+function decompressMorphTargets_(str, meshParams, decodeParams) {
   var decodeOffsets = decodeParams.decodeOffsets;
   var decodeScales = decodeParams.decodeScales;
   var attribStart = meshParams.attribRange[0];
   var numVerts = meshParams.attribRange[1];
+  var quantized = new Int32Array(3 * numVerts);
+  for (var j = 0; j < 3; j++) {
+    var prev = 0;
+    for (var i = 0; i < numVerts; i++) {
+      var code = str.charCodeAt(attribStart + j*numVerts + i);
+      prev += (code >> 1) ^ (-(code & 1));
+      quantized[3*i + j] = prev;
+    }
+  }
+  var morphTargets = [];
+  for (var k = 0; k < meshParams.morphTargets.length; k++) {
+    var inputStart = meshParams.morphTargets[k];
+    var positions = new Float32Array(3 * numVerts);
+    for (var j = 0; j < 3; j++) {
+      for (var i = 0; i < numVerts; i++) {
+        var code = str.charCodeAt(inputStart + j*numVerts + i);
+        var value = (quantized[3*i + j] + ((code >> 1) ^ (-(code & 1)))) &
+            0xFFFF;
+        quantized[3*i + j] = value;
+        positions[3*i + j] = decodeScales[j] * (value + decodeOffsets[j]);
+      }
+    }
+    morphTargets.push(positions);
+  }
+  return morphTargets;
+}
 
-  // Decode attributes.
-  var inputOffset = attribStart;
+// Decodes numVerts vertices of the given layout, stored channel by
+// channel from inputOffset, into a Float32Array with every channel of
+// decodeParams.
+function decompressAttribs_(str, inputOffset, numVerts, layout,
+                            decodeParams) {
+  // Extract conversion parameters from attribArrays.
+  var stride = decodeParams.decodeScales.length;
+  var decodeOffsets = decodeParams.decodeOffsets;
+  var decodeScales = decodeParams.decodeScales;
   var attribsOut = new Float32Array(stride * numVerts);
-  for (var j = 0; j < stride; j++) {
+  var channels = LAYOUT_CHANNELS[layout || 'PNT'];
+  var hasNormals = channels.indexOf(7) >= 0;
+  var octNormals = hasNormals && decodeParams.octNormals;
+  for (var i = 0; i < channels.length; i++) {
+    var j = channels[i];
+    // Octahedral normals only store the first two components.
+    if (octNormals && j == 7) continue;
     var end = inputOffset + numVerts;
     var decodeScale = decodeScales[j];
     if (decodeScale) {
@@ -110,18 +286,36 @@ function decompressMesh(str, meshParams, decodeParams, callback) {
     }
     inputOffset = end;
   }
+  if (octNormals) {
+    decodeOctNormals_(attribsOut, numVerts, stride, 5, decodeScales[5]);
+  }
+  return attribsOut;
+}
+
+function decompressMesh(str, meshParams, decodeParams, callback) {
+  // Decode attributes.
+  var attribsOut = decompressAttribs_(str, meshParams.attribRange[0],
+                                      meshParams.attribRange[1],
+                                      meshParams.layout, decodeParams);
 
   var indexStart = meshParams.indexRange[0];
-  var numIndices = 3*meshParams.indexRange[1];
+  var numIndices = meshNumIndices_(meshParams);
   var indicesOut = new Uint16Array(numIndices);
-  decompressIndices_(str, inputOffset, numIndices, indicesOut, 0);
+  decompressIndices_(str, indexStart, numIndices, indicesOut, 0);
 
   // Decode bboxen.
   var bboxen = undefined;
   var bboxOffset = meshParams.bboxes;
   if (bboxOffset) {
     bboxen = decompressAABBs_(str, bboxOffset, meshParams.names.length,
-                              decodeOffsets, decodeScales);
+                              decodeParams.decodeOffsets,
+                              decodeParams.decodeScales);
+  }
+  // Decode the positions of later animation frames, if any.
+  if (meshParams.morphTargets) {
+    callback(attribsOut, indicesOut, bboxen, meshParams,
+             decompressMorphTargets_(str, meshParams, decodeParams));
+    return;
   }
   callback(attribsOut, indicesOut, bboxen, meshParams);
 }
@@ -132,7 +326,12 @@ function downloadMesh(path, meshEntry, decodeParams, callback) {
     while (idx < meshEntry.length) {
       var meshParams = meshEntry[idx];
       var indexRange = meshParams.indexRange;
-      var meshEnd = indexRange[0] + 3*indexRange[1];
+      var meshEnd = indexRange[0] + meshNumIndices_(meshParams);
+      var morphTargets = meshParams.morphTargets;
+      if (morphTargets) {
+        meshEnd = morphTargets[morphTargets.length - 1] +
+            3*meshParams.attribRange[1];
+      }
       if (req.responseText.length < meshEnd) break;
 
       decompressMesh(req.responseText, meshParams, decodeParams, callback);
@@ -154,7 +353,191 @@ function downloadMeshes(path, meshUrlMap, decodeParams, callback) {
   }
 }
 
+// Downloads the tiles of a tiled model for which isVisible(tile)
+// is true, or all of them without isVisible.
+function downloadTiles(path, model, isVisible, callback) {
+  var tiles = MODELS[model].tiles || [];
+  for (var i = 0; i < tiles.length; i++) {
+    var tile = tiles[i];
+    if (!isVisible || isVisible(tile)) {
+      downloadMeshes(path, tile.urls, tile.decodeParams, callback);
+    }
+  }
+}
+
+// Downloads the objects of a model named in names, or all of them
+// without names. Objects share the model's decodeParams.
+function downloadObjects(path, model, names, callback) {
+  var objects = MODELS[model].objects || {};
+  names = names || Object.keys(objects);
+  for (var i = 0; i < names.length; i++) {
+    var object = objects[names[i]];
+    if (object) {
+      downloadMeshes(path, object.urls, MODELS[model].decodeParams, callback);
+    }
+  }
+}
+
+// Downloads the vertex stream that all of a model's meshes share and
+// calls callback once per mesh, always with the same attribs and a
+// view of the shared indices covering the mesh's, so a viewer can
+// upload both once and draw each mesh as a range of them.
+function downloadShared(path, model, callback) {
+  var model = MODELS[model];
+  var shared = model.shared;
+  if (!shared) return;
+  getHttpRequest(path + shared.url, function(req, e) {
+    if (req.status !== 200 && req.status !== 0) return;
+    var str = req.responseText;
+    var decodeParams = model.decodeParams;
+    var attribs = decompressAttribs_(str, 0, shared.attribRange[1],
+                                     shared.layout, decodeParams);
+    var indexRange = shared.indexRange;
+    var indices = decompressLongIndices_(str, indexRange[0], indexRange[1]);
+    for (var i = 0; i < shared.meshes.length; i++) {
+      var meshParams = shared.meshes[i];
+      var start = meshParams.indexRange[0];
+      var bboxen = decompressAABBs_(str, meshParams.bboxes,
+                                    meshParams.names.length,
+                                    decodeParams.decodeOffsets,
+                                    decodeParams.decodeScales);
+      callback(attribs,
+               indices.subarray(start, start + meshNumIndices_(meshParams)),
+               bboxen, meshParams);
+    }
+  }, function() {});
+}
+
+// Downloads the levels of detail of a model (or of a tile or object)
+// coarse to fine, then its full resolution urls, starting each level
+// once the previous one has been decoded. callback gets the level as a
+// fifth argument, with lods.length for the full resolution. Objects
+// need their model's decodeParams.
+function downloadLods(path, entry, callback, decodeParams) {
+  decodeParams = decodeParams || entry.decodeParams;
+  var levels = (entry.lods || []).concat([{ urls: entry.urls }]);
+  function downloadLevel(level) {
+    var urls = levels[level].urls;
+    var remaining = 0;
+    for (var url in urls) {
+      remaining += urls[url].length;
+    }
+    var next = level + 1 < levels.length ? level + 1 : -1;
+    if (remaining == 0) {
+      if (next >= 0) downloadLevel(next);
+      return;
+    }
+    downloadMeshes(path, urls, decodeParams,
+                   function(attribs, indices, bboxen, meshParams) {
+      callback(attribs, indices, bboxen, meshParams, level);
+      if (--remaining == 0 && next >= 0) downloadLevel(next);
+    });
+  }
+  downloadLevel(0);
+}
+
+// Decodes a BVH file into node boxes (min x, y, z, max x, y, z), the
+// number of groups of each leaf (0 for inner nodes), the right child
+// or first leaf group of each node, and the leaves' group numbers.
+function decompressBvh_(str, bvh, decodeParams) {
+  var decodeOffsets = decodeParams.decodeOffsets;
+  var decodeScales = decodeParams.decodeScales;
+  var boxes = new Float32Array(6 * bvh.nodes);
+  var counts = new Uint16Array(bvh.nodes);
+  var indices = new Uint32Array(bvh.nodes);
+  var groups = new Uint32Array(bvh.groups);
+  var input = 0;
+  for (var i = 0; i < bvh.nodes; i++) {
+    for (var j = 0; j < 6; j++) {
+      boxes[6*i + j] = decodeScales[j % 3] *
+          (str.charCodeAt(input++) + decodeOffsets[j % 3]);
+    }
+    counts[i] = str.charCodeAt(input++);
+    indices[i] = (str.charCodeAt(input) << 15) | str.charCodeAt(input + 1);
+    input += 2;
+  }
+  for (var i = 0; i < bvh.groups; i++) {
+    groups[i] = (str.charCodeAt(input) << 15) | str.charCodeAt(input + 1);
+    input += 2;
+  }
+  return { boxes: boxes, counts: counts, indices: indices, groups: groups };
+}
+
+function downloadBvh(path, model, callback) {
+  var model = MODELS[model];
+  if (!model.bvh) return;
+  getHttpRequest(path + model.bvh.url, function(req, e) {
+    if (req.status === 200 || req.status === 0) {
+      callback(decompressBvh_(req.responseText, model.bvh,
+                              model.decodeParams));
+    }
+  }, function() {});
+}
+
+// Calls visit(group) for every group in a leaf whose box passes
+// test(boxes, offset), skipping the subtrees of inner nodes that fail.
+function traverseBvh(bvh, test, visit) {
+  if (!bvh.counts.length) return;
+  var stack = [0];
+  while (stack.length) {
+    var node = stack.pop();
+    if (!test(bvh.boxes, 6 * node)) continue;
+    var count = bvh.counts[node];
+    var index = bvh.indices[node];
+    if (count) {
+      for (var i = 0; i < count; i++) {
+        visit(bvh.groups[index + i]);
+      }
+    } else {
+      stack.push(index, node + 1);
+    }
+  }
+}
+
+// Returns a test for traverseBvh, passing boxes the ray from origin
+// along direction hits.
+function rayBoxTest(origin, direction) {
+  var inverse = [1/direction[0], 1/direction[1], 1/direction[2]];
+  return function(boxes, offset) {
+    var near = 0;
+    var far = Infinity;
+    for (var i = 0; i < 3; i++) {
+      var t0 = (boxes[offset + i] - origin[i]) * inverse[i];
+      var t1 = (boxes[offset + 3 + i] - origin[i]) * inverse[i];
+      near = Math.max(near, Math.min(t0, t1));
+      far = Math.min(far, Math.max(t0, t1));
+    }
+    return near <= far;
+  };
+}
+
+// Downloads the prototypes of a model's repeated shapes. callback gets
+// the shape of each of the mesh's names as a fifth argument; every copy
+// is drawn at scale * position + [x, y, z] of its transform.
+function downloadInstances(path, model, callback) {
+  var model = MODELS[model];
+  var instances = model.instances;
+  if (!instances) return;
+  var shapeStart = 0;
+  for (var url in instances.urls) {
+    var meshEntry = instances.urls[url];
+    for (var i = 0; i < meshEntry.length; i++) {
+      meshEntry[i].shapes = instances.shapes.slice(
+          shapeStart, shapeStart + meshEntry[i].names.length);
+      shapeStart += meshEntry[i].names.length;
+    }
+  }
+  downloadMeshes(path, instances.urls, model.decodeParams,
+                 function(attribs, indices, bboxen, meshParams) {
+    callback(attribs, indices, bboxen, meshParams, meshParams.shapes);
+  });
+}
+
 function downloadModel(path, model, callback) {
+  downloadTiles(path, model, null, callback);
+  downloadObjects(path, model, null, callback);
+  downloadShared(path, model, callback);
+  downloadInstances(path, model, callback);
   var model = MODELS[model];
   downloadMeshes(path, model.urls, model.decodeParams, callback);
 }
@@ -0,0 +1,359 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You
+// may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied. See the License for the specific language governing
+// permissions and limitations under the License.
+
+#ifndef WEBGL_LOADER_APPEND_H_
+#define WEBGL_LOADER_APPEND_H_
+
+// Reading back a manifest objcompress wrote, for -append, which adds
+// the faces of another OBJ file to it. Only as much JavaScript is
+// understood as objcompress prints, minified or not: objects, arrays,
+// quoted strings and bare numbers and names.
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include "base.h"
+#include "mesh.h"
+#include "utf8.h"
+
+// An entry of an object or an element of an array in a manifest: its
+// key (empty for elements), where the key starts and where its value
+// starts and ends.
+struct ManifestEntry {
+  std::string key;
+  size_t begin;
+  size_t value_begin, value_end;
+};
+
+typedef std::vector<ManifestEntry> ManifestEntryList;
+
+static inline size_t SkipManifestSpace(const std::string& text, size_t pos) {
+  while (pos < text.size() && isspace(text[pos])) {
+    ++pos;
+  }
+  return pos;
+}
+
+// Returns where the value at |pos| ends, or std::string::npos if it
+// does not.
+static inline size_t SkipManifestValue(const std::string& text, size_t pos) {
+  if (pos >= text.size()) {
+    return std::string::npos;
+  }
+  if (text[pos] == '\'') {
+    const size_t quote = text.find('\'', pos + 1);
+    return (quote == std::string::npos) ? quote : quote + 1;
+  }
+  if (text[pos] != '{' && text[pos] != '[') {
+    const size_t end = text.find_first_of(",]}", pos);
+    return (end == std::string::npos || end == pos) ? std::string::npos
+                                                    : end;
+  }
+  std::string closers;
+  while (pos < text.size()) {
+    const char ch = text[pos];
+    if (ch == '\'') {
+      pos = text.find('\'', pos + 1);
+      if (pos == std::string::npos) break;
+    } else if (ch == '{') {
+      closers.push_back('}');
+    } else if (ch == '[') {
+      closers.push_back(']');
+    } else if (ch == '}' || ch == ']') {
+      if (ch != closers[closers.size() - 1]) break;
+      closers.resize(closers.size() - 1);
+      if (closers.empty()) return pos + 1;
+    }
+    ++pos;
+  }
+  return std::string::npos;
+}
+
+// Lists the entries of the object, or the elements of the array, at
+// |pos|. Returns false if it is malformed.
+static inline bool ListManifestEntries(const std::string& text, size_t pos,
+                                       ManifestEntryList* entries) {
+  entries->clear();
+  if (pos >= text.size() || (text[pos] != '{' && text[pos] != '[')) {
+    return false;
+  }
+  const bool object = text[pos] == '{';
+  const char close = object ? '}' : ']';
+  pos = SkipManifestSpace(text, pos + 1);
+  if (pos < text.size() && text[pos] == close) {
+    return true;
+  }
+  while (pos < text.size()) {
+    ManifestEntry entry;
+    entry.begin = pos;
+    if (object) {
+      size_t key_end;
+      if (text[pos] == '\'') {
+        key_end = SkipManifestValue(text, pos);
+        if (key_end == std::string::npos) return false;
+        entry.key.assign(text, pos + 1, key_end - pos - 2);
+      } else {
+        key_end = pos;
+        while (key_end < text.size() &&
+               (isalnum(text[key_end]) || text[key_end] == '_')) {
+          ++key_end;
+        }
+        entry.key.assign(text, pos, key_end - pos);
+      }
+      pos = SkipManifestSpace(text, key_end);
+      if (entry.key.empty() || pos >= text.size() || text[pos] != ':') {
+        return false;
+      }
+      pos = SkipManifestSpace(text, pos + 1);
+    }
+    entry.value_begin = pos;
+    entry.value_end = SkipManifestValue(text, pos);
+    if (entry.value_end == std::string::npos) return false;
+    entries->push_back(entry);
+    pos = SkipManifestSpace(text, entry.value_end);
+    if (pos >= text.size()) return false;
+    if (text[pos] == close) return true;
+    if (text[pos] != ',') return false;
+    pos = SkipManifestSpace(text, pos + 1);
+  }
+  return false;
+}
+
+// The entry of |entries| with |key|, or NULL.
+static inline const ManifestEntry* FindManifestEntry(
+    const ManifestEntryList& entries, const std::string& key) {
+  for (size_t i = 0; i < entries.size(); ++i) {
+    if (entries[i].key == key) return &entries[i];
+  }
+  return NULL;
+}
+
+// Where the model of |manifest| starts: the '{' after MODELS['name'] =.
+// Returns std::string::npos if there is none.
+static inline size_t FindManifestModel(const std::string& manifest) {
+  size_t pos = manifest.find("MODELS[");
+  if (pos == std::string::npos) return pos;
+  pos = SkipManifestValue(manifest, pos + 7);
+  if (pos == std::string::npos) return pos;
+  pos = SkipManifestSpace(manifest, pos);
+  if (pos >= manifest.size() || manifest[pos] != ']') return std::string::npos;
+  pos = SkipManifestSpace(manifest, pos + 1);
+  if (pos >= manifest.size() || manifest[pos] != '=') return std::string::npos;
+  pos = SkipManifestSpace(manifest, pos + 1);
+  if (pos >= manifest.size() || manifest[pos] != '{') return std::string::npos;
+  return pos;
+}
+
+// Reads the numbers of the array |entry|.
+static inline bool ParseManifestNumbers(const std::string& text,
+                                        const ManifestEntry& entry,
+                                        std::vector<double>* numbers) {
+  ManifestEntryList elements;
+  if (!ListManifestEntries(text, entry.value_begin, &elements)) {
+    return false;
+  }
+  numbers->resize(elements.size());
+  for (size_t i = 0; i < elements.size(); ++i) {
+    const char* str = text.c_str() + elements[i].value_begin;
+    char* end = NULL;
+    (*numbers)[i] = strtod(str, &end);
+    if (end == str) return false;
+  }
+  return true;
+}
+
+// Reads the number that is the value of |entry|.
+static inline bool ParseManifestNumber(const std::string& text,
+                                       const ManifestEntry& entry,
+                                       size_t* number) {
+  const char* str = text.c_str() + entry.value_begin;
+  char* end = NULL;
+  *number = strtoul(str, &end, 10);
+  return end != str;
+}
+
+// True if a urls entry of the model of |manifest|, or of one of its
+// levels of detail, has the name of another, which hides it.
+static inline bool ManifestRepeatsUrls(const std::string& manifest) {
+  ManifestEntryList entries, lists, levels, urls;
+  const size_t model = FindManifestModel(manifest);
+  if (model == std::string::npos ||
+      !ListManifestEntries(manifest, model, &entries)) {
+    return false;
+  }
+  if (const ManifestEntry* urls_entry = FindManifestEntry(entries, "urls")) {
+    lists.push_back(*urls_entry);
+  }
+  const ManifestEntry* lods = FindManifestEntry(entries, "lods");
+  if (lods && ListManifestEntries(manifest, lods->value_begin, &levels)) {
+    for (size_t i = 0; i < levels.size(); ++i) {
+      ManifestEntryList level;
+      if (ListManifestEntries(manifest, levels[i].value_begin, &level)) {
+        if (const ManifestEntry* level_urls =
+                FindManifestEntry(level, "urls")) {
+          lists.push_back(*level_urls);
+        }
+      }
+    }
+  }
+  for (size_t i = 0; i < lists.size(); ++i) {
+    if (!ListManifestEntries(manifest, lists[i].value_begin, &urls)) {
+      continue;
+    }
+    std::set<std::string> names;
+    for (size_t k = 0; k < urls.size(); ++k) {
+      if (!names.insert(urls[k].key).second) return true;
+    }
+  }
+  return false;
+}
+
+// Rebuilds the quantization of a model from its decodeParams |entry|.
+// Texcoords, normals and colors are quantized as they were. Positions
+// are quantized to the nearest step that decodeOffsets and decodeScales
+// decode, as the model's own mins and scales are not in the manifest
+// (decodeOffsets are rounded): half a step lower, as Quantize
+// truncates.
+static inline bool ParseManifestDecodeParams(const std::string& text,
+                                             const ManifestEntry& entry,
+                                             BoundsParams* params) {
+  ManifestEntryList entries;
+  if (!ListManifestEntries(text, entry.value_begin, &entries)) {
+    return false;
+  }
+  const ManifestEntry* offsets = FindManifestEntry(entries, "decodeOffsets");
+  const ManifestEntry* scales = FindManifestEntry(entries, "decodeScales");
+  const ManifestEntry* bits = FindManifestEntry(entries, "quantizationBits");
+  const ManifestEntry* oct = FindManifestEntry(entries, "octNormals");
+  std::vector<double> offset_values, scale_values, bit_values;
+  if (!offsets || !scales || !bits ||
+      !ParseManifestNumbers(text, *offsets, &offset_values) ||
+      !ParseManifestNumbers(text, *scales, &scale_values) ||
+      !ParseManifestNumbers(text, *bits, &bit_values)) {
+    return false;
+  }
+  const size_t num_channels = bit_values.size();
+  if ((num_channels != 8 && num_channels != kNumChannels) ||
+      offset_values.size() != num_channels ||
+      scale_values.size() != num_channels) {
+    return false;
+  }
+  QuantizationBits quantization_bits;
+  quantization_bits.position = static_cast<int>(bit_values[0]);
+  quantization_bits.texcoord = static_cast<int>(bit_values[3]);
+  quantization_bits.normal = static_cast<int>(bit_values[5]);
+  if (!quantization_bits.Valid()) {
+    return false;
+  }
+  Bounds unit;
+  for (size_t i = 0; i < kNumChannels; ++i) {
+    unit.mins[i] = 0;
+    unit.maxes[i] = 1;
+  }
+  *params = BoundsParams::FromBounds(unit, quantization_bits);
+  for (size_t i = 0; i < 3; ++i) {
+    const double scale = scale_values[i];
+    if (!(scale > 0)) {
+      return false;
+    }
+    params->decodeOffsets[i] = static_cast<int>(offset_values[i]);
+    params->decodeScales[i] = static_cast<float>(scale);
+    params->mins[i] = static_cast<float>((offset_values[i] - 0.5) * scale);
+    params->scales[i] =
+        static_cast<float>(scale * params->outputMaxes[i]);
+  }
+  params->octNormals = oct && text.compare(oct->value_begin, 4, "true") == 0;
+  params->colors = num_channels == kNumChannels;
+  return true;
+}
+
+// True if every position of |batches| quantizes within |params|, to
+// within a step (Quantize truncates).
+static inline bool BatchesFit(const MaterialBatches& batches,
+                              const BoundsParams& params) {
+  for (MaterialBatches::const_iterator iter = batches.begin();
+       iter != batches.end(); ++iter) {
+    const AttribList& attribs = iter->second.draw_mesh().attribs;
+    const size_t stride = LayoutStride(iter->second.layout());
+    for (size_t i = 0; i < attribs.size(); i += stride) {
+      for (size_t j = 0; j < 3; ++j) {
+        const float steps = params.outputMaxes[j] *
+            ((attribs[i + j] - params.mins[j]) / params.scales[j]);
+        if (!(steps > -1 && steps < params.outputMaxes[j] + 1)) {
+          return false;
+        }
+      }
+    }
+  }
+  return true;
+}
+
+// Appends the boxes of the groups of the urls entry |entry|, in the
+// order of their names, decoded from its |payload| with |params|.
+// Returns false if they are not there.
+static inline bool ReadManifestBoxes(const std::string& text,
+                                     const ManifestEntry& entry,
+                                     const std::vector<char>& payload,
+                                     const BoundsParams& params,
+                                     std::vector<Bounds>* boxes) {
+  ManifestEntryList meshes;
+  if (!ListManifestEntries(text, entry.value_begin, &meshes)) {
+    return false;
+  }
+  // The boxes' offsets count words, not bytes.
+  std::vector<uint16> words;
+  for (size_t pos = 0; pos < payload.size(); ) {
+    uint16 word = 0;
+    const size_t taken =
+        Utf8ToUint16(&payload[pos], payload.size() - pos, &word);
+    if (!taken) return false;
+    words.push_back(word);
+    pos += taken;
+  }
+  for (size_t i = 0; i < meshes.size(); ++i) {
+    ManifestEntryList mesh;
+    if (!ListManifestEntries(text, meshes[i].value_begin, &mesh)) {
+      return false;
+    }
+    const ManifestEntry* bboxes = FindManifestEntry(mesh, "bboxes");
+    const ManifestEntry* names = FindManifestEntry(mesh, "names");
+    ManifestEntryList name_list;
+    size_t start = 0;
+    if (!bboxes || !names || !ParseManifestNumber(text, *bboxes, &start) ||
+        !ListManifestEntries(text, names->value_begin, &name_list) ||
+        start + 6 * name_list.size() > words.size()) {
+      return false;
+    }
+    for (size_t k = 0; k < name_list.size(); ++k) {
+      const uint16* box = &words[start + 6 * k];
+      Bounds bounds;
+      bounds.Clear();
+      for (size_t j = 0; j < 3; ++j) {
+        const float scale = params.decodeScales[j];
+        const int offset = params.decodeOffsets[j];
+        bounds.mins[j] = scale * (box[j] + offset);
+        bounds.maxes[j] = scale * (box[j] + box[j + 3] + offset);
+      }
+      boxes->push_back(bounds);
+    }
+  }
+  return true;
+}
+
+#endif  // WEBGL_LOADER_APPEND_H_
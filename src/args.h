@@ -0,0 +1,213 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You
+// may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied. See the License for the specific language governing
+// permissions and limitations under the License.
+
+#ifndef WEBGL_LOADER_ARGS_H_
+#define WEBGL_LOADER_ARGS_H_
+
+// The flags of objcompress, which objconvertd jobs take too.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "convert.h"
+#include "precompress.h"
+
+struct CompressArgs {
+  CompressArgs() : js_file(NULL), batch(false), memory_mb(0) { }
+
+  // With -batch, input.obj_file is the list or directory of OBJ files.
+  ConvertInput input;
+  ConvertOptions options;
+  Precompressor::Options precompress;
+  const char* js_file;  // NULL to write the JavaScript to STDOUT.
+  bool batch;  // -batch
+  size_t memory_mb;  // -memory, 0 for the default.
+};
+
+// Parses the flags and the two file names in |argv|, which must outlive
+// |args|. Returns false if they are malformed.
+static inline bool ParseCompressArgs(int argc, const char* const argv[],
+                                     CompressArgs* args) {
+  ConvertOptions& options = args->options;
+  ConvertInput& input = args->input;
+  Precompressor::Options& precompress_options = args->precompress;
+  int argi = 0;
+  for (; argi < argc && argv[argi][0] == '-'; ++argi) {
+    if (0 == strcmp(argv[argi], "-w")) {
+      options.missing_materials_as_white = true;
+    } else if (0 == strcmp(argv[argi], "-bits") && argi + 1 < argc) {
+      QuantizationBits& bits = options.bits;
+      if (3 != sscanf(argv[++argi], "%d,%d,%d",
+                      &bits.position, &bits.texcoord, &bits.normal) ||
+          !bits.Valid()) {
+        return false;
+      }
+    } else if (0 == strcmp(argv[argi], "-tolerance") && argi + 1 < argc) {
+      options.position_tolerance = strtof(argv[++argi], NULL);
+      if (!(options.position_tolerance > 0)) {
+        return false;
+      }
+    } else if (0 == strcmp(argv[argi], "-oct")) {
+      options.oct_normals = true;
+    } else if (0 == strcmp(argv[argi], "-tiles") && argi + 1 < argc) {
+      const int triangles = atoi(argv[++argi]);
+      if (triangles <= 0) {
+        return false;
+      }
+      options.max_tile_triangles = triangles;
+    } else if (0 == strcmp(argv[argi], "-lods") && argi + 1 < argc) {
+      const char* ratios = argv[++argi];
+      char* end = NULL;
+      for (;;) {
+        const float ratio = strtof(ratios, &end);
+        if (end == ratios || !(ratio > 0 && ratio < 1)) {
+          return false;
+        }
+        options.lod_ratios.push_back(ratio);
+        if (*end != ',') break;
+        ratios = end + 1;
+      }
+      if (*end) {
+        return false;
+      }
+    } else if (0 == strcmp(argv[argi], "-instances")) {
+      options.find_instances = true;
+    } else if (0 == strcmp(argv[argi], "-frames") && argi + 1 < argc) {
+      const char* files = argv[++argi];
+      const char* comma;
+      while ((comma = strchr(files, ',')) != NULL) {
+        input.frame_files.push_back(std::string(files, comma));
+        files = comma + 1;
+      }
+      input.frame_files.push_back(files);
+    } else if (0 == strcmp(argv[argi], "-merge")) {
+      options.merge_materials = true;
+    } else if (0 == strcmp(argv[argi], "-objects")) {
+      options.split_objects = true;
+    } else if (0 == strcmp(argv[argi], "-shared")) {
+      options.share_vertices = true;
+    } else if (0 == strcmp(argv[argi], "-incremental")) {
+      options.incremental = true;
+    } else if (0 == strcmp(argv[argi], "-hash32")) {
+      options.short_names = true;
+    } else if (0 == strcmp(argv[argi], "-memstats")) {
+      options.report_memory = true;
+    } else if (0 == strcmp(argv[argi], "-spill") && argi + 1 < argc) {
+      options.spill_dir = argv[++argi];
+    } else if (0 == strcmp(argv[argi], "-shards") && argi + 1 < argc) {
+      const int num_shards = atoi(argv[++argi]);
+      if (num_shards <= 0) {
+        return false;
+      }
+      options.num_shards = num_shards;
+    } else if (0 == strcmp(argv[argi], "-shard") && argi + 1 < argc) {
+      char* end = NULL;
+      options.shard = strtol(argv[++argi], &end, 10);
+      if (*end || end == argv[argi] || options.shard < 0) {
+        return false;
+      }
+    } else if (0 == strcmp(argv[argi], "-merge-shards")) {
+      options.merge_shards = true;
+    } else if (0 == strcmp(argv[argi], "-append") && argi + 1 < argc) {
+      input.append_file = argv[++argi];
+    } else if (0 == strcmp(argv[argi], "-glb") && argi + 1 < argc) {
+      options.glb_file = argv[++argi];
+    } else if (0 == strcmp(argv[argi], "-js") && argi + 1 < argc) {
+      args->js_file = argv[++argi];
+    } else if (0 == strcmp(argv[argi], "-gz")) {
+      precompress_options.gzip = true;
+    } else if (0 == strcmp(argv[argi], "-br")) {
+      precompress_options.brotli = true;
+    } else if (0 == strcmp(argv[argi], "-tar") && argi + 1 < argc) {
+      precompress_options.tar_file = argv[++argi];
+    } else if (0 == strcmp(argv[argi], "-j") && argi + 1 < argc) {
+      precompress_options.num_threads = atoi(argv[++argi]);
+    } else if (0 == strcmp(argv[argi], "-batch") ||
+               0 == strcmp(argv[argi], "--batch")) {
+      args->batch = true;
+    } else if (0 == strcmp(argv[argi], "-memory") && argi + 1 < argc) {
+      const int memory_mb = atoi(argv[++argi]);
+      if (memory_mb <= 0) {
+        return false;
+      }
+      args->memory_mb = memory_mb;
+      options.spill_memory = static_cast<size_t>(memory_mb) << 20;
+    } else {
+      return false;
+    }
+  }
+  if (argc - argi != 2) {
+    return false;
+  }
+  input.obj_file = argv[argi];
+  options.out_file = argv[argi + 1];
+  return true;
+}
+
+// Checks what ConvertObj would, and that the compressors asked for were
+// built in.
+static inline bool CheckCompressArgs(const CompressArgs& args,
+                                     std::string* error) {
+  if (CheckConvertOptions(args.input, args.options, error) != kConvertOk) {
+    return false;
+  }
+  if (args.batch &&
+      (!args.input.frame_files.empty() || !args.options.glb_file.empty())) {
+    *error = "-batch cannot be combined with -frames or -glb";
+    return false;
+  }
+  if (!args.input.append_file.empty() &&
+      (!args.js_file || args.batch || args.precompress.tar_file)) {
+    *error = "-append needs -js, the manifest it rewrites, and cannot be "
+        "combined with -batch or -tar";
+    return false;
+  }
+  if (args.options.report_memory && args.batch) {
+    *error = "-memstats measures the whole process, so it cannot be "
+        "combined with -batch";
+    return false;
+  }
+  const bool sharded = args.options.num_shards || args.options.shard >= 0 ||
+      args.options.merge_shards;
+  if (sharded && (args.batch || args.precompress.tar_file)) {
+    *error = "-shards, -shard and -merge-shards cannot be combined with "
+        "-batch or -tar";
+    return false;
+  }
+  if ((args.options.num_shards || args.options.shard >= 0) && args.js_file) {
+    *error = "-shards and -shard write no JavaScript for -js; the shards' "
+        "manifests are named after out.utf8";
+    return false;
+  }
+  if (args.batch && !args.options.spill_dir.empty()) {
+    *error = "-batch cannot be combined with -spill";
+    return false;
+  }
+  if (args.memory_mb && !args.batch && args.options.spill_dir.empty()) {
+    *error = "-memory only applies to -batch or -spill";
+    return false;
+  }
+  if (args.precompress.gzip && !GzipAvailable()) {
+    *error = "-gz needs a build with -D WITH_ZLIB";
+    return false;
+  }
+  if (args.precompress.brotli && !BrotliAvailable()) {
+    *error = "-br needs a build with -D WITH_BROTLI";
+    return false;
+  }
+  return true;
+}
+
+#endif  // WEBGL_LOADER_ARGS_H_
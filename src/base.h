@@ -18,13 +18,21 @@
 
 #include <ctype.h>
 #include <float.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
+#include <map>
 #include <string>
 #include <vector>
 
+#ifndef _WIN32
+# include <sys/resource.h>
+# include <unistd.h>
+#endif
+
 #ifdef _WIN32
 #define SIZET_FORMAT "%Iu"
 #else
@@ -34,11 +42,23 @@
 typedef unsigned short uint16;
 typedef short int16;
 typedef unsigned int uint32;
+typedef unsigned long long uint64;
+typedef long long int64;
 
 #ifndef isfinite
 # define isfinite _finite
 #endif
 
+// va_copy is C99 and C++11; C++98 compilers may only have __va_copy,
+// or (like older MSVC) a va_list that copies by assignment.
+#ifndef va_copy
+# ifdef __va_copy
+#  define va_copy(dest, src) __va_copy(dest, src)
+# else
+#  define va_copy(dest, src) ((dest) = (src))
+# endif
+#endif
+
 typedef std::vector<float> AttribList;
 typedef std::vector<int> IndexList;
 typedef std::vector<uint16> QuantizedAttribList;
@@ -142,9 +162,36 @@ static inline void ToLowerInplace(std::string* in) {
   }
 }
 
+// Like vsprintf, but appends to a std::string.
+static inline void StringAppendV(std::string* out, const char* format,
+                                 va_list args) {
+  char buffer[256];
+  va_list copy;
+  va_copy(copy, args);
+  const int length = vsnprintf(buffer, sizeof(buffer), format, copy);
+  va_end(copy);
+  if (length < 0) {
+    return;
+  } else if (static_cast<size_t>(length) < sizeof(buffer)) {
+    out->append(buffer, length);
+  } else {
+    std::vector<char> big(length + 1);
+    vsnprintf(&big[0], big.size(), format, args);
+    out->append(&big[0], length);
+  }
+}
+
+// Like sprintf, but appends to a std::string.
+static inline void StringAppendF(std::string* out, const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  StringAppendV(out, format, args);
+  va_end(args);
+}
+
 // Jenkin's One-at-a-time Hash. Not the best, but simple and
 // portable.
-uint32 SimpleHash(char *key, size_t len, uint32 seed = 0) {
+static inline uint32 SimpleHash(char *key, size_t len, uint32 seed = 0) {
   uint32 hash = seed;
   for(size_t i = 0; i < len; ++i) {
     hash += static_cast<unsigned char>(key[i]);
@@ -157,7 +204,150 @@ uint32 SimpleHash(char *key, size_t len, uint32 seed = 0) {
   return hash;
 }
 
-void ToHex(uint32 w, char out[9]) {
+// 64-bit FNV-1a, for telling inputs apart rather than naming outputs.
+// Every Add() also mixes in its length, so "ab" then "c" differs from
+// "a" then "bc".
+class Fingerprint {
+ public:
+  Fingerprint() : hash_(14695981039346656037ull) { }
+
+  void Add(const void* data, size_t size) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; ++i) {
+      hash_ = (hash_ ^ bytes[i]) * 1099511628211ull;
+    }
+    const uint64 length = size;
+    for (size_t i = 0; i < sizeof(length); ++i) {
+      hash_ = (hash_ ^ ((length >> (8 * i)) & 0xFF)) * 1099511628211ull;
+    }
+  }
+
+  void Add(const std::string& str) {
+    Add(str.data(), str.size());
+  }
+
+  template <typename T>
+  void Add(const std::vector<T>& v) {
+    Add(v.empty() ? NULL : &v[0], v.size() * sizeof(T));
+  }
+
+  uint64 hash() const { return hash_; }
+
+ private:
+  uint64 hash_;
+};
+
+// 64-bit xxHash (XXH64) of data added in pieces of any size. It
+// mixes 32 bytes at a time in four independent lanes, which keeps the
+// CPU's multipliers busy, so it runs several times faster than
+// SimpleHash's byte at a time.
+class Hash64 {
+ public:
+  explicit Hash64(uint64 seed = 0)
+      : seed_(seed), total_(0), buffered_(0) {
+    lanes_[0] = seed + kPrime1 + kPrime2;
+    lanes_[1] = seed + kPrime2;
+    lanes_[2] = seed;
+    lanes_[3] = seed - kPrime1;
+  }
+
+  void Add(const void* data, size_t size) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    total_ += size;
+    if (buffered_) {
+      const size_t fill = std::min(size, kStripe - buffered_);
+      memcpy(buffer_ + buffered_, bytes, fill);
+      buffered_ += fill;
+      bytes += fill;
+      size -= fill;
+      if (buffered_ < kStripe) return;
+      Stripe(buffer_);
+      buffered_ = 0;
+    }
+    for (; size >= kStripe; bytes += kStripe, size -= kStripe) {
+      Stripe(bytes);
+    }
+    memcpy(buffer_, bytes, size);
+    buffered_ = size;
+  }
+
+  uint64 hash() const {
+    uint64 hash;
+    if (total_ >= kStripe) {
+      hash = Rotate(lanes_[0], 1) + Rotate(lanes_[1], 7) +
+          Rotate(lanes_[2], 12) + Rotate(lanes_[3], 18);
+      for (size_t i = 0; i < 4; ++i) {
+        hash = (hash ^ Round(0, lanes_[i])) * kPrime1 + kPrime4;
+      }
+    } else {
+      hash = seed_ + kPrime5;
+    }
+    hash += total_;
+    const unsigned char* bytes = buffer_;
+    size_t size = buffered_;
+    for (; size >= 8; bytes += 8, size -= 8) {
+      hash = Rotate(hash ^ Round(0, Read64(bytes)), 27) * kPrime1 + kPrime4;
+    }
+    if (size >= 4) {
+      hash = Rotate(hash ^ (Read32(bytes) * kPrime1), 23) * kPrime2 + kPrime3;
+      bytes += 4;
+      size -= 4;
+    }
+    for (; size; ++bytes, --size) {
+      hash = Rotate(hash ^ (*bytes * kPrime5), 11) * kPrime1;
+    }
+    hash ^= hash >> 33;
+    hash *= kPrime2;
+    hash ^= hash >> 29;
+    hash *= kPrime3;
+    hash ^= hash >> 32;
+    return hash;
+  }
+
+ private:
+  static const size_t kStripe = 32;
+  static const uint64 kPrime1 = 11400714785074694791ull;
+  static const uint64 kPrime2 = 14029467366897019727ull;
+  static const uint64 kPrime3 = 1609587929392839161ull;
+  static const uint64 kPrime4 = 9650029242287828579ull;
+  static const uint64 kPrime5 = 2870177450012600261ull;
+
+  static uint64 Rotate(uint64 x, int bits) {
+    return (x << bits) | (x >> (64 - bits));
+  }
+
+  static uint64 Round(uint64 lane, uint64 input) {
+    return Rotate(lane + input * kPrime2, 31) * kPrime1;
+  }
+
+  // Little endian, whatever the CPU's order; compilers make this one
+  // load where they can.
+  static uint64 Read64(const unsigned char* bytes) {
+    return static_cast<uint64>(Read32(bytes)) |
+        (static_cast<uint64>(Read32(bytes + 4)) << 32);
+  }
+
+  static uint32 Read32(const unsigned char* bytes) {
+    return static_cast<uint32>(bytes[0]) |
+        (static_cast<uint32>(bytes[1]) << 8) |
+        (static_cast<uint32>(bytes[2]) << 16) |
+        (static_cast<uint32>(bytes[3]) << 24);
+  }
+
+  void Stripe(const unsigned char* bytes) {
+    for (size_t i = 0; i < 4; ++i) {
+      lanes_[i] = Round(lanes_[i], Read64(bytes + 8 * i));
+    }
+  }
+
+  uint64 seed_;
+  uint64 lanes_[4];
+  uint64 total_;
+  unsigned char buffer_[kStripe];
+  size_t buffered_;
+};
+
+static inline void ToHex(uint32 w, char out[9]) {
   const char kOffset0 = '0';
   const char kOffset10 = 'a' - 10;
   out[8] = '\0';
@@ -168,10 +358,222 @@ void ToHex(uint32 w, char out[9]) {
   }
 }
 
-uint16 Quantize(float f, float in_min, float in_scale, uint16 out_max) {
+// Names payloads after a hash of their contents, taken in pieces as
+// they are encoded: 16 hex digits of Hash64, or with |short_names| the
+// 8 of SimpleHash that older versions used.
+class PayloadHash {
+ public:
+  explicit PayloadHash(bool short_names = false)
+      : short_names_(short_names), simple_(0), added_(0) {
+  }
+
+  // Adds what was appended to |utf8| since the last call.
+  void AddNew(const std::vector<char>& utf8) {
+    if (added_ >= utf8.size()) {
+      return;
+    }
+    const char* data = &utf8[added_];
+    const size_t size = utf8.size() - added_;
+    added_ = utf8.size();
+    if (!short_names_) {
+      hash_.Add(data, size);
+      return;
+    }
+    // SimpleHash, a byte at a time.
+    for (size_t i = 0; i < size; ++i) {
+      simple_ += static_cast<unsigned char>(data[i]);
+      simple_ += (simple_ << 10);
+      simple_ ^= (simple_ >> 6);
+    }
+  }
+
+  // The name of a payload with what was added so far and then |suffix|.
+  std::string Name(const std::string& suffix) const {
+    char hex[17];
+    if (short_names_) {
+      uint32 hash = simple_;
+      hash += (hash << 3);
+      hash ^= (hash >> 11);
+      hash += (hash << 15);
+      ToHex(hash, hex);
+    } else {
+      const uint64 hash = hash_.hash();
+      ToHex(static_cast<uint32>(hash >> 32), hex);
+      ToHex(static_cast<uint32>(hash), hex + 8);
+    }
+    return std::string(hex) + "." + suffix;
+  }
+
+ private:
+  bool short_names_;
+  Hash64 hash_;
+  uint32 simple_;
+  size_t added_;
+};
+
+static inline uint16 Quantize(float f, float in_min, float in_scale,
+                              uint16 out_max) {
   return static_cast<uint16>(out_max * ((f-in_min) / in_scale));
 }
 
+// Files kept in memory, such as uploads, by the name they would have
+// on disk.
+typedef std::map<std::string, std::string> TextFiles;
+
+// Lines of text for the parsers, from a file or from memory.
+class TextSource {
+ public:
+  // Reads |fp|, which stays open.
+  explicit TextSource(FILE* fp)
+      : fp_(fp), owns_fp_(false), data_(NULL), pos_(0), offset_(0),
+        end_(kNoEnd) {
+  }
+
+  // Reads |name| from |files| if it is there (|files| may be NULL),
+  // else opens it. Check ok().
+  TextSource(const std::string& name, const TextFiles* files)
+      : fp_(NULL), owns_fp_(false), data_(NULL), pos_(0), offset_(0),
+        end_(kNoEnd) {
+    TextFiles::const_iterator iter;
+    if (files && (iter = files->find(name)) != files->end()) {
+      data_ = &iter->second;
+    } else {
+      // Binary, so that offset() counts the bytes of the file. Lines
+      // lose any '\r' as they are parsed.
+      fp_ = fopen(name.c_str(), "rb");
+      owns_fp_ = true;
+    }
+  }
+
+  static const uint64 kNoEnd = ~0ull;
+
+  ~TextSource() {
+    if (owns_fp_ && fp_) {
+      fclose(fp_);
+    }
+  }
+
+  bool ok() const {
+    return fp_ || data_;
+  }
+
+  // Reads just the bytes from |begin| up to |end|, which should start
+  // lines. Returns false if it cannot skip to |begin|.
+  bool SetRange(uint64 begin, uint64 end) {
+    if (data_) {
+      if (begin > data_->size()) {
+        return false;
+      }
+      pos_ = static_cast<size_t>(begin);
+    } else {
+#ifdef _WIN32
+      if (!fp_ || _fseeki64(fp_, begin, SEEK_SET) != 0) {
+#else
+      if (!fp_ || fseeko(fp_, begin, SEEK_SET) != 0) {
+#endif
+        return false;
+      }
+    }
+    offset_ = begin;
+    end_ = end;
+    return true;
+  }
+
+  // Gets the size of the whole text in bytes. Returns false if it
+  // cannot tell.
+  bool GetSize(uint64* size) {
+    if (data_) {
+      *size = data_->size();
+      return true;
+    }
+#ifdef _WIN32
+    const __int64 pos = fp_ ? _ftelli64(fp_) : -1;
+    if (pos < 0 || _fseeki64(fp_, 0, SEEK_END) != 0) {
+      return false;
+    }
+    *size = _ftelli64(fp_);
+    return _fseeki64(fp_, pos, SEEK_SET) == 0;
+#else
+    const off_t pos = fp_ ? ftello(fp_) : -1;
+    if (pos < 0 || fseeko(fp_, 0, SEEK_END) != 0) {
+      return false;
+    }
+    *size = ftello(fp_);
+    return fseeko(fp_, pos, SEEK_SET) == 0;
+#endif
+  }
+
+  // How many bytes into the text the next GetLine starts.
+  uint64 offset() const {
+    return offset_;
+  }
+
+  // Like fgets.
+  char* GetLine(char* buffer, size_t size) {
+    if (offset_ >= end_) {
+      return NULL;
+    }
+    if (fp_) {
+      if (!fgets(buffer, static_cast<int>(size), fp_)) {
+        return NULL;
+      }
+      offset_ += strlen(buffer);
+      return buffer;
+    }
+    if (!data_ || pos_ == data_->size() || size < 2) {
+      return NULL;
+    }
+    size_t length = 0;
+    while (length < size - 1 && pos_ < data_->size()) {
+      const char ch = (*data_)[pos_++];
+      buffer[length++] = ch;
+      if (ch == '\n') break;
+    }
+    buffer[length] = '\0';
+    offset_ += length;
+    return buffer;
+  }
+
+ private:
+  TextSource(const TextSource&);
+  void operator=(const TextSource&);
+
+  FILE* fp_;
+  bool owns_fp_;
+  const std::string* data_;
+  size_t pos_;
+  uint64 offset_, end_;
+};
+
+// The memory this process has resident now and has had at most so far,
+// in bytes. Returns false where the platform does not tell; |current|
+// is 0 where only the peak is known.
+static inline bool GetMemoryUsage(size_t* current, size_t* peak) {
+#ifdef _WIN32
+  return false;
+#else
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return false;
+  }
+#ifdef __APPLE__
+  *peak = usage.ru_maxrss;
+#else
+  *peak = static_cast<size_t>(usage.ru_maxrss) * 1024;
+#endif
+  *current = 0;
+  FILE* fp = fopen("/proc/self/statm", "r");
+  if (fp) {
+    unsigned long size = 0, resident = 0;
+    if (2 == fscanf(fp, "%lu %lu", &size, &resident)) {
+      *current = resident * sysconf(_SC_PAGESIZE);
+    }
+    fclose(fp);
+  }
+  return true;
+#endif
+}
+
 // TODO: Visual Studio calls this someting different.
 #ifdef putc_unlocked
 # define PutChar putc_unlocked
@@ -0,0 +1,135 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You
+// may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied. See the License for the specific language governing
+// permissions and limitations under the License.
+
+#ifndef WEBGL_LOADER_BATCH_H_
+#define WEBGL_LOADER_BATCH_H_
+
+// Helpers for objcompress -batch, which converts many OBJ files in one
+// process.
+
+#include <ctype.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "base.h"
+#include "mesh.h"
+#include "thread.h"
+
+// Keeps every mtllib file parsed during a batch, by name, for the other
+// OBJ files that name it. Safe to share between threads; a file is
+// parsed under the lock, so it is only ever parsed once.
+class MtlCache : public MtlLibraries {
+ public:
+  MtlCache() : num_loads_(0) { }
+
+  virtual bool Load(const std::string& name, const TextFiles* files,
+                    MaterialList* materials) {
+    MutexLock lock(&mutex_);
+    ++num_loads_;
+    std::map<std::string, Library>::iterator found = libraries_.find(name);
+    if (found == libraries_.end()) {
+      Library& library = libraries_[name];
+      library.ok = MtlLibraries::Load(name, files, &library.materials);
+      found = libraries_.find(name);
+    }
+    *materials = found->second.materials;
+    return found->second.ok;
+  }
+
+  size_t num_parsed() const { return libraries_.size(); }
+  size_t num_loads() const { return num_loads_; }
+
+ private:
+  struct Library {
+    Library() : ok(false) { }
+
+    bool ok;
+    MaterialList materials;
+  };
+
+  std::map<std::string, Library> libraries_;
+  size_t num_loads_;
+  Mutex mutex_;
+};
+
+// Puts the OBJ files of a batch into |files|: the .obj files in |path|,
+// in name order, if it is a directory, else the lines of the file
+// |path|. Returns false if |path| could not be read.
+static inline bool ListBatchFiles(const std::string& path,
+                                  std::vector<std::string>* files) {
+  if (DIR* dir = opendir(path.c_str())) {
+    std::vector<std::string> names;
+    while (const dirent* entry = readdir(dir)) {
+      const std::string name = entry->d_name;
+      if (name.size() > 4 && name.compare(name.size() - 4, 4, ".obj") == 0) {
+        names.push_back(name);
+      }
+    }
+    closedir(dir);
+    std::sort(names.begin(), names.end());
+    for (size_t i = 0; i < names.size(); ++i) {
+      files->push_back(path + "/" + names[i]);
+    }
+    return true;
+  }
+  TextSource source(path, NULL);
+  if (!source.ok()) {
+    return false;
+  }
+  const size_t kLineBufferSize = 4096;
+  char buffer[kLineBufferSize];
+  while (source.GetLine(buffer, kLineBufferSize) != NULL) {
+    const char* name = StripLeadingWhitespace(buffer);
+    size_t length = strlen(name);
+    while (length && isspace(name[length - 1])) {
+      --length;
+    }
+    if (length) {
+      files->push_back(std::string(name, length));
+    }
+  }
+  return true;
+}
+
+// The size of the file |fn|, or 0 if it cannot be read.
+static inline uint64 FileSize(const std::string& fn) {
+  FILE* fp = fopen(fn.c_str(), "rb");
+  if (!fp) {
+    return 0;
+  }
+  const long size = (fseek(fp, 0, SEEK_END) == 0) ? ftell(fp) : 0;
+  fclose(fp);
+  return (size > 0) ? static_cast<uint64>(size) : 0;
+}
+
+// The out_file of |obj_file| in a batch written as |out_file|: ben.obj
+// in a batch written as all.utf8 becomes ben.all.utf8, so its payloads
+// are <hash>.ben.all.utf8.
+static inline std::string BatchOutFile(const std::string& obj_file,
+                                       const std::string& out_file) {
+  std::string name = StripLeadingDir(obj_file.c_str());
+  const size_t dot = name.rfind('.');
+  if (dot != std::string::npos && dot > 0) {
+    name.resize(dot);
+  }
+  return name + "." + out_file;
+}
+
+#endif  // WEBGL_LOADER_BATCH_H_
@@ -0,0 +1,169 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You
+// may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied. See the License for the specific language governing
+// permissions and limitations under the License.
+
+#ifndef WEBGL_LOADER_BVH_H_
+#define WEBGL_LOADER_BVH_H_
+
+#include <float.h>
+#include <math.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "base.h"
+#include "mesh.h"
+#include "utf8.h"
+
+// A bounding volume hierarchy over the position bounds of a model's
+// groups, so viewers can cull and pick in O(log n) instead of testing
+// every group's box.
+//
+// Nodes are stored depth first, so an inner node's left child follows
+// it. Each node is 9 words of UTF-8, like the payloads:
+//   min x, y, z, max x, y, z  quantized like positions, rounded outward
+//   count                     0 for inner nodes, else the leaf's groups
+//   index (high, low 15 bits) right child, or first of the leaf's groups
+// followed by the group numbers of all leaves, 2 words each (high, low
+// 15 bits).
+class BvhBuilder {
+ public:
+  static const size_t kMaxLeafSize = 4;
+
+  explicit BvhBuilder(const std::vector<Bounds>& bounds)
+      : bounds_(bounds) {
+    order_.resize(bounds.size());
+    for (size_t i = 0; i < order_.size(); ++i) {
+      order_[i] = i;
+    }
+    if (!order_.empty()) {
+      Build(0, order_.size());
+    }
+  }
+
+  size_t num_nodes() const {
+    return nodes_.size();
+  }
+
+  size_t num_groups() const {
+    return order_.size();
+  }
+
+  void Encode(const BoundsParams& params, std::vector<char>* utf8) const {
+    for (size_t i = 0; i < nodes_.size(); ++i) {
+      const Node& node = nodes_[i];
+      for (size_t j = 0; j < 3; ++j) {
+        CHECK(Uint16ToUtf8(QuantizeMin(node.mins[j], params, j), utf8));
+      }
+      for (size_t j = 0; j < 3; ++j) {
+        CHECK(Uint16ToUtf8(QuantizeMax(node.maxes[j], params, j), utf8));
+      }
+      CHECK(Uint16ToUtf8(static_cast<uint16>(node.count), utf8));
+      EncodeIndex(node.index, utf8);
+    }
+    for (size_t i = 0; i < order_.size(); ++i) {
+      EncodeIndex(order_[i], utf8);
+    }
+  }
+
+ private:
+  struct Node {
+    float mins[3], maxes[3];
+    size_t count;
+    size_t index;
+  };
+
+  // Orders groups by the center of their bounds along one axis.
+  class CenterLess {
+   public:
+    CenterLess(const std::vector<Bounds>& bounds, size_t axis)
+        : bounds_(bounds), axis_(axis) { }
+
+    bool operator()(size_t a, size_t b) const {
+      return bounds_[a].mins[axis_] + bounds_[a].maxes[axis_] <
+          bounds_[b].mins[axis_] + bounds_[b].maxes[axis_];
+    }
+
+   private:
+    const std::vector<Bounds>& bounds_;
+    size_t axis_;
+  };
+
+  // Builds the subtree over order_[begin, end) and returns its root.
+  size_t Build(size_t begin, size_t end) {
+    const size_t index = nodes_.size();
+    nodes_.push_back(Node());
+    Node node;
+    float center_mins[3], center_maxes[3];
+    for (size_t j = 0; j < 3; ++j) {
+      node.mins[j] = center_mins[j] = FLT_MAX;
+      node.maxes[j] = center_maxes[j] = -FLT_MAX;
+    }
+    for (size_t i = begin; i < end; ++i) {
+      const Bounds& bounds = bounds_[order_[i]];
+      for (size_t j = 0; j < 3; ++j) {
+        const float center = (bounds.mins[j] + bounds.maxes[j]) / 2;
+        node.mins[j] = std::min(node.mins[j], bounds.mins[j]);
+        node.maxes[j] = std::max(node.maxes[j], bounds.maxes[j]);
+        center_mins[j] = std::min(center_mins[j], center);
+        center_maxes[j] = std::max(center_maxes[j], center);
+      }
+    }
+    if (end - begin <= kMaxLeafSize) {
+      node.count = end - begin;
+      node.index = begin;
+    } else {
+      // Split at the median along the axis the centers spread most.
+      size_t axis = 0;
+      for (size_t j = 1; j < 3; ++j) {
+        if (center_maxes[j] - center_mins[j] >
+            center_maxes[axis] - center_mins[axis]) {
+          axis = j;
+        }
+      }
+      const size_t middle = begin + (end - begin) / 2;
+      std::nth_element(order_.begin() + begin, order_.begin() + middle,
+                       order_.begin() + end, CenterLess(bounds_, axis));
+      node.count = 0;
+      Build(begin, middle);
+      node.index = Build(middle, end);
+    }
+    nodes_[index] = node;
+    return index;
+  }
+
+  static uint16 QuantizeMin(float f, const BoundsParams& params, size_t i) {
+    const float scaled =
+        floorf(params.outputMaxes[i] * (f - params.mins[i]) / params.scales[i]);
+    return static_cast<uint16>(std::max(0.f, scaled));
+  }
+
+  static uint16 QuantizeMax(float f, const BoundsParams& params, size_t i) {
+    const float scaled =
+        ceilf(params.outputMaxes[i] * (f - params.mins[i]) / params.scales[i]);
+    return static_cast<uint16>(
+        std::min(static_cast<float>(params.outputMaxes[i]), scaled));
+  }
+
+  static void EncodeIndex(size_t index, std::vector<char>* utf8) {
+    CHECK(index < (1u << 30));
+    CHECK(Uint16ToUtf8(static_cast<uint16>(index >> 15), utf8));
+    CHECK(Uint16ToUtf8(static_cast<uint16>(index & 0x7FFF), utf8));
+  }
+
+  const std::vector<Bounds>& bounds_;
+  std::vector<size_t> order_;
+  std::vector<Node> nodes_;
+};
+
+#endif  // WEBGL_LOADER_BVH_H_
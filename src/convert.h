@@ -0,0 +1,2176 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You
+// may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied. See the License for the specific language governing
+// permissions and limitations under the License.
+
+#ifndef WEBGL_LOADER_CONVERT_H_
+#define WEBGL_LOADER_CONVERT_H_
+
+// Converts an OBJ file in memory: ConvertObj takes the OBJ, its MTL
+// files and any animation frames as paths or as contents, and hands
+// back the manifest JavaScript and the payload files it lists.
+// objcompress is a command line around it.
+
+#include <stdarg.h>
+
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "append.h"
+#include "base.h"
+#include "bvh.h"
+#include "frames.h"
+#include "glb.h"
+#include "incremental.h"
+#include "instances.h"
+#include "merge.h"
+#include "mesh.h"
+#include "objects.h"
+#include "optimize.h"
+#include "shard.h"
+#include "shared.h"
+#include "simplify.h"
+#include "spill.h"
+#include "tiles.h"
+
+enum ConvertStatus {
+  kConvertOk = 0,
+  kConvertBadOptions,     // Options out of range or that cannot be combined.
+  kConvertReadError,      // An input could not be read.
+  kConvertParseError,     // An input is malformed.
+  kConvertFrameMismatch,  // A frame's faces differ from the first frame's.
+  kConvertWriteError      // A payload could not be kept.
+};
+
+// One per objcompress flag.
+struct ConvertOptions {
+  ConvertOptions()
+      : missing_materials_as_white(false),
+        position_tolerance(0),
+        oct_normals(false),
+        max_tile_triangles(0),
+        find_instances(false),
+        merge_materials(false),
+        split_objects(false),
+        share_vertices(false),
+        incremental(false),
+        short_names(false),
+        report_memory(false),
+        spill_memory(0),
+        num_shards(0),
+        shard(-1),
+        merge_shards(false) {
+  }
+
+  // Payloads are named after a hash of their contents and this.
+  std::string out_file;
+  bool missing_materials_as_white;  // -w
+  QuantizationBits bits;  // -bits
+  float position_tolerance;  // -tolerance, 0 for none.
+  bool oct_normals;  // -oct
+  size_t max_tile_triangles;  // -tiles, 0 for none.
+  std::vector<float> lod_ratios;  // -lods, each between 0 and 1.
+  bool find_instances;  // -instances
+  bool merge_materials;  // -merge
+  bool split_objects;  // -objects
+  bool share_vertices;  // -shared
+  std::string glb_file;  // -glb, the GLB payload's name. Empty for none.
+  bool incremental;  // -incremental
+  bool short_names;  // -hash32
+  bool report_memory;  // -memstats
+  // -spill: where the scratch files go. Empty to convert in memory.
+  std::string spill_dir;
+  size_t spill_memory;  // -memory with -spill, 0 for the default.
+  // The steps of a sharded conversion (see shard.h), one at a time.
+  size_t num_shards;  // -shards, 0 for none.
+  int shard;  // -shard, -1 for none.
+  bool merge_shards;  // -merge-shards
+};
+
+struct ConvertInput {
+  ConvertInput() : mtl_libraries(NULL) { }
+
+  // The OBJ file, whose name (without its directory) also names the
+  // model in the manifest.
+  std::string obj_file;
+  // The later frames of an animation (-frames).
+  std::vector<std::string> frame_files;
+  // The contents of any of the above, or of the mtllib files, that are
+  // in memory. The others are read from disk.
+  TextFiles files;
+  // Where the mtllib files are parsed, e.g. a cache of them shared by a
+  // batch of conversions. NULL to parse each afresh.
+  MtlLibraries* mtl_libraries;
+  // With -append, an OBJ file of faces to add to |manifest|, which an
+  // earlier conversion of obj_file printed. obj_file, which must have
+  // them too, is only converted if they cannot be added.
+  std::string append_file;
+  std::string manifest;
+};
+
+// Collects what a conversion writes: the manifest JavaScript, and the
+// payloads it lists. By default the payloads are kept in memory;
+// subclasses can store them elsewhere as they come.
+class ConvertOutput {
+ public:
+  struct Payload {
+    std::string name;
+    std::vector<char> data;
+  };
+
+  typedef std::vector<Payload> PayloadList;
+
+  ConvertOutput() : batch_records_(NULL), short_names_(false) { }
+  virtual ~ConvertOutput() { }
+
+  // Like printf, putchar and puts, onto the manifest.
+  void Printf(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    StringAppendV(&manifest_, format, args);
+    va_end(args);
+  }
+
+  void Putchar(char ch) {
+    manifest_.push_back(ch);
+  }
+
+  void Puts(const char* str) {
+    manifest_.append(str);
+    manifest_.push_back('\n');
+  }
+
+  // Takes the contents of |data|, leaving it empty, as the payload
+  // |name|.
+  void AddPayload(const std::string& name, std::vector<char>* data) {
+    if (!KeepPayload(name, data) && failed_payload_.empty()) {
+      failed_payload_ = name;
+    }
+  }
+
+  const std::string& manifest() const {
+    return manifest_;
+  }
+
+  std::string* mutable_manifest() {
+    return &manifest_;
+  }
+
+  const PayloadList& payloads() const {
+    return payloads_;
+  }
+
+  // The first payload that could not be kept, if any.
+  const std::string& failed_payload() const {
+    return failed_payload_;
+  }
+
+  // While ConvertObj runs with -incremental, the batches of the earlier
+  // run and of this one. NULL otherwise.
+  BatchRecords* batch_records() {
+    return batch_records_;
+  }
+
+  void set_batch_records(BatchRecords* batch_records) {
+    batch_records_ = batch_records;
+  }
+
+  // While ConvertObj runs, whether payloads get the short names of
+  // older versions (-hash32).
+  bool short_names() const {
+    return short_names_;
+  }
+
+  void set_short_names(bool short_names) {
+    short_names_ = short_names;
+  }
+
+  // For -incremental. ReadState gets back the state an earlier run
+  // passed to KeepState, and ReusePayload tells whether that run's
+  // payload |name| is still there, in which case it is not made again.
+  // By default there is no earlier run, and the state is dropped.
+  virtual bool ReadState(const std::string& name, std::string* state) {
+    return false;
+  }
+
+  virtual bool KeepState(const std::string& name, const std::string& state) {
+    return true;
+  }
+
+  virtual bool ReusePayload(const std::string& name) {
+    return false;
+  }
+
+  // For -append, gets back the payload |name| of the earlier conversion,
+  // whose boxes go into the new BVH. By default there is none.
+  virtual bool ReadPayload(const std::string& name, std::vector<char>* data) {
+    return false;
+  }
+
+ protected:
+  // Returns false if |data| could not be kept.
+  virtual bool KeepPayload(const std::string& name, std::vector<char>* data) {
+    payloads_.push_back(Payload());
+    payloads_.back().name = name;
+    payloads_.back().data.swap(*data);
+    return true;
+  }
+
+ private:
+  ConvertOutput(const ConvertOutput&);
+  void operator=(const ConvertOutput&);
+
+  std::string manifest_;
+  PayloadList payloads_;
+  BatchRecords* batch_records_;
+  bool short_names_;
+  std::string failed_payload_;
+};
+
+// Prints the urls entry of the batch of |material| from its |record|,
+// |indent| spaces deeper than a urls entry of the model. If |groups| is
+// given, the group behind every name printed is appended to it, in
+// manifest order.
+static inline void PrintBatchEntry(const WavefrontObjFile& obj,
+                                   const std::string& material,
+                                   VertexLayout layout, PrimitiveMode mode,
+                                   const std::vector<GroupStart>& group_starts,
+                                   const BatchRecord& record, int indent,
+                                   ConvertOutput* output,
+                                   std::vector<const GroupStart*>* groups) {
+#ifdef MINI_JS
+  output->Printf("'%s':[", record.payload.c_str());
+#else
+  output->Printf("%*s    '%s': [\n", indent, "", record.payload.c_str());
+#endif
+  for (size_t i = 0; i < record.meshes.size(); ++i) {
+    const BatchRecord::Mesh& mesh = record.meshes[i];
+#ifdef MINI_JS
+    output->Printf("{material:'%s',layout:'%s',"
+                   "attribRange:[" SIZET_FORMAT "," SIZET_FORMAT "],"
+                   "indexRange:[" SIZET_FORMAT "," SIZET_FORMAT "],"
+                   "bboxes:" SIZET_FORMAT ",",
+                   material.c_str(), LayoutName(layout),
+                   mesh.attrib_start, mesh.attrib_length,
+                   mesh.index_start, mesh.index_length,
+                   mesh.bboxes);
+#else
+    output->Printf("%*s      { material: '%s',\n"
+                   "%*s        layout: '%s',\n"
+                   "%*s        attribRange: [" SIZET_FORMAT ", " SIZET_FORMAT "],\n"
+                   "%*s        indexRange: [" SIZET_FORMAT ", " SIZET_FORMAT "],\n"
+                   "%*s        bboxes: " SIZET_FORMAT ",\n",
+                   indent, "", material.c_str(),
+                   indent, "", LayoutName(layout),
+                   indent, "", mesh.attrib_start, mesh.attrib_length,
+                   indent, "", mesh.index_start, mesh.index_length,
+                   indent, "", mesh.bboxes);
+#endif
+    // Triangles, the usual case, go untagged.
+    if (mode != kTriangles) {
+#ifdef MINI_JS
+      output->Printf("mode:'%s',", PrimitiveName(mode));
+#else
+      output->Printf("%*s        mode: '%s',\n", indent, "",
+                     PrimitiveName(mode));
+#endif
+    }
+    if (!mesh.morph_starts.empty()) {
+#ifdef MINI_JS
+      output->Printf("morphTargets:[");
+#else
+      output->Printf("%*s        morphTargets: [", indent, "");
+#endif
+      for (size_t k = 0; k < mesh.morph_starts.size(); ++k) {
+#ifdef MINI_JS
+        output->Printf("%s" SIZET_FORMAT, k ? "," : "", mesh.morph_starts[k]);
+#else
+        output->Printf("%s" SIZET_FORMAT, k ? ", " : "", mesh.morph_starts[k]);
+#endif
+      }
+#ifdef MINI_JS
+      output->Printf("],");
+#else
+      output->Printf("],\n");
+#endif
+    }
+#ifdef MINI_JS
+    output->Printf("names:[");
+#else
+    output->Printf("%*s        names: [", indent, "");
+#endif
+    for (size_t k = 0; k < mesh.groups.size(); ++k) {
+      const GroupStart& group_start = group_starts[mesh.groups[k]];
+      output->Printf("'%s'", obj.LineToGroup(group_start.group_line).c_str());
+      if (k != mesh.groups.size() - 1) {
+#ifdef MINI_JS
+        output->Putchar(',');
+#else
+        output->Printf(", ");
+#endif
+      }
+      if (groups) {
+        groups->push_back(&group_start);
+      }
+    }
+#ifdef MINI_JS
+    output->Printf("],lengths:[");
+#else
+    output->Printf("],\n%*s        lengths: [", indent, "");
+#endif
+    for (size_t k = 0; k < mesh.lengths.size(); ++k) {
+      output->Printf(SIZET_FORMAT, mesh.lengths[k]);
+      if (k != mesh.lengths.size() - 1) {
+#ifdef MINI_JS
+        output->Putchar(',');
+#else
+        output->Printf(", ");
+#endif
+      }
+    }
+#ifdef MINI_JS
+    output->Printf("]}");
+#else
+    output->Printf("]\n%*s      }", indent, "");
+#endif
+    if (i != record.meshes.size() - 1)
+      output->Putchar(',');
+#ifndef MINI_JS
+    output->Putchar('\n');
+#endif
+  }
+#ifdef MINI_JS
+  output->Putchar(']');
+#else
+  output->Printf("%*s    ]", indent, "");
+#endif
+}
+
+// True if |record| fits a batch with |num_groups| groups, which a
+// record with the batch's fingerprint always does unless the state has
+// been tampered with.
+static inline bool RecordFits(const BatchRecord& record, size_t num_groups) {
+  for (size_t i = 0; i < record.meshes.size(); ++i) {
+    const std::vector<size_t>& groups = record.meshes[i].groups;
+    for (size_t k = 0; k < groups.size(); ++k) {
+      if (groups[k] >= num_groups) return false;
+    }
+  }
+  return true;
+}
+
+// Pass 2: quantizes, optimizes and compresses each batch into its own
+// file, named after a hash of its contents, and prints the urls
+// entries describing them. If |groups| is given, the group behind
+// every name printed is appended to it, in manifest order. If |frames|
+// is given, each mesh is followed by the positions of every later frame
+// as deltas against the frame before, listed as morphTargets. If
+// |more_urls|, more entries follow, so the last one gets a comma too.
+// The entries are printed |indent| spaces deeper than the model's urls.
+// With -incremental, a batch whose payload an earlier run made is not
+// encoded again (unless it goes into the GLB too).
+static inline void WriteBatches(const WavefrontObjFile& obj,
+                                const MaterialBatches& batches,
+                                const BoundsParams& bounds_params,
+                                const char* out_file, ConvertOutput* output,
+                                GlbWriter* glb,
+                                std::vector<const GroupStart*>* groups,
+                                const FrameList* frames, bool more_urls = false,
+                                int indent = 0) {
+  BatchRecords* batch_records = output->batch_records();
+  std::vector<char> utf8;
+  for (MaterialBatches::const_iterator iter = batches.begin();
+       iter != batches.end(); /*++iter*/) {
+    size_t offset = 0;
+    utf8.clear();
+    const DrawMesh& draw_mesh = iter->second.draw_mesh();
+    if (draw_mesh.indices.empty()) { ++iter; continue; }
+    
+    VertexLayout layout = iter->second.layout();
+    const PrimitiveMode mode = iter->second.mode();
+    const size_t primitive_size = PrimitiveSize(mode);
+    // Once the decodeParams list colors every batch has them, white
+    // for the batches whose positions had none.
+    const AttribList* attribs = &draw_mesh.attribs;
+    AttribList colored_attribs;
+    if (bounds_params.colors && !LayoutHasColors(layout)) {
+      const VertexLayout colored_layout = LayoutUnion(layout, kLayoutPC);
+      WidenAttribs(draw_mesh.attribs, layout, colored_layout,
+                   &colored_attribs);
+      attribs = &colored_attribs;
+      layout = colored_layout;
+    }
+    QuantizedAttribList quantized_attribs;
+    AttribsToQuantizedAttribs(*attribs, layout, bounds_params,
+                              &quantized_attribs);
+    const size_t stride = bounds_params.QuantizedStride(layout);
+    // Later frames' positions ride along with each vertex, so they are
+    // reordered exactly like the first frame's.
+    size_t vertex_stride = stride;
+    if (frames && !frames->empty()) {
+      AppendFramePositions(*frames, iter->first, bounds_params, stride,
+                           &quantized_attribs);
+      vertex_stride += 3 * frames->size();
+    }
+    const std::vector<GroupStart>& group_starts = iter->second.group_starts();
+
+    BatchRecord record;
+    uint64 fingerprint = 0;
+    const BatchRecord* earlier = NULL;
+    if (batch_records) {
+      fingerprint = BatchFingerprint(iter->second, quantized_attribs,
+                                     vertex_stride, bounds_params, out_file);
+      earlier = batch_records->Find(fingerprint);
+      if (earlier && (glb || !RecordFits(*earlier, group_starts.size()) ||
+                      !output->ReusePayload(earlier->payload))) {
+        earlier = NULL;
+      }
+    }
+    if (earlier) {
+      record = *earlier;
+      batch_records->CountReused();
+    } else {
+      WebGLMeshList webgl_meshes;
+      PayloadHash payload_hash(output->short_names());
+      std::vector<size_t> group_lengths;
+      for (size_t i = 1; i < group_starts.size(); ++i) {
+        group_lengths.push_back(group_starts[i].offset -
+                                group_starts[i-1].offset);
+      }
+      const size_t length =
+          draw_mesh.indices.size() - group_starts.back().offset;
+      const bool divisible_by_size = length % primitive_size == 0;
+      CHECK(divisible_by_size);
+      group_lengths.push_back(length);
+      if (mode == kTriangles) {
+        VertexOptimizer vertex_optimizer(quantized_attribs, vertex_stride);
+        for (size_t i = 0; i < group_starts.size(); ++i) {
+          const size_t here = group_starts[i].offset;
+          vertex_optimizer.AddTriangles(&draw_mesh.indices[here],
+                                        group_lengths[i], &webgl_meshes);
+        }
+      } else {
+        FirstUseOrderer orderer(quantized_attribs, vertex_stride,
+                                primitive_size);
+        for (size_t i = 0; i < group_starts.size(); ++i) {
+          const size_t here = group_starts[i].offset;
+          orderer.AddPrimitives(&draw_mesh.indices[here], group_lengths[i],
+                                &webgl_meshes);
+        }
+      }
+      // The meshes have copies of the vertices they use.
+      QuantizedAttribList().swap(quantized_attribs);
+
+      record.meshes.resize(webgl_meshes.size());
+      for (size_t i = 0; i < webgl_meshes.size(); ++i) {
+        QuantizedAttribList frame_attribs;
+        if (vertex_stride != stride) {
+          frame_attribs.swap(webgl_meshes[i].attribs);
+          QuantizedAttribList& attribs = webgl_meshes[i].attribs;
+          for (size_t j = 0; j < frame_attribs.size(); j += vertex_stride) {
+            attribs.insert(attribs.end(), &frame_attribs[j],
+                           &frame_attribs[j] + stride);
+          }
+        }
+        const size_t num_attribs = webgl_meshes[i].attribs.size();
+        const size_t num_indices = webgl_meshes[i].indices.size();
+        const bool kBadSizes =
+            num_attribs % stride || num_indices % primitive_size;
+        CHECK(!kBadSizes);
+        CompressQuantizedAttribsToUtf8(webgl_meshes[i].attribs, &utf8,
+                                       stride);
+        CompressIndicesToUtf8(webgl_meshes[i].indices, &utf8);
+        BatchRecord::Mesh& mesh = record.meshes[i];
+        mesh.attrib_start = offset;
+        mesh.attrib_length = num_attribs / stride;
+        mesh.index_start = offset + num_attribs;
+        mesh.index_length = num_indices / primitive_size;
+        offset += num_attribs + num_indices;
+        for (size_t f = stride; f < vertex_stride; f += 3) {
+          mesh.morph_starts.push_back(offset);
+          CompressPositionDeltasToUtf8(frame_attribs, vertex_stride,
+                                       f == stride ? 0 : f - 3, f, &utf8);
+          offset += 3 * (num_attribs / stride);
+        }
+        // While the mesh is still in the cache.
+        payload_hash.AddNew(utf8);
+        // Unless the GLB takes the mesh too, only its record is needed
+        // from here on.
+        if (!glb) {
+          QuantizedAttribList().swap(webgl_meshes[i].attribs);
+          OptimizedIndexList().swap(webgl_meshes[i].indices);
+        }
+      }
+
+      // TODO: this needs to handle paths.
+      record.payload = payload_hash.Name(out_file);
+
+      // The boxes of the groups come last, mesh by mesh; a group split
+      // between meshes has one in each. They are not in the name's hash.
+      size_t group_index = 0;
+      for (size_t i = 0; i < webgl_meshes.size(); ++i) {
+        BatchRecord::Mesh& mesh = record.meshes[i];
+        mesh.bboxes = offset;
+        size_t group_start = 0;
+        while (group_index < group_lengths.size()) {
+          const size_t group_length = group_lengths[group_index];
+          const size_t next_start = group_start + group_length;
+          const size_t webgl_index_length =
+              mesh.index_length * primitive_size;
+          mesh.groups.push_back(group_index);
+          // TODO: bbox info is better placed at the head of the file,
+          // perhaps transposed. Also, when a group gets split between
+          // batches, the bbox gets stored twice.
+          CompressAABBToUtf8(group_starts[group_index].bounds,
+                             bounds_params, &utf8);
+          offset += 6;
+          if (next_start < webgl_index_length) {
+            mesh.lengths.push_back(group_length);
+            group_start = next_start;
+            ++group_index;
+          } else {
+            const size_t fits = webgl_index_length - group_start;
+            mesh.lengths.push_back(fits);
+            group_start = 0;
+            group_lengths[group_index] -= fits;
+            break;
+          }
+        }
+      }
+
+      output->AddPayload(record.payload, &utf8);
+      if (glb) {
+        std::vector<std::vector<std::string> > mesh_names(
+            webgl_meshes.size());
+        for (size_t i = 0; i < webgl_meshes.size(); ++i) {
+          const std::vector<size_t>& mesh_groups = record.meshes[i].groups;
+          for (size_t k = 0; k < mesh_groups.size(); ++k) {
+            mesh_names[i].push_back(
+                obj.LineToGroup(group_starts[mesh_groups[k]].group_line));
+          }
+        }
+        std::vector<std::vector<size_t> > mesh_lengths(webgl_meshes.size());
+        for (size_t i = 0; i < webgl_meshes.size(); ++i) {
+          mesh_lengths[i] = record.meshes[i].lengths;
+        }
+        glb->AddBatch(iter->first, layout, mode, &webgl_meshes, mesh_names,
+                      mesh_lengths);
+      }
+    }
+    if (batch_records) {
+      batch_records->Keep(fingerprint, record);
+    }
+    PrintBatchEntry(obj, iter->first, layout, mode, group_starts, record,
+                    indent, output, groups);
+    // Batches left empty (a usemtl with no faces after it) get no entry.
+    while (++iter != batches.end() &&
+           iter->second.draw_mesh().indices.empty()) { }
+    if (iter != batches.end() || more_urls)
+      output->Putchar(',');
+#ifndef MINI_JS
+    output->Putchar('\n');
+#endif
+  }
+}
+
+// Simplifies each batch to every ratio in |lod_ratios| (largest first)
+// of its triangles, into a level of |lods| each, and counts the
+// triangles of every level in |lod_triangles|.
+static inline void SimplifyLods(const MaterialBatches& batches,
+                                const std::vector<float>& lod_ratios,
+                                std::vector<MaterialBatches>* lods,
+                                std::vector<size_t>* lod_triangles) {
+  lods->assign(lod_ratios.size(), MaterialBatches());
+  lod_triangles->assign(lod_ratios.size(), 0);
+  for (MaterialBatches::const_iterator iter = batches.begin();
+       iter != batches.end(); ++iter) {
+    const size_t num_triangles = iter->second.draw_mesh().indices.size() / 3;
+    if (!num_triangles) continue;
+    Simplifier simplifier(iter->second);
+    for (size_t i = 0; i < lod_ratios.size(); ++i) {
+      const size_t target = static_cast<size_t>(lod_ratios[i] * num_triangles);
+      (*lod_triangles)[i] += simplifier.Simplify(target);
+      simplifier.GetBatch(&(*lods)[i][iter->first]);
+    }
+  }
+}
+
+// Simplifies each batch like SimplifyLods and prints the lods entry,
+// coarsest level first. The levels share |bounds_params| with the full
+// resolution meshes. Levels that simplify nothing are left out. The
+// entry is printed |indent| spaces deeper than one of the model's.
+static inline void WriteLods(const WavefrontObjFile& obj,
+                             const MaterialBatches& batches,
+                             const std::vector<float>& lod_ratios,
+                             const BoundsParams& bounds_params,
+                             const char* out_file, ConvertOutput* output,
+                             int indent = 0) {
+  if (lod_ratios.empty()) {
+    return;
+  }
+  std::vector<MaterialBatches> lods;
+  std::vector<size_t> lod_triangles;
+  SimplifyLods(batches, lod_ratios, &lods, &lod_triangles);
+  // A level that simplified nothing would only repeat the one above it.
+  size_t above = 0;
+  for (MaterialBatches::const_iterator iter = batches.begin();
+       iter != batches.end(); ++iter) {
+    above += iter->second.draw_mesh().indices.size() / 3;
+  }
+  std::vector<size_t> levels;
+  for (size_t i = 0; i < lods.size(); ++i) {
+    if (lod_triangles[i] < above) {
+      levels.push_back(i);
+      above = lod_triangles[i];
+    } else {
+      fprintf(stderr, "WARNING: nothing could be simplified for level of "
+              "detail %g, which is left out\n", lod_ratios[i]);
+    }
+  }
+  if (levels.empty()) {
+    return;
+  }
+#ifdef MINI_JS
+  output->Printf(",lods:[");
+#else
+  output->Printf(",\n%*s  lods: [\n", indent, "");
+#endif
+  for (size_t level = levels.size(); level-- > 0; ) {
+    const size_t i = levels[level];
+#ifdef MINI_JS
+    output->Printf("{triangles:" SIZET_FORMAT ",urls:{", lod_triangles[i]);
+#else
+    output->Printf("%*s    { triangles: " SIZET_FORMAT ",\n"
+                   "%*s      urls: {\n",
+                   indent, "", lod_triangles[i], indent, "");
+#endif
+    WriteBatches(obj, lods[i], bounds_params, out_file, output, NULL,
+                 NULL, NULL, false, indent + 4);
+#ifdef MINI_JS
+    output->Printf("}}");
+#else
+    output->Printf("%*s      }\n%*s    }", indent, "", indent, "");
+#endif
+    if (level)
+      output->Putchar(',');
+#ifndef MINI_JS
+    output->Putchar('\n');
+#endif
+  }
+#ifdef MINI_JS
+  output->Putchar(']');
+#else
+  output->Printf("%*s  ]", indent, "");
+#endif
+}
+
+// Prints the entry of |tile| in the tiles of the manifest, quantized
+// within its own bounds and written to its own files, and adds the
+// bounds of its groups to |group_bounds|.
+static inline void WriteTile(const WavefrontObjFile& obj, const Tile& tile,
+                             QuantizationBits bits, float position_tolerance,
+                             bool oct_normals,
+                             const std::vector<float>& lod_ratios,
+                             const char* out_file, ConvertOutput* output,
+                             std::vector<Bounds>* group_bounds) {
+  if (position_tolerance > 0) {
+    PositionSourceList sources;
+    AddPositionSources(tile.batches, &sources);
+    bits.position = ChoosePositionBits(tile.bounds, sources, bits,
+                                       position_tolerance);
+  }
+  BoundsParams bounds_params = BoundsParams::FromBounds(tile.bounds, bits);
+  bounds_params.octNormals = oct_normals;
+  bounds_params.colors = HasColors(tile.batches);
+  const float* mins = tile.bounds.mins;
+  const float* maxes = tile.bounds.maxes;
+#ifdef MINI_JS
+  output->Printf("{path:'%s',bounds:[%g,%g,%g,%g,%g,%g],decodeParams:",
+                 tile.path.c_str(), mins[0], mins[1], mins[2],
+                 maxes[0], maxes[1], maxes[2]);
+  bounds_params.DumpJson(output->mutable_manifest());
+  output->Printf("urls:{");
+#else
+  output->Printf("    { path: '%s',\n"
+                 "      bounds: [%g, %g, %g, %g, %g, %g],\n"
+                 "      decodeParams: ",
+                 tile.path.c_str(), mins[0], mins[1], mins[2],
+                 maxes[0], maxes[1], maxes[2]);
+  bounds_params.DumpJson(output->mutable_manifest(), 4);
+  output->Puts("      urls: {");
+#endif
+  std::vector<const GroupStart*> groups;
+  WriteBatches(obj, tile.batches, bounds_params, out_file, output,
+               NULL, &groups, NULL, false, 4);
+  for (size_t i = 0; i < groups.size(); ++i) {
+    group_bounds->push_back(groups[i]->bounds);
+  }
+#ifdef MINI_JS
+  output->Putchar('}');
+#else
+  output->Printf("      }");
+#endif
+  WriteLods(obj, tile.batches, lod_ratios, bounds_params, out_file,
+            output, 4);
+#ifdef MINI_JS
+  output->Putchar('}');
+#else
+  output->Printf("\n    }");
+#endif
+}
+
+// Buckets the triangles into an octree of tiles and prints the tiles
+// entry of the manifest. The model-wide urls only keep the lines and
+// points. The bounds of the tiles' groups are added to |group_bounds|.
+static inline void WriteTiles(const WavefrontObjFile& obj,
+                              const MaterialBatches& batches,
+                              size_t max_tile_triangles, QuantizationBits bits,
+                              float position_tolerance, bool oct_normals,
+                              const std::vector<float>& lod_ratios,
+                              const char* out_file, ConvertOutput* output,
+                              std::vector<Bounds>* group_bounds) {
+  TileList tiles;
+  TileBuilder(batches, max_tile_triangles).Build(&tiles);
+#ifdef MINI_JS
+  output->Printf(",tiles:[");
+#else
+  output->Puts(",\n  tiles: [");
+#endif
+  for (size_t i = 0; i < tiles.size(); ++i) {
+    WriteTile(obj, tiles[i], bits, position_tolerance, oct_normals,
+              lod_ratios, out_file, output, group_bounds);
+    // Each tile's copy of its triangles goes once it is written.
+    MaterialBatches().swap(tiles[i].batches);
+    if (i != tiles.size() - 1)
+      output->Putchar(',');
+#ifndef MINI_JS
+    output->Putchar('\n');
+#endif
+  }
+#ifdef MINI_JS
+  output->Putchar(']');
+#else
+  output->Printf("  ]");
+#endif
+}
+
+// Prints the objects entry of the manifest: the bounds, urls and levels
+// of detail of each object, so viewers can fetch just the objects they
+// show. The model-wide urls are left empty.
+static inline void WriteObjects(const WavefrontObjFile& obj,
+                                const ObjectList& objects,
+                                const std::vector<float>& lod_ratios,
+                                const BoundsParams& bounds_params,
+                                const char* out_file, ConvertOutput* output,
+                                GlbWriter* glb,
+                                std::vector<const GroupStart*>* groups) {
+#ifdef MINI_JS
+  output->Printf(",objects:{");
+#else
+  output->Puts(",\n  objects: {");
+#endif
+  for (size_t i = 0; i < objects.size(); ++i) {
+    const Object& object = objects[i];
+    const float* mins = object.bounds.mins;
+    const float* maxes = object.bounds.maxes;
+#ifdef MINI_JS
+    output->Printf("'%s':{bounds:[%g,%g,%g,%g,%g,%g],urls:{",
+                   object.name.c_str(), mins[0], mins[1], mins[2],
+                   maxes[0], maxes[1], maxes[2]);
+#else
+    output->Printf("    '%s': {\n"
+                   "      bounds: [%g, %g, %g, %g, %g, %g],\n"
+                   "      urls: {\n",
+                   object.name.c_str(), mins[0], mins[1], mins[2],
+                   maxes[0], maxes[1], maxes[2]);
+#endif
+    const MaterialBatches* batches = object.batches;
+    WriteBatches(obj, batches[kTriangles], bounds_params, out_file,
+                 output, glb, groups, NULL,
+                 !batches[kLines].empty() || !batches[kPoints].empty(), 4);
+    WriteBatches(obj, batches[kLines], bounds_params, out_file,
+                 output, glb, groups, NULL, !batches[kPoints].empty(), 4);
+    WriteBatches(obj, batches[kPoints], bounds_params, out_file,
+                 output, glb, groups, NULL, false, 4);
+#ifdef MINI_JS
+    output->Putchar('}');
+#else
+    output->Printf("      }");
+#endif
+    WriteLods(obj, batches[kTriangles], lod_ratios, bounds_params, out_file,
+              output, 4);
+#ifdef MINI_JS
+    output->Putchar('}');
+#else
+    output->Printf("\n    }");
+#endif
+    if (i != objects.size() - 1)
+      output->Putchar(',');
+#ifndef MINI_JS
+    output->Putchar('\n');
+#endif
+  }
+#ifdef MINI_JS
+  output->Putchar('}');
+#else
+  output->Printf("  }");
+#endif
+}
+
+// Writes the triangles, lines and points of every material into one
+// file around a single deduplicated vertex stream, and prints the
+// shared entry of the manifest: the stream's layout and ranges, then
+// for each batch its material, index range and groups. The model-wide
+// urls are left empty.
+static inline void WriteShared(const WavefrontObjFile& obj,
+                               const MaterialBatches& triangles,
+                               const MaterialBatches& lines,
+                               const MaterialBatches& points,
+                               const BoundsParams& bounds_params,
+                               const char* out_file, ConvertOutput* output,
+                               std::vector<const GroupStart*>* groups) {
+  const MaterialBatches* sources[] = { &triangles, &lines, &points };
+  std::vector<const DrawBatch*> batches;
+  std::vector<std::string> material;
+  VertexLayout layout = kLayoutP;
+  for (size_t i = 0; i < 3; ++i) {
+    for (MaterialBatches::const_iterator iter = sources[i]->begin();
+         iter != sources[i]->end(); ++iter) {
+      if (iter->second.draw_mesh().indices.empty()) continue;
+      batches.push_back(&iter->second);
+      material.push_back(iter->first);
+      layout = LayoutUnion(layout, iter->second.layout());
+    }
+  }
+  SharedVertexBuilder builder(layout, bounds_params);
+  std::vector<size_t> first_index;
+  for (size_t i = 0; i < batches.size(); ++i) {
+    first_index.push_back(builder.Add(*batches[i]));
+  }
+  std::vector<char> utf8;
+  PayloadHash payload_hash(output->short_names());
+  const QuantizedAttribList& attribs = builder.attribs();
+  const std::vector<uint32>& indices = builder.indices();
+  CompressQuantizedAttribsToUtf8(attribs, &utf8, builder.stride());
+  payload_hash.AddNew(utf8);
+  size_t offset = attribs.size();
+  offset += CompressLongIndicesToUtf8(indices, &utf8);
+  payload_hash.AddNew(utf8);
+  std::vector<size_t> bboxes;
+  for (size_t i = 0; i < batches.size(); ++i) {
+    bboxes.push_back(offset);
+    const std::vector<GroupStart>& group_starts = batches[i]->group_starts();
+    for (size_t j = 0; j < group_starts.size(); ++j) {
+      CompressAABBToUtf8(group_starts[j].bounds, bounds_params, &utf8);
+      offset += 6;
+      groups->push_back(&group_starts[j]);
+    }
+  }
+  payload_hash.AddNew(utf8);
+  const std::string out_fn = payload_hash.Name(out_file);
+  output->AddPayload(out_fn, &utf8);
+  fprintf(stderr, "Shared " SIZET_FORMAT " vertices among " SIZET_FORMAT
+          " batches\n", builder.num_vertices(), batches.size());
+
+#ifdef MINI_JS
+  output->Printf(",shared:{url:'%s',layout:'%s',"
+                 "attribRange:[0," SIZET_FORMAT "],"
+                 "indexRange:[" SIZET_FORMAT "," SIZET_FORMAT "],meshes:[",
+                 out_fn.c_str(), LayoutName(layout), builder.num_vertices(),
+                 attribs.size(), indices.size());
+#else
+  output->Printf(",\n  shared: {\n"
+                 "    url: '%s',\n"
+                 "    layout: '%s',\n"
+                 "    attribRange: [0, " SIZET_FORMAT "],\n"
+                 "    indexRange: [" SIZET_FORMAT ", " SIZET_FORMAT "],\n"
+                 "    meshes: [\n",
+                 out_fn.c_str(), LayoutName(layout), builder.num_vertices(),
+                 attribs.size(), indices.size());
+#endif
+  for (size_t i = 0; i < batches.size(); ++i) {
+    const DrawBatch& batch = *batches[i];
+    const PrimitiveMode mode = batch.mode();
+    const size_t num_indices = batch.draw_mesh().indices.size();
+#ifdef MINI_JS
+    output->Printf("{material:'%s',"
+                   "indexRange:[" SIZET_FORMAT "," SIZET_FORMAT "],"
+                   "bboxes:" SIZET_FORMAT ",",
+                   material[i].c_str(), first_index[i],
+                   num_indices / PrimitiveSize(mode), bboxes[i]);
+#else
+    output->Printf("      { material: '%s',\n"
+                   "        indexRange: [" SIZET_FORMAT ", " SIZET_FORMAT "],\n"
+                   "        bboxes: " SIZET_FORMAT ",\n",
+                   material[i].c_str(), first_index[i],
+                   num_indices / PrimitiveSize(mode), bboxes[i]);
+#endif
+    if (mode != kTriangles) {
+#ifdef MINI_JS
+      output->Printf("mode:'%s',", PrimitiveName(mode));
+#else
+      output->Printf("        mode: '%s',\n", PrimitiveName(mode));
+#endif
+    }
+#ifdef MINI_JS
+    output->Printf("names:[");
+#else
+    output->Printf("        names: [");
+#endif
+    const std::vector<GroupStart>& group_starts = batch.group_starts();
+    for (size_t j = 0; j < group_starts.size(); ++j) {
+#ifdef MINI_JS
+      output->Printf("%s'%s'", j ? "," : "",
+                     obj.LineToGroup(group_starts[j].group_line).c_str());
+#else
+      output->Printf("%s'%s'", j ? ", " : "",
+                     obj.LineToGroup(group_starts[j].group_line).c_str());
+#endif
+    }
+#ifdef MINI_JS
+    output->Printf("],lengths:[");
+#else
+    output->Printf("],\n        lengths: [");
+#endif
+    for (size_t j = 0; j < group_starts.size(); ++j) {
+      const size_t end = (j + 1 < group_starts.size()) ?
+          group_starts[j + 1].offset : num_indices;
+      const size_t length = end - group_starts[j].offset;
+#ifdef MINI_JS
+      output->Printf("%s" SIZET_FORMAT, j ? "," : "", length);
+#else
+      output->Printf("%s" SIZET_FORMAT, j ? ", " : "", length);
+#endif
+    }
+#ifdef MINI_JS
+    output->Printf("]}");
+#else
+    output->Printf("]\n      }");
+#endif
+    if (i != batches.size() - 1)
+      output->Putchar(',');
+#ifndef MINI_JS
+    output->Putchar('\n');
+#endif
+  }
+#ifdef MINI_JS
+  output->Printf("]}");
+#else
+  output->Printf("    ]\n  }");
+#endif
+}
+
+// Builds a BVH over the bounds of the groups, numbered in manifest
+// order, writes it to its own file and prints the bvh entry of the
+// manifest.
+static inline void WriteBvh(const std::vector<Bounds>& group_bounds,
+                            const BoundsParams& bounds_params,
+                            const char* out_file, ConvertOutput* output) {
+  if (group_bounds.empty()) {
+    return;
+  }
+  const BvhBuilder bvh(group_bounds);
+  std::vector<char> utf8;
+  bvh.Encode(bounds_params, &utf8);
+  PayloadHash payload_hash(output->short_names());
+  payload_hash.AddNew(utf8);
+  const std::string out_fn = payload_hash.Name(std::string("bvh.") + out_file);
+  output->AddPayload(out_fn, &utf8);
+#ifdef MINI_JS
+  output->Printf(",bvh:{url:'%s',nodes:" SIZET_FORMAT ",groups:"
+                 SIZET_FORMAT "}", out_fn.c_str(), bvh.num_nodes(),
+                 bvh.num_groups());
+#else
+  output->Printf(",\n  bvh: { url: '%s', nodes: " SIZET_FORMAT ", groups: "
+                 SIZET_FORMAT " }", out_fn.c_str(), bvh.num_nodes(),
+                 bvh.num_groups());
+#endif
+}
+
+// The groups printed in the urls come first, then |later_bounds|.
+static inline void WriteBvh(const std::vector<const GroupStart*>& groups,
+                            const std::vector<Bounds>& later_bounds,
+                            const BoundsParams& bounds_params,
+                            const char* out_file, ConvertOutput* output) {
+  std::vector<Bounds> group_bounds(groups.size());
+  for (size_t i = 0; i < groups.size(); ++i) {
+    group_bounds[i] = groups[i]->bounds;
+  }
+  group_bounds.insert(group_bounds.end(), later_bounds.begin(),
+                      later_bounds.end());
+  WriteBvh(group_bounds, bounds_params, out_file, output);
+}
+
+// Writes the prototypes of repeated shapes like the urls and prints the
+// instances entry: their urls, and for every name printed there the
+// shape's instances, as group names and scale and translation. The
+// bounds of the instances, in the order of their names, are added to
+// |group_bounds| for the BVH.
+static inline void WriteInstances(const WavefrontObjFile& obj,
+                                  const MaterialBatches& prototypes,
+                                  const ShapeList& shapes,
+                                  const BoundsParams& bounds_params,
+                                  const char* out_file, ConvertOutput* output,
+                                  std::vector<Bounds>* group_bounds) {
+  if (shapes.empty()) {
+    return;
+  }
+#ifdef MINI_JS
+  output->Printf(",instances:{urls:{");
+#else
+  output->Puts(",\n  instances: {\n    urls: {");
+#endif
+  std::vector<const GroupStart*> groups;
+  WriteBatches(obj, prototypes, bounds_params, out_file, output, NULL,
+               &groups, NULL, false, 2);
+  // Each prototype batch holds one group per shape of its material.
+  std::map<const GroupStart*, const Shape*> group_shapes;
+  for (size_t i = 0; i < shapes.size(); ++i) {
+    const Shape& shape = shapes[i];
+    const std::vector<GroupStart>& group_starts =
+        prototypes.find(shape.material)->second.group_starts();
+    for (size_t j = 0; j < group_starts.size(); ++j) {
+      if (group_starts[j].group_line == shape.instances[0].group_line) {
+        group_shapes[&group_starts[j]] = &shape;
+      }
+    }
+  }
+#ifdef MINI_JS
+  output->Printf("},shapes:[");
+#else
+  output->Puts("    },\n    shapes: [");
+#endif
+  for (size_t i = 0; i < groups.size(); ++i) {
+    const std::vector<Instance>& instances =
+        group_shapes.find(groups[i])->second->instances;
+#ifdef MINI_JS
+    output->Printf("{names:[");
+#else
+    output->Printf("      { names: [");
+#endif
+    for (size_t j = 0; j < instances.size(); ++j) {
+      output->Printf("%s'%s'", j ? "," : "",
+                     obj.LineToGroup(instances[j].group_line).c_str());
+    }
+#ifdef MINI_JS
+    output->Printf("],transforms:[");
+#else
+    output->Printf("],\n        transforms: [");
+#endif
+    for (size_t j = 0; j < instances.size(); ++j) {
+      const Instance& instance = instances[j];
+      output->Printf("%s%.9g,%.9g,%.9g,%.9g", j ? "," : "", instance.scale,
+                     instance.translation[0], instance.translation[1],
+                     instance.translation[2]);
+      Bounds bounds = groups[i]->bounds;
+      for (size_t k = 0; k < 3; ++k) {
+        bounds.mins[k] = instance.scale * bounds.mins[k] +
+            instance.translation[k];
+        bounds.maxes[k] = instance.scale * bounds.maxes[k] +
+            instance.translation[k];
+      }
+      group_bounds->push_back(bounds);
+    }
+#ifdef MINI_JS
+    output->Putchar(']');
+    output->Putchar('}');
+#else
+    output->Printf("]\n      }");
+#endif
+    if (i != groups.size() - 1)
+      output->Putchar(',');
+#ifndef MINI_JS
+    output->Putchar('\n');
+#endif
+  }
+#ifdef MINI_JS
+  output->Printf("]}");
+#else
+  output->Printf("    ]\n  }");
+#endif
+}
+
+// Returns kConvertBadOptions, describing the problem in |error|, if
+// |options| are out of range or cannot be combined for |input|.
+static inline ConvertStatus CheckConvertOptions(const ConvertInput& input,
+                                                const ConvertOptions& options,
+                                                std::string* error) {
+  bool ratios_valid = true;
+  for (size_t i = 0; i < options.lod_ratios.size(); ++i) {
+    const float ratio = options.lod_ratios[i];
+    ratios_valid = ratios_valid && ratio > 0 && ratio < 1;
+  }
+  if (!options.bits.Valid() || options.position_tolerance < 0 ||
+      !ratios_valid) {
+    *error = "options out of range";
+  } else if (options.max_tile_triangles && !options.glb_file.empty()) {
+    *error = "-tiles cannot be combined with -glb";
+  } else if (!input.frame_files.empty() &&
+             (options.max_tile_triangles || options.find_instances ||
+              options.merge_materials || options.split_objects)) {
+    *error = "-frames cannot be combined with -tiles, -instances, -merge "
+        "or -objects";
+  } else if (options.split_objects &&
+             (options.max_tile_triangles || options.find_instances)) {
+    *error = "-objects cannot be combined with -tiles or -instances";
+  } else if (options.share_vertices &&
+             (options.max_tile_triangles || options.find_instances ||
+              options.split_objects || !input.frame_files.empty() ||
+              !options.glb_file.empty())) {
+    *error = "-shared cannot be combined with -tiles, -instances, -objects, "
+        "-frames or -glb";
+  } else if (options.find_instances &&
+             (options.max_tile_triangles || !options.glb_file.empty())) {
+    *error = "-instances cannot be combined with -tiles or -glb";
+  } else if (!input.append_file.empty() &&
+             (options.max_tile_triangles || options.find_instances ||
+              options.merge_materials || options.split_objects ||
+              options.share_vertices || !input.frame_files.empty() ||
+              !options.glb_file.empty())) {
+    *error = "-append cannot be combined with -tiles, -instances, -merge, "
+        "-objects, -shared, -frames or -glb";
+  } else if (!options.spill_dir.empty() &&
+             (options.find_instances || options.merge_materials ||
+              options.split_objects || options.share_vertices ||
+              !input.frame_files.empty() || !options.glb_file.empty() ||
+              options.incremental || !input.append_file.empty())) {
+    *error = "-spill cannot be combined with -instances, -merge, -objects, "
+        "-shared, -frames, -glb, -incremental or -append";
+  } else if ((options.num_shards != 0) + (options.shard >= 0) +
+             options.merge_shards > 1) {
+    *error = "-shards, -shard and -merge-shards are separate steps";
+  } else if ((options.num_shards || options.shard >= 0 ||
+              options.merge_shards) &&
+             (options.position_tolerance > 0 || options.max_tile_triangles ||
+              !options.lod_ratios.empty() || options.find_instances ||
+              options.merge_materials || options.split_objects ||
+              options.share_vertices || !input.frame_files.empty() ||
+              !options.glb_file.empty() || options.incremental ||
+              !input.append_file.empty() || !options.spill_dir.empty())) {
+    *error = "-shards, -shard and -merge-shards cannot be combined with "
+        "-tolerance, -tiles, -lods, -instances, -merge, -objects, -shared, "
+        "-frames, -glb, -incremental, -append or -spill";
+  } else {
+    return kConvertOk;
+  }
+  return kConvertBadOptions;
+}
+
+// A rough bound on the memory ConvertObj needs for |input_bytes| of OBJ
+// and frames, to decide how many conversions can run side by side. The
+// parsed attributes, batches and payloads come to about five times the
+// text.
+static inline size_t EstimateConvertMemory(uint64 input_bytes) {
+  return static_cast<size_t>(6 * input_bytes) + (8 << 20);
+}
+
+// Copies a manifest into |output|'s, with entries added on the way.
+class ManifestSplicer {
+ public:
+  ManifestSplicer(const std::string& text, ConvertOutput* output)
+      : text_(text), output_(output), pos_(0) {
+  }
+
+  // Copies the text up to |end|.
+  void CopyTo(size_t end) {
+    output_->mutable_manifest()->append(text_, pos_, end - pos_);
+    pos_ = end;
+  }
+
+  // Leaves the text up to |pos| out.
+  void SkipTo(size_t pos) {
+    pos_ = pos;
+  }
+
+  // Copies the object or array |entry| up to its last entry, ready for
+  // more to be printed after it as WriteBatches prints them.
+  void OpenEntries(const ManifestEntry& entry) {
+    size_t end = entry.value_end - 1;
+    while (end > entry.value_begin + 1 && isspace(text_[end - 1])) {
+      --end;
+    }
+    CopyTo(end);
+    if (end != entry.value_begin + 1) {
+      output_->Putchar(',');
+    }
+#ifndef MINI_JS
+    output_->Putchar('\n');
+    // The entries printed end their lines.
+    if (pos_ < text_.size() && text_[pos_] == '\n') {
+      ++pos_;
+    }
+#endif
+  }
+
+  // Copies the rest of the text.
+  void Finish() {
+    CopyTo(text_.size());
+  }
+
+ private:
+  const std::string& text_;
+  ConvertOutput* output_;
+  size_t pos_;
+};
+
+// With -append, adds the faces of input.append_file to the model of
+// input.manifest: they are quantized in its decodeParams into payloads
+// of their own, listed after its urls (and levels of detail), and the
+// BVH is built again over the boxes of all the groups. The manifest
+// with them goes into |output|. If they cannot be added like this,
+// because they are outside the model's bounds, its manifest has more
+// than urls or they repeat its batches, returns kConvertOk with why in
+// |rebuild| and an empty manifest in |output|.
+static inline ConvertStatus AppendObj(const ConvertInput& input,
+                                      const ConvertOptions& options,
+                                      ConvertOutput* output, std::string* error,
+                                      std::string* rebuild) {
+  const std::string& manifest = input.manifest;
+  const char* append_file = input.append_file.c_str();
+  const char* out_file = options.out_file.c_str();
+  std::vector<float> lod_ratios = options.lod_ratios;
+  std::sort(lod_ratios.begin(), lod_ratios.end(), std::greater<float>());
+  lod_ratios.erase(std::unique(lod_ratios.begin(), lod_ratios.end()),
+                   lod_ratios.end());
+
+  if (manifest.empty()) {
+    *rebuild = "there is no manifest to append to";
+    return kConvertOk;
+  }
+  const size_t model = FindManifestModel(manifest);
+  ManifestEntryList entries;
+  if (model == std::string::npos ||
+      !ListManifestEntries(manifest, model, &entries)) {
+    *rebuild = "the manifest cannot be read";
+    return kConvertOk;
+  }
+  // Anything tiled, split or animated is not only in urls.
+  static const char* const kAppendable[] = {
+    "materials", "decodeParams", "urls", "lods", "instances", "bvh"
+  };
+  for (size_t i = 0; i < entries.size(); ++i) {
+    bool appendable = false;
+    for (size_t k = 0; k < sizeof(kAppendable) / sizeof(*kAppendable); ++k) {
+      appendable = appendable || entries[i].key == kAppendable[k];
+    }
+    if (!appendable) {
+      *rebuild = "the manifest has " + entries[i].key;
+      return kConvertOk;
+    }
+  }
+  const ManifestEntry* materials_entry =
+      FindManifestEntry(entries, "materials");
+  const ManifestEntry* urls_entry = FindManifestEntry(entries, "urls");
+  const ManifestEntry* decode_entry =
+      FindManifestEntry(entries, "decodeParams");
+  const ManifestEntry* lods_entry = FindManifestEntry(entries, "lods");
+  ManifestEntryList materials, urls, levels;
+  std::vector<ManifestEntryList> level_entries;
+  BoundsParams bounds_params;
+  if (!materials_entry || !urls_entry || !decode_entry ||
+      !ListManifestEntries(manifest, materials_entry->value_begin,
+                           &materials) ||
+      !ListManifestEntries(manifest, urls_entry->value_begin, &urls) ||
+      !ParseManifestDecodeParams(manifest, *decode_entry, &bounds_params) ||
+      (lods_entry && !ListManifestEntries(manifest, lods_entry->value_begin,
+                                          &levels))) {
+    *rebuild = "the manifest cannot be read";
+    return kConvertOk;
+  }
+  if (levels.size() != lod_ratios.size()) {
+    *rebuild = "its levels of detail are not those of -lods";
+    return kConvertOk;
+  }
+  // Each level has triangles, then urls.
+  level_entries.resize(levels.size());
+  for (size_t i = 0; i < levels.size(); ++i) {
+    ManifestEntryList& level = level_entries[i];
+    size_t triangles = 0;
+    if (!ListManifestEntries(manifest, levels[i].value_begin, &level) ||
+        level.size() != 2 || level[0].key != "triangles" ||
+        level[1].key != "urls" ||
+        !ParseManifestNumber(manifest, level[0], &triangles)) {
+      *rebuild = "the manifest cannot be read";
+      return kConvertOk;
+    }
+  }
+
+  TextSource source(input.append_file, &input.files);
+  if (!source.ok()) {
+    StringAppendF(error, "could not read %s", append_file);
+    return kConvertReadError;
+  }
+  WavefrontObjFile obj(&source, options.missing_materials_as_white,
+                       &input.files, input.mtl_libraries);
+  if (!obj.ok()) {
+    StringAppendF(error, "%s in %s", obj.error().c_str(), append_file);
+    return kConvertParseError;
+  }
+  const MaterialBatches& batches = obj.material_batches();
+  const MaterialBatches& line_batches = obj.line_batches();
+  const MaterialBatches& point_batches = obj.point_batches();
+  if (!BatchesFit(batches, bounds_params) ||
+      !BatchesFit(line_batches, bounds_params) ||
+      !BatchesFit(point_batches, bounds_params)) {
+    *rebuild = "the new faces are outside the model's bounds";
+    return kConvertOk;
+  }
+  if (!bounds_params.colors && (HasColors(batches) ||
+                                HasColors(line_batches) ||
+                                HasColors(point_batches))) {
+    *rebuild = "the new faces have colors and the model has none";
+    return kConvertOk;
+  }
+  // The BVH numbers the groups in manifest order, the earlier ones
+  // first.
+  std::vector<Bounds> group_bounds;
+  std::vector<char> payload;
+  for (size_t i = 0; i < urls.size(); ++i) {
+    if (!output->ReadPayload(urls[i].key, &payload) ||
+        !ReadManifestBoxes(manifest, urls[i], payload, bounds_params,
+                           &group_bounds)) {
+      *rebuild = "the boxes in " + urls[i].key + " cannot be read";
+      return kConvertOk;
+    }
+  }
+
+  ManifestSplicer splicer(manifest, output);
+  std::vector<const Material*> new_materials;
+  for (size_t i = 0; i < obj.materials().size(); ++i) {
+    if (!FindManifestEntry(materials, obj.materials()[i].name)) {
+      new_materials.push_back(&obj.materials()[i]);
+    }
+  }
+  if (!new_materials.empty()) {
+    splicer.OpenEntries(*materials_entry);
+    for (size_t i = 0; i < new_materials.size(); ++i) {
+      new_materials[i]->DumpJson(output->mutable_manifest());
+      if (i != new_materials.size() - 1)
+        output->Putchar(',');
+#ifndef MINI_JS
+      output->Putchar('\n');
+#endif
+    }
+  }
+  const size_t num_batches = CountDrawCalls(batches) +
+      CountDrawCalls(line_batches) + CountDrawCalls(point_batches);
+  std::vector<const GroupStart*> groups;
+  if (num_batches) {
+    splicer.OpenEntries(*urls_entry);
+    WriteBatches(obj, batches, bounds_params, out_file, output, NULL,
+                 &groups, NULL,
+                 !line_batches.empty() || !point_batches.empty());
+    WriteBatches(obj, line_batches, bounds_params, out_file, output, NULL,
+                 &groups, NULL, !point_batches.empty());
+    WriteBatches(obj, point_batches, bounds_params, out_file, output, NULL,
+                 &groups, NULL);
+  }
+  // The manifest lists the levels coarsest first.
+  std::vector<MaterialBatches> lods;
+  std::vector<size_t> lod_triangles;
+  SimplifyLods(batches, lod_ratios, &lods, &lod_triangles);
+  for (size_t i = 0; i < levels.size(); ++i) {
+    const size_t lod = levels.size() - 1 - i;
+    const ManifestEntry& triangles_entry = level_entries[i][0];
+    size_t triangles = 0;
+    ParseManifestNumber(manifest, triangles_entry, &triangles);
+    splicer.CopyTo(triangles_entry.value_begin);
+    output->Printf(SIZET_FORMAT, triangles + lod_triangles[lod]);
+    splicer.SkipTo(manifest.find_first_not_of("0123456789",
+                                              triangles_entry.value_begin));
+    if (CountDrawCalls(lods[lod])) {
+      splicer.OpenEntries(level_entries[i][1]);
+      WriteBatches(obj, lods[lod], bounds_params, out_file, output, NULL,
+                   NULL, NULL, false, 4);
+    }
+  }
+  // WriteBvh prints the comma before the bvh entry.
+  for (size_t i = 0; i < groups.size(); ++i) {
+    group_bounds.push_back(groups[i]->bounds);
+  }
+  const ManifestEntry* bvh_entry = FindManifestEntry(entries, "bvh");
+  if (bvh_entry) {
+    splicer.CopyTo(manifest.rfind(',', bvh_entry->begin));
+    splicer.SkipTo(bvh_entry->value_end);
+  } else {
+    splicer.CopyTo(entries.back().value_end);
+  }
+  WriteBvh(group_bounds, bounds_params, out_file, output);
+  splicer.Finish();
+  // A batch just like one the model has gets its name.
+  if (ManifestRepeatsUrls(output->manifest())) {
+    output->mutable_manifest()->clear();
+    StringAppendF(rebuild, "%s repeats batches the model has", append_file);
+    return kConvertOk;
+  }
+  fprintf(stderr, "Appended " SIZET_FORMAT " batches of %s\n", num_batches,
+          append_file);
+  if (!output->failed_payload().empty()) {
+    StringAppendF(error, "could not write %s",
+                  output->failed_payload().c_str());
+    return kConvertWriteError;
+  }
+  return kConvertOk;
+}
+
+// Opens the manifest's entry for the model of |in_file| and prints its
+// materials.
+static inline void WriteMaterials(const char* in_file,
+                                  const MaterialList& materials,
+                                  ConvertOutput* output) {
+#ifdef MINI_JS
+  output->Printf("MODELS['%s']={materials:{", StripLeadingDir(in_file));
+#else
+  output->Printf("MODELS['%s'] = {\n  materials: {\n",
+                 StripLeadingDir(in_file));
+#endif
+  for (size_t i = 0; i < materials.size(); ++i) {
+    materials[i].DumpJson(output->mutable_manifest());
+    if (i != materials.size() - 1)
+        output->Putchar(',');
+#ifndef MINI_JS
+    output->Printf("\n");
+#endif
+  }
+#ifdef MINI_JS
+  output->Printf("},");
+#else
+  output->Puts("  },");
+#endif
+}
+
+// With -memstats, tells how much memory the conversion holds after
+// |stage|, and the most it has held before, to find the stage that
+// sets the peak.
+static inline void ReportMemory(const ConvertOptions& options,
+                                const char* stage) {
+  size_t current = 0, peak = 0;
+  if (!options.report_memory || !GetMemoryUsage(&current, &peak)) {
+    return;
+  }
+  const size_t kMegabyte = 1 << 20;
+  if (current) {
+    fprintf(stderr, "Memory after %s: " SIZET_FORMAT " MB resident, "
+            SIZET_FORMAT " MB at peak\n", stage, current / kMegabyte,
+            peak / kMegabyte);
+  } else {
+    fprintf(stderr, "Memory after %s: " SIZET_FORMAT " MB at peak\n",
+            stage, peak / kMegabyte);
+  }
+}
+
+// ConvertObj with -spill: like -tiles, but the parsed triangles wait in
+// scratch files in options.spill_dir instead of memory, and the tiles
+// are read back and written one at a time. The model's decodeParams
+// cover the lines and points, which are held in memory.
+static inline ConvertStatus ConvertSpilled(const ConvertInput& input,
+                                           const ConvertOptions& options,
+                                           ConvertOutput* output,
+                                           std::string* error) {
+  const char* in_file = input.obj_file.c_str();
+  const char* out_file = options.out_file.c_str();
+  ObjSpill spill(options.spill_dir + "/" + StripLeadingDir(out_file) +
+                 ".spill", options.spill_memory);
+  if (!spill.Start(error)) {
+    return kConvertWriteError;
+  }
+  TextSource source(input.obj_file, &input.files);
+  if (!source.ok()) {
+    StringAppendF(error, "could not read %s", in_file);
+    return kConvertReadError;
+  }
+  WavefrontObjFile obj(&source, options.missing_materials_as_white,
+                       &input.files, input.mtl_libraries, &spill);
+  if (!obj.ok()) {
+    *error = obj.error();
+    return kConvertParseError;
+  }
+  MaterialBatches line_batches, point_batches;
+  if (!spill.Finish(error) ||
+      !spill.ReadOthers(&line_batches, &point_batches, error)) {
+    return kConvertWriteError;
+  }
+  const size_t max_tile_triangles = options.max_tile_triangles ?
+      options.max_tile_triangles : spill.max_tile_triangles();
+  if (!spill.Sort(max_tile_triangles, error)) {
+    return kConvertWriteError;
+  }
+  ReportMemory(options, "parsing");
+
+  WriteMaterials(in_file, obj.materials(), output);
+  Bounds bounds = spill.bounds();
+  const MaterialBatches* primitive_batches[] = {
+    &line_batches, &point_batches
+  };
+  for (size_t i = 0; i < 2; ++i) {
+    for (MaterialBatches::const_iterator iter = primitive_batches[i]->begin();
+         iter != primitive_batches[i]->end(); ++iter) {
+      bounds.Enclose(iter->second.draw_mesh().attribs, iter->second.layout());
+    }
+  }
+  BoundsParams bounds_params = BoundsParams::FromBounds(bounds, options.bits);
+  bounds_params.octNormals = options.oct_normals;
+  bounds_params.colors = spill.has_colors() || HasColors(line_batches) ||
+      HasColors(point_batches);
+#ifdef MINI_JS
+  output->Printf("decodeParams:");
+#else
+  output->Printf("  decodeParams: ");
+#endif
+  bounds_params.DumpJson(output->mutable_manifest());
+
+  std::vector<const GroupStart*> groups;
+#ifdef MINI_JS
+  output->Printf("urls:{");
+#else
+  output->Puts("  urls: {");
+#endif
+  WriteBatches(obj, line_batches, bounds_params, out_file, output, NULL,
+               &groups, NULL, !point_batches.empty());
+  WriteBatches(obj, point_batches, bounds_params, out_file, output, NULL,
+               &groups, NULL);
+#ifdef MINI_JS
+  output->Putchar('}');
+#else
+  output->Printf("  }");
+#endif
+  ReportMemory(options, "encoding the batches");
+
+  // The lines and points come first in the BVH, then each tile's groups.
+  std::vector<Bounds> group_bounds(groups.size());
+  for (size_t i = 0; i < groups.size(); ++i) {
+    group_bounds[i] = groups[i]->bounds;
+  }
+  std::vector<float> lod_ratios = options.lod_ratios;
+  std::sort(lod_ratios.begin(), lod_ratios.end(), std::greater<float>());
+  lod_ratios.erase(std::unique(lod_ratios.begin(), lod_ratios.end()),
+                   lod_ratios.end());
+#ifdef MINI_JS
+  output->Printf(",tiles:[");
+#else
+  output->Puts(",\n  tiles: [");
+#endif
+  // Whether a tile is the last is only known after it, so the commas go
+  // before the tiles.
+  Tile tile;
+  size_t num_tiles = 0;
+  while (spill.NextTile(&tile)) {
+    if (num_tiles++) {
+      output->Putchar(',');
+#ifndef MINI_JS
+      output->Putchar('\n');
+#endif
+    }
+    WriteTile(obj, tile, options.bits, options.position_tolerance,
+              options.oct_normals, lod_ratios, out_file, output,
+              &group_bounds);
+  }
+#ifdef MINI_JS
+  output->Putchar(']');
+#else
+  if (num_tiles)
+    output->Putchar('\n');
+  output->Printf("  ]");
+#endif
+  if (!spill.Close()) {
+    StringAppendF(error, "could not read the triangles spilled to %s",
+                  options.spill_dir.c_str());
+    return kConvertReadError;
+  }
+  ReportMemory(options, "the other payloads");
+  WriteBvh(group_bounds, bounds_params, out_file, output);
+#ifndef MINI_JS
+  output->Putchar('\n');
+#endif
+#ifdef MINI_JS
+  output->Printf("};");
+#else
+  output->Puts("};");
+#endif
+  if (!output->failed_payload().empty()) {
+    StringAppendF(error, "could not write %s",
+                  output->failed_payload().c_str());
+    return kConvertWriteError;
+  }
+  return kConvertOk;
+}
+
+// -shards: parses input.obj_file to plan options.num_shards shards of
+// it, and writes the plan and the attribute files. There is no
+// manifest.
+static inline ConvertStatus PlanShards(const ConvertInput& input,
+                                       const ConvertOptions& options,
+                                       ConvertOutput* output,
+                                       std::string* error) {
+  const char* in_file = input.obj_file.c_str();
+  TextSource source(input.obj_file, &input.files);
+  uint64 size = 0;
+  if (!source.ok() || !source.GetSize(&size)) {
+    StringAppendF(error, "could not read %s", in_file);
+    return kConvertReadError;
+  }
+  ShardPlanner planner(options.out_file, size, options.num_shards);
+  if (!planner.Start(error)) {
+    return kConvertWriteError;
+  }
+  WavefrontObjFile obj(&source, options.missing_materials_as_white,
+                       &input.files, input.mtl_libraries, &planner);
+  if (!obj.ok()) {
+    *error = obj.error();
+    return kConvertParseError;
+  }
+  ShardPlan plan;
+  if (!planner.Finish(obj, &plan, error)) {
+    return kConvertWriteError;
+  }
+  std::string text;
+  plan.Serialize(&text);
+  const std::string plan_name = ShardPlanName(options.out_file);
+  if (!output->KeepState(plan_name, text)) {
+    StringAppendF(error, "could not write %s", plan_name.c_str());
+    return kConvertWriteError;
+  }
+  fprintf(stderr, "Planned " SIZET_FORMAT " shards of %s in %s\n",
+          plan.starts.size(), in_file, plan_name.c_str());
+  return kConvertOk;
+}
+
+// Reads the plan -shards wrote for options.out_file.
+static inline ConvertStatus ReadShardPlan(const ConvertOptions& options,
+                                          ConvertOutput* output,
+                                          ShardPlan* plan, std::string* error) {
+  const std::string plan_name = ShardPlanName(options.out_file);
+  std::string text;
+  if (!output->ReadState(plan_name, &text) || !plan->Parse(text)) {
+    StringAppendF(error, "could not read %s, the plan of -shards",
+                  plan_name.c_str());
+    return kConvertReadError;
+  }
+  return kConvertOk;
+}
+
+// -shard: converts shard options.shard of the plan, in the decodeParams
+// of the whole model, into a manifest of just its materials and urls
+// for MergeShards.
+static inline ConvertStatus ConvertShard(const ConvertInput& input,
+                                         const ConvertOptions& options,
+                                         ConvertOutput* output,
+                                         std::string* error) {
+  const char* in_file = input.obj_file.c_str();
+  const char* out_file = options.out_file.c_str();
+  ShardPlan plan;
+  const ConvertStatus plan_status =
+      ReadShardPlan(options, output, &plan, error);
+  if (plan_status != kConvertOk) {
+    return plan_status;
+  }
+  const size_t shard = options.shard;
+  if (shard >= plan.starts.size()) {
+    StringAppendF(error, "there are only " SIZET_FORMAT " shards",
+                  plan.starts.size());
+    return kConvertBadOptions;
+  }
+  ObjParseStart start;
+  if (!ReadShardStart(plan, shard, options.out_file, &start, error)) {
+    return kConvertReadError;
+  }
+  TextSource source(input.obj_file, &input.files);
+  if (!source.ok() ||
+      !source.SetRange(start.state.offset, plan.End(shard))) {
+    StringAppendF(error, "could not read %s", in_file);
+    return kConvertReadError;
+  }
+  WavefrontObjFile obj(&source, options.missing_materials_as_white,
+                       &input.files, input.mtl_libraries, &start);
+  if (!obj.ok()) {
+    *error = obj.error();
+    return kConvertParseError;
+  }
+  ReportMemory(options, "parsing");
+
+  const BoundsParams bounds_params =
+      plan.DecodeParams(options.bits, options.oct_normals);
+  const MaterialBatches& line_batches = obj.line_batches();
+  const MaterialBatches& point_batches = obj.point_batches();
+  WriteMaterials(in_file, obj.materials(), output);
+#ifdef MINI_JS
+  output->Printf("decodeParams:");
+#else
+  output->Printf("  decodeParams: ");
+#endif
+  bounds_params.DumpJson(output->mutable_manifest());
+#ifdef MINI_JS
+  output->Printf("urls:{");
+#else
+  output->Puts("  urls: {");
+#endif
+  // A shard may end just after a usemtl, leaving its batch empty.
+  WriteBatches(obj, obj.material_batches(), bounds_params, out_file, output,
+               NULL, NULL, NULL,
+               CountDrawCalls(line_batches) +
+                   CountDrawCalls(point_batches) > 0);
+  WriteBatches(obj, line_batches, bounds_params, out_file, output, NULL,
+               NULL, NULL, CountDrawCalls(point_batches) > 0);
+  WriteBatches(obj, point_batches, bounds_params, out_file, output, NULL,
+               NULL, NULL);
+#ifdef MINI_JS
+  output->Printf("}};");
+#else
+  output->Puts("  }\n};");
+#endif
+  ReportMemory(options, "encoding the batches");
+  if (!output->failed_payload().empty()) {
+    StringAppendF(error, "could not write %s",
+                  output->failed_payload().c_str());
+    return kConvertWriteError;
+  }
+  return kConvertOk;
+}
+
+// Copies |entry| of |text| into |output|, indented as it was.
+static inline void CopyManifestEntry(const std::string& text,
+                                     const ManifestEntry& entry,
+                                     ConvertOutput* output) {
+  size_t begin = entry.begin;
+#ifndef MINI_JS
+  while (begin > 0 && text[begin - 1] == ' ') {
+    --begin;
+  }
+#endif
+  output->mutable_manifest()->append(text, begin, entry.value_end - begin);
+}
+
+// -merge-shards: combines the manifests of all the shards of the plan
+// into the model's, listing the urls of every shard in order, with a BVH
+// over all of their groups, whose boxes are read back from their
+// payloads. The attribute files are removed; the plan and the shards'
+// manifests are kept, for merging again.
+static inline ConvertStatus MergeShards(const ConvertInput& input,
+                                        const ConvertOptions& options,
+                                        ConvertOutput* output,
+                                        std::string* error) {
+  const char* in_file = input.obj_file.c_str();
+  const char* out_file = options.out_file.c_str();
+  ShardPlan plan;
+  const ConvertStatus plan_status =
+      ReadShardPlan(options, output, &plan, error);
+  if (plan_status != kConvertOk) {
+    return plan_status;
+  }
+  const BoundsParams bounds_params =
+      plan.DecodeParams(options.bits, options.oct_normals);
+  std::string decode_params;
+  bounds_params.DumpJson(&decode_params);
+  const size_t num_shards = plan.starts.size();
+  std::vector<std::string> manifests(num_shards);
+  std::vector<ManifestEntryList> materials(num_shards), urls(num_shards);
+  for (size_t i = 0; i < num_shards; ++i) {
+    const std::string name = ShardManifestName(options.out_file, i);
+    const std::string& manifest = manifests[i];
+    if (!output->ReadState(name, &manifests[i])) {
+      StringAppendF(error, "could not read %s; convert shard " SIZET_FORMAT
+                    " with -shard first", name.c_str(), i);
+      return kConvertReadError;
+    }
+    const size_t model = FindManifestModel(manifest);
+    ManifestEntryList entries;
+    const ManifestEntry* materials_entry = NULL;
+    const ManifestEntry* decode_entry = NULL;
+    const ManifestEntry* urls_entry = NULL;
+    if (model == std::string::npos ||
+        !ListManifestEntries(manifest, model, &entries) ||
+        !(materials_entry = FindManifestEntry(entries, "materials")) ||
+        !(decode_entry = FindManifestEntry(entries, "decodeParams")) ||
+        !(urls_entry = FindManifestEntry(entries, "urls")) ||
+        !ListManifestEntries(manifest, materials_entry->value_begin,
+                             &materials[i]) ||
+        !ListManifestEntries(manifest, urls_entry->value_begin, &urls[i])) {
+      StringAppendF(error, "%s cannot be read", name.c_str());
+      return kConvertParseError;
+    }
+    // The shards and the merge must agree on the -bits and -oct that
+    // went into the decodeParams.
+    const size_t length = decode_entry->value_end - decode_entry->value_begin;
+    if (decode_params.compare(0, length, manifest, decode_entry->value_begin,
+                              length) != 0) {
+      StringAppendF(error, "shard " SIZET_FORMAT " was converted with other "
+                    "options", i);
+      return kConvertBadOptions;
+    }
+  }
+
+#ifdef MINI_JS
+  output->Printf("MODELS['%s']={materials:{", StripLeadingDir(in_file));
+#else
+  output->Printf("MODELS['%s'] = {\n  materials: {\n",
+                 StripLeadingDir(in_file));
+#endif
+  // Every shard has the materials of its mtllib.
+  std::set<std::string> names;
+  for (size_t i = 0; i < num_shards; ++i) {
+    for (size_t k = 0; k < materials[i].size(); ++k) {
+      if (!names.insert(materials[i][k].key).second) continue;
+      if (names.size() > 1) {
+        output->Putchar(',');
+#ifndef MINI_JS
+        output->Putchar('\n');
+#endif
+      }
+      CopyManifestEntry(manifests[i], materials[i][k], output);
+    }
+  }
+#ifdef MINI_JS
+  output->Printf("},decodeParams:");
+#else
+  if (!names.empty())
+    output->Putchar('\n');
+  output->Puts("  },");
+  output->Printf("  decodeParams: ");
+#endif
+  bounds_params.DumpJson(output->mutable_manifest());
+#ifdef MINI_JS
+  output->Printf("urls:{");
+#else
+  output->Puts("  urls: {");
+#endif
+  // The BVH numbers the groups in manifest order.
+  std::vector<Bounds> group_bounds;
+  std::vector<char> payload;
+  names.clear();
+  for (size_t i = 0; i < num_shards; ++i) {
+    for (size_t k = 0; k < urls[i].size(); ++k) {
+      const ManifestEntry& entry = urls[i][k];
+      if (!names.insert(entry.key).second) {
+        StringAppendF(error, "more than one shard has the batch %s; merge "
+                      "fewer shards", entry.key.c_str());
+        return kConvertParseError;
+      }
+      if (!output->ReadPayload(entry.key, &payload) ||
+          !ReadManifestBoxes(manifests[i], entry, payload, bounds_params,
+                             &group_bounds)) {
+        StringAppendF(error, "the boxes in %s cannot be read",
+                      entry.key.c_str());
+        return kConvertReadError;
+      }
+      if (names.size() > 1) {
+        output->Putchar(',');
+#ifndef MINI_JS
+        output->Putchar('\n');
+#endif
+      }
+      CopyManifestEntry(manifests[i], entry, output);
+    }
+  }
+#ifdef MINI_JS
+  output->Putchar('}');
+#else
+  if (!names.empty())
+    output->Putchar('\n');
+  output->Printf("  }");
+#endif
+  WriteBvh(group_bounds, bounds_params, out_file, output);
+#ifndef MINI_JS
+  output->Putchar('\n');
+#endif
+#ifdef MINI_JS
+  output->Printf("};");
+#else
+  output->Puts("};");
+#endif
+  if (!output->failed_payload().empty()) {
+    StringAppendF(error, "could not write %s",
+                  output->failed_payload().c_str());
+    return kConvertWriteError;
+  }
+  RemoveShardAttribs(options.out_file);
+  fprintf(stderr, "Merged " SIZET_FORMAT " shards of %s\n", num_shards,
+          in_file);
+  return kConvertOk;
+}
+
+// Converts |input| into |output|. Anything but kConvertOk comes with a
+// description in |error|, and |output| is then incomplete.
+static inline ConvertStatus ConvertObj(const ConvertInput& input,
+                                       const ConvertOptions& options,
+                                       ConvertOutput* output,
+                                       std::string* error) {
+  const ConvertStatus options_status =
+      CheckConvertOptions(input, options, error);
+  if (options_status != kConvertOk) {
+    return options_status;
+  }
+  const char* in_file = input.obj_file.c_str();
+  output->set_short_names(options.short_names);
+  if (!options.spill_dir.empty()) {
+    return ConvertSpilled(input, options, output, error);
+  } else if (options.num_shards) {
+    return PlanShards(input, options, output, error);
+  } else if (options.shard >= 0) {
+    return ConvertShard(input, options, output, error);
+  } else if (options.merge_shards) {
+    return MergeShards(input, options, output, error);
+  }
+  if (!input.append_file.empty()) {
+    std::string rebuild;
+    const ConvertStatus append_status =
+        AppendObj(input, options, output, error, &rebuild);
+    if (append_status != kConvertOk || rebuild.empty()) {
+      return append_status;
+    }
+    fprintf(stderr, "Converting all of %s, as %s\n", in_file,
+            rebuild.c_str());
+  }
+  const char* out_file = options.out_file.c_str();
+  QuantizationBits bits = options.bits;
+  const float position_tolerance = options.position_tolerance;
+  const bool oct_normals = options.oct_normals;
+  const size_t max_tile_triangles = options.max_tile_triangles;
+  const bool find_instances = options.find_instances;
+  const bool merge_materials = options.merge_materials;
+  const bool split_objects = options.split_objects;
+  const bool share_vertices = options.share_vertices;
+  const bool write_glb = !options.glb_file.empty();
+  std::vector<float> lod_ratios = options.lod_ratios;
+  std::sort(lod_ratios.begin(), lod_ratios.end(), std::greater<float>());
+  lod_ratios.erase(std::unique(lod_ratios.begin(), lod_ratios.end()),
+                   lod_ratios.end());
+
+  TextSource source(input.obj_file, &input.files);
+  if (!source.ok()) {
+    StringAppendF(error, "could not read %s", in_file);
+    return kConvertReadError;
+  }
+  WavefrontObjFile obj(&source, options.missing_materials_as_white,
+                       &input.files, input.mtl_libraries);
+  if (!obj.ok()) {
+    *error = obj.error();
+    return kConvertParseError;
+  }
+  const std::vector<std::string>& frame_files = input.frame_files;
+  FrameList frames(frame_files.size());
+  for (size_t i = 0; i < frame_files.size(); ++i) {
+    TextSource frame_source(frame_files[i], &input.files);
+    if (!frame_source.ok()) {
+      StringAppendF(error, "could not read %s", frame_files[i].c_str());
+      return kConvertReadError;
+    }
+    WavefrontObjFile frame(&frame_source, true, &input.files,
+                           input.mtl_libraries);
+    if (!frame.ok()) {
+      StringAppendF(error, "%s in %s", frame.error().c_str(),
+                    frame_files[i].c_str());
+      return kConvertParseError;
+    }
+    if (!ReadFrame(frame, obj.material_batches(), &frames[i])) {
+      StringAppendF(error, "the faces of %s differ from those of %s",
+                    frame_files[i].c_str(), in_file);
+      return kConvertFrameMismatch;
+    }
+  }
+  ReportMemory(options, "parsing");
+
+  // With -incremental, batches that an earlier run encoded are reused.
+  BatchRecords batch_records;
+  const std::string state_name = IncrementalStateName(options.out_file);
+  if (options.incremental) {
+    std::string state;
+    if (output->ReadState(state_name, &state) &&
+        !batch_records.Parse(state)) {
+      fprintf(stderr, "WARNING: ignoring %s, which is damaged or from "
+              "another version\n", state_name.c_str());
+    }
+    output->set_batch_records(&batch_records);
+  }
+
+  MaterialList merged_materials;
+  MaterialBatches merged_batches, merged_lines, merged_points;
+  if (merge_materials) {
+    MergeMaterials(obj.materials(), obj.material_batches(),
+                   &merged_materials, &merged_batches);
+    // Lines and points follow their materials.
+    MaterialList same_materials;
+    MergeMaterials(obj.materials(), obj.line_batches(), &same_materials,
+                   &merged_lines);
+    same_materials.clear();
+    MergeMaterials(obj.materials(), obj.point_batches(), &same_materials,
+                   &merged_points);
+    fprintf(stderr, "Merged " SIZET_FORMAT " materials into " SIZET_FORMAT
+            ": " SIZET_FORMAT " draw calls instead of " SIZET_FORMAT "\n",
+            obj.materials().size(), merged_materials.size(),
+            CountDrawCalls(merged_batches),
+            CountDrawCalls(obj.material_batches()));
+  }
+  const MaterialList& materials =
+      merge_materials ? merged_materials : obj.materials();
+  const MaterialBatches& batches =
+      merge_materials ? merged_batches : obj.material_batches();
+  const MaterialBatches& line_batches =
+      merge_materials ? merged_lines : obj.line_batches();
+  const MaterialBatches& point_batches =
+      merge_materials ? merged_points : obj.point_batches();
+
+  WriteMaterials(in_file, materials, output);
+
+  // Pass 1: compute bounds.
+  Bounds bounds;
+  bounds.Clear();
+  for (MaterialBatches::const_iterator iter = batches.begin();
+       iter != batches.end(); ++iter) {
+    const DrawBatch& draw_batch = iter->second;
+    bounds.Enclose(draw_batch.draw_mesh().attribs, draw_batch.layout());
+    for (size_t i = 0; i < frames.size(); ++i) {
+      bounds.Enclose(frames[i].find(iter->first)->second, kLayoutP);
+    }
+  }
+  // Lines and points share the triangles' decodeParams.
+  const MaterialBatches* primitive_batches[] = {
+    &line_batches, &point_batches
+  };
+  for (size_t i = 0; i < 2; ++i) {
+    for (MaterialBatches::const_iterator iter = primitive_batches[i]->begin();
+         iter != primitive_batches[i]->end(); ++iter) {
+      bounds.Enclose(iter->second.draw_mesh().attribs, iter->second.layout());
+    }
+  }
+  if (position_tolerance > 0) {
+    PositionSourceList sources;
+    AddPositionSources(batches, &sources);
+    AddPositionSources(line_batches, &sources);
+    AddPositionSources(point_batches, &sources);
+    // Later frames are quantized with the same decodeParams.
+    for (size_t i = 0; i < frames.size(); ++i) {
+      for (FramePositions::const_iterator iter = frames[i].begin();
+           iter != frames[i].end(); ++iter) {
+        sources.push_back(std::make_pair(&iter->second, kLayoutP));
+      }
+    }
+    bits.position = ChoosePositionBits(bounds, sources, bits,
+                                       position_tolerance);
+  }
+  BoundsParams bounds_params = BoundsParams::FromBounds(bounds, bits);
+  bounds_params.octNormals = oct_normals;
+  bounds_params.colors = HasColors(batches) || HasColors(line_batches) ||
+      HasColors(point_batches);
+#ifdef MINI_JS
+  output->Printf("decodeParams:");
+#else
+  output->Printf("  decodeParams: ");
+#endif
+  bounds_params.DumpJson(output->mutable_manifest());
+  if (!frames.empty()) {
+#ifdef MINI_JS
+    output->Printf("frames:" SIZET_FORMAT ",", frames.size() + 1);
+#else
+    output->Printf("  frames: " SIZET_FORMAT ",\n", frames.size() + 1);
+#endif
+  }
+  GlbWriter glb(bounds_params);
+  glb.AddMaterials(materials);
+
+  // Repeated groups move to the instances, leaving the rest in urls.
+  MaterialBatches unique_batches, prototypes;
+  ShapeList shapes;
+  ObjectList objects;
+  std::vector<const GroupStart*> groups;
+  // The bounds of the groups of the tiles or instances, which the
+  // manifest lists after the urls.
+  std::vector<Bounds> later_bounds;
+  if (find_instances) {
+    InstanceFinder(batches, bounds_params).Find(&unique_batches,
+                                                &prototypes, &shapes);
+  }
+  const MaterialBatches& url_batches =
+      find_instances ? unique_batches : batches;
+#ifdef MINI_JS
+  output->Printf("urls:{");
+#else
+  output->Puts("  urls: {");
+#endif
+  if (split_objects) {
+    SplitObjects(obj, batches, line_batches, point_batches, &objects);
+  } else if (!share_vertices) {
+    if (!max_tile_triangles) {
+      WriteBatches(obj, url_batches, bounds_params, out_file, output,
+                   write_glb ? &glb : NULL, &groups, &frames,
+                   !line_batches.empty() || !point_batches.empty());
+    }
+    // Lines and points are never tiled, simplified or instanced.
+    WriteBatches(obj, line_batches, bounds_params, out_file, output,
+                 write_glb ? &glb : NULL, &groups, NULL,
+                 !point_batches.empty());
+    WriteBatches(obj, point_batches, bounds_params, out_file, output,
+                 write_glb ? &glb : NULL, &groups, NULL);
+  }
+#ifdef MINI_JS
+  output->Putchar('}');
+#else
+  output->Printf("  }");
+#endif
+  ReportMemory(options, "encoding the batches");
+  if (max_tile_triangles) {
+    WriteTiles(obj, batches, max_tile_triangles, bits, position_tolerance,
+               oct_normals, lod_ratios, out_file, output, &later_bounds);
+  } else if (split_objects) {
+    WriteObjects(obj, objects, lod_ratios, bounds_params, out_file,
+                 output, write_glb ? &glb : NULL, &groups);
+  } else {
+    if (share_vertices) {
+      WriteShared(obj, batches, line_batches, point_batches, bounds_params,
+                  out_file, output, &groups);
+    }
+    WriteLods(obj, url_batches, lod_ratios, bounds_params, out_file,
+              output);
+    WriteInstances(obj, prototypes, shapes, bounds_params, out_file,
+                   output, &later_bounds);
+  }
+  ReportMemory(options, "the other payloads");
+  WriteBvh(groups, later_bounds, bounds_params, out_file, output);
+#ifndef MINI_JS
+  output->Putchar('\n');
+#endif
+#ifdef MINI_JS
+  output->Printf("};");
+#else
+  output->Puts("};");
+#endif
+  if (write_glb) {
+    std::vector<char> glb_data;
+    glb.Serialize(&glb_data);
+    output->AddPayload(options.glb_file, &glb_data);
+  }
+  ReportMemory(options, "the BVH and GLB");
+  if (options.incremental) {
+    output->set_batch_records(NULL);
+    fprintf(stderr, "Reused " SIZET_FORMAT " of " SIZET_FORMAT " batches\n",
+            batch_records.num_reused(), batch_records.num_kept());
+    // The next run can rely on the payloads only if all were kept.
+    std::string state;
+    batch_records.Serialize(&state);
+    if (output->failed_payload().empty() &&
+        !output->KeepState(state_name, state)) {
+      StringAppendF(error, "could not write %s", state_name.c_str());
+      return kConvertWriteError;
+    }
+  }
+  if (!output->failed_payload().empty()) {
+    StringAppendF(error, "could not write %s",
+                  output->failed_payload().c_str());
+    return kConvertWriteError;
+  }
+  return kConvertOk;
+}
+
+#endif  // WEBGL_LOADER_CONVERT_H_
@@ -0,0 +1,93 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You
+// may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied. See the License for the specific language governing
+// permissions and limitations under the License.
+
+#ifndef WEBGL_LOADER_FRAMES_H_
+#define WEBGL_LOADER_FRAMES_H_
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "base.h"
+#include "mesh.h"
+
+// The positions of one later frame of an animation, per material, 3
+// floats for each of the first frame's flattened vertices.
+typedef std::map<std::string, AttribList> FramePositions;
+typedef std::vector<FramePositions> FrameList;
+
+// Takes the positions of the frame |obj|, which must come from faces
+// exactly like those of |first|: same materials, same triangles, same
+// vertices. Texcoords and normals are left to the first frame.
+static inline bool ReadFrame(const WavefrontObjFile& obj,
+                             const MaterialBatches& first,
+                             FramePositions* positions) {
+  const MaterialBatches& batches = obj.material_batches();
+  if (batches.size() != first.size()) {
+    return false;
+  }
+  for (MaterialBatches::const_iterator iter = first.begin(),
+           frame_iter = batches.begin();
+       iter != first.end(); ++iter, ++frame_iter) {
+    const DrawMesh& draw_mesh = iter->second.draw_mesh();
+    const DrawMesh& frame_mesh = frame_iter->second.draw_mesh();
+    if (frame_iter->first != iter->first ||
+        frame_iter->second.layout() != iter->second.layout() ||
+        frame_mesh.indices != draw_mesh.indices ||
+        frame_mesh.attribs.size() != draw_mesh.attribs.size()) {
+      return false;
+    }
+    const size_t stride = LayoutStride(iter->second.layout());
+    AttribList& out = (*positions)[iter->first];
+    out.reserve(frame_mesh.attribs.size() / stride * 3);
+    for (size_t i = 0; i < frame_mesh.attribs.size(); i += stride) {
+      const float* position = &frame_mesh.attribs[i];
+      out.insert(out.end(), position, position + 3);
+    }
+  }
+  return true;
+}
+
+// Appends the quantized positions of every frame, in order, to each
+// vertex of |attribs|, which has |stride| words per vertex. The
+// VertexOptimizer then carries them along with the vertices.
+static inline void AppendFramePositions(const FrameList& frames,
+                                        const std::string& material,
+                                        const BoundsParams& bounds_params,
+                                        size_t stride,
+                                        QuantizedAttribList* attribs) {
+  const size_t num_vertices = attribs->size() / stride;
+  const size_t frame_stride = stride + 3 * frames.size();
+  QuantizedAttribList out(num_vertices * frame_stride);
+  for (size_t i = 0; i < num_vertices; ++i) {
+    uint16* vertex = &out[i * frame_stride];
+    std::copy(&attribs->at(i * stride), &attribs->at(i * stride) + stride,
+              vertex);
+    vertex += stride;
+    for (size_t f = 0; f < frames.size(); ++f) {
+      const float* position = &frames[f].find(material)->second[3 * i];
+      for (size_t j = 0; j < 3; ++j) {
+        *vertex++ = Quantize(position[j], bounds_params.mins[j],
+                             bounds_params.scales[j],
+                             bounds_params.outputMaxes[j]);
+      }
+    }
+  }
+  attribs->swap(out);
+}
+
+#endif  // WEBGL_LOADER_FRAMES_H_
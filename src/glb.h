@@ -0,0 +1,514 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You
+// may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied. See the License for the specific language governing
+// permissions and limitations under the License.
+
+#ifndef WEBGL_LOADER_GLB_H_
+#define WEBGL_LOADER_GLB_H_
+
+#include <math.h>
+#include <stdio.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "base.h"
+#include "mesh.h"
+
+// Writes the quantized meshes as a binary glTF 2.0 file using
+// KHR_mesh_quantization. Positions are stored as the very same uint16
+// values that go into the UTF-8 stream, and the position decode
+// transform from BoundsParams becomes the translation and scale of the
+// root node, so viewers can upload the buffers without decoding them.
+//
+// Vertices follow the batch's VertexLayout, up to 24 bytes:
+//   POSITION    3 x uint16 (+ 2 bytes padding)
+//   TEXCOORD_0  2 x uint16, normalized
+//   NORMAL      3 x int16, normalized (+ 2 bytes padding)
+//   COLOR_0     3 x uint8, normalized (+ 1 byte padding)
+// Texcoords and normals are rescaled from their quantized ranges into
+// the full 16-bit range through small lookup tables while writing, which
+// also flip V to glTF's top-left origin.
+// Octahedral normals are unpacked to three components, since glTF has
+// no core way to store them.
+class GlbWriter {
+ public:
+  explicit GlbWriter(const BoundsParams& bounds_params)
+      : bounds_params_(bounds_params) {
+    for (size_t i = 3; i < 8; ++i) {
+      const int out_max = bounds_params.outputMaxes[i];
+      std::vector<uint16>& table = remap_[i - 3];
+      table.resize(out_max + 1);
+      for (int q = 0; q <= out_max; ++q) {
+        const float decoded = bounds_params.decodeScales[i] *
+            (q + bounds_params.decodeOffsets[i]);
+        if (i == 4) {
+          // OBJ puts V = 0 at the bottom of the image, glTF at the top.
+          table[q] = ToUnorm16(1.f - decoded);
+        } else {
+          table[q] = (i < 5) ? ToUnorm16(decoded) : ToSnorm16(decoded);
+        }
+      }
+    }
+  }
+
+  void AddMaterials(const MaterialList& materials) {
+    materials_.insert(materials_.end(), materials.begin(), materials.end());
+  }
+
+  // Takes the contents of |meshes|, leaving it empty. |names| and
+  // |lengths| list the groups of each mesh, just like the manifest.
+  void AddBatch(const std::string& material, VertexLayout layout,
+                PrimitiveMode mode, WebGLMeshList* meshes,
+                const std::vector<std::vector<std::string> >& names,
+                const std::vector<std::vector<size_t> >& lengths) {
+    batches_.push_back(Batch());
+    Batch& batch = batches_.back();
+    batch.material = material;
+    batch.layout = layout;
+    batch.mode = mode;
+    batch.meshes.swap(*meshes);
+    batch.names = names;
+    batch.lengths = lengths;
+  }
+
+  // Appends the whole binary glTF file to |out|.
+  void Serialize(std::vector<char>* out) const {
+    std::string json;
+    const size_t bin_length = BuildJson(&json);
+    while (json.size() % 4) {
+      json.push_back(' ');
+    }
+    const size_t kHeaderLength = 12, kChunkHeaderLength = 8;
+    const size_t length = kHeaderLength + kChunkHeaderLength + json.size() +
+        kChunkHeaderLength + bin_length;
+    out->reserve(out->size() + length);
+    WriteUint32(0x46546C67, out);  // "glTF"
+    WriteUint32(2, out);
+    WriteUint32(length, out);
+    WriteUint32(json.size(), out);
+    WriteUint32(0x4E4F534A, out);  // "JSON"
+    out->insert(out->end(), json.begin(), json.end());
+    WriteUint32(bin_length, out);
+    WriteUint32(0x004E4942, out);  // "BIN\0"
+    for (size_t i = 0; i < batches_.size(); ++i) {
+      const WebGLMeshList& meshes = batches_[i].meshes;
+      for (size_t j = 0; j < meshes.size(); ++j) {
+        WriteVertices(meshes[j].attribs, batches_[i].layout, out);
+        WriteIndices(meshes[j].indices, out);
+      }
+    }
+  }
+
+ private:
+  static const size_t kMaxVertexStride = 24;
+
+  struct Batch {
+    std::string material;
+    VertexLayout layout;
+    PrimitiveMode mode;
+    WebGLMeshList meshes;
+    std::vector<std::vector<std::string> > names;
+    std::vector<std::vector<size_t> > lengths;
+  };
+
+  static size_t NormalByteOffset(VertexLayout layout) {
+    return LayoutHasTexcoords(layout) ? 12 : 8;
+  }
+
+  // glTF's primitive modes are WebGL's.
+  static int GltfMode(PrimitiveMode mode) {
+    static const int kModes[] = { 4, 1, 0 };  // TRIANGLES, LINES, POINTS
+    return kModes[mode];
+  }
+
+  static size_t ColorByteOffset(VertexLayout layout) {
+    return NormalByteOffset(layout) + (LayoutHasNormals(layout) ? 8 : 0);
+  }
+
+  static size_t VertexStride(VertexLayout layout) {
+    return ColorByteOffset(layout) + (LayoutHasColors(layout) ? 4 : 0);
+  }
+
+  static uint16 ToUnorm16(float f) {
+    if (f <= 0.f) return 0;
+    if (f >= 1.f) return 0xFFFF;
+    return static_cast<uint16>(f * 65535.f + 0.5f);
+  }
+
+  static uint16 ToSnorm16(float f) {
+    if (f <= -1.f) return static_cast<uint16>(-32767);
+    if (f >= 1.f) return 32767;
+    return static_cast<uint16>(
+        static_cast<int16>(floorf(f * 32767.f + 0.5f)));
+  }
+
+  static void Append(const void* data, size_t size, std::vector<char>* out) {
+    const char* bytes = static_cast<const char*>(data);
+    out->insert(out->end(), bytes, bytes + size);
+  }
+
+  static void WriteUint32(size_t word, std::vector<char>* out) {
+    const unsigned char bytes[4] = {
+      static_cast<unsigned char>(word),
+      static_cast<unsigned char>(word >> 8),
+      static_cast<unsigned char>(word >> 16),
+      static_cast<unsigned char>(word >> 24)
+    };
+    Append(bytes, 4, out);
+  }
+
+  static bool IsLittleEndian() {
+    const uint16 word = 1;
+    return *reinterpret_cast<const unsigned char*>(&word) == 1;
+  }
+
+  static size_t Align4(size_t size) {
+    return (size + 3) & ~static_cast<size_t>(3);
+  }
+
+  // Out-of-range texcoords (e.g. for wrapped textures) clamp.
+  uint16 Remap(size_t channel, uint16 word) const {
+    const std::vector<uint16>& table = remap_[channel];
+    return (word < table.size()) ? table[word] : table.back();
+  }
+
+  static void PutUint16(uint16 word, unsigned char* out) {
+    out[0] = static_cast<unsigned char>(word);
+    out[1] = static_cast<unsigned char>(word >> 8);
+  }
+
+  // Interleaves one mesh straight out of its quantized attributes,
+  // a block of vertices at a time.
+  void WriteVertices(const QuantizedAttribList& attribs, VertexLayout layout,
+                     std::vector<char>* glb) const {
+    const size_t kBlockVertices = 4096;
+    unsigned char block[kBlockVertices * kMaxVertexStride];
+    const size_t stride = bounds_params_.QuantizedStride(layout);
+    const size_t vertex_stride = VertexStride(layout);
+    const bool has_texcoords = LayoutHasTexcoords(layout);
+    const bool has_normals = LayoutHasNormals(layout);
+    const bool has_colors = LayoutHasColors(layout);
+    const size_t normal_offset = NormalByteOffset(layout);
+    const size_t color_offset = ColorByteOffset(layout);
+    const int oct_half = -bounds_params_.decodeOffsets[5];
+    const size_t num_verts = attribs.size() / stride;
+    for (size_t begin = 0; begin < num_verts; begin += kBlockVertices) {
+      const size_t end = (num_verts - begin < kBlockVertices) ?
+          num_verts : begin + kBlockVertices;
+      unsigned char* out = block;
+      for (size_t v = begin; v < end; ++v, out += vertex_stride) {
+        const uint16* in = &attribs[stride*v];
+        PutUint16(*in++, out + 0);
+        PutUint16(*in++, out + 2);
+        PutUint16(*in++, out + 4);
+        PutUint16(0, out + 6);
+        if (has_texcoords) {
+          PutUint16(Remap(0, *in++), out + 8);
+          PutUint16(Remap(1, *in++), out + 10);
+        }
+        if (has_normals) {
+          unsigned char* normal_out = out + normal_offset;
+          if (bounds_params_.octNormals) {
+            float normal[3];
+            OctDecodeNormal(in, oct_half, normal);
+            PutUint16(ToSnorm16(normal[0]), normal_out + 0);
+            PutUint16(ToSnorm16(normal[1]), normal_out + 2);
+            PutUint16(ToSnorm16(normal[2]), normal_out + 4);
+            in += 2;
+          } else {
+            PutUint16(Remap(2, in[0]), normal_out + 0);
+            PutUint16(Remap(3, in[1]), normal_out + 2);
+            PutUint16(Remap(4, in[2]), normal_out + 4);
+            in += 3;
+          }
+          PutUint16(0, normal_out + 6);
+        }
+        if (has_colors) {
+          // Colors are quantized to bytes already.
+          unsigned char* color_out = out + color_offset;
+          color_out[0] = static_cast<unsigned char>(in[0]);
+          color_out[1] = static_cast<unsigned char>(in[1]);
+          color_out[2] = static_cast<unsigned char>(in[2]);
+          color_out[3] = 0;
+        }
+      }
+      Append(block, out - block, glb);
+    }
+  }
+
+  void WriteIndices(const OptimizedIndexList& indices,
+                    std::vector<char>* out) const {
+    if (indices.empty()) {
+      return;
+    } else if (IsLittleEndian()) {
+      Append(&indices[0], sizeof(uint16) * indices.size(), out);
+    } else {
+      unsigned char bytes[2];
+      for (size_t i = 0; i < indices.size(); ++i) {
+        PutUint16(indices[i], bytes);
+        Append(bytes, 2, out);
+      }
+    }
+    const size_t padding = Align4(2*indices.size()) - 2*indices.size();
+    const unsigned char zeros[4] = { 0 };
+    Append(zeros, padding, out);
+  }
+
+  // Builds the glTF JSON chunk and returns the length of the binary
+  // chunk it describes.
+  size_t BuildJson(std::string* out) const {
+    std::string& json = *out;
+    std::string images, textures, materials, meshes, nodes;
+    std::string buffer_views, accessors;
+    std::map<std::string, int> material_indices;
+    std::map<std::string, int> image_indices;
+    for (size_t i = 0; i < materials_.size(); ++i) {
+      const Material& material = materials_[i];
+      if (material_indices.count(material.name)) continue;
+      int texture = -1;
+      if (!material.map_Kd.empty()) {
+        std::map<std::string, int>::iterator iter =
+            image_indices.find(material.map_Kd);
+        if (iter == image_indices.end()) {
+          const int index = static_cast<int>(image_indices.size());
+          iter = image_indices.insert(
+              std::make_pair(material.map_Kd, index)).first;
+          if (index) images.push_back(',');
+          images += "{\"uri\":";
+          AppendJsonString(material.map_Kd, &images);
+          images.push_back('}');
+          if (index) textures.push_back(',');
+          StringAppendF(&textures, "{\"source\":%d}", index);
+        }
+        texture = iter->second;
+      }
+      const int index = static_cast<int>(material_indices.size());
+      material_indices[material.name] = index;
+      if (index) materials.push_back(',');
+      AppendMaterial(material, texture, &materials);
+    }
+
+    size_t bin_offset = 0;
+    int node_index = 1;
+    int view = 0;
+    int accessor = 0;
+    for (size_t i = 0; i < batches_.size(); ++i) {
+      const Batch& batch = batches_[i];
+      if (batch.meshes.empty()) continue;
+      if (node_index != 1) {
+        meshes.push_back(',');
+        nodes.push_back(',');
+      }
+      StringAppendF(&nodes, "{\"mesh\":%d}", node_index - 1);
+      meshes += "{\"name\":";
+      AppendJsonString(batch.material, &meshes);
+      meshes += ",\"primitives\":[";
+      const size_t stride = bounds_params_.QuantizedStride(batch.layout);
+      const size_t vertex_stride = VertexStride(batch.layout);
+      for (size_t j = 0; j < batch.meshes.size(); ++j) {
+        const WebGLMesh& mesh = batch.meshes[j];
+        const size_t num_verts = mesh.attribs.size() / stride;
+        const size_t num_indices = mesh.indices.size();
+        if (view) {
+          buffer_views.push_back(',');
+          accessors.push_back(',');
+        }
+        StringAppendF(&buffer_views,
+                      "{\"buffer\":0,\"byteOffset\":" SIZET_FORMAT
+                      ",\"byteLength\":" SIZET_FORMAT
+                      ",\"byteStride\":" SIZET_FORMAT ",\"target\":34962},",
+                      bin_offset, vertex_stride * num_verts, vertex_stride);
+        bin_offset += vertex_stride * num_verts;
+        StringAppendF(&buffer_views,
+                      "{\"buffer\":0,\"byteOffset\":" SIZET_FORMAT
+                      ",\"byteLength\":" SIZET_FORMAT ",\"target\":34963}",
+                      bin_offset, 2*num_indices);
+        bin_offset += Align4(2*num_indices);
+
+        uint16 mins[3] = { 0xFFFF, 0xFFFF, 0xFFFF };
+        uint16 maxes[3] = { 0, 0, 0 };
+        for (size_t k = 0; k < mesh.attribs.size(); k += stride) {
+          for (size_t c = 0; c < 3; ++c) {
+            const uint16 word = mesh.attribs[k + c];
+            if (word < mins[c]) mins[c] = word;
+            if (word > maxes[c]) maxes[c] = word;
+          }
+        }
+        std::string attributes;
+        StringAppendF(&attributes, "\"POSITION\":%d", accessor++);
+        StringAppendF(&accessors,
+                      "{\"bufferView\":%d,\"byteOffset\":0,"
+                      "\"componentType\":5123,\"count\":" SIZET_FORMAT ","
+                      "\"type\":\"VEC3\",\"min\":[%u,%u,%u],"
+                      "\"max\":[%u,%u,%u]},",
+                      view, num_verts, mins[0], mins[1], mins[2],
+                      maxes[0], maxes[1], maxes[2]);
+        if (LayoutHasTexcoords(batch.layout)) {
+          StringAppendF(&attributes, ",\"TEXCOORD_0\":%d", accessor++);
+          StringAppendF(&accessors,
+                        "{\"bufferView\":%d,\"byteOffset\":8,"
+                        "\"componentType\":5123,\"normalized\":true,"
+                        "\"count\":" SIZET_FORMAT ",\"type\":\"VEC2\"},",
+                        view, num_verts);
+        }
+        if (LayoutHasNormals(batch.layout)) {
+          StringAppendF(&attributes, ",\"NORMAL\":%d", accessor++);
+          StringAppendF(&accessors,
+                        "{\"bufferView\":%d,\"byteOffset\":" SIZET_FORMAT ","
+                        "\"componentType\":5122,\"normalized\":true,"
+                        "\"count\":" SIZET_FORMAT ",\"type\":\"VEC3\"},",
+                        view, NormalByteOffset(batch.layout), num_verts);
+        }
+        if (LayoutHasColors(batch.layout)) {
+          StringAppendF(&attributes, ",\"COLOR_0\":%d", accessor++);
+          StringAppendF(&accessors,
+                        "{\"bufferView\":%d,\"byteOffset\":" SIZET_FORMAT ","
+                        "\"componentType\":5121,\"normalized\":true,"
+                        "\"count\":" SIZET_FORMAT ",\"type\":\"VEC3\"},",
+                        view, ColorByteOffset(batch.layout), num_verts);
+        }
+        const int index_accessor = accessor++;
+        StringAppendF(&accessors,
+                      "{\"bufferView\":%d,\"componentType\":5123,"
+                      "\"count\":" SIZET_FORMAT ",\"type\":\"SCALAR\"}",
+                      view + 1, num_indices);
+        view += 2;
+
+        if (j) meshes.push_back(',');
+        StringAppendF(&meshes,
+                      "{\"attributes\":{%s},\"indices\":%d,\"mode\":%d",
+                      attributes.c_str(), index_accessor,
+                      GltfMode(batch.mode));
+        std::map<std::string, int>::const_iterator material =
+            material_indices.find(batch.material);
+        if (material != material_indices.end()) {
+          StringAppendF(&meshes, ",\"material\":%d", material->second);
+        }
+        meshes += ",\"extras\":{\"names\":[";
+        for (size_t k = 0; k < batch.names[j].size(); ++k) {
+          if (k) meshes.push_back(',');
+          AppendJsonString(batch.names[j][k], &meshes);
+        }
+        meshes += "],\"lengths\":[";
+        for (size_t k = 0; k < batch.lengths[j].size(); ++k) {
+          StringAppendF(&meshes, k ? "," SIZET_FORMAT : SIZET_FORMAT,
+                        batch.lengths[j][k]);
+        }
+        meshes += "]}}";
+      }
+      meshes += "]}";
+      ++node_index;
+    }
+
+    // The root node carries the position decode transform:
+    //   position = decodeScale * (quantized + decodeOffset)
+    const BoundsParams& bp = bounds_params_;
+    json = "{\"asset\":{\"version\":\"2.0\",\"generator\":\"objcompress\"},"
+        "\"extensionsUsed\":[\"KHR_mesh_quantization\"],"
+        "\"extensionsRequired\":[\"KHR_mesh_quantization\"],"
+        "\"scene\":0,\"scenes\":[{\"nodes\":[0]}],\"nodes\":[";
+    StringAppendF(&json,
+                  "{\"translation\":[%.9g,%.9g,%.9g],"
+                  "\"scale\":[%.9g,%.9g,%.9g]",
+                  bp.decodeScales[0] * bp.decodeOffsets[0],
+                  bp.decodeScales[1] * bp.decodeOffsets[1],
+                  bp.decodeScales[2] * bp.decodeOffsets[2],
+                  bp.decodeScales[0], bp.decodeScales[1], bp.decodeScales[2]);
+    if (node_index > 1) {
+      json += ",\"children\":[";
+      for (int i = 1; i < node_index; ++i) {
+        StringAppendF(&json, (i > 1) ? ",%d" : "%d", i);
+      }
+      json.push_back(']');
+    }
+    json.push_back('}');
+    if (!nodes.empty()) {
+      json.push_back(',');
+      json += nodes;
+    }
+    json += "]";
+    if (!meshes.empty()) {
+      json += ",\"meshes\":[" + meshes + "]";
+      json += ",\"accessors\":[" + accessors + "]";
+      json += ",\"bufferViews\":[" + buffer_views + "]";
+      StringAppendF(&json, ",\"buffers\":[{\"byteLength\":" SIZET_FORMAT "}]",
+                    bin_offset);
+    }
+    if (!materials.empty()) {
+      json += ",\"materials\":[" + materials + "]";
+    }
+    if (!images.empty()) {
+      json += ",\"images\":[" + images + "]";
+      json += ",\"textures\":[" + textures + "]";
+    }
+    json.push_back('}');
+    return bin_offset;
+  }
+
+  static void AppendMaterial(const Material& material, int texture,
+                             std::string* out) {
+    float color[4] = { 1.f, 1.f, 1.f, 1.f };
+    if (material.Kd[0] != HUGE_VALF && material.Kd[1] != HUGE_VALF &&
+        material.Kd[2] != HUGE_VALF) {
+      color[0] = material.Kd[0];
+      color[1] = material.Kd[1];
+      color[2] = material.Kd[2];
+    }
+    if (material.d != HUGE_VALF) {
+      color[3] = material.d;
+    }
+    *out += "{\"name\":";
+    AppendJsonString(material.name, out);
+    StringAppendF(out, ",\"pbrMetallicRoughness\":{"
+                  "\"baseColorFactor\":[%.6g,%.6g,%.6g,%.6g],"
+                  "\"metallicFactor\":0",
+                  color[0], color[1], color[2], color[3]);
+    if (material.Ns != HUGE_VALF) {
+      // Usual Blinn-Phong exponent to roughness approximation.
+      StringAppendF(out, ",\"roughnessFactor\":%.6g",
+                    sqrtf(2.f / (material.Ns + 2.f)));
+    }
+    if (texture >= 0) {
+      StringAppendF(out, ",\"baseColorTexture\":{\"index\":%d}", texture);
+    }
+    out->push_back('}');
+    if (color[3] < 1.f) {
+      *out += ",\"alphaMode\":\"BLEND\"";
+    }
+    out->push_back('}');
+  }
+
+  static void AppendJsonString(const std::string& str, std::string* out) {
+    out->push_back('"');
+    for (size_t i = 0; i < str.size(); ++i) {
+      const unsigned char ch = str[i];
+      if (ch == '"' || ch == '\\') {
+        out->push_back('\\');
+        out->push_back(ch);
+      } else if (ch < 0x20) {
+        StringAppendF(out, "\\u%04x", ch);
+      } else {
+        out->push_back(ch);
+      }
+    }
+    out->push_back('"');
+  }
+
+  const BoundsParams bounds_params_;
+  std::vector<uint16> remap_[5];
+  MaterialList materials_;
+  std::vector<Batch> batches_;
+};
+
+#endif  // WEBGL_LOADER_GLB_H_
@@ -0,0 +1,262 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You
+// may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied. See the License for the specific language governing
+// permissions and limitations under the License.
+
+#ifndef WEBGL_LOADER_INCREMENTAL_H_
+#define WEBGL_LOADER_INCREMENTAL_H_
+
+// Incremental rebuilds (-incremental): every batch written is
+// fingerprinted by everything that goes into its payload, and the next
+// run reuses the payload of a batch with the same fingerprint, printing
+// its urls entry from what was recorded instead of encoding it again.
+
+#include <stdlib.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "base.h"
+#include "mesh.h"
+
+// What it takes to print a batch's urls entry without encoding it.
+struct BatchRecord {
+  struct Mesh {
+    Mesh()
+        : attrib_start(0), attrib_length(0), index_start(0),
+          index_length(0), bboxes(0) {
+    }
+
+    size_t attrib_start, attrib_length;
+    size_t index_start, index_length;
+    size_t bboxes;
+    std::vector<size_t> morph_starts;
+    // Indices into the batch's group_starts, and how many primitives of
+    // each are in this mesh.
+    std::vector<size_t> groups;
+    std::vector<size_t> lengths;
+  };
+
+  std::string payload;
+  std::vector<Mesh> meshes;
+};
+
+// The first line of the state. Bump the version when the encoding
+// changes, so that older payloads are not reused.
+static const char kIncrementalHeader[] = "objcompress incremental 1";
+
+// The records of an earlier run, read back from its state, and those of
+// this one, to be kept for the next.
+class BatchRecords {
+ public:
+  BatchRecords() : num_reused_(0) { }
+
+  // Reads the state Serialize() wrote. Returns false, keeping nothing,
+  // if it is malformed or from another version.
+  bool Parse(const std::string& state) {
+    old_.clear();
+    size_t pos = 0;
+    std::string line;
+    if (!NextLine(state, &pos, &line) || line != kIncrementalHeader) {
+      return false;
+    }
+    while (NextLine(state, &pos, &line)) {
+      // <fingerprint> <number of meshes> <payload>
+      uint64 fingerprint = 0;
+      char* end = NULL;
+      size_t num_meshes = 0;
+      if (line.size() < 17 || line[16] != ' ' ||
+          !ParseHex(line.substr(0, 16), &fingerprint) ||
+          (num_meshes = strtoul(&line[17], &end, 10), *end != ' ')) {
+        old_.clear();
+        return false;
+      }
+      BatchRecord& record = old_[fingerprint];
+      record.payload = end + 1;
+      record.meshes.resize(num_meshes);
+      for (size_t i = 0; i < num_meshes; ++i) {
+        if (!NextLine(state, &pos, &line) ||
+            !ParseMesh(line.c_str(), &record.meshes[i])) {
+          old_.clear();
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  // The earlier run's record of |fingerprint|, or NULL.
+  const BatchRecord* Find(uint64 fingerprint) const {
+    const std::map<uint64, BatchRecord>::const_iterator found =
+        old_.find(fingerprint);
+    return (found != old_.end()) ? &found->second : NULL;
+  }
+
+  // Keeps |record| for the next run.
+  void Keep(uint64 fingerprint, const BatchRecord& record) {
+    new_[fingerprint] = record;
+  }
+
+  size_t num_kept() const { return new_.size(); }
+  size_t num_reused() const { return num_reused_; }
+  void CountReused() { ++num_reused_; }
+
+  // Writes the records kept in this run.
+  void Serialize(std::string* state) const {
+    state->assign(kIncrementalHeader);
+    state->push_back('\n');
+    for (std::map<uint64, BatchRecord>::const_iterator iter = new_.begin();
+         iter != new_.end(); ++iter) {
+      const BatchRecord& record = iter->second;
+      char high[9], low[9];
+      ToHex(static_cast<uint32>(iter->first >> 32), high);
+      ToHex(static_cast<uint32>(iter->first), low);
+      StringAppendF(state, "%s%s " SIZET_FORMAT " %s\n", high, low,
+                    record.meshes.size(), record.payload.c_str());
+      for (size_t i = 0; i < record.meshes.size(); ++i) {
+        const BatchRecord::Mesh& mesh = record.meshes[i];
+        StringAppendF(state, SIZET_FORMAT " " SIZET_FORMAT " " SIZET_FORMAT
+                      " " SIZET_FORMAT " " SIZET_FORMAT " " SIZET_FORMAT,
+                      mesh.attrib_start, mesh.attrib_length,
+                      mesh.index_start, mesh.index_length, mesh.bboxes,
+                      mesh.morph_starts.size());
+        for (size_t k = 0; k < mesh.morph_starts.size(); ++k) {
+          StringAppendF(state, " " SIZET_FORMAT, mesh.morph_starts[k]);
+        }
+        StringAppendF(state, " " SIZET_FORMAT, mesh.groups.size());
+        for (size_t k = 0; k < mesh.groups.size(); ++k) {
+          StringAppendF(state, " " SIZET_FORMAT " " SIZET_FORMAT,
+                        mesh.groups[k], mesh.lengths[k]);
+        }
+        state->push_back('\n');
+      }
+    }
+  }
+
+ private:
+  static bool NextLine(const std::string& text, size_t* pos,
+                       std::string* line) {
+    if (*pos >= text.size()) {
+      return false;
+    }
+    size_t end = text.find('\n', *pos);
+    if (end == std::string::npos) {
+      end = text.size();
+    }
+    line->assign(text, *pos, end - *pos);
+    *pos = end + 1;
+    return true;
+  }
+
+  static bool ParseHex(const std::string& hex, uint64* value) {
+    *value = 0;
+    for (size_t i = 0; i < hex.size(); ++i) {
+      const char ch = hex[i];
+      int digit;
+      if (ch >= '0' && ch <= '9') {
+        digit = ch - '0';
+      } else if (ch >= 'a' && ch <= 'f') {
+        digit = ch - 'a' + 10;
+      } else {
+        return false;
+      }
+      *value = (*value << 4) | digit;
+    }
+    return true;
+  }
+
+  // Reads the next number at |*str|, moving past it.
+  static bool ParseNumber(char** str, size_t* number) {
+    char* end = NULL;
+    *number = strtoul(*str, &end, 10);
+    if (end == *str) {
+      return false;
+    }
+    *str = end;
+    return true;
+  }
+
+  static bool ParseMesh(const char* line, BatchRecord::Mesh* mesh) {
+    char* str = const_cast<char*>(line);
+    size_t num_morphs = 0, num_groups = 0;
+    if (!ParseNumber(&str, &mesh->attrib_start) ||
+        !ParseNumber(&str, &mesh->attrib_length) ||
+        !ParseNumber(&str, &mesh->index_start) ||
+        !ParseNumber(&str, &mesh->index_length) ||
+        !ParseNumber(&str, &mesh->bboxes) ||
+        !ParseNumber(&str, &num_morphs)) {
+      return false;
+    }
+    mesh->morph_starts.resize(num_morphs);
+    for (size_t k = 0; k < num_morphs; ++k) {
+      if (!ParseNumber(&str, &mesh->morph_starts[k])) return false;
+    }
+    if (!ParseNumber(&str, &num_groups)) {
+      return false;
+    }
+    mesh->groups.resize(num_groups);
+    mesh->lengths.resize(num_groups);
+    for (size_t k = 0; k < num_groups; ++k) {
+      if (!ParseNumber(&str, &mesh->groups[k]) ||
+          !ParseNumber(&str, &mesh->lengths[k])) {
+        return false;
+      }
+    }
+    return *str == '\0';
+  }
+
+  std::map<uint64, BatchRecord> old_;
+  std::map<uint64, BatchRecord> new_;
+  size_t num_reused_;
+};
+
+// The name of the state an incremental build keeps for |out_file|.
+static inline std::string IncrementalStateName(const std::string& out_file) {
+  return out_file + ".incremental";
+}
+
+// Everything that goes into the payload of a batch: its quantized
+// vertices (with any later frames) and their stride, its indices, the
+// groups' extents and boxes, the quantization and the payload's name.
+static inline uint64 BatchFingerprint(
+    const DrawBatch& batch, const QuantizedAttribList& quantized_attribs,
+    size_t vertex_stride, const BoundsParams& bounds_params,
+    const std::string& out_file) {
+  Fingerprint fingerprint;
+  const uint32 layout = batch.layout();
+  const uint32 mode = batch.mode();
+  const uint64 stride = vertex_stride;
+  fingerprint.Add(&layout, sizeof(layout));
+  fingerprint.Add(&mode, sizeof(mode));
+  fingerprint.Add(&stride, sizeof(stride));
+  fingerprint.Add(quantized_attribs);
+  fingerprint.Add(batch.draw_mesh().indices);
+  const std::vector<GroupStart>& group_starts = batch.group_starts();
+  for (size_t i = 0; i < group_starts.size(); ++i) {
+    const uint64 offset = group_starts[i].offset;
+    fingerprint.Add(&offset, sizeof(offset));
+    fingerprint.Add(group_starts[i].bounds.mins, 3 * sizeof(float));
+    fingerprint.Add(group_starts[i].bounds.maxes, 3 * sizeof(float));
+  }
+  fingerprint.Add(bounds_params.mins, sizeof(bounds_params.mins));
+  fingerprint.Add(bounds_params.scales, sizeof(bounds_params.scales));
+  fingerprint.Add(bounds_params.outputMaxes,
+                  sizeof(bounds_params.outputMaxes));
+  const uint32 flags = (bounds_params.octNormals ? 1 : 0) |
+                       (bounds_params.colors ? 2 : 0);
+  fingerprint.Add(&flags, sizeof(flags));
+  fingerprint.Add(out_file);
+  return fingerprint.hash();
+}
+
+#endif  // WEBGL_LOADER_INCREMENTAL_H_
@@ -0,0 +1,207 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You
+// may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied. See the License for the specific language governing
+// permissions and limitations under the License.
+
+#ifndef WEBGL_LOADER_INSTANCES_H_
+#define WEBGL_LOADER_INSTANCES_H_
+
+#include <math.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "base.h"
+#include "mesh.h"
+
+// A copy of a shape: positions are scale * prototype + translation.
+struct Instance {
+  unsigned int group_line;
+  float scale;
+  float translation[3];
+};
+
+// Groups of one material that are translated and uniformly scaled
+// copies of each other, the first of which is the prototype.
+struct Shape {
+  std::string material;
+  std::vector<Instance> instances;
+};
+
+typedef std::vector<Shape> ShapeList;
+
+// Finds groups whose geometry repeats within a batch. Each group is
+// brought into a canonical form, its vertices in order of first use
+// and positions translated to the origin and scaled to a unit box,
+// and hashed by its topology. Groups in the same bucket are congruent
+// if their canonical vertices agree to within half a quantization step
+// of |params|, so swapping a copy for its transformed prototype moves
+// no vertex further than quantization already does.
+class InstanceFinder {
+ public:
+  InstanceFinder(const MaterialBatches& batches, const BoundsParams& params)
+      : batches_(batches), params_(params) {
+  }
+
+  // Splits the groups of the batches between |unique|, for groups that
+  // appear once, and |prototypes|, for the first copy of each shape
+  // in |shapes|.
+  void Find(MaterialBatches* unique, MaterialBatches* prototypes,
+            ShapeList* shapes) const {
+    for (MaterialBatches::const_iterator iter = batches_.begin();
+         iter != batches_.end(); ++iter) {
+      const DrawBatch& batch = iter->second;
+      const std::vector<GroupStart>& group_starts = batch.group_starts();
+      const size_t num_indices = batch.draw_mesh().indices.size();
+      std::vector<Canonical> canonicals(group_starts.size());
+      // Canonical groups found so far, by hash, and the shape each
+      // leads, or -1 while it has no copies yet.
+      std::multimap<uint32, size_t> buckets;
+      std::vector<int> shape_of(group_starts.size(), -1);
+      std::vector<bool> is_copy(group_starts.size(), false);
+      for (size_t i = 0; i < group_starts.size(); ++i) {
+        const size_t end = (i + 1 < group_starts.size()) ?
+            group_starts[i + 1].offset : num_indices;
+        Canonical& canonical = canonicals[i];
+        MakeCanonical(batch, group_starts[i], end, &canonical);
+        if (canonical.extent <= 0) continue;
+        typedef std::multimap<uint32, size_t>::const_iterator Bucket;
+        std::pair<Bucket, Bucket> range = buckets.equal_range(canonical.hash);
+        Bucket match = range.second;
+        for (Bucket candidate = range.first; candidate != range.second;
+             ++candidate) {
+          if (Congruent(canonicals[candidate->second], canonical,
+                        batch.layout())) {
+            match = candidate;
+            break;
+          }
+        }
+        if (match == range.second) {
+          buckets.insert(std::make_pair(canonical.hash, i));
+          continue;
+        }
+        const size_t prototype = match->second;
+        if (shape_of[prototype] < 0) {
+          shape_of[prototype] = static_cast<int>(shapes->size());
+          shapes->push_back(Shape());
+          shapes->back().material = iter->first;
+          shapes->back().instances.push_back(
+              MakeInstance(canonicals[prototype], canonicals[prototype],
+                           group_starts[prototype].group_line));
+        }
+        (*shapes)[shape_of[prototype]].instances.push_back(
+            MakeInstance(canonicals[prototype], canonical,
+                         group_starts[i].group_line));
+        is_copy[i] = true;
+        IndexList().swap(canonical.indices);
+        AttribList().swap(canonical.attribs);
+      }
+      for (size_t i = 0; i < group_starts.size(); ++i) {
+        if (is_copy[i]) continue;
+        const size_t end = (i + 1 < group_starts.size()) ?
+            group_starts[i + 1].offset : num_indices;
+        DrawBatch& out = (shape_of[i] < 0) ?
+            (*unique)[iter->first] : (*prototypes)[iter->first];
+        for (size_t offset = group_starts[i].offset; offset < end;
+             offset += 3) {
+          out.AddTriangleFrom(batch, offset, group_starts[i].group_line);
+        }
+      }
+    }
+  }
+
+ private:
+  struct Canonical {
+    uint32 hash;
+    float mins[3];
+    float extent;
+    IndexList indices;  // local to the group, in order of first use.
+    AttribList attribs;  // with positions scaled into the unit box.
+  };
+
+  void MakeCanonical(const DrawBatch& batch, const GroupStart& group,
+                     size_t end, Canonical* canonical) const {
+    const DrawMesh& draw_mesh = batch.draw_mesh();
+    const size_t stride = LayoutStride(batch.layout());
+    const Bounds& bounds = group.bounds;
+    canonical->extent = bounds.UniformScale();
+    for (size_t j = 0; j < 3; ++j) {
+      canonical->mins[j] = bounds.mins[j];
+    }
+    std::map<int, int> local;
+    for (size_t i = group.offset; i < end; ++i) {
+      const int index = draw_mesh.indices[i];
+      std::map<int, int>::const_iterator found = local.find(index);
+      if (found != local.end()) {
+        canonical->indices.push_back(found->second);
+        continue;
+      }
+      const int local_index = static_cast<int>(local.size());
+      local[index] = local_index;
+      canonical->indices.push_back(local_index);
+      const float* in = &draw_mesh.attribs[stride * index];
+      for (size_t j = 0; j < stride; ++j) {
+        canonical->attribs.push_back(j < 3 ?
+            (in[j] - canonical->mins[j]) / canonical->extent : in[j]);
+      }
+    }
+    canonical->hash = canonical->indices.empty() ? 0 :
+        SimpleHash(reinterpret_cast<char*>(&canonical->indices[0]),
+                   canonical->indices.size() * sizeof(int));
+  }
+
+  bool Congruent(const Canonical& a, const Canonical& b,
+                 VertexLayout layout) const {
+    if (a.indices != b.indices || a.attribs.size() != b.attribs.size()) {
+      return false;
+    }
+    size_t channels[kNumChannels];
+    const size_t stride = LayoutChannels(layout, channels);
+    float tolerances[kNumChannels];
+    for (size_t j = 0; j < stride; ++j) {
+      const size_t channel = channels[j];
+      tolerances[j] = 0.5f * params_.scales[channel] /
+          params_.outputMaxes[channel];
+      if (j < 3) {
+        tolerances[j] /= std::max(a.extent, b.extent);
+      }
+    }
+    for (size_t i = 0; i < a.attribs.size(); i += stride) {
+      for (size_t j = 0; j < stride; ++j) {
+        if (fabsf(a.attribs[i + j] - b.attribs[i + j]) > tolerances[j]) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  static Instance MakeInstance(const Canonical& prototype,
+                               const Canonical& copy,
+                               unsigned int group_line) {
+    Instance instance;
+    instance.group_line = group_line;
+    instance.scale = copy.extent / prototype.extent;
+    for (size_t j = 0; j < 3; ++j) {
+      instance.translation[j] =
+          copy.mins[j] - instance.scale * prototype.mins[j];
+    }
+    return instance;
+  }
+
+  const MaterialBatches& batches_;
+  const BoundsParams& params_;
+};
+
+#endif  // WEBGL_LOADER_INSTANCES_H_
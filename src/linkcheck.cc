@@ -0,0 +1,48 @@
+#if 0  // A cute trick to making this .cc self-building from shell.
+g++ $0 -c -O2 -Wall -Werror -pthread -D WITH_ZLIB -D SECOND_UNIT -o `basename $0 .cc`2.o &&
+g++ $0 `basename $0 .cc`2.o -O2 -Wall -Werror -pthread -D WITH_ZLIB -o `basename $0 .cc` -lz;
+rm -f `basename $0 .cc`2.o;
+exit;
+#endif
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You
+// may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied. See the License for the specific language governing
+// permissions and limitations under the License.
+
+// Builds the headers the tools use into two translation units and
+// links them together, so that a definition that is not inline (or
+// static) in a header fails the build here instead of in a program
+// that includes convert.h from more than one file. There is nothing
+// to run; if it links, it passes.
+
+#include "args.h"
+#include "batch.h"
+#include "convert.h"
+#include "precompress.h"
+#include "thread.h"
+#include "writer.h"
+
+#ifdef SECOND_UNIT
+
+int SecondUnit() {
+  return 0;
+}
+
+#else
+
+int SecondUnit();
+
+int main() {
+  return SecondUnit();
+}
+
+#endif
@@ -0,0 +1,68 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You
+// may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied. See the License for the specific language governing
+// permissions and limitations under the License.
+
+#ifndef WEBGL_LOADER_MERGE_H_
+#define WEBGL_LOADER_MERGE_H_
+
+#include <map>
+#include <string>
+
+#include "base.h"
+#include "mesh.h"
+
+// Number of batches with triangles, which is how many draw calls a
+// viewer makes (more if a batch needs over 0xD800 vertices).
+static inline size_t CountDrawCalls(const MaterialBatches& batches) {
+  size_t count = 0;
+  for (MaterialBatches::const_iterator iter = batches.begin();
+       iter != batches.end(); ++iter) {
+    if (!iter->second.draw_mesh().indices.empty()) {
+      ++count;
+    }
+  }
+  return count;
+}
+
+// Merges the batches of materials whose properties, as written to the
+// manifest, are the same, under the name of the first of them. Only
+// those first materials are kept. Groups keep their names, so they can
+// still be told apart.
+static inline void MergeMaterials(const MaterialList& materials,
+                                  const MaterialBatches& batches,
+                                  MaterialList* merged_materials,
+                                  MaterialBatches* merged_batches) {
+  std::map<std::string, std::string> first_by_key;
+  std::map<std::string, std::string> merged_names;
+  for (size_t i = 0; i < materials.size(); ++i) {
+    const Material& material = materials[i];
+    const std::pair<std::map<std::string, std::string>::iterator, bool>
+        inserted = first_by_key.insert(
+            std::make_pair(material.PropertiesKey(), material.name));
+    if (inserted.second) {
+      merged_materials->push_back(material);
+    }
+    merged_names[material.name] = inserted.first->second;
+  }
+  for (MaterialBatches::const_iterator iter = batches.begin();
+       iter != batches.end(); ++iter) {
+    if (iter->second.draw_mesh().indices.empty()) continue;
+    std::map<std::string, std::string>::const_iterator merged_name =
+        merged_names.find(iter->first);
+    const std::string& name = (merged_name != merged_names.end()) ?
+        merged_name->second : iter->first;
+    (*merged_batches)[name].Append(iter->second);
+  }
+}
+
+#endif  // WEBGL_LOADER_MERGE_H_
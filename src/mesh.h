@@ -22,7 +22,9 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include <algorithm>
 #include <map>
 #include <string>
 #include <utility>
@@ -31,27 +33,7 @@
 #include "base.h"
 #include "utf8.h"
 
-void DumpJsonFromQuantizedAttribs(const QuantizedAttribList& attribs) {
-  puts("var attribs = new Uint16Array([");
-  for (size_t i = 0; i < attribs.size(); i += 8) {
-    printf("%u,%hu,%hu,%hu,%hu,%hu,%hu,%hu,\n",
-           attribs[i + 0], attribs[i + 1], attribs[i + 2], attribs[i + 3],
-           attribs[i + 4], attribs[i + 5], attribs[i + 6], attribs[i + 7]);
-  }
-  puts("]);");
-}
-
-void DumpJsonFromInterleavedAttribs(const AttribList& attribs) {
-  puts("var attribs = new Float32Array([");
-  for (size_t i = 0; i < attribs.size(); i += 8) {
-    printf("%f,%f,%f,%f,%f,%f,%f,%f,\n",
-           attribs[i + 0], attribs[i + 1], attribs[i + 2], attribs[i + 3],
-           attribs[i + 4], attribs[i + 5], attribs[i + 6], attribs[i + 7]);
-  }
-  puts("]);");
-}
-
-void DumpJsonFromIndices(const IndexList& indices) {
+static inline void DumpJsonFromIndices(const IndexList& indices) {
   puts("var indices = new Uint16Array([");
   for (size_t i = 0; i < indices.size(); i += 3) {
     printf("%d,%d,%d,\n", indices[i + 0], indices[i + 1], indices[i + 2]);
@@ -115,6 +97,7 @@ class IndexFlattener {
  public:
   explicit IndexFlattener(size_t num_positions)
       : count_(0),
+        base_(0),
         table_(num_positions) {
   }
 
@@ -124,15 +107,34 @@ class IndexFlattener {
     table_.reserve(size);
   }
 
+  // Frees the lookups, once no more vertices are to be shared. Vertices
+  // flattened after this are all new ones.
+  void Release() {
+    std::vector<IndexType>().swap(table_);
+    MapType().swap(map_);
+  }
+
   // Returns a pair of: < flattened index, newly inserted >.
   std::pair<int, bool> GetFlattenedIndex(int position_index,
                                          int texcoord_index,
                                          int normal_index) {
-    if (position_index >= static_cast<int>(table_.size())) {
-      table_.resize(position_index + 1);
+    // The table only spans the positions seen so far, so a batch whose
+    // faces use a run of the file's positions only pays for that run.
+    if (table_.empty()) {
+      base_ = position_index;
+    } else if (position_index < base_) {
+      // Grows at least twofold, so that walking down stays linear.
+      const int grow = std::max(base_ - position_index,
+                                static_cast<int>(table_.size()));
+      const int new_base = std::max(0, base_ - grow);
+      table_.insert(table_.begin(), base_ - new_base, IndexType());
+      base_ = new_base;
+    }
+    if (position_index - base_ >= static_cast<int>(table_.size())) {
+      table_.resize(position_index - base_ + 1);
     }
     // First, optimistically look up position_index in the table.
-    IndexType& index = table_[position_index];
+    IndexType& index = table_[position_index - base_];
     if (index.position_or_flat == kIndexUnknown) {
       // This is the first time we've seen this position in the table,
       // so fill it. Since the table is indexed by position, we can
@@ -228,6 +230,8 @@ class IndexFlattener {
   typedef std::map<IndexType, int> MapType;
 
   int count_;
+  // The position of table_[0].
+  int base_;
   std::vector<IndexType> table_;
   MapType map_;
 };
@@ -235,34 +239,202 @@ class IndexFlattener {
 static inline size_t positionDim() { return 3; }
 static inline size_t texcoordDim() { return 2; }
 static inline size_t normalDim() { return 3; }
+static inline size_t colorDim() { return 3; }
+
+// Channels of the full vertex that Bounds and BoundsParams describe:
+// position, texcoord, normal and, for models with vertex colors, color.
+static const size_t kNumChannels = 11;
+
+// Which attributes the vertices of a batch carry, in the order they
+// are interleaved. Positions are always there; texcoords and normals
+// only when some face of the batch refers to them, so meshes without
+// vt or vn don't spend bytes on zero filler. Colors come from "v x y z
+// r g b" positions.
+enum VertexLayout {
+  kLayoutP = 0,
+  kLayoutPT = 1,
+  kLayoutPN = 2,
+  kLayoutPNT = kLayoutPT | kLayoutPN,
+  kLayoutPC = 4,
+  kLayoutPTC = kLayoutPT | kLayoutPC,
+  kLayoutPNC = kLayoutPN | kLayoutPC,
+  kLayoutPNTC = kLayoutPNT | kLayoutPC
+};
+
+static inline bool LayoutHasTexcoords(VertexLayout layout) {
+  return (layout & kLayoutPT) != 0;
+}
+
+static inline bool LayoutHasNormals(VertexLayout layout) {
+  return (layout & kLayoutPN) != 0;
+}
+
+static inline bool LayoutHasColors(VertexLayout layout) {
+  return (layout & kLayoutPC) != 0;
+}
+
+static inline VertexLayout LayoutUnion(VertexLayout a, VertexLayout b) {
+  return static_cast<VertexLayout>(a | b);
+}
+
+static inline size_t LayoutStride(VertexLayout layout) {
+  return positionDim() +
+      (LayoutHasTexcoords(layout) ? texcoordDim() : 0) +
+      (LayoutHasNormals(layout) ? normalDim() : 0) +
+      (LayoutHasColors(layout) ? colorDim() : 0);
+}
+
+static inline const char* LayoutName(VertexLayout layout) {
+  static const char* const kNames[] = {
+    "P", "PT", "PN", "PNT", "PC", "PTC", "PNC", "PNTC"
+  };
+  return kNames[layout];
+}
+
+// Fills |channels| with the full (Bounds, BoundsParams) channel of
+// each of |layout|'s channels, and returns the stride.
+static inline size_t LayoutChannels(VertexLayout layout, size_t* channels) {
+  size_t stride = 0;
+  for (size_t i = 0; i < kNumChannels; ++i) {
+    if ((i < 3) ||
+        (i < 5 && LayoutHasTexcoords(layout)) ||
+        (i >= 5 && i < 8 && LayoutHasNormals(layout)) ||
+        (i >= 8 && LayoutHasColors(layout))) {
+      channels[stride++] = i;
+    }
+  }
+  return stride;
+}
+
+// Appends |attribs|, interleaved in layout |from|, to |out| in layout
+// |to|, which must include |from|, with zeros for the texcoords and
+// normals |to| adds and white for its colors.
+static inline void WidenAttribs(const AttribList& attribs, VertexLayout from,
+                                VertexLayout to, AttribList* out) {
+  size_t from_channels[kNumChannels], to_channels[kNumChannels];
+  const size_t from_stride = LayoutChannels(from, from_channels);
+  const size_t to_stride = LayoutChannels(to, to_channels);
+  for (size_t i = 0; i < attribs.size(); i += from_stride) {
+    float vertex[kNumChannels] = { 0 };
+    for (size_t j = 8; j < kNumChannels; ++j) {
+      vertex[j] = 1.f;
+    }
+    for (size_t j = 0; j < from_stride; ++j) {
+      vertex[from_channels[j]] = attribs[i + j];
+    }
+    for (size_t j = 0; j < to_stride; ++j) {
+      out->push_back(vertex[to_channels[j]]);
+    }
+  }
+}
+
+// What a batch's indices draw. Triangles come from f records, lines
+// from l records and points from p records, each kind in its own
+// batches.
+enum PrimitiveMode {
+  kTriangles,
+  kLines,
+  kPoints
+};
+
+// Indices per primitive.
+static inline size_t PrimitiveSize(PrimitiveMode mode) {
+  static const size_t kSizes[] = { 3, 2, 1 };
+  return kSizes[mode];
+}
+
+// The WebGL draw mode, as listed in the manifest.
+static inline const char* PrimitiveName(PrimitiveMode mode) {
+  static const char* const kNames[] = { "TRIANGLES", "LINES", "POINTS" };
+  return kNames[mode];
+}
+
+// The same, at compile time, for inner loops specialized per layout.
+template <VertexLayout kLayout>
+struct LayoutTraits {
+  static const bool kHasTexcoords = (kLayout & kLayoutPT) != 0;
+  static const bool kHasNormals = (kLayout & kLayoutPN) != 0;
+  static const bool kHasColors = (kLayout & kLayoutPC) != 0;
+  static const size_t kNormalOffset = 3 + (kHasTexcoords ? 2 : 0);
+  static const size_t kColorOffset = kNormalOffset + (kHasNormals ? 3 : 0);
+  static const size_t kStride = kColorOffset + (kHasColors ? 3 : 0);
+};
 
 struct Bounds {
-  float mins[8];
-  float maxes[8];
+  float mins[kNumChannels];
+  float maxes[kNumChannels];
 
   void Clear() {
-    for (size_t i = 0; i < 8; ++i) {
+    for (size_t i = 0; i < kNumChannels; ++i) {
       mins[i] = FLT_MAX;
       maxes[i] = -FLT_MAX;
     }
   }
 
-  void EncloseAttrib(const float* attribs) {
-    for (size_t i = 0; i < 8; ++i) {
-      const float attrib = attribs[i];
-      if (mins[i] > attrib) {
-        mins[i] = attrib;
+  // Encloses one vertex of |kLayout|. Absent channels are left alone.
+  template <VertexLayout kLayout>
+  void EncloseVertex(const float* attribs) {
+    typedef LayoutTraits<kLayout> Traits;
+    EncloseChannels(attribs, 0, 3);
+    if (Traits::kHasTexcoords) {
+      EncloseChannels(attribs + 3, 3, 5);
+    }
+    if (Traits::kHasNormals) {
+      EncloseChannels(attribs + Traits::kNormalOffset, 5, 8);
+    }
+    if (Traits::kHasColors) {
+      EncloseChannels(attribs + Traits::kColorOffset, 8, kNumChannels);
+    }
+  }
+
+  void EncloseVertex(const float* attribs, VertexLayout layout) {
+    switch (layout) {
+      case kLayoutP: EncloseVertex<kLayoutP>(attribs); break;
+      case kLayoutPT: EncloseVertex<kLayoutPT>(attribs); break;
+      case kLayoutPN: EncloseVertex<kLayoutPN>(attribs); break;
+      case kLayoutPNT: EncloseVertex<kLayoutPNT>(attribs); break;
+      case kLayoutPC: EncloseVertex<kLayoutPC>(attribs); break;
+      case kLayoutPTC: EncloseVertex<kLayoutPTC>(attribs); break;
+      case kLayoutPNC: EncloseVertex<kLayoutPNC>(attribs); break;
+      case kLayoutPNTC: EncloseVertex<kLayoutPNTC>(attribs); break;
+    }
+  }
+
+  void Enclose(const AttribList& attribs, VertexLayout layout = kLayoutPNT) {
+    switch (layout) {
+      case kLayoutP: EncloseVertices<kLayoutP>(attribs); break;
+      case kLayoutPT: EncloseVertices<kLayoutPT>(attribs); break;
+      case kLayoutPN: EncloseVertices<kLayoutPN>(attribs); break;
+      case kLayoutPNT: EncloseVertices<kLayoutPNT>(attribs); break;
+      case kLayoutPC: EncloseVertices<kLayoutPC>(attribs); break;
+      case kLayoutPTC: EncloseVertices<kLayoutPTC>(attribs); break;
+      case kLayoutPNC: EncloseVertices<kLayoutPNC>(attribs); break;
+      case kLayoutPNTC: EncloseVertices<kLayoutPNTC>(attribs); break;
+    }
+  }
+
+  template <VertexLayout kLayout>
+  void EncloseVertices(const AttribList& attribs) {
+    const size_t stride = LayoutTraits<kLayout>::kStride;
+    for (size_t i = 0; i < attribs.size(); i += stride) {
+      EncloseVertex<kLayout>(&attribs[i]);
+    }
+  }
+
+  void EncloseChannels(const float* attribs, size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i, ++attribs) {
+      if (mins[i] > *attribs) {
+        mins[i] = *attribs;
       }
-      if (maxes[i] < attrib) {
-        maxes[i] = attrib;
+      if (maxes[i] < *attribs) {
+        maxes[i] = *attribs;
       }
     }
   }
 
-  void Enclose(const AttribList& attribs) {
-    for (size_t i = 0; i < attribs.size(); i += 8) {
-      EncloseAttrib(&attribs[i]);
-    }
+  void EncloseBounds(const Bounds& other) {
+    EncloseChannels(other.mins, 0, kNumChannels);
+    EncloseChannels(other.maxes, 0, kNumChannels);
   }
 
   float UniformScale() const {
@@ -287,21 +459,173 @@ class DrawBatch {
  public:
   DrawBatch()
       : flattener_(0),
-        current_group_line_(0xFFFFFFFF) {
+        current_group_line_(0xFFFFFFFF),
+        layout_(kLayoutP),
+        mode_(kTriangles) {
   }
 
   const std::vector<GroupStart>& group_starts() const {
     return group_starts_;
   }
 
-  void Init(AttribList* positions, AttribList* texcoords, AttribList* normals) {
+  void Init(AttribList* positions, AttribList* texcoords, AttribList* normals,
+            AttribList* colors) {
     positions_ = positions;
     texcoords_ = texcoords;
     normals_ = normals;
+    colors_ = colors;
     flattener_.reserve(1024);
   }
 
   void AddTriangle(unsigned int group_line, int* indices) {
+    AddPrimitive(group_line, indices, kTriangles);
+  }
+
+  // Lines and points go in batches of their own. |indices| has 6 and 3
+  // entries, like AddTriangle's 9.
+  void AddLine(unsigned int group_line, int* indices) {
+    AddPrimitive(group_line, indices, kLines);
+  }
+
+  void AddPoint(unsigned int group_line, int* indices) {
+    AddPrimitive(group_line, indices, kPoints);
+  }
+
+  // Frees what only adding more primitives needs, once the batch is
+  // complete. Vertices added after this are not shared with earlier ones.
+  void ReleaseFlattener() {
+    flattener_.Release();
+  }
+
+  VertexLayout layout() const {
+    return layout_;
+  }
+
+  PrimitiveMode mode() const {
+    return mode_;
+  }
+
+  // Appends the triangle at |offset| into |source|'s indices, for
+  // splitting a batch into smaller ones. Vertices are looked up by
+  // their index in |source|, so the ones triangles share stay shared.
+  void AddTriangleFrom(const DrawBatch& source, size_t offset,
+                       unsigned int group_line) {
+    AddTriangleFrom(source, &source.draw_mesh_.indices[offset], group_line);
+  }
+
+  // The same, for a triangle made of any three of |source|'s vertices.
+  void AddTriangleFrom(const DrawBatch& source, const int* source_indices,
+                       unsigned int group_line) {
+    CHECK(source.mode_ == kTriangles);
+    AddVerticesFrom(source, source_indices, group_line);
+  }
+
+  // The same, for the triangle, line or point at |offset|.
+  void AddPrimitiveFrom(const DrawBatch& source, size_t offset,
+                        unsigned int group_line) {
+    AddVerticesFrom(source, &source.draw_mesh_.indices[offset], group_line);
+  }
+
+  // Appends all of |other|'s triangles and vertices, widening either
+  // layout as needed, for merging batches of materials that look the
+  // same. A group continuing from the end of this batch stays one group.
+  void Append(const DrawBatch& other) {
+    if (draw_mesh_.indices.empty()) {
+      mode_ = other.mode_;
+    }
+    CHECK(mode_ == other.mode_);
+    const VertexLayout layout = LayoutUnion(layout_, other.layout_);
+    if (layout != layout_) {
+      Widen(layout);
+    }
+    const int base = static_cast<int>(draw_mesh_.attribs.size() /
+                                      LayoutStride(layout_));
+    const size_t base_offset = draw_mesh_.indices.size();
+    WidenAttribs(other.draw_mesh_.attribs, other.layout_, layout_,
+                 &draw_mesh_.attribs);
+    const IndexList& other_indices = other.draw_mesh_.indices;
+    for (size_t i = 0; i < other_indices.size(); ++i) {
+      draw_mesh_.indices.push_back(base + other_indices[i]);
+    }
+    for (size_t i = 0; i < other.group_starts_.size(); ++i) {
+      GroupStart group_start = other.group_starts_[i];
+      group_start.offset += base_offset;
+      // Groups that only reuse earlier vertices have empty ranges.
+      if (group_start.min_index != INT_MAX) group_start.min_index += base;
+      if (group_start.max_index != INT_MIN) group_start.max_index += base;
+      if (i == 0 && !group_starts_.empty() &&
+          group_starts_.back().group_line == group_start.group_line) {
+        GroupStart& group = group_starts_.back();
+        group.min_index = std::min(group.min_index, group_start.min_index);
+        group.max_index = std::max(group.max_index, group_start.max_index);
+        group.bounds.EncloseBounds(group_start.bounds);
+      } else {
+        group_starts_.push_back(group_start);
+      }
+    }
+    if (!group_starts_.empty()) {
+      current_group_line_ = group_starts_.back().group_line;
+    }
+  }
+
+  const DrawMesh& draw_mesh() const {
+    return draw_mesh_;
+  }
+ private:
+  // Adds a primitive of |source|'s mode made of |source|'s vertices.
+  void AddVerticesFrom(const DrawBatch& source, const int* source_indices,
+                       unsigned int group_line) {
+    if (draw_mesh_.indices.empty()) {
+      mode_ = source.mode_;
+    }
+    CHECK(mode_ == source.mode_);
+    if (group_line != current_group_line_) {
+      current_group_line_ = group_line;
+      GroupStart group_start;
+      group_start.offset = draw_mesh_.indices.size();
+      group_start.group_line = group_line;
+      group_start.min_index = INT_MAX;
+      group_start.max_index = INT_MIN;
+      group_start.bounds.Clear();
+      group_starts_.push_back(group_start);
+    }
+    if (source.layout_ != layout_) {
+      Widen(LayoutUnion(layout_, source.layout_));
+    }
+    CHECK(source.layout_ == layout_);
+    GroupStart& group = group_starts_.back();
+    const size_t source_stride = LayoutStride(source.layout_);
+    const AttribList& source_attribs = source.draw_mesh_.attribs;
+    for (size_t i = 0; i < PrimitiveSize(mode_); ++i) {
+      const int source_index = source_indices[i];
+      const std::pair<int, bool> flattened =
+          flattener_.GetFlattenedIndex(source_index, -1, -1);
+      const int flat_index = flattened.first;
+      draw_mesh_.indices.push_back(flat_index);
+      if (flattened.second) {
+        if (flat_index > group.max_index) {
+          group.max_index = flat_index;
+        }
+        if (flat_index < group.min_index) {
+          group.min_index = flat_index;
+        }
+        const float* in = &source_attribs[source_stride * source_index];
+        draw_mesh_.attribs.insert(draw_mesh_.attribs.end(),
+                                  in, in + source_stride);
+        group.bounds.EncloseVertex(in, layout_);
+      }
+    }
+  }
+
+  // Adds a primitive of |mode|'s size. A batch only ever holds one
+  // kind of primitive.
+  void AddPrimitive(unsigned int group_line, int* indices,
+                    PrimitiveMode mode) {
+    if (draw_mesh_.indices.empty()) {
+      mode_ = mode;
+    }
+    CHECK(mode == mode_);
+    const size_t num_vertices = PrimitiveSize(mode);
     if (group_line != current_group_line_) {
       current_group_line_ = group_line;
       GroupStart group_start;
@@ -312,8 +636,39 @@ class DrawBatch {
       group_start.bounds.Clear();
       group_starts_.push_back(group_start);
     }
+    // The layout only ever widens; vertices of faces without some
+    // attribute get zeros for it, or white for colors.
+    int used = kLayoutP;
+    for (size_t i = 0; i < 3 * num_vertices; i += 3) {
+      if (indices[i + 1]) used |= kLayoutPT;
+      if (indices[i + 2]) used |= kLayoutPN;
+    }
+    // Once any position had a color, all of them have one.
+    if (!colors_->empty()) used |= kLayoutPC;
+    const VertexLayout layout =
+        LayoutUnion(layout_, static_cast<VertexLayout>(used));
+    if (layout != layout_) {
+      Widen(layout);
+    }
+    switch (layout_) {
+      case kLayoutP: AddVertices<kLayoutP>(indices, num_vertices); break;
+      case kLayoutPT: AddVertices<kLayoutPT>(indices, num_vertices); break;
+      case kLayoutPN: AddVertices<kLayoutPN>(indices, num_vertices); break;
+      case kLayoutPNT: AddVertices<kLayoutPNT>(indices, num_vertices); break;
+      case kLayoutPC: AddVertices<kLayoutPC>(indices, num_vertices); break;
+      case kLayoutPTC: AddVertices<kLayoutPTC>(indices, num_vertices); break;
+      case kLayoutPNC: AddVertices<kLayoutPNC>(indices, num_vertices); break;
+      case kLayoutPNTC:
+        AddVertices<kLayoutPNTC>(indices, num_vertices);
+        break;
+    }
+  }
+
+  template <VertexLayout kLayout>
+  void AddVertices(const int* indices, size_t num_vertices) {
+    typedef LayoutTraits<kLayout> Traits;
     GroupStart& group = group_starts_.back();
-    for (size_t i = 0; i < 9; i += 3) {
+    for (size_t i = 0; i < 3 * num_vertices; i += 3) {
       // .OBJ files use 1-based indexing.
       const int position_index = indices[i + 0] - 1;
       const int texcoord_index = indices[i + 1] - 1;
@@ -333,46 +688,53 @@ class DrawBatch {
           group.min_index = flat_index;
         }
         const size_t new_loc = draw_mesh_.attribs.size();
-        CHECK(8*size_t(flat_index) == new_loc);
+        CHECK(Traits::kStride*size_t(flat_index) == new_loc);
+        draw_mesh_.attribs.resize(new_loc + Traits::kStride);
+        float* out = &draw_mesh_.attribs[new_loc];
         for (size_t i = 0; i < positionDim(); ++i) {
-          draw_mesh_.attribs.push_back(
-              positions_->at(positionDim() * position_index + i));
+          *out++ = positions_->at(positionDim() * position_index + i);
         }
-        if (texcoord_index == -1) {
-          for (size_t i = 0; i < texcoordDim(); ++i) {
-            draw_mesh_.attribs.push_back(0);
-          }
-        } else {
+        if (Traits::kHasTexcoords) {
           for (size_t i = 0; i < texcoordDim(); ++i) {
-            draw_mesh_.attribs.push_back(
-                texcoords_->at(texcoordDim() * texcoord_index + i));
+            *out++ = (texcoord_index == -1) ? 0 :
+                texcoords_->at(texcoordDim() * texcoord_index + i);
           }
         }
-        if (normal_index == -1) {
+        if (Traits::kHasNormals) {
           for (size_t i = 0; i < normalDim(); ++i) {
-            draw_mesh_.attribs.push_back(0);
+            *out++ = (normal_index == -1) ? 0 :
+                normals_->at(normalDim() * normal_index + i);
           }
-        } else {
-          for (size_t i = 0; i < normalDim(); ++i) {
-            draw_mesh_.attribs.push_back(
-                normals_->at(normalDim() * normal_index + i));
+        }
+        if (Traits::kHasColors) {
+          for (size_t i = 0; i < colorDim(); ++i) {
+            *out++ = colors_->at(colorDim() * position_index + i);
           }
         }
         // TODO: is the covariance body useful for anything?
-        group.bounds.EncloseAttrib(&draw_mesh_.attribs[new_loc]);
+        group.bounds.EncloseVertex<kLayout>(&draw_mesh_.attribs[new_loc]);
       }
     }
   }
 
-  const DrawMesh& draw_mesh() const {
-    return draw_mesh_;
+  // Re-interleaves the vertices so far with the attributes |layout|
+  // adds, as WidenAttribs fills them.
+  void Widen(VertexLayout layout) {
+    AttribList attribs;
+    attribs.reserve(draw_mesh_.attribs.size() / LayoutStride(layout_) *
+                    LayoutStride(layout));
+    WidenAttribs(draw_mesh_.attribs, layout_, layout, &attribs);
+    draw_mesh_.attribs.swap(attribs);
+    layout_ = layout;
   }
- private:
-  AttribList* positions_, *texcoords_, *normals_;
+
+  AttribList* positions_, *texcoords_, *normals_, *colors_;
   DrawMesh draw_mesh_;
   IndexFlattener flattener_;
   unsigned int current_group_line_;
   std::vector<GroupStart> group_starts_;
+  VertexLayout layout_;
+  PrimitiveMode mode_;
 };
 
 struct Material {
@@ -386,46 +748,56 @@ struct Material {
     Ks[0] = HUGE_VALF; Ks[1] = HUGE_VALF; Ks[2] = HUGE_VALF;
   }
 
-  void DumpJson() const {
+  void DumpJson(std::string* json) const {
     // TODO: JSON serialization needs to be better!
 #ifdef MINI_JS
     const char* sep = "";
-    printf("'%s':{", name.c_str());
-    if (Ka[0] != HUGE_VALF && Ka[1] != HUGE_VALF && Ka[2] != HUGE_VALF) { printf("%sKa:[%hu,%hu,%hu]", sep, Quantize(Ka[0], 0, 1, 255), Quantize(Ka[1], 0, 1, 255), Quantize(Ka[2], 0, 1, 255)); sep = ","; }
-    if (Kd[0] != HUGE_VALF && Kd[1] != HUGE_VALF && Kd[2] != HUGE_VALF) { printf("%sKd:[%hu,%hu,%hu]", sep, Quantize(Kd[0], 0, 1, 255), Quantize(Kd[1], 0, 1, 255), Quantize(Kd[2], 0, 1, 255)); sep = ","; }
-    if (Ks[0] != HUGE_VALF && Ks[1] != HUGE_VALF && Ks[2] != HUGE_VALF) { printf("%sKs:[%hu,%hu,%hu]", sep, Quantize(Ks[0], 0, 1, 255), Quantize(Ks[1], 0, 1, 255), Quantize(Ks[2], 0, 1, 255)); sep = ","; }
-    if (Ns != HUGE_VALF) { printf("%sNs:%f", sep, Ns); sep = ","; }
-    if (d  != HUGE_VALF) { printf("%sd:%hu", sep, Quantize(d, 0, 1, 255)); sep = ","; }
-    if (!map_Ka.empty()) { printf("%smap_Ka:'%s'", sep, map_Ka.c_str()); sep = ","; }
-    if (!map_Kd.empty()) { printf("%smap_Kd:'%s'", sep, map_Kd.c_str()); sep = ","; }
-    if (!map_Ks.empty()) { printf("%smap_Ks:'%s'", sep, map_Ks.c_str()); sep = ","; }
-    if (!map_Ns.empty()) { printf("%smap_Ns:'%s'", sep, map_Ns.c_str()); sep = ","; }
-    if (!map_d.empty())  { printf("%smap_d:'%s'",  sep, map_d.c_str()); sep = ","; }
-    printf("}");
+    StringAppendF(json, "'%s':{", name.c_str());
+    if (Ka[0] != HUGE_VALF && Ka[1] != HUGE_VALF && Ka[2] != HUGE_VALF) { StringAppendF(json, "%sKa:[%hu,%hu,%hu]", sep, Quantize(Ka[0], 0, 1, 255), Quantize(Ka[1], 0, 1, 255), Quantize(Ka[2], 0, 1, 255)); sep = ","; }
+    if (Kd[0] != HUGE_VALF && Kd[1] != HUGE_VALF && Kd[2] != HUGE_VALF) { StringAppendF(json, "%sKd:[%hu,%hu,%hu]", sep, Quantize(Kd[0], 0, 1, 255), Quantize(Kd[1], 0, 1, 255), Quantize(Kd[2], 0, 1, 255)); sep = ","; }
+    if (Ks[0] != HUGE_VALF && Ks[1] != HUGE_VALF && Ks[2] != HUGE_VALF) { StringAppendF(json, "%sKs:[%hu,%hu,%hu]", sep, Quantize(Ks[0], 0, 1, 255), Quantize(Ks[1], 0, 1, 255), Quantize(Ks[2], 0, 1, 255)); sep = ","; }
+    if (Ns != HUGE_VALF) { StringAppendF(json, "%sNs:%f", sep, Ns); sep = ","; }
+    if (d  != HUGE_VALF) { StringAppendF(json, "%sd:%hu", sep, Quantize(d, 0, 1, 255)); sep = ","; }
+    if (!map_Ka.empty()) { StringAppendF(json, "%smap_Ka:'%s'", sep, map_Ka.c_str()); sep = ","; }
+    if (!map_Kd.empty()) { StringAppendF(json, "%smap_Kd:'%s'", sep, map_Kd.c_str()); sep = ","; }
+    if (!map_Ks.empty()) { StringAppendF(json, "%smap_Ks:'%s'", sep, map_Ks.c_str()); sep = ","; }
+    if (!map_Ns.empty()) { StringAppendF(json, "%smap_Ns:'%s'", sep, map_Ns.c_str()); sep = ","; }
+    if (!map_d.empty())  { StringAppendF(json, "%smap_d:'%s'",  sep, map_d.c_str()); sep = ","; }
+    StringAppendF(json, "}");
 #else
     const char* sep = "\n";
-    printf("    '%s': {", name.c_str());
-    if (Ka[0] != HUGE_VALF && Ka[1] != HUGE_VALF && Ka[2] != HUGE_VALF) { printf("%s      Ka: [%hu, %hu, %hu]", sep, Quantize(Ka[0], 0, 1, 255), Quantize(Ka[1], 0, 1, 255), Quantize(Ka[2], 0, 1, 255)); sep = ",\n"; }
-    if (Kd[0] != HUGE_VALF && Kd[1] != HUGE_VALF && Kd[2] != HUGE_VALF) { printf("%s      Kd: [%hu, %hu, %hu]", sep, Quantize(Kd[0], 0, 1, 255), Quantize(Kd[1], 0, 1, 255), Quantize(Kd[2], 0, 1, 255)); sep = ",\n"; }
-    if (Ks[0] != HUGE_VALF && Ks[1] != HUGE_VALF && Ks[2] != HUGE_VALF) { printf("%s      Ks: [%hu, %hu, %hu]", sep, Quantize(Ks[0], 0, 1, 255), Quantize(Ks[1], 0, 1, 255), Quantize(Ks[2], 0, 1, 255)); sep = ",\n"; }
-    if (Ns != HUGE_VALF) { printf("%s      Ns: %f", sep, Ns); sep = ",\n"; }
-    if (d  != HUGE_VALF) { printf("%s      d: %hu", sep, Quantize(d, 0, 1, 255)); sep = ",\n"; }
-    if (!map_Ka.empty()) { printf("%s      map_Ka: '%s'", sep, map_Ka.c_str()); sep = ",\n"; }
-    if (!map_Kd.empty()) { printf("%s      map_Kd: '%s'", sep, map_Kd.c_str()); sep = ",\n"; }
-    if (!map_Ks.empty()) { printf("%s      map_Ks: '%s'", sep, map_Ks.c_str()); sep = ",\n"; }
-    if (!map_Ns.empty()) { printf("%s      map_Ns: '%s'", sep, map_Ns.c_str()); sep = ",\n"; }
-    if (!map_d.empty())  { printf("%s      map_d: '%s'",  sep, map_d.c_str()); sep = ",\n"; }
-    printf("\n    }");
+    StringAppendF(json, "    '%s': {", name.c_str());
+    if (Ka[0] != HUGE_VALF && Ka[1] != HUGE_VALF && Ka[2] != HUGE_VALF) { StringAppendF(json, "%s      Ka: [%hu, %hu, %hu]", sep, Quantize(Ka[0], 0, 1, 255), Quantize(Ka[1], 0, 1, 255), Quantize(Ka[2], 0, 1, 255)); sep = ",\n"; }
+    if (Kd[0] != HUGE_VALF && Kd[1] != HUGE_VALF && Kd[2] != HUGE_VALF) { StringAppendF(json, "%s      Kd: [%hu, %hu, %hu]", sep, Quantize(Kd[0], 0, 1, 255), Quantize(Kd[1], 0, 1, 255), Quantize(Kd[2], 0, 1, 255)); sep = ",\n"; }
+    if (Ks[0] != HUGE_VALF && Ks[1] != HUGE_VALF && Ks[2] != HUGE_VALF) { StringAppendF(json, "%s      Ks: [%hu, %hu, %hu]", sep, Quantize(Ks[0], 0, 1, 255), Quantize(Ks[1], 0, 1, 255), Quantize(Ks[2], 0, 1, 255)); sep = ",\n"; }
+    if (Ns != HUGE_VALF) { StringAppendF(json, "%s      Ns: %f", sep, Ns); sep = ",\n"; }
+    if (d  != HUGE_VALF) { StringAppendF(json, "%s      d: %hu", sep, Quantize(d, 0, 1, 255)); sep = ",\n"; }
+    if (!map_Ka.empty()) { StringAppendF(json, "%s      map_Ka: '%s'", sep, map_Ka.c_str()); sep = ",\n"; }
+    if (!map_Kd.empty()) { StringAppendF(json, "%s      map_Kd: '%s'", sep, map_Kd.c_str()); sep = ",\n"; }
+    if (!map_Ks.empty()) { StringAppendF(json, "%s      map_Ks: '%s'", sep, map_Ks.c_str()); sep = ",\n"; }
+    if (!map_Ns.empty()) { StringAppendF(json, "%s      map_Ns: '%s'", sep, map_Ns.c_str()); sep = ",\n"; }
+    if (!map_d.empty())  { StringAppendF(json, "%s      map_d: '%s'",  sep, map_d.c_str()); sep = ",\n"; }
+    StringAppendF(json, "\n    }");
 #endif
   }
+
+  // The properties as DumpJson writes them, without the name, so
+  // materials that look the same have the same key.
+  std::string PropertiesKey() const {
+    Material unnamed(*this);
+    unnamed.name.clear();
+    std::string key;
+    unnamed.DumpJson(&key);
+    return key;
+  }
 };
 
 typedef std::vector<Material> MaterialList;
 
 class WavefrontMtlFile {
  public:
-  explicit WavefrontMtlFile(FILE* fp) {
-    ParseFile(fp);
+  explicit WavefrontMtlFile(TextSource* source) {
+    ParseFile(source);
   }
 
   const MaterialList& materials() const {
@@ -434,12 +806,12 @@ class WavefrontMtlFile {
 
  private:
   // TODO: factor this parsing stuff out.
-  void ParseFile(FILE* fp) {
+  void ParseFile(TextSource* source) {
     // TODO: don't use a fixed-size buffer.
     const size_t kLineBufferSize = 256;
     char buffer[kLineBufferSize];
     unsigned int line_num = 1;
-    while (fgets(buffer, kLineBufferSize, fp) != NULL) {
+    while (source->GetLine(buffer, kLineBufferSize) != NULL) {
       char* stripped = StripLeadingWhitespace(buffer);
       TerminateAtNewlineOrComment(stripped);
       ParseLine(stripped, line_num++);
@@ -506,18 +878,146 @@ class WavefrontMtlFile {
   MaterialList materials_;
 };
 
+// Reads and parses mtllib files for WavefrontObjFile. A subclass can
+// keep them, so that OBJ files sharing one only parse it once.
+class MtlLibraries {
+ public:
+  virtual ~MtlLibraries() { }
+
+  // Puts the materials of |name| into |materials|, reading it from
+  // |files| if it is there (|files| may be NULL), else from disk.
+  // Returns false if it could not be read.
+  virtual bool Load(const std::string& name, const TextFiles* files,
+                    MaterialList* materials) {
+    TextSource source(name, files);
+    if (!source.ok()) {
+      return false;
+    }
+    WavefrontMtlFile mtlfile(&source);
+    *materials = mtlfile.materials();
+    return true;
+  }
+};
+
 typedef std::map<std::string, DrawBatch> MaterialBatches;
 
+// True if any of the batches has per-vertex colors, in which case the
+// decodeParams list the color channels too.
+static inline bool HasColors(const MaterialBatches& batches) {
+  for (MaterialBatches::const_iterator iter = batches.begin();
+       iter != batches.end(); ++iter) {
+    if (LayoutHasColors(iter->second.layout())) return true;
+  }
+  return false;
+}
+
+// Where a parse of an OBJ file stands before one of its lines, from
+// which another parse can take up the lines after it (see shard.h). By
+// default, before the first line.
+struct ObjParseState {
+  ObjParseState()
+      : offset(0), line_num(1), num_positions(0), num_texcoords(0),
+        num_normals(0), has_colors(false), group_line(0),
+        object("default") {
+  }
+
+  uint64 offset;  // of the line, in bytes.
+  unsigned int line_num;
+  // The attributes before the line.
+  size_t num_positions, num_texcoords, num_normals;
+  bool has_colors;
+  std::string mtllib;  // The last mtllib, empty for none.
+  std::string material;  // The last usemtl.
+  unsigned int group_line;
+  std::vector<std::string> group_names;  // Of group_line, if not 0.
+  std::string object;
+};
+
+// What a parse of part of an OBJ file starts from: the state of a parse
+// of the file up to there, the attributes read by then (colors only if
+// the state has them), and how many g and o records name each group in
+// the whole file, so that groups get the names they would get in one
+// parse.
+struct ObjParseStart {
+  ObjParseState state;
+  AttribList positions, texcoords, normals, colors;
+  std::map<std::string, int> group_counts;
+};
+
+// Takes the attributes and primitives a WavefrontObjFile parses, in
+// place of it keeping them, for files too big to hold (see spill.h).
+// Primitives come as 1-based triples of position, texcoord and normal
+// index, like DrawBatch::AddTriangle's.
+class ObjSink {
+ public:
+  virtual ~ObjSink() { }
+
+  // Before the first line at or past NextCut() bytes into the file, the
+  // parse hands its state to Cut(), to be parsed in parts from there.
+  // By default there are no cuts.
+  virtual uint64 NextCut() const { return TextSource::kNoEnd; }
+  virtual void Cut(const ObjParseState& state) { }
+
+  // |color| is NULL for a position without one.
+  virtual void AddPosition(const float* position, const float* color) = 0;
+  virtual void AddTexCoord(const float* texcoord) = 0;
+  virtual void AddNormal(const float* normal) = 0;
+  virtual void AddPrimitive(const std::string& material,
+                            unsigned int group_line, PrimitiveMode mode,
+                            const int* indices) = 0;
+};
+
 // TODO: consider splitting this into a low-level parser and a high-level
 // object.
 class WavefrontObjFile {
  public:
-  explicit WavefrontObjFile(FILE* fp, bool missingMaterialsAsWhite = false) : missingMaterialsAsWhite_(missingMaterialsAsWhite) {
-    current_batch_ = &material_batches_[""];
-    current_batch_->Init(&positions_, &texcoords_, &normals_);
-    current_group_line_ = 0;
-    line_to_groups_.insert(std::make_pair(0, "default"));
-    ParseFile(fp);
+  explicit WavefrontObjFile(FILE* fp, bool missingMaterialsAsWhite = false) : missingMaterialsAsWhite_(missingMaterialsAsWhite), files_(NULL), libraries_(NULL), sink_(NULL) {
+    TextSource source(fp);
+    Init();
+    ParseFile(&source);
+    ReleaseAttribs();
+  }
+
+  // Reads mtllib files from |files| when they are there (|files| may
+  // be NULL, and must outlive the parse), else from disk, through
+  // |libraries| unless it is NULL. With a |sink|, the attributes and
+  // primitives go there and the batches are left empty; the materials,
+  // groups and objects are kept as usual.
+  WavefrontObjFile(TextSource* source, bool missingMaterialsAsWhite,
+                   const TextFiles* files, MtlLibraries* libraries = NULL,
+                   ObjSink* sink = NULL)
+      : missingMaterialsAsWhite_(missingMaterialsAsWhite), files_(files),
+        libraries_(libraries), sink_(sink) {
+    Init();
+    ParseFile(source);
+    ReleaseAttribs();
+  }
+
+  // Parses the part of a file that |source| is set to (see
+  // TextSource::SetRange), taking up from |start|, whose contents it
+  // takes.
+  WavefrontObjFile(TextSource* source, bool missingMaterialsAsWhite,
+                   const TextFiles* files, MtlLibraries* libraries,
+                   ObjParseStart* start)
+      : missingMaterialsAsWhite_(missingMaterialsAsWhite), files_(files),
+        libraries_(libraries), sink_(NULL) {
+    Init();
+    Resume(start);
+    if (ok()) {
+      ParseFile(source, start->state.line_num);
+    }
+    // The groups are named after their counts in the whole file.
+    group_counts_.swap(start->group_counts);
+    ReleaseAttribs();
+  }
+
+  // Parsing stops at the first malformed line, which error() describes.
+  bool ok() const {
+    return error_.empty();
+  }
+
+  const std::string& error() const {
+    return error_;
   }
 
   const MaterialList& materials() const {
@@ -528,6 +1028,15 @@ class WavefrontObjFile {
     return material_batches_;
   }
 
+  // The l and p records, per material.
+  const MaterialBatches& line_batches() const {
+    return line_batches_;
+  }
+
+  const MaterialBatches& point_batches() const {
+    return point_batches_;
+  }
+
   const std::string& LineToGroup(unsigned int line) const {
     typedef LineToGroups::const_iterator Iterator;
     typedef std::pair<Iterator, Iterator> EqualRange;
@@ -543,29 +1052,146 @@ class WavefrontObjFile {
         best_count = count;
       }
     }
-    if (!best_group) {
-      ErrorLine("no suitable group found", line);
-    }
+    CHECK(best_group);
     return *best_group;
   }
 
+  // How many g and o records name each group.
+  const std::map<std::string, int>& group_counts() const {
+    return group_counts_;
+  }
+
+  // The object (o) a group's faces are in, "default" before the first.
+  const std::string& LineToObject(unsigned int line) const {
+    return line_to_object_.find(line)->second;
+  }
+
   void DumpDebug() const {
-    printf("positions size: "SIZET_FORMAT"\ntexcoords size: "SIZET_FORMAT"\nnormals size: "SIZET_FORMAT"\n",
+    printf("positions size: " SIZET_FORMAT "\n"
+           "texcoords size: " SIZET_FORMAT "\n"
+           "normals size: " SIZET_FORMAT "\n",
            positions_.size(), texcoords_.size(), normals_.size());
   }
  private:
-  WavefrontObjFile() : missingMaterialsAsWhite_(false) { }  // For testing.
+  WavefrontObjFile() : missingMaterialsAsWhite_(false), files_(NULL), libraries_(NULL), sink_(NULL) { }  // For testing.
 
-  void ParseFile(FILE* fp) {
-    // TODO: don't use a fixed-size buffer.
+  void Init() {
+    current_batch_ = &material_batches_[""];
+    current_batch_->Init(&positions_, &texcoords_, &normals_, &colors_);
+    current_group_line_ = 0;
+    line_to_groups_.insert(std::make_pair(0, "default"));
+    current_object_ = "default";
+    line_to_object_[0] = current_object_;
+    warned_smoothing_ = false;
+    num_positions_ = num_texcoords_ = num_normals_ = 0;
+    has_colors_ = false;
+  }
+
+  // Takes up a parse from |start|, before parsing the rest.
+  void Resume(ObjParseStart* start) {
+    const ObjParseState& state = start->state;
+    positions_.swap(start->positions);
+    texcoords_.swap(start->texcoords);
+    normals_.swap(start->normals);
+    colors_.swap(start->colors);
+    num_positions_ = state.num_positions;
+    num_texcoords_ = state.num_texcoords;
+    num_normals_ = state.num_normals;
+    has_colors_ = state.has_colors;
+    if (!state.mtllib.empty()) {
+      ParseMtllib(state.mtllib.c_str(), state.line_num);
+    }
+    if (!state.material.empty()) {
+      ParseUsemtl(state.material.c_str(), state.line_num);
+    }
+    if (state.group_line) {
+      for (size_t i = 0; i < state.group_names.size(); ++i) {
+        line_to_groups_.insert(std::make_pair(state.group_line,
+                                              state.group_names[i]));
+      }
+    }
+    current_group_line_ = state.group_line;
+    current_object_ = state.object;
+    line_to_object_[state.group_line] = current_object_;
+  }
+
+  // The state before the line |line_num|, at |offset|.
+  ObjParseState State(uint64 offset, unsigned int line_num) const {
+    ObjParseState state;
+    state.offset = offset;
+    state.line_num = line_num;
+    state.num_positions = num_positions_;
+    state.num_texcoords = num_texcoords_;
+    state.num_normals = num_normals_;
+    state.has_colors = has_colors_;
+    state.mtllib = mtllib_;
+    state.material = current_material_;
+    state.group_line = current_group_line_;
+    typedef LineToGroups::const_iterator Iterator;
+    const std::pair<Iterator, Iterator> names =
+        line_to_groups_.equal_range(current_group_line_);
+    for (Iterator iter = names.first; iter != names.second; ++iter) {
+      state.group_names.push_back(iter->second);
+    }
+    state.object = current_object_;
+    return state;
+  }
+
+  // The faces are flattened into their batches as they are read, so
+  // once the file is parsed the attributes they index, and the batches'
+  // lookups into them, are no longer needed.
+  void ReleaseAttribs() {
+    AttribList().swap(positions_);
+    AttribList().swap(texcoords_);
+    AttribList().swap(normals_);
+    AttribList().swap(colors_);
+    MaterialBatches* all_batches[] = {
+      &material_batches_, &line_batches_, &point_batches_
+    };
+    for (size_t i = 0; i < 3; ++i) {
+      for (MaterialBatches::iterator iter = all_batches[i]->begin();
+           iter != all_batches[i]->end(); ++iter) {
+        iter->second.ReleaseFlattener();
+      }
+    }
+  }
+
+  void ParseFile(TextSource* source, unsigned int line_num = 1) {
     const size_t kLineBufferSize = 256;
     char buffer[kLineBufferSize] = { 0 };
-    unsigned int line_num = 1;
-    while (fgets(buffer, kLineBufferSize, fp) != NULL) {
-      char* stripped = StripLeadingWhitespace(buffer);
-      TerminateAtNewlineOrComment(stripped);
-      ParseLine(stripped, line_num++);
+    // Lines that don't fit the buffer, like long polylines, are put
+    // back together here.
+    std::string long_line;
+    uint64 line_start = source->offset();
+    uint64 next_cut = sink_ ? sink_->NextCut() : TextSource::kNoEnd;
+    while (ok() && source->GetLine(buffer, kLineBufferSize) != NULL) {
+      const size_t length = strlen(buffer);
+      if (length == kLineBufferSize - 1 && buffer[length - 1] != '\n') {
+        long_line += buffer;
+        continue;
+      }
+      char* line = buffer;
+      if (!long_line.empty()) {
+        long_line += buffer;
+        line = &long_line[0];
+      }
+      if (line_start >= next_cut) {
+        sink_->Cut(State(line_start, line_num));
+        next_cut = sink_->NextCut();
+      }
+      ParseBufferedLine(line, line_num++);
+      long_line.clear();
+      line_start = source->offset();
     }
+    if (ok() && !long_line.empty()) {
+      ParseBufferedLine(&long_line[0], line_num);
+    }
+  }
+
+  void ParseBufferedLine(char* line, unsigned int line_num) {
+    char* stripped = StripLeadingWhitespace(line);
+    TerminateAtNewlineOrComment(stripped);
+    ParseLine(stripped, line_num);
   }
 
   void ParseLine(const char* line, unsigned int line_num) {
@@ -583,14 +1209,29 @@ class WavefrontObjFile {
           goto unknown;
         }
         break;
+      case 'o':
+        if (isspace(line[1])) {
+          ParseObject(line + 2, line_num);
+        } else {
+          goto unknown;
+        }
+        break;
       case '\0':
       case '#':
         break;  // Do nothing for comments or blank lines.
       case 'p':
-        WarnLine("point unsupported", line_num);
+        if (isspace(line[1])) {
+          ParsePoints(line + 1, line_num);
+        } else {
+          goto unknown;
+        }
         break;
       case 'l':
-        WarnLine("line unsupported", line_num);
+        if (isspace(line[1])) {
+          ParsePolyline(line + 1, line_num);
+        } else {
+          goto unknown;
+        }
         break;
       case 'u':
         if (0 == strncmp(line + 1, "semtl", 5)) {
@@ -632,8 +1273,33 @@ class WavefrontObjFile {
 
   void ParsePosition(const ShortFloatList& floats, unsigned int line_num) {
     if (floats.size() != positionDim() &&
-        floats.size() != 6) {  // ignore r g b for now.
+        floats.size() != positionDim() + colorDim()) {
       ErrorLine("bad position", line_num);
+      return;
+    }
+    ++num_positions_;
+    has_colors_ = has_colors_ || floats.size() > positionDim();
+    if (sink_) {
+      float position[3], color[3];
+      for (size_t i = 0; i < positionDim(); ++i) {
+        position[i] = floats[i];
+      }
+      for (size_t i = 0; i < colorDim(); ++i) {
+        color[i] = floats[positionDim() + i];
+      }
+      sink_->AddPosition(position, (floats.size() > positionDim()) ?
+                         color : NULL);
+      return;
+    }
+    // Colors are kept for all positions once one has them, white for
+    // those without.
+    if (floats.size() == positionDim() + colorDim()) {
+      colors_.resize(positions_.size(), 1.f);
+      for (size_t i = 0; i < colorDim(); ++i) {
+        colors_.push_back(floats[positionDim() + i]);
+      }
+    } else if (!colors_.empty()) {
+      colors_.resize(colors_.size() + colorDim(), 1.f);
     }
     floats.AppendNTo(&positions_, positionDim());
   }
@@ -643,6 +1309,13 @@ class WavefrontObjFile {
       // TODO: correctly handle 3-D texcoords instead of just
       // truncating.
       ErrorLine("bad texcoord", line_num);
+      return;
+    }
+    ++num_texcoords_;
+    if (sink_) {
+      const float texcoord[2] = { floats[0], floats[1] };
+      sink_->AddTexCoord(texcoord);
+      return;
     }
     floats.AppendNTo(&texcoords_, texcoordDim());
   }
@@ -650,6 +1323,7 @@ class WavefrontObjFile {
   void ParseNormal(const ShortFloatList& floats, unsigned int line_num) {
     if (floats.size() != normalDim()) {
       ErrorLine("bad normal", line_num);
+      return;
     }
     // Normalize to avoid out-of-bounds quantization. This should be
     // optional, in case someone wants to be using the normal magnitude as
@@ -658,6 +1332,17 @@ class WavefrontObjFile {
     const float y = floats[1];
     const float z = floats[2];
     const float scale = 1.0/sqrt(x*x + y*y + z*z);
+    ++num_normals_;
+    if (sink_) {
+      float normal[3] = { 0, 0, 0 };
+      if (isfinite(scale)) {
+        normal[0] = scale * x;
+        normal[1] = scale * y;
+        normal[2] = scale * z;
+      }
+      sink_->AddNormal(normal);
+      return;
+    }
     if (isfinite(scale)) {
       normals_.push_back(scale * x);
       normals_.push_back(scale * y);
@@ -685,16 +1370,23 @@ class WavefrontObjFile {
     line = ParseIndices(line, line_num, indices + 0, indices + 1, indices + 2);
     if (line == NULL) {
       ErrorLine("bad first index", line_num);
+      return;
     }
     line = ParseIndices(line, line_num, indices + 3, indices + 4, indices + 5);
     if (line == NULL) {
       ErrorLine("bad second index", line_num);
+      return;
+    }
+    if (!CheckIndices(indices + 0, line_num) ||
+        !CheckIndices(indices + 3, line_num)) {
+      return;
     }
     // After the first two indices, each index introduces a new
     // triangle to the fan.
     while ((line = ParseIndices(line, line_num,
                                 indices + 6, indices + 7, indices + 8))) {
-      current_batch_->AddTriangle(current_group_line_, indices);
+      if (!CheckIndices(indices + 6, line_num)) return;
+      AddPrimitive(current_batch_, kTriangles, indices);
       // The most recent vertex is reused for the next triangle.
       indices[3] = indices[6];
       indices[4] = indices[7];
@@ -703,6 +1395,90 @@ class WavefrontObjFile {
     }
   }
 
+  // Parses a polyline into a line per segment. Its vertices may have
+  // texcoords.
+  void ParsePolyline(const char* line, unsigned int line_num) {
+    int indices[6] = { 0 };
+    line = ParseIndices(line, line_num, indices + 0, indices + 1, indices + 2);
+    if (line == NULL) {
+      ErrorLine("bad first index", line_num);
+      return;
+    }
+    if (!CheckIndices(indices + 0, line_num)) return;
+    DrawBatch* batch = sink_ ? NULL : &CurrentBatch(&line_batches_);
+    bool any = false;
+    while ((line = ParseIndices(line, line_num,
+                                indices + 3, indices + 4, indices + 5))) {
+      if (!CheckIndices(indices + 3, line_num)) return;
+      AddPrimitive(batch, kLines, indices);
+      any = true;
+      // Each segment starts where the last one ended.
+      indices[0] = indices[3];
+      indices[1] = indices[4];
+      indices[2] = indices[5];
+    }
+    if (!any) {
+      ErrorLine("bad second index", line_num);
+    }
+  }
+
+  void ParsePoints(const char* line, unsigned int line_num) {
+    int indices[3] = { 0 };
+    DrawBatch* batch = sink_ ? NULL : &CurrentBatch(&point_batches_);
+    bool any = false;
+    while ((line = ParseIndices(line, line_num,
+                                indices + 0, indices + 1, indices + 2))) {
+      if (!CheckIndices(indices + 0, line_num)) return;
+      AddPrimitive(batch, kPoints, indices);
+      any = true;
+    }
+    if (!any) {
+      ErrorLine("bad first index", line_num);
+    }
+  }
+
+  // Adds a primitive of the current material and group to |batch|, or
+  // hands it to the sink.
+  void AddPrimitive(DrawBatch* batch, PrimitiveMode mode, int* indices) {
+    if (sink_) {
+      sink_->AddPrimitive(current_material_, current_group_line_, mode,
+                          indices);
+    } else if (mode == kTriangles) {
+      batch->AddTriangle(current_group_line_, indices);
+    } else if (mode == kLines) {
+      batch->AddLine(current_group_line_, indices);
+    } else {
+      batch->AddPoint(current_group_line_, indices);
+    }
+  }
+
+  // The current material's batch in |batches|.
+  DrawBatch& CurrentBatch(MaterialBatches* batches) {
+    MaterialBatches::iterator iter = batches->find(current_material_);
+    if (iter == batches->end()) {
+      iter = batches->insert(
+          std::make_pair(current_material_, DrawBatch())).first;
+      iter->second.Init(&positions_, &texcoords_, &normals_, &colors_);
+    }
+    return iter->second;
+  }
+
+  // True if the position, texcoord and normal indices of a vertex
+  // refer to attributes read so far (texcoords and normals may be 0,
+  // for none). Reports the line otherwise.
+  bool CheckIndices(const int* indices, unsigned int line_num) {
+    if (indices[0] < 1 ||
+        static_cast<size_t>(indices[0]) > num_positions_ ||
+        indices[1] < 0 ||
+        static_cast<size_t>(indices[1]) > num_texcoords_ ||
+        indices[2] < 0 ||
+        static_cast<size_t>(indices[2]) > num_normals_) {
+      ErrorLine("index out of range", line_num);
+      return false;
+    }
+    return true;
+  }
+
   // Parse a single group of indices, separated by slashes ('/').
   // TODO: convert negative indices (that is, relative to the end of
   // the current vertex positions) to more conventional positive
@@ -742,28 +1518,45 @@ class WavefrontObjFile {
       line_to_groups_.insert(std::make_pair(line_num, token));
     }
     current_group_line_ = line_num;
+    line_to_object_[line_num] = current_object_;
+  }
+
+  // Objects also start a group, named after the object until a g
+  // record names it.
+  void ParseObject(const char* line, unsigned int line_num) {
+    std::string token;
+    if (!ConsumeFirstToken(line, &token)) {
+      ErrorLine("bad object", line_num);
+      return;
+    }
+    current_object_ = token;
+    ToLowerInplace(&token);
+    group_counts_[token]++;
+    line_to_groups_.insert(std::make_pair(line_num, token));
+    current_group_line_ = line_num;
+    line_to_object_[line_num] = current_object_;
   }
 
   void ParseSmoothingGroup(const char* line, unsigned int line_num) {
-    static bool once = true;
-    if (once) {
+    if (!warned_smoothing_) {
       WarnLine("s ignored", line_num);
-      once = false;
+      warned_smoothing_ = true;
     }
   }
 
   void ParseMtllib(const char* line, unsigned int line_num) {
-    FILE* fp = fopen(StripLeadingWhitespace(line), "r");
-    if (!fp) {
+    MtlLibraries uncached;
+    MtlLibraries* libraries = libraries_ ? libraries_ : &uncached;
+    MaterialList materials;
+    if (!libraries->Load(StripLeadingWhitespace(line), files_, &materials)) {
       WarnLine("mtllib not found", line_num);
       return;
     }
-    WavefrontMtlFile mtlfile(fp);
-    fclose(fp);
-    materials_ = mtlfile.materials();
+    mtllib_ = StripLeadingWhitespace(line);
+    materials_.swap(materials);
     for (size_t i = 0; i < materials_.size(); ++i) {
       DrawBatch& draw_batch = material_batches_[materials_[i].name];
-      draw_batch.Init(&positions_, &texcoords_, &normals_);
+      draw_batch.Init(&positions_, &texcoords_, &normals_, &colors_);
     }
   }
 
@@ -783,50 +1576,90 @@ class WavefrontObjFile {
         current_->Kd[2] = 1;
 
         DrawBatch& draw_batch = material_batches_[usemtl];
-        draw_batch.Init(&positions_, &texcoords_, &normals_);
+        draw_batch.Init(&positions_, &texcoords_, &normals_, &colors_);
         current_batch_ = &draw_batch;
       } else {
         ErrorLine("material not found", line_num);
+        return;
       }
     } else {
       current_batch_ = &iter->second;
     }
+    current_material_ = usemtl;
   }
 
   void WarnLine(const char* why, unsigned int line_num) const {
     fprintf(stderr, "WARNING: %s at line %u\n", why, line_num);
   }
 
-  void ErrorLine(const char* why, unsigned int line_num) const {
-    fprintf(stderr, "ERROR: %s at line %u\n", why, line_num);
-    exit(-1);
+  // Keeps the first error; ParseFile stops there.
+  void ErrorLine(const char* why, unsigned int line_num) {
+    if (error_.empty()) {
+      StringAppendF(&error_, "%s at line %u", why, line_num);
+    }
   }
 
   bool missingMaterialsAsWhite_;
-
+  const TextFiles* files_;
+  MtlLibraries* libraries_;
+  ObjSink* sink_;
+  std::string error_;
+  bool warned_smoothing_;
+
+  // How many of each attribute were read, for checking indices.
+  size_t num_positions_, num_texcoords_, num_normals_;
+  bool has_colors_;
+  std::string mtllib_;
   AttribList positions_;
   AttribList texcoords_;
   AttribList normals_;
+  AttribList colors_;
   MaterialList materials_;
 
   // Currently, batch by texture (i.e. map_Kd).
   MaterialBatches material_batches_;
   DrawBatch* current_batch_;
+  std::string current_material_;
+  MaterialBatches line_batches_;
+  MaterialBatches point_batches_;
 
   typedef std::multimap<unsigned int, std::string> LineToGroups;
   LineToGroups line_to_groups_;
   std::map<std::string, int> group_counts_;
   unsigned int current_group_line_;
+  std::map<unsigned int, std::string> line_to_object_;
+  std::string current_object_;
+};
+
+// Quantization bit depths for each kind of attribute. The UTF-8 stream
+// stores zigzagged 16-bit deltas, which must stay below 0xF800 (see
+// Uint16ToUtf8), so 14 bits is the most any attribute can use.
+struct QuantizationBits {
+  static const int kMinBits = 2;
+  static const int kMaxBits = 14;
+
+  QuantizationBits() : position(14), texcoord(10), normal(10) { }
+
+  bool Valid() const {
+    return position >= kMinBits && position <= kMaxBits &&
+        texcoord >= kMinBits && texcoord <= kMaxBits &&
+        normal >= kMinBits && normal <= kMaxBits;
+  }
+
+  int position;
+  int texcoord;
+  int normal;
 };
 
-// TODO: make maxPosition et. al. configurable.
 struct BoundsParams {
-  static BoundsParams FromBounds(const Bounds& bounds) {
+  static BoundsParams FromBounds(const Bounds& bounds,
+                                 const QuantizationBits& bits =
+                                     QuantizationBits()) {
     BoundsParams ret;
     const float scale = bounds.UniformScale();
     // Position. Use a uniform scale.
     for (size_t i = 0; i < 3; ++i) {
-      const int maxPosition = (1 << 14) - 1;  // 16383;
+      const int maxPosition = (1 << bits.position) - 1;
       ret.mins[i] = bounds.mins[i];
       ret.scales[i] = scale;
       ret.outputMaxes[i] = maxPosition;
@@ -837,7 +1670,7 @@ struct BoundsParams {
     // TODO: get bounds-dependent texcoords working!
     for (size_t i = 3; i < 5; ++i) {
       // const float texScale = bounds.maxes[i] - bounds.mins[i];
-      const int maxTexcoord = (1 << 10) - 1;  // 1023
+      const int maxTexcoord = (1 << bits.texcoord) - 1;
       ret.mins[i] = 0;  //bounds.mins[i];
       ret.scales[i] = 1;  //texScale;
       ret.outputMaxes[i] = maxTexcoord;
@@ -846,73 +1679,311 @@ struct BoundsParams {
     }
     // Normal. Always uniform range.
     for (size_t i = 5; i < 8; ++i) {
+      const int halfNormal = (1 << (bits.normal - 1)) - 1;
       ret.mins[i] = -1;
       ret.scales[i] = 2.f;
-      ret.outputMaxes[i] = (1 << 10) - 1;  // 1023
-      ret.decodeOffsets[i] = 1 - (1 << 9);  // -511
-      ret.decodeScales[i] = 1.0f / 511;
+      ret.outputMaxes[i] = (1 << bits.normal) - 1;
+      ret.decodeOffsets[i] = -halfNormal;
+      ret.decodeScales[i] = 1.0f / halfNormal;
+    }
+    // Color. Always 8 bits in [0, 1].
+    for (size_t i = 8; i < kNumChannels; ++i) {
+      ret.mins[i] = 0;
+      ret.scales[i] = 1;
+      ret.outputMaxes[i] = 255;
+      ret.decodeOffsets[i] = 0;
+      ret.decodeScales[i] = 1.0f / 255;
     }
+    ret.octNormals = false;
+    ret.colors = false;
     return ret;
   }
 
-  void DumpJson() {
+  // Quantized words per vertex of |layout|. Octahedral normals need two
+  // words instead of three; they decode through the first two normal
+  // slots.
+  size_t QuantizedStride(VertexLayout layout = kLayoutPNT) const {
+    const size_t stride = LayoutStride(layout);
+    return (octNormals && LayoutHasNormals(layout)) ? stride - 1 : stride;
+  }
+
+  // Returns the largest difference, along any axis, between a position
+  // in |attribs| and the value a viewer decodes for it.
+  float MaxPositionError(const AttribList& attribs,
+                         VertexLayout layout = kLayoutPNT) const {
+    const size_t stride = LayoutStride(layout);
+    double max_error = 0;
+    for (size_t i = 0; i < attribs.size(); i += stride) {
+      for (size_t j = 0; j < 3; ++j) {
+        const uint16 quantized = Quantize(attribs[i + j], mins[j], scales[j],
+                                          outputMaxes[j]);
+        const double decoded = static_cast<double>(decodeScales[j]) *
+            (quantized + decodeOffsets[j]);
+        const double error = fabs(decoded - attribs[i + j]);
+        if (error > max_error) {
+          max_error = error;
+        }
+      }
+    }
+    return static_cast<float>(max_error);
+  }
+
+  // Models with colors list all kNumChannels channels, the rest just
+  // the first 8, so their decoded vertices keep a stride of 8. The
+  // entries are printed |indent| spaces deeper than the model's.
+  void DumpJson(std::string* json, int indent = 0) const {
+    const char* colors_offsets = colors ? ",0,0,0" : "";
+    char colors_scales[64] = "";
+    if (colors) {
+      snprintf(colors_scales, sizeof(colors_scales), ",%.9g,%.9g,%.9g",
+               decodeScales[8], decodeScales[9], decodeScales[10]);
+    }
+    const char* colors_bits = colors ? ",8,8,8" : "";
 #ifdef MINI_JS
-    putchar('{');
-    printf("decodeOffsets:[%d,%d,%d,%d,%d,%d,%d,%d],",
-           decodeOffsets[0], decodeOffsets[1], decodeOffsets[2],
-           decodeOffsets[3], decodeOffsets[4], decodeOffsets[5],
-           decodeOffsets[6], decodeOffsets[7]);
-    printf("decodeScales:[%f,%f,%f,%f,%f,%f,%f,%f]",
-           decodeScales[0], decodeScales[1], decodeScales[2], decodeScales[3],
-           decodeScales[4], decodeScales[5], decodeScales[6], decodeScales[7]);
-    printf("},");
+    json->push_back('{');
+    StringAppendF(json, "decodeOffsets:[%d,%d,%d,%d,%d,%d,%d,%d%s],",
+                  decodeOffsets[0], decodeOffsets[1], decodeOffsets[2],
+                  decodeOffsets[3], decodeOffsets[4], decodeOffsets[5],
+                  decodeOffsets[6], decodeOffsets[7], colors_offsets);
+    StringAppendF(json, "decodeScales:[%.9g,%.9g,%.9g,%.9g,%.9g,%.9g,%.9g,%.9g%s],",
+                  decodeScales[0], decodeScales[1], decodeScales[2], decodeScales[3],
+                  decodeScales[4], decodeScales[5], decodeScales[6], decodeScales[7],
+                  colors_scales);
+    StringAppendF(json, "quantizationBits:[%d,%d,%d,%d,%d,%d,%d,%d%s]",
+                  Bits(0), Bits(1), Bits(2), Bits(3),
+                  Bits(4), Bits(5), Bits(6), Bits(7), colors_bits);
+    if (octNormals) {
+      json->append(",octNormals:true");
+    }
+    json->append("},");
 #else
-    puts("{");
-    printf("    decodeOffsets: [%d,%d,%d,%d,%d,%d,%d,%d],\n",
-           decodeOffsets[0], decodeOffsets[1], decodeOffsets[2],
-           decodeOffsets[3], decodeOffsets[4], decodeOffsets[5],
-           decodeOffsets[6], decodeOffsets[7]);
-    printf("    decodeScales: [%f,%f,%f,%f,%f,%f,%f,%f]\n",
-           decodeScales[0], decodeScales[1], decodeScales[2], decodeScales[3],
-           decodeScales[4], decodeScales[5], decodeScales[6], decodeScales[7]);
-    puts("  },");
+    json->append("{\n");
+    StringAppendF(json, "%*s    decodeOffsets: [%d,%d,%d,%d,%d,%d,%d,%d%s],\n",
+                  indent, "",
+                  decodeOffsets[0], decodeOffsets[1], decodeOffsets[2],
+                  decodeOffsets[3], decodeOffsets[4], decodeOffsets[5],
+                  decodeOffsets[6], decodeOffsets[7], colors_offsets);
+    StringAppendF(json, "%*s    decodeScales: [%.9g,%.9g,%.9g,%.9g,%.9g,%.9g,%.9g,%.9g%s],\n",
+                  indent, "",
+                  decodeScales[0], decodeScales[1], decodeScales[2], decodeScales[3],
+                  decodeScales[4], decodeScales[5], decodeScales[6], decodeScales[7],
+                  colors_scales);
+    StringAppendF(json, "%*s    quantizationBits: [%d,%d,%d,%d,%d,%d,%d,%d%s]%s\n",
+                  indent, "",
+                  Bits(0), Bits(1), Bits(2), Bits(3),
+                  Bits(4), Bits(5), Bits(6), Bits(7), colors_bits,
+                  octNormals ? "," : "");
+    if (octNormals) {
+      StringAppendF(json, "%*s    octNormals: true\n", indent, "");
+    }
+    StringAppendF(json, "%*s  },\n", indent, "");
 #endif
   }
 
-  float mins[8];
-  float scales[8];
-  int outputMaxes[8];
-  int decodeOffsets[8];
-  float decodeScales[8];
+  int Bits(size_t i) const {
+    int bits = 0;
+    while ((1 << bits) <= outputMaxes[i]) ++bits;
+    return bits;
+  }
+
+  float mins[kNumChannels];
+  float scales[kNumChannels];
+  int outputMaxes[kNumChannels];
+  int decodeOffsets[kNumChannels];
+  float decodeScales[kNumChannels];
+  bool octNormals;
+  bool colors;
 };
 
-void AttribsToQuantizedAttribs(const AttribList& interleaved_attribs,
-                               const BoundsParams& bounds_params,
-                               QuantizedAttribList* quantized_attribs) {
-  quantized_attribs->resize(interleaved_attribs.size());
-  for (size_t i = 0; i < interleaved_attribs.size(); i += 8) {
-    for (size_t j = 0; j < 8; ++j) {
-      quantized_attribs->at(i + j) = Quantize(interleaved_attribs[i + j],
-                                              bounds_params.mins[j],
-                                              bounds_params.scales[j],
-                                              bounds_params.outputMaxes[j]);
+// Attributes whose positions ChoosePositionBits keeps within the
+// tolerance, each with its layout.
+typedef std::vector<std::pair<const AttribList*, VertexLayout> >
+    PositionSourceList;
+
+// Appends the attributes of every batch of |batches| to |sources|.
+static inline void AddPositionSources(const MaterialBatches& batches,
+                                      PositionSourceList* sources) {
+  for (MaterialBatches::const_iterator iter = batches.begin();
+       iter != batches.end(); ++iter) {
+    sources->push_back(std::make_pair(&iter->second.draw_mesh().attribs,
+                                      iter->second.layout()));
+  }
+}
+
+// Finds the fewest position bits that keep the maximum position error
+// of every one of |sources| within |tolerance|. Falls back to the most
+// bits allowed if the tolerance cannot be met, with a warning.
+static inline int ChoosePositionBits(const Bounds& bounds,
+                                     const PositionSourceList& sources,
+                                     QuantizationBits bits, float tolerance) {
+  float error = 0;
+  for (bits.position = QuantizationBits::kMinBits;
+       bits.position <= QuantizationBits::kMaxBits; ++bits.position) {
+    const BoundsParams params = BoundsParams::FromBounds(bounds, bits);
+    error = 0;
+    for (size_t i = 0; i < sources.size() && error <= tolerance; ++i) {
+      const float source_error = params.MaxPositionError(*sources[i].first,
+                                                         sources[i].second);
+      if (source_error > error) {
+        error = source_error;
+      }
+    }
+    if (error <= tolerance) {
+      return bits.position;
     }
   }
+  fprintf(stderr, "WARNING: position tolerance %g needs more than %d bits "
+          "(maximum error %g)\n", tolerance, QuantizationBits::kMaxBits,
+          error);
+  return QuantizationBits::kMaxBits;
 }
 
-uint16 ZigZag(int16 word) {
+// Octahedral normal encoding: the unit sphere is projected onto the
+// octahedron |x| + |y| + |z| = 1, whose lower half is folded out over
+// the corners of the [-1, 1] square. Components are rounded to
+// multiples of 1/|half|, so they decode with the usual normal
+// decodeOffsets and decodeScales. The (-1, -1) corner is kept for the
+// zero normal of vertices without one; (0, 0, -1) uses (1, 1) instead,
+// which decodes the same.
+static inline void OctEncodeNormal(const float* normal, int half,
+                                   uint16* out) {
+  const float length = fabsf(normal[0]) + fabsf(normal[1]) + fabsf(normal[2]);
+  if (length == 0) {
+    out[0] = out[1] = 0;
+    return;
+  }
+  float x = normal[0] / length;
+  float y = normal[1] / length;
+  if (normal[2] < 0) {
+    const float folded_x = (1 - fabsf(y)) * (x < 0 ? -1 : 1);
+    y = (1 - fabsf(x)) * (y < 0 ? -1 : 1);
+    x = folded_x;
+  }
+  out[0] = static_cast<uint16>(floorf(x * half + 0.5f) + half);
+  out[1] = static_cast<uint16>(floorf(y * half + 0.5f) + half);
+  if (out[0] == 0 && out[1] == 0) {
+    out[0] = out[1] = static_cast<uint16>(2 * half);
+  }
+}
+
+static inline void OctDecodeNormal(const uint16* in, int half, float* normal) {
+  if (in[0] == 0 && in[1] == 0) {
+    normal[0] = normal[1] = normal[2] = 0;
+    return;
+  }
+  float x = static_cast<float>(in[0] - half) / half;
+  float y = static_cast<float>(in[1] - half) / half;
+  const float z = 1 - fabsf(x) - fabsf(y);
+  if (z < 0) {
+    const float unfolded_x = (1 - fabsf(y)) * (x < 0 ? -1 : 1);
+    y = (1 - fabsf(x)) * (y < 0 ? -1 : 1);
+    x = unfolded_x;
+  }
+  const float scale = 1.0f / sqrtf(x * x + y * y + z * z);
+  normal[0] = x * scale;
+  normal[1] = y * scale;
+  normal[2] = z * scale;
+}
+
+template <VertexLayout kLayout>
+static inline void QuantizeVertices(const AttribList& interleaved_attribs,
+                                    const BoundsParams& bounds_params,
+                                    QuantizedAttribList* quantized_attribs) {
+  typedef LayoutTraits<kLayout> Traits;
+  const size_t stride = bounds_params.QuantizedStride(kLayout);
+  const int oct_half = -bounds_params.decodeOffsets[5];
+  quantized_attribs->resize(
+      interleaved_attribs.size() / Traits::kStride * stride);
+  uint16* out = quantized_attribs->empty() ? NULL : &quantized_attribs->at(0);
+  for (size_t i = 0; i < interleaved_attribs.size(); i += Traits::kStride) {
+    const float* in = &interleaved_attribs[i];
+    for (size_t j = 0; j < 3; ++j) {
+      *out++ = Quantize(in[j], bounds_params.mins[j], bounds_params.scales[j],
+                        bounds_params.outputMaxes[j]);
+    }
+    if (Traits::kHasTexcoords) {
+      for (size_t j = 3; j < 5; ++j) {
+        *out++ = Quantize(in[j], bounds_params.mins[j],
+                          bounds_params.scales[j],
+                          bounds_params.outputMaxes[j]);
+      }
+    }
+    if (Traits::kHasNormals) {
+      const float* normal = in + Traits::kNormalOffset;
+      if (bounds_params.octNormals) {
+        OctEncodeNormal(normal, oct_half, out);
+        out += 2;
+      } else {
+        for (size_t j = 5; j < 8; ++j) {
+          *out++ = Quantize(normal[j - 5], bounds_params.mins[j],
+                            bounds_params.scales[j],
+                            bounds_params.outputMaxes[j]);
+        }
+      }
+    }
+    if (Traits::kHasColors) {
+      const float* color = in + Traits::kColorOffset;
+      for (size_t j = 8; j < kNumChannels; ++j) {
+        *out++ = Quantize(color[j - 8], bounds_params.mins[j],
+                          bounds_params.scales[j],
+                          bounds_params.outputMaxes[j]);
+      }
+    }
+  }
+}
+
+static inline void AttribsToQuantizedAttribs(
+    const AttribList& interleaved_attribs, VertexLayout layout,
+    const BoundsParams& bounds_params, QuantizedAttribList* quantized_attribs) {
+  switch (layout) {
+    case kLayoutP:
+      QuantizeVertices<kLayoutP>(interleaved_attribs, bounds_params,
+                                 quantized_attribs);
+      break;
+    case kLayoutPT:
+      QuantizeVertices<kLayoutPT>(interleaved_attribs, bounds_params,
+                                  quantized_attribs);
+      break;
+    case kLayoutPN:
+      QuantizeVertices<kLayoutPN>(interleaved_attribs, bounds_params,
+                                  quantized_attribs);
+      break;
+    case kLayoutPNT:
+      QuantizeVertices<kLayoutPNT>(interleaved_attribs, bounds_params,
+                                   quantized_attribs);
+      break;
+    case kLayoutPC:
+      QuantizeVertices<kLayoutPC>(interleaved_attribs, bounds_params,
+                                  quantized_attribs);
+      break;
+    case kLayoutPTC:
+      QuantizeVertices<kLayoutPTC>(interleaved_attribs, bounds_params,
+                                   quantized_attribs);
+      break;
+    case kLayoutPNC:
+      QuantizeVertices<kLayoutPNC>(interleaved_attribs, bounds_params,
+                                   quantized_attribs);
+      break;
+    case kLayoutPNTC:
+      QuantizeVertices<kLayoutPNTC>(interleaved_attribs, bounds_params,
+                                    quantized_attribs);
+      break;
+  }
+}
+
+static inline uint16 ZigZag(int16 word) {
   return (word >> 15) ^ (word << 1);
 }
 
-void CompressAABBToUtf8(const Bounds& bounds,
-                        const BoundsParams& total_bounds,
-                        std::vector<char>* utf8) {
-  const int maxPosition = (1 << 14) - 1;  // 16383;
+static inline void CompressAABBToUtf8(const Bounds& bounds,
+                                      const BoundsParams& total_bounds,
+                                      std::vector<char>* utf8) {
   uint16 mins[3] = { 0 };
   uint16 maxes[3] = { 0 };
   for (int i = 0; i < 3; ++i) {
-    float total_min = total_bounds.mins[i];
-    float total_scale = total_bounds.scales[i];
+    const float total_min = total_bounds.mins[i];
+    const float total_scale = total_bounds.scales[i];
+    const int maxPosition = total_bounds.outputMaxes[i];
     mins[i] = Quantize(bounds.mins[i], total_min, total_scale, maxPosition);
     maxes[i] = Quantize(bounds.maxes[i], total_min, total_scale, maxPosition);
   }
@@ -924,8 +1995,8 @@ void CompressAABBToUtf8(const Bounds& bounds,
   }
 }
 
-void CompressIndicesToUtf8(const OptimizedIndexList& list,
-                           std::vector<char>* utf8) {
+static inline void CompressIndicesToUtf8(const OptimizedIndexList& list,
+                                         std::vector<char>* utf8) {
   // For indices, we don't do delta from the most recent index, but
   // from the high water mark. The assumption is that the high water
   // mark only ever moves by one at a time. Foruntately, the vertex
@@ -943,12 +2014,40 @@ void CompressIndicesToUtf8(const OptimizedIndexList& list,
   }
 }
 
-void CompressQuantizedAttribsToUtf8(const QuantizedAttribList& attribs,
-                                    std::vector<char>* utf8) {
-  for (size_t i = 0; i < 8; ++i) {
+// The same for indices that may not fit 16 bits, such as those into a
+// vertex stream shared by all of a model's batches. Each distance
+// below the high water mark is split into 14-bit words, low bits
+// first, with 0x4000 set on all but the last. Returns the number of
+// words written.
+static inline size_t CompressLongIndicesToUtf8(const std::vector<uint32>& list,
+                                               std::vector<char>* utf8) {
+  size_t num_words = list.size();
+  uint32 index_high_water_mark = 0;
+  for (size_t i = 0; i < list.size(); ++i) {
+    const uint32 index = list[i];
+    CHECK(index <= index_high_water_mark);
+    uint32 code = index_high_water_mark - index;
+    while (code >= 0x4000) {
+      CHECK(Uint16ToUtf8(static_cast<uint16>(0x4000 | (code & 0x3FFF)),
+                         utf8));
+      code >>= 14;
+      ++num_words;
+    }
+    CHECK(Uint16ToUtf8(static_cast<uint16>(code), utf8));
+    if (index == index_high_water_mark) {
+      ++index_high_water_mark;
+    }
+  }
+  return num_words;
+}
+
+static inline void CompressQuantizedAttribsToUtf8(
+    const QuantizedAttribList& attribs, std::vector<char>* utf8,
+    size_t stride = 8) {
+  for (size_t i = 0; i < stride; ++i) {
     // Use a transposed representation, and delta compression.
     uint16 prev = 0;
-    for (size_t j = i; j < attribs.size(); j += 8) {
+    for (size_t j = i; j < attribs.size(); j += stride) {
       const uint16 word = attribs[j];
       const uint16 za = ZigZag(static_cast<int16>(word - prev));
       prev = word;
@@ -957,4 +2056,19 @@ void CompressQuantizedAttribsToUtf8(const QuantizedAttribList& attribs,
   }
 }
 
+// Compresses the positions at |offset| in each vertex of |attribs| as
+// deltas against the ones at |base_offset|, transposed like the
+// attributes.
+static inline void CompressPositionDeltasToUtf8(
+    const QuantizedAttribList& attribs, size_t stride, size_t base_offset,
+    size_t offset, std::vector<char>* utf8) {
+  for (size_t i = 0; i < 3; ++i) {
+    for (size_t j = 0; j < attribs.size(); j += stride) {
+      const uint16 delta =
+          attribs[j + offset + i] - attribs[j + base_offset + i];
+      CHECK(Uint16ToUtf8(ZigZag(static_cast<int16>(delta)), utf8));
+    }
+  }
+}
+
 #endif  // WEBGL_LOADER_MESH_H_
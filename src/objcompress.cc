@@ -1,5 +1,5 @@
 #if 0  // A cute trick to making this .cc self-building from shell.
-g++ $0 -O2 -Wall -Werror -o `basename $0 .cc`;
+g++ $0 -O2 -Wall -Werror -pthread -D WITH_ZLIB -o `basename $0 .cc` -lz;
 exit;
 #endif
 // Copyright 2011 Google Inc. All Rights Reserved.
@@ -16,223 +16,270 @@ exit;
 // implied. See the License for the specific language governing
 // permissions and limitations under the License.
 
-#include "mesh.h"
-#include "optimize.h"
+#include <set>
 
-int main(int argc, const char* argv[]) {
-  if (argc != 3 && (argc != 4 || strncmp(argv[1], "-w", 2) != 0)) {
-    fprintf(stderr, "Usage: %s [-w] in.obj out.utf8\n\n"
-            "\tCompress in.obj to out.utf8 and writes JS to STDOUT.\n"
-            "\tIf -w is given missing materials will result in solid white instead of ending in error.\n\n",
-            argv[0]);
-    return -1;
+#include "args.h"
+#include "batch.h"
+#include "convert.h"
+#include "precompress.h"
+#include "writer.h"
+#include "thread.h"
+
+int Usage(const char* argv0) {
+  fprintf(stderr, "Usage: %s [-w] [-bits p,t,n] [-tolerance e] [-oct]\n"
+          "\t\t[-tiles n] [-lods r,r,...] [-instances] [-frames f.obj,...]\n"
+          "\t\t[-merge] [-objects] [-shared] [-glb out.glb]\n"
+          "\t\t[-js out.js] [-gz] [-br] [-tar bundle.tar] [-j threads]\n"
+          "\t\t[-incremental] [-append new.obj] [-hash32] [-memstats]\n"
+          "\t\t[-spill dir] [-batch] [-memory MB]\n"
+          "\t\t[-shards n | -shard i | -merge-shards] in.obj out.utf8\n\n"
+          "\tCompress in.obj to out.utf8 and writes JS to STDOUT.\n"
+          "\tIf -w is given missing materials will result in solid white instead of ending in error.\n"
+          "\t-bits sets the quantization bits of positions, texcoords and normals (default: 14,10,10, at most 14).\n"
+          "\tIf -tolerance is given the fewest position bits keeping the position error within e are used.\n"
+          "\tIf -oct is given normals are stored as two octahedral components instead of three.\n"
+          "\tIf -tiles is given the model is split into an octree of tiles of at most n triangles each.\n"
+          "\t-lods adds simplified levels of detail with the given ratios of the triangles (e.g. 0.25,0.05).\n"
+          "\tIf -instances is given repeated groups are stored once and listed with their transforms.\n"
+          "\t-frames adds later frames of an animation of in.obj, stored as position deltas.\n"
+          "\tIf -merge is given materials that look the same share one batch.\n"
+          "\tIf -objects is given every object (o) gets its own urls, to be fetched on demand.\n"
+          "\tIf -shared is given all materials share one deduplicated vertex stream with 32-bit indices.\n"
+          "\tIf -incremental is given batches whose payloads an earlier run wrote are not encoded again.\n"
+          "\tIf -append is given only the faces of new.obj are added to the model in out.js (see -js).\n"
+          "\tIf -hash32 is given payloads keep the 8 digit names of older versions.\n"
+          "\tIf -memstats is given the memory held after each stage is reported on STDERR.\n"
+          "\tIf -spill is given the triangles are sorted into tiles in scratch files in dir, for OBJ files bigger than memory.\n"
+          "\tIf -glb is given the quantized meshes are also written to out.glb.\n"
+          "\tIf -js is given the JS is written to out.js instead of STDOUT.\n"
+          "\tIf -gz or -br are given gzip or brotli compressed copies of every output are written too.\n"
+          "\tIf -tar is given all the UTF8 files are also bundled into bundle.tar.\n"
+          "\t-j sets the number of compression threads (default: one per CPU).\n"
+          "\t-shards plans n shards of in.obj, each converted by -shard i (0 to n - 1) in a process of its own, and -merge-shards merges them.\n"
+          "\tIf -batch is given in.obj is a list or directory of OBJ files, converted at once on -j threads.\n"
+          "\t-memory sets the memory budget of the files converting at once, or of -spill (default: 1024).\n\n",
+          argv0);
+  return -1;
+}
+
+// Queues each payload to be written to disk as soon as it is encoded,
+// and then compressed, while the next one is still being encoded.
+// Payloads that cannot be written are reported by the writer.
+class FileOutput : public ConvertOutput {
+ public:
+  FileOutput(AsyncWriter* writer, Precompressor* precompressor,
+             const std::string& glb_file)
+      : writer_(writer), precompressor_(precompressor), glb_file_(glb_file) {
   }
-  bool missingMaterialsAsWhite = argc == 4; // && strncmp(argv[1], "-w", 2) == 0
-  const char* in_file = argv[missingMaterialsAsWhite ? 2 : 1];
-  const char* out_file = argv[missingMaterialsAsWhite ? 3 : 2];
-  FILE* fp = fopen(in_file, "r");
-  WavefrontObjFile obj(fp, missingMaterialsAsWhite);
-  fclose(fp);
-
-#ifdef MINI_JS
-  printf("MODELS['%s']={materials:{", StripLeadingDir(in_file));
-#else
-  printf("MODELS['%s'] = {\n  materials: {\n", StripLeadingDir(in_file));
-#endif
-  const MaterialList& materials = obj.materials();
-  for (size_t i = 0; i < materials.size(); ++i) {
-    materials[i].DumpJson();
-    if (i != materials.size() - 1)
-        putchar(',');
-#ifndef MINI_JS
-    printf("\n");
-#endif
+
+ protected:
+  virtual bool KeepPayload(const std::string& name, std::vector<char>* data) {
+    // The GLB is compressed, but not bundled with the UTF8 files.
+    writer_->Add(name, data, name == glb_file_);
+    return true;
   }
-#ifdef MINI_JS
-  printf("},");
-#else
-  puts("  },");
-#endif
 
-  const MaterialBatches& batches = obj.material_batches();
-
-  // Pass 1: compute bounds.
-  Bounds bounds;
-  bounds.Clear();
-  for (MaterialBatches::const_iterator iter = batches.begin();
-       iter != batches.end(); ++iter) {
-    const DrawBatch& draw_batch = iter->second;
-    bounds.Enclose(draw_batch.draw_mesh().attribs);
-  }
-  BoundsParams bounds_params = BoundsParams::FromBounds(bounds);
-#ifdef MINI_JS
-  printf("decodeParams:");
-#else
-  printf("  decodeParams: ");
-#endif
-  bounds_params.DumpJson();
+  virtual bool ReadState(const std::string& name, std::string* state) {
+    std::vector<char> data;
+    if (!ReadFile(name, &data)) {
+      return false;
+    }
+    state->assign(data.begin(), data.end());
+    return true;
+  }
 
-#ifdef MINI_JS
-  printf("urls:{");
-#else
-  puts("  urls: {");
-#endif
-  std::vector<char> utf8;
-  // Pass 2: quantize, optimize, compress, report.
-  for (MaterialBatches::const_iterator iter = batches.begin();
-       iter != batches.end(); /*++iter*/) {
-    size_t offset = 0;
-    utf8.clear();
-    const DrawMesh& draw_mesh = iter->second.draw_mesh();
-    if (draw_mesh.indices.empty()) { ++iter; continue; }
-    
-    QuantizedAttribList quantized_attribs;
-    AttribsToQuantizedAttribs(draw_mesh.attribs, bounds_params,
-                              &quantized_attribs);
-    VertexOptimizer vertex_optimizer(quantized_attribs);
-    const std::vector<GroupStart>& group_starts = iter->second.group_starts();
-    WebGLMeshList webgl_meshes;
-    std::vector<size_t> group_lengths;
-    for (size_t i = 1; i < group_starts.size(); ++i) {
-      const size_t here = group_starts[i-1].offset;
-      const size_t length = group_starts[i].offset - here;
-      group_lengths.push_back(length);
-      vertex_optimizer.AddTriangles(&draw_mesh.indices[here], length,
-                                    &webgl_meshes);
+  virtual bool KeepState(const std::string& name, const std::string& state) {
+    return WriteFile(name, state.data(), state.size());
+  }
+
+  virtual bool ReadPayload(const std::string& name, std::vector<char>* data) {
+    return ReadFile(name, data);
+  }
+
+  // An earlier run's payload is compressed and bundled again from disk.
+  // One this run is still writing is not there yet, and is encoded again.
+  virtual bool ReusePayload(const std::string& name) {
+    FILE* fp = fopen(name.c_str(), "rb");
+    if (!fp) {
+      return false;
     }
-    const size_t here = group_starts.back().offset;
-    const size_t length = draw_mesh.indices.size() - here;
-    const bool divisible_by_3 = length % 3 == 0;
-    CHECK(divisible_by_3);
-    group_lengths.push_back(length);
-    vertex_optimizer.AddTriangles(&draw_mesh.indices[here], length,
-                                  &webgl_meshes);
-
-    std::vector<std::string> material;
-    std::vector<size_t> attrib_start, attrib_length, index_start, index_length;
-    for (size_t i = 0; i < webgl_meshes.size(); ++i) {
-      const size_t num_attribs = webgl_meshes[i].attribs.size();
-      const size_t num_indices = webgl_meshes[i].indices.size();
-      const bool kBadSizes = num_attribs % 8 || num_indices % 3;
-      CHECK(!kBadSizes);
-      CompressQuantizedAttribsToUtf8(webgl_meshes[i].attribs, &utf8);
-      CompressIndicesToUtf8(webgl_meshes[i].indices, &utf8);
-      material.push_back(iter->first);
-      attrib_start.push_back(offset);
-      attrib_length.push_back(num_attribs / 8);
-      index_start.push_back(offset + num_attribs);
-      index_length.push_back(num_indices / 3);
-      offset += num_attribs + num_indices;
+    fclose(fp);
+    precompressor_->AddFile(name, true);
+    return true;
+  }
+
+ private:
+  AsyncWriter* writer_;
+  Precompressor* precompressor_;
+  const std::string glb_file_;
+};
+
+// Enough to keep the writer busy while a batch is encoded.
+static const size_t kMaxPendingWrites = 4;
+static const size_t kDefaultBatchMemoryMb = 1024;
+
+// What became of one file of a batch.
+struct BatchResult {
+  BatchResult() : ok(false) { }
+
+  std::string manifest;
+  bool ok;
+};
+
+// Converts one file of a batch, then gives back its share of the
+// memory budget.
+class BatchTask : public ThreadPool::Task {
+ public:
+  BatchTask(const CompressArgs& args, const std::string& obj_file,
+            MtlCache* mtl_cache, AsyncWriter* writer,
+            Precompressor* precompressor, MemoryBudget* budget,
+            size_t reserved, BatchResult* result)
+      : args_(args), obj_file_(obj_file), mtl_cache_(mtl_cache),
+        writer_(writer), precompressor_(precompressor), budget_(budget),
+        reserved_(reserved), result_(result) {
+  }
+
+  virtual void Run() {
+    ConvertInput input;
+    input.obj_file = obj_file_;
+    input.mtl_libraries = mtl_cache_;
+    ConvertOptions options = args_.options;
+    options.out_file = BatchOutFile(obj_file_, options.out_file);
+    FileOutput output(writer_, precompressor_, options.glb_file);
+    std::string error;
+    if (ConvertObj(input, options, &output, &error) == kConvertOk) {
+      result_->manifest.swap(*output.mutable_manifest());
+      result_->ok = true;
+    } else {
+      fprintf(stderr, "ERROR: %s: %s\n", obj_file_.c_str(), error.c_str());
     }
-    const uint32 hash = SimpleHash(&utf8[0], utf8.size());
-    char buf[9] = { '\0' };
-    ToHex(hash, buf);
-    // TODO: this needs to handle paths.
-    std::string out_fn = std::string(buf) + "." + out_file;
-    FILE* out_fp = fopen(out_fn.c_str(), "wb");
-#ifdef MINI_JS
-    printf("'%s':[", out_fn.c_str());
-#else
-    printf("    '%s': [\n", out_fn.c_str());
-#endif
-    size_t group_index = 0;
-    for (size_t i = 0; i < webgl_meshes.size(); ++i) {
-#ifdef MINI_JS
-      printf("{material:'%s',"
-             "attribRange:["SIZET_FORMAT","SIZET_FORMAT"],"
-             "indexRange:["SIZET_FORMAT","SIZET_FORMAT"],"
-             "bboxes:"SIZET_FORMAT","
-             "names:[",
-             material[i].c_str(),
-             attrib_start[i], attrib_length[i],
-             index_start[i], index_length[i],
-             offset);
-#else
-      printf("      { material: '%s',\n"
-             "        attribRange: ["SIZET_FORMAT", "SIZET_FORMAT"],\n"
-             "        indexRange: ["SIZET_FORMAT", "SIZET_FORMAT"],\n"
-             "        bboxes: "SIZET_FORMAT",\n"
-             "        names: [",
-             material[i].c_str(),
-             attrib_start[i], attrib_length[i],
-             index_start[i], index_length[i],
-             offset);
-#endif
-      std::vector<size_t> buffered_lengths;
-      size_t group_start = 0;
-      while (group_index < group_lengths.size()) {
-        const size_t group_length = group_lengths[group_index];
-        const size_t next_start = group_start + group_length;
-        const size_t webgl_index_length = webgl_meshes[i].indices.size();
-        printf("'%s'", obj.LineToGroup(group_starts[group_index].group_line).c_str());
-        if (group_index != group_lengths.size() - 1 && next_start < webgl_index_length) {
-#ifdef MINI_JS
-          putchar(',');
-#else
-          printf(", ");
-#endif
-        }
-        // TODO: bbox info is better placed at the head of the file,
-        // perhaps transposed. Also, when a group gets split between
-        // batches, the bbox gets stored twice.
-        CompressAABBToUtf8(group_starts[group_index].bounds,
-                           bounds_params, &utf8);
-        offset += 6;
-        if (next_start < webgl_index_length) {
-          buffered_lengths.push_back(group_length);
-          group_start = next_start;
-          ++group_index;
-        } else {
-          const size_t fits = webgl_index_length - group_start;
-          buffered_lengths.push_back(fits);
-          group_start = 0;
-          group_lengths[group_index] -= fits;
-          break;
-        }
-      }
-#ifdef MINI_JS
-      printf("],lengths:[");
-#else
-      printf("],\n        lengths: [");
-#endif
-      for (size_t k = 0; k < buffered_lengths.size(); ++k) {
-        printf(SIZET_FORMAT, buffered_lengths[k]);
-        if (k != buffered_lengths.size() - 1) {
-#ifdef MINI_JS
-          putchar(',');
-#else
-          printf(", ");
-#endif
-        }
+    budget_->Release(reserved_);
+  }
+
+ private:
+  const CompressArgs& args_;
+  const std::string obj_file_;
+  MtlCache* mtl_cache_;
+  AsyncWriter* writer_;
+  Precompressor* precompressor_;
+  MemoryBudget* budget_;
+  const size_t reserved_;
+  BatchResult* result_;
+};
+
+// Converts |files| side by side, as many as fit in the memory budget,
+// into one manifest with theirs in order. Returns false if any failed;
+// the manifest then leaves them out.
+bool ConvertBatch(const CompressArgs& args,
+                  const std::vector<std::string>& files, AsyncWriter* writer,
+                  Precompressor* precompressor, std::string* manifest) {
+  MtlCache mtl_cache;
+  MemoryBudget budget((args.memory_mb ? args.memory_mb
+                                      : kDefaultBatchMemoryMb) << 20);
+  std::vector<BatchResult> results(files.size());
+  {
+    const size_t num_threads = args.precompress.num_threads ?
+        args.precompress.num_threads : NumCpus();
+    ThreadPool pool(num_threads, 1);
+    for (size_t i = 0; i < files.size(); ++i) {
+      const size_t reserved =
+          budget.Acquire(EstimateConvertMemory(FileSize(files[i])));
+      pool.Add(new BatchTask(args, files[i], &mtl_cache, writer,
+                             precompressor, &budget, reserved, &results[i]));
+    }
+    pool.Wait();
+  }
+  size_t num_converted = 0;
+  for (size_t i = 0; i < results.size(); ++i) {
+    if (results[i].ok) {
+      manifest->append(results[i].manifest);
+      ++num_converted;
+    }
+  }
+  fprintf(stderr, "Converted " SIZET_FORMAT " of " SIZET_FORMAT
+          " files, parsing " SIZET_FORMAT " mtllib files for " SIZET_FORMAT
+          " mtllib records\n", num_converted, files.size(),
+          mtl_cache.num_parsed(), mtl_cache.num_loads());
+  return num_converted == files.size();
+}
+
+int main(int argc, const char* argv[]) {
+  CompressArgs args;
+  if (!ParseCompressArgs(argc - 1, argv + 1, &args)) {
+    return Usage(argv[0]);
+  }
+  const ConvertInput& input = args.input;
+  const ConvertOptions& options = args.options;
+  const char* js_file = args.js_file;
+  std::string error;
+  if (!CheckCompressArgs(args, &error)) {
+    fprintf(stderr, "ERROR: %s\n", error.c_str());
+    return -1;
+  }
+  std::vector<std::string> batch_files;
+  if (args.batch) {
+    if (!ListBatchFiles(input.obj_file, &batch_files)) {
+      fprintf(stderr, "ERROR: could not read %s\n", input.obj_file.c_str());
+      return -1;
+    }
+    // Models are named after their files, so those must differ.
+    std::set<std::string> names;
+    for (size_t i = 0; i < batch_files.size(); ++i) {
+      if (!names.insert(StripLeadingDir(batch_files[i].c_str())).second) {
+        fprintf(stderr, "ERROR: more than one %s in the batch\n",
+                StripLeadingDir(batch_files[i].c_str()));
+        return -1;
       }
-#ifdef MINI_JS
-      printf("]}");
-#else
-      printf("]\n      }");
-#endif
-      if (i != webgl_meshes.size() - 1)
-        putchar(',');
-#ifndef MINI_JS
-      putchar('\n');
-#endif
     }
-    fwrite(&utf8[0], 1, utf8.size(), out_fp);
-    fclose(out_fp);
-#ifdef MINI_JS
-    putchar(']');
-#else
-    printf("    ]");
-#endif
-    if (++iter != batches.end())
-      putchar(',');
-#ifndef MINI_JS
-    putchar('\n');
-#endif
   }
-#ifdef MINI_JS
-  printf("}};");
-#else
-  puts("  }\n};");
-#endif
-  return 0;
+  // -append rewrites the manifest in out.js, so it is read first. If
+  // there is none, in.obj is converted in full.
+  if (!input.append_file.empty()) {
+    std::vector<char> data;
+    if (ReadFile(js_file, &data)) {
+      args.input.manifest.assign(data.begin(), data.end());
+    }
+  }
+  Precompressor precompressor(args.precompress);
+  AsyncWriter writer(&precompressor, kMaxPendingWrites);
+  std::string manifest;
+  bool converted = true;
+  if (args.batch) {
+    converted = ConvertBatch(args, batch_files, &writer, &precompressor,
+                             &manifest);
+  } else {
+    FileOutput output(&writer, &precompressor, options.glb_file);
+    if (ConvertObj(input, options, &output, &error) != kConvertOk) {
+      fprintf(stderr, "ERROR: %s\n", error.c_str());
+      return -1;
+    }
+    manifest.swap(*output.mutable_manifest());
+  }
+  // The manifest is written in one go once all of its payloads are, so
+  // out.js is only replaced by a complete one that they all back.
+  if (!writer.Finish()) {
+    return -1;
+  }
+  if (options.num_shards) {
+    // The plan is all there is.
+    return precompressor.Finish() ? 0 : -1;
+  }
+  // A shard's manifest is only part of the model's, which -merge-shards
+  // puts together from where it expects them.
+  std::string shard_js;
+  if (options.shard >= 0) {
+    shard_js = ShardManifestName(options.out_file, options.shard);
+    js_file = shard_js.c_str();
+  }
+  if (js_file ? !WriteFile(js_file, manifest.data(), manifest.size()) :
+      (fwrite(manifest.data(), 1, manifest.size(), stdout) !=
+       manifest.size() || fflush(stdout) != 0)) {
+    fprintf(stderr, "ERROR: could not write %s\n",
+            js_file ? js_file : "the JavaScript");
+    return -1;
+  }
+  if (js_file && shard_js.empty()) {
+    precompressor.AddFile(js_file);
+  }
+  return (precompressor.Finish() && converted) ? 0 : -1;
 }
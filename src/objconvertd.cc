@@ -0,0 +1,716 @@
+#if 0  // A cute trick to making this .cc self-building from shell.
+g++ $0 -O2 -Wall -Werror -pthread -D WITH_ZLIB -o `basename $0 .cc` -lz;
+exit;
+#endif
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You
+// may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied. See the License for the specific language governing
+// permissions and limitations under the License.
+
+// A conversion server on a Unix socket, so that a web front end does
+// not start (and wait on) an objcompress process per upload. Jobs take
+// the same flags as objcompress, run a few at a time in order of
+// priority within a memory budget, and recent results are cached by a
+// hash of their input. See Usage() for the protocol.
+
+#ifdef _WIN32
+
+#include <stdio.h>
+
+int main() {
+  fprintf(stderr, "ERROR: objconvertd needs Unix domain sockets\n");
+  return -1;
+}
+
+#else
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <list>
+#include <map>
+#include <set>
+
+#include "args.h"
+#include "convert.h"
+#include "precompress.h"
+#include "thread.h"
+
+int Usage(const char* argv0) {
+  fprintf(stderr, "Usage: %s [-jobs n] [-j threads] [-memory MB] [-cache MB]\n"
+          "\t\tsocket\n\n"
+          "\tListens on the Unix socket for objcompress jobs, one per connection.\n"
+          "\t-jobs sets how many jobs convert at once (default: 2).\n"
+          "\t-j sets the number of compression threads they share (default: one per CPU).\n"
+          "\t-memory sets the memory budget of the running jobs (default: 1024).\n"
+          "\t-cache sets the size of the cache of recent results (default: 256).\n\n"
+          "\tA job is a line \"dir /abs/path\", optional \"priority n\" (higher\n"
+          "\tgo first) and \"memory MB\" lines, an \"arg a\" line per objcompress\n"
+          "\targument, then an empty line. File names are relative to dir. The\n"
+          "\treplies are \"queued n\" (jobs ahead), \"running\", \"cached\",\n"
+          "\t\"wrote file\" per payload, and finally \"error why\" or \"ok n\",\n"
+          "\tfollowed by the n bytes of JavaScript when -js is not given.\n\n",
+          argv0);
+  return -1;
+}
+
+static const size_t kMegabyte = 1024 * 1024;
+static const size_t kMaxRequestLine = 64 * 1024;
+static const int kRequestTimeoutSeconds = 10;
+
+// Joins |name| to |dir| unless it is absolute.
+static std::string Resolve(const std::string& dir, const std::string& name) {
+  if (!name.empty() && name[0] == '/') {
+    return name;
+  }
+  return dir + "/" + name;
+}
+
+// Milliseconds on a clock that only moves forward.
+static int64 MonotonicMs() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return static_cast<int64>(now.tv_sec) * 1000 + now.tv_nsec / 1000000;
+}
+
+// One client's socket. Once a send fails (the client has gone) the job
+// still runs, so the cache gets its result, but nothing more is sent.
+// The whole request must arrive within kRequestTimeoutSeconds of the
+// connection, however slowly it trickles in.
+class Connection {
+ public:
+  explicit Connection(int fd)
+      : fd_(fd), ok_(true), pos_(0),
+        deadline_ms_(MonotonicMs() + 1000 * kRequestTimeoutSeconds) { }
+
+  ~Connection() {
+    close(fd_);
+  }
+
+  // Reads a line without its newline. Returns false at the end of the
+  // stream, on an error, past the deadline, or if the line is too long.
+  bool ReadLine(std::string* line) {
+    line->clear();
+    for (;;) {
+      if (pos_ == buffer_.size()) {
+        const int64 left_ms = deadline_ms_ - MonotonicMs();
+        if (left_ms <= 0) return false;
+        pollfd readable;
+        readable.fd = fd_;
+        readable.events = POLLIN;
+        readable.revents = 0;
+        const int ready = poll(&readable, 1, static_cast<int>(left_ms));
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready <= 0) return false;
+        char chunk[4096];
+        const ssize_t got = read(fd_, chunk, sizeof(chunk));
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return false;
+        buffer_.assign(chunk, chunk + got);
+        pos_ = 0;
+      }
+      const char ch = buffer_[pos_++];
+      if (ch == '\n') return true;
+      if (line->size() == kMaxRequestLine) return false;
+      line->push_back(ch);
+    }
+  }
+
+  // Sends a line, formatted like printf.
+  void Send(const char* format, ...) {
+    std::string line;
+    va_list args;
+    va_start(args, format);
+    StringAppendV(&line, format, args);
+    va_end(args);
+    line.push_back('\n');
+    SendBytes(line.data(), line.size());
+  }
+
+  void SendBytes(const char* data, size_t size) {
+    while (ok_ && size) {
+      const ssize_t sent = write(fd_, data, size);
+      if (sent < 0 && errno == EINTR) continue;
+      if (sent <= 0) {
+        ok_ = false;
+        break;
+      }
+      data += sent;
+      size -= sent;
+    }
+  }
+
+ private:
+  Connection(const Connection&);
+  void operator=(const Connection&);
+
+  const int fd_;
+  bool ok_;
+  std::string buffer_;
+  size_t pos_;
+  const int64 deadline_ms_;
+};
+
+struct Job {
+  Job() : connection(NULL), priority(0), budget(0), order(0) { }
+
+  Connection* connection;
+  std::string dir;
+  int priority;
+  size_t budget;  // Bytes.
+  size_t order;  // Ties in priority go first come, first served.
+  std::vector<std::string> arg_strings;
+  std::vector<const char*> argv;  // Into arg_strings.
+  CompressArgs args;
+};
+
+// Puts higher priorities, then earlier jobs, at the top of a heap.
+struct JobLess {
+  bool operator()(const Job* a, const Job* b) const {
+    if (a->priority != b->priority) {
+      return a->priority < b->priority;
+    }
+    return a->order > b->order;
+  }
+};
+
+// What ConvertObj made for a job: the same input gives the same result,
+// so it can be written out again for a later one.
+struct Result {
+  size_t size() const {
+    size_t total = manifest.size();
+    for (size_t i = 0; i < payloads.size(); ++i) {
+      total += payloads[i].name.size() + payloads[i].data.size();
+    }
+    return total;
+  }
+
+  std::string manifest;
+  ConvertOutput::PayloadList payloads;
+};
+
+// Least recently used results, up to |capacity| bytes, by the hash of
+// their input. A job that misses claims the hash until it has a result,
+// and others with the same input wait for that instead of converting it
+// again themselves.
+class ResultCache {
+ public:
+  explicit ResultCache(size_t capacity) : capacity_(capacity), size_(0) { }
+
+  // Copies the result for |key| into |result| and returns true if it is
+  // cached. Otherwise claims |key| and returns false, after which the
+  // caller must Insert() or Release() it.
+  bool LookupOrClaim(uint64 key, Result* result) {
+    MutexLock lock(&mutex_);
+    while (claimed_.count(key)) {
+      released_.Wait(&mutex_);
+    }
+    const IndexMap::iterator found = index_.find(key);
+    if (found == index_.end()) {
+      claimed_.insert(key);
+      return false;
+    }
+    entries_.splice(entries_.begin(), entries_, found->second);
+    *result = found->second->second;
+    return true;
+  }
+
+  // Takes the contents of |result| and releases |key|.
+  void Insert(uint64 key, Result* result) {
+    MutexLock lock(&mutex_);
+    const size_t size = result->size();
+    if (size <= capacity_) {
+      entries_.push_front(Entry(key, Result()));
+      entries_.front().second.manifest.swap(result->manifest);
+      entries_.front().second.payloads.swap(result->payloads);
+      index_[key] = entries_.begin();
+      size_ += size;
+      while (size_ > capacity_) {
+        size_ -= entries_.back().second.size();
+        index_.erase(entries_.back().first);
+        entries_.pop_back();
+      }
+    }
+    claimed_.erase(key);
+    released_.Broadcast();
+  }
+
+  // Releases |key| without a result.
+  void Release(uint64 key) {
+    MutexLock lock(&mutex_);
+    claimed_.erase(key);
+    released_.Broadcast();
+  }
+
+ private:
+  typedef std::pair<uint64, Result> Entry;
+  typedef std::list<Entry> EntryList;  // Most recently used first.
+  typedef std::map<uint64, EntryList::iterator> IndexMap;
+
+  const size_t capacity_;
+  size_t size_;
+  EntryList entries_;
+  IndexMap index_;
+  std::set<uint64> claimed_;
+  Mutex mutex_;
+  CondVar released_;
+};
+
+static bool ReadText(const std::string& fn, std::string* text) {
+  std::vector<char> data;
+  if (!ReadFile(fn, &data)) {
+    return false;
+  }
+  text->assign(data.begin(), data.end());
+  return true;
+}
+
+// Reads the OBJ, its frames and the mtllib files it names into
+// |input|'s files, so the parse never goes to disk and the cache key
+// covers all of them.
+static bool ReadInputs(const std::string& dir, ConvertInput* input,
+                       std::string* error) {
+  std::vector<std::string> names(1, input->obj_file);
+  names.insert(names.end(), input->frame_files.begin(),
+               input->frame_files.end());
+  for (size_t i = 0; i < names.size(); ++i) {
+    if (!ReadText(Resolve(dir, names[i]), &input->files[names[i]])) {
+      *error = "could not read " + names[i];
+      return false;
+    }
+  }
+  // Found the way WavefrontObjFile finds them. A missing one is only a
+  // warning there, so it is left out here.
+  const std::string& obj = input->files[input->obj_file];
+  size_t start = 0;
+  while (start < obj.size()) {
+    size_t end = obj.find('\n', start);
+    if (end == std::string::npos) end = obj.size();
+    std::string line(obj, start, end - start);
+    start = end + 1;
+    const char* stripped = StripLeadingWhitespace(line.c_str());
+    if (strncmp(stripped, "mtllib", 6) != 0) continue;
+    std::string name(StripLeadingWhitespace(stripped + 6));
+    name.resize(strcspn(name.c_str(), "#\r\n"));
+    if (!name.empty() && !input->files.count(name)) {
+      std::string mtl;
+      if (ReadText(Resolve(dir, name), &mtl)) {
+        input->files[name].swap(mtl);
+      }
+    }
+  }
+  return true;
+}
+
+// Writes a job's payloads into its directory, queues their compressed
+// copies and reports each to the client.
+class PayloadWriter {
+ public:
+  PayloadWriter(const Job& job, Precompressor* precompressor)
+      : job_(job), precompressor_(precompressor) {
+  }
+
+  // Takes the contents of |data|.
+  bool Write(const std::string& name, std::vector<char>* data) {
+    const std::string fn = Resolve(job_.dir, name);
+    if (!WriteFile(fn, data->empty() ? NULL : &(*data)[0], data->size())) {
+      return false;
+    }
+    // The GLB is compressed, but not bundled with the UTF8 files.
+    if (name == job_.args.options.glb_file) {
+      precompressor_->AddFile(fn);
+    } else {
+      precompressor_->AddBuffer(fn, data);
+    }
+    job_.connection->Send("wrote %s", name.c_str());
+    return true;
+  }
+
+ private:
+  const Job& job_;
+  Precompressor* precompressor_;
+};
+
+// Writes payloads as they are encoded, keeping a copy for the cache.
+class JobOutput : public ConvertOutput {
+ public:
+  explicit JobOutput(PayloadWriter* writer) : writer_(writer) { }
+
+ protected:
+  virtual bool KeepPayload(const std::string& name, std::vector<char>* data) {
+    std::vector<char> copy(*data);
+    return ConvertOutput::KeepPayload(name, &copy) &&
+        writer_->Write(name, data);
+  }
+
+ private:
+  PayloadWriter* writer_;
+};
+
+// Runs jobs on |num_workers| threads, highest priority first. A job
+// only starts once the budgets of the running ones leave room for its
+// own; until then it holds back the jobs behind it, so large ones are
+// not starved by a stream of small ones.
+class JobQueue {
+ public:
+  JobQueue(size_t num_workers, size_t memory, ResultCache* cache,
+           ThreadPool* compress_pool)
+      : memory_(memory),
+        free_memory_(memory),
+        cache_(cache),
+        compress_pool_(compress_pool),
+        num_added_(0) {
+    threads_.resize(num_workers ? num_workers : 1);
+    for (size_t i = 0; i < threads_.size(); ++i) {
+      CHECK(0 == pthread_create(&threads_[i], NULL, &JobQueue::Main, this));
+    }
+  }
+
+  size_t memory() const { return memory_; }
+
+  // Takes ownership of |job|, and tells its client how many jobs are
+  // ahead of it. Its budget must be at most memory().
+  void Add(Job* job) {
+    MutexLock lock(&mutex_);
+    job->order = num_added_++;
+    size_t ahead = 0;
+    for (size_t i = 0; i < pending_.size(); ++i) {
+      if (JobLess()(job, pending_[i])) ++ahead;
+    }
+    job->connection->Send("queued " SIZET_FORMAT, ahead);
+    pending_.push_back(job);
+    std::push_heap(pending_.begin(), pending_.end(), JobLess());
+    changed_.Broadcast();
+  }
+
+ private:
+  JobQueue(const JobQueue&);
+  void operator=(const JobQueue&);
+
+  static void* Main(void* arg) {
+    static_cast<JobQueue*>(arg)->Loop();
+    return NULL;
+  }
+
+  void Loop() {
+    MutexLock lock(&mutex_);
+    for (;;) {
+      while (pending_.empty() || pending_.front()->budget > free_memory_) {
+        changed_.Wait(&mutex_);
+      }
+      std::pop_heap(pending_.begin(), pending_.end(), JobLess());
+      Job* job = pending_.back();
+      pending_.pop_back();
+      const size_t budget = job->budget;
+      free_memory_ -= budget;
+      mutex_.Unlock();
+      Run(job);
+      delete job->connection;
+      delete job;
+      mutex_.Lock();
+      free_memory_ += budget;
+      changed_.Broadcast();
+    }
+  }
+
+  void Run(Job* job) {
+    Connection* connection = job->connection;
+    connection->Send("running");
+    CompressArgs& args = job->args;
+    std::string error;
+    if (!ReadInputs(job->dir, &args.input, &error)) {
+      connection->Send("error %s", error.c_str());
+      return;
+    }
+    // Everything that goes into the result.
+    Fingerprint fingerprint;
+    for (size_t i = 0; i < job->arg_strings.size(); ++i) {
+      fingerprint.Add(job->arg_strings[i]);
+    }
+    for (TextFiles::const_iterator iter = args.input.files.begin();
+         iter != args.input.files.end(); ++iter) {
+      fingerprint.Add(iter->first);
+      fingerprint.Add(iter->second);
+    }
+    const uint64 key = fingerprint.hash();
+
+    // Compressed copies and the bundle go into the job's directory, on
+    // the shared compression threads.
+    const std::string tar_file =
+        args.precompress.tar_file ? Resolve(job->dir, args.precompress.tar_file)
+                                  : "";
+    Precompressor::Options precompress_options = args.precompress;
+    precompress_options.tar_file = tar_file.empty() ? NULL : tar_file.c_str();
+    precompress_options.pool = compress_pool_;
+    Precompressor precompressor(precompress_options);
+    PayloadWriter writer(*job, &precompressor);
+
+    std::string manifest;
+    Result result;
+    if (cache_->LookupOrClaim(key, &result)) {
+      connection->Send("cached");
+      manifest.swap(result.manifest);
+      for (size_t i = 0; i < result.payloads.size(); ++i) {
+        ConvertOutput::Payload& payload = result.payloads[i];
+        if (!writer.Write(payload.name, &payload.data)) {
+          connection->Send("error could not write %s", payload.name.c_str());
+          return;
+        }
+      }
+    } else {
+      JobOutput output(&writer);
+      if (ConvertObj(args.input, args.options, &output, &error) !=
+          kConvertOk) {
+        cache_->Release(key);
+        connection->Send("error %s", error.c_str());
+        return;
+      }
+      manifest = output.manifest();
+      result.manifest = manifest;
+      result.payloads = output.payloads();
+      cache_->Insert(key, &result);
+    }
+
+    if (args.js_file) {
+      const std::string js_file = Resolve(job->dir, args.js_file);
+      if (!WriteFile(js_file, manifest.data(), manifest.size())) {
+        connection->Send("error could not write %s", args.js_file);
+        return;
+      }
+      precompressor.AddFile(js_file);
+    }
+    if (!precompressor.Finish()) {
+      connection->Send("error could not write the compressed copies");
+      return;
+    }
+    if (args.js_file) {
+      connection->Send("ok 0");
+    } else {
+      connection->Send("ok " SIZET_FORMAT, manifest.size());
+      connection->SendBytes(manifest.data(), manifest.size());
+    }
+  }
+
+  const size_t memory_;
+  size_t free_memory_;
+  ResultCache* const cache_;
+  ThreadPool* const compress_pool_;
+  size_t num_added_;
+  std::vector<Job*> pending_;  // A heap, by JobLess.
+  std::vector<pthread_t> threads_;
+  Mutex mutex_;
+  CondVar changed_;
+};
+
+// Reads a job from |connection| and checks it. Returns NULL, having
+// sent the error, if it is no good.
+static Job* ReadJob(Connection* connection, size_t max_budget) {
+  Job* job = new Job;
+  job->connection = connection;
+  std::string line;
+  std::string error;
+  size_t budget_mb = 0;
+  while (error.empty()) {
+    if (!connection->ReadLine(&line)) {
+      error = "incomplete request";
+    } else if (line.empty()) {
+      break;
+    } else if (0 == line.compare(0, 4, "arg ")) {
+      job->arg_strings.push_back(line.substr(4));
+    } else if (0 == line.compare(0, 4, "dir ")) {
+      job->dir = line.substr(4);
+    } else if (0 == line.compare(0, 9, "priority ")) {
+      job->priority = atoi(line.c_str() + 9);
+    } else if (0 == line.compare(0, 7, "memory ")) {
+      budget_mb = strtoul(line.c_str() + 7, NULL, 10);
+    } else {
+      error = "unknown request line: " + line;
+    }
+  }
+  if (error.empty() && (job->dir.empty() || job->dir[0] != '/')) {
+    error = "dir must be an absolute path";
+  }
+  if (error.empty()) {
+    for (size_t i = 0; i < job->arg_strings.size(); ++i) {
+      job->argv.push_back(job->arg_strings[i].c_str());
+    }
+    if (!ParseCompressArgs(static_cast<int>(job->argv.size()),
+                           job->argv.empty() ? NULL : &job->argv[0],
+                           &job->args)) {
+      error = "bad objcompress arguments";
+    } else {
+      CheckCompressArgs(job->args, &error);
+    }
+    if (error.empty() && job->args.batch) {
+      error = "-batch is not for objconvertd jobs";
+    }
+    if (error.empty() && !job->args.input.append_file.empty()) {
+      error = "-append is not for objconvertd jobs";
+    }
+    if (error.empty() && job->args.options.report_memory) {
+      error = "-memstats is not for objconvertd jobs";
+    }
+    if (error.empty() && !job->args.options.spill_dir.empty()) {
+      error = "-spill is not for objconvertd jobs";
+    }
+    if (error.empty() && (job->args.options.num_shards ||
+                          job->args.options.shard >= 0 ||
+                          job->args.options.merge_shards)) {
+      error = "-shards, -shard and -merge-shards are not for objconvertd jobs";
+    }
+  }
+  if (error.empty()) {
+    if (budget_mb) {
+      job->budget = budget_mb * kMegabyte;
+    } else {
+      // Estimated from the size of the OBJ and its frames. The daemon
+      // also holds a copy of them, and of the payloads for the cache.
+      const ConvertInput& input = job->args.input;
+      std::vector<std::string> names(1, input.obj_file);
+      names.insert(names.end(), input.frame_files.begin(),
+                   input.frame_files.end());
+      uint64 input_bytes = 0;
+      struct stat info;
+      for (size_t i = 0; i < names.size(); ++i) {
+        if (stat(Resolve(job->dir, names[i]).c_str(), &info) == 0) {
+          input_bytes += info.st_size;
+        }
+      }
+      job->budget = std::min(EstimateConvertMemory(input_bytes) +
+                             static_cast<size_t>(2 * input_bytes),
+                             max_budget);
+    }
+    if (job->budget > max_budget) {
+      StringAppendF(&error, "needs " SIZET_FORMAT " MB, more than -memory",
+                    job->budget / kMegabyte);
+    }
+  }
+  if (!error.empty()) {
+    connection->Send("error %s", error.c_str());
+    delete job;
+    return NULL;
+  }
+  return job;
+}
+
+// Reads one request, then queues its job or drops the connection.
+struct RequestReader {
+  RequestReader(Connection* connection, JobQueue* queue)
+      : connection(connection), queue(queue) { }
+
+  static void* Main(void* arg) {
+    RequestReader* reader = static_cast<RequestReader*>(arg);
+    Job* job = ReadJob(reader->connection, reader->queue->memory());
+    if (job) {
+      reader->queue->Add(job);
+    } else {
+      delete reader->connection;
+    }
+    delete reader;
+    return NULL;
+  }
+
+  Connection* connection;
+  JobQueue* queue;
+};
+
+int main(int argc, const char* argv[]) {
+  size_t num_jobs = 2;
+  size_t num_threads = 0;
+  size_t memory_mb = 1024;
+  size_t cache_mb = 256;
+  int argi = 1;
+  for (; argi < argc && argv[argi][0] == '-'; ++argi) {
+    if (argi + 1 == argc) {
+      return Usage(argv[0]);
+    }
+    const long value = atol(argv[argi + 1]);
+    if (0 == strcmp(argv[argi], "-jobs") && value > 0) {
+      num_jobs = value;
+    } else if (0 == strcmp(argv[argi], "-j") && value > 0) {
+      num_threads = value;
+    } else if (0 == strcmp(argv[argi], "-memory") && value > 0) {
+      memory_mb = value;
+    } else if (0 == strcmp(argv[argi], "-cache") && value >= 0) {
+      cache_mb = value;
+    } else {
+      return Usage(argv[0]);
+    }
+    ++argi;
+  }
+  if (argc - argi != 1) {
+    return Usage(argv[0]);
+  }
+  const char* socket_path = argv[argi];
+
+  sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "ERROR: socket path too long: %s\n", socket_path);
+    return -1;
+  }
+  strcpy(address.sun_path, socket_path);
+  const int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(socket_path);  // Left by an earlier run.
+  if (listener < 0 ||
+      bind(listener, reinterpret_cast<sockaddr*>(&address),
+           sizeof(address)) != 0 ||
+      listen(listener, SOMAXCONN) != 0) {
+    fprintf(stderr, "ERROR: could not listen on %s: %s\n", socket_path,
+            strerror(errno));
+    return -1;
+  }
+  // Jobs name their directory, and a client that goes away must not
+  // take the daemon with it.
+  if (chdir("/") != 0) {
+    fprintf(stderr, "ERROR: could not change to /\n");
+    return -1;
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  const size_t compress_threads = num_threads ? num_threads : NumCpus();
+  ThreadPool compress_pool(compress_threads, 2 * compress_threads);
+  ResultCache cache(cache_mb * kMegabyte);
+  JobQueue queue(num_jobs, memory_mb * kMegabyte, &cache, &compress_pool);
+  fprintf(stderr, "Listening on %s\n", socket_path);
+  for (;;) {
+    const int fd = accept(listener, NULL, NULL);
+    if (fd < 0) {
+      if (errno != EINTR) {
+        fprintf(stderr, "WARNING: accept failed: %s\n", strerror(errno));
+      }
+      continue;
+    }
+    // A client that is slow to send its request must not hold up the
+    // others, so each request is read on a thread of its own.
+    RequestReader* reader = new RequestReader(new Connection(fd), &queue);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, &RequestReader::Main, reader) != 0) {
+      fprintf(stderr, "WARNING: could not start a thread for a request\n");
+      reader->connection->Send("error the server is out of threads");
+      delete reader->connection;
+      delete reader;
+      continue;
+    }
+    pthread_detach(thread);
+  }
+}
+
+#endif  // _WIN32
@@ -0,0 +1,116 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You
+// may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied. See the License for the specific language governing
+// permissions and limitations under the License.
+
+#ifndef WEBGL_LOADER_OBJECTS_H_
+#define WEBGL_LOADER_OBJECTS_H_
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "base.h"
+#include "mesh.h"
+
+// The faces, lines and points of one object (o record), batched by
+// material like the whole model, and the bounds of their vertices.
+struct Object {
+  std::string name;
+  Bounds bounds;
+  MaterialBatches batches[3];  // by PrimitiveMode.
+};
+
+typedef std::vector<Object> ObjectList;
+
+// Splits the batches of each kind of primitive by the object their
+// groups are in. Objects are listed in the order they first appear in
+// the file; faces before any o record are in "default".
+static inline void SplitObjects(const WavefrontObjFile& obj,
+                                const MaterialBatches& triangles,
+                                const MaterialBatches& lines,
+                                const MaterialBatches& points,
+                                ObjectList* objects) {
+  const MaterialBatches* sources[] = { &triangles, &lines, &points };
+  // First find the objects and their order.
+  std::map<std::string, unsigned int> first_lines;
+  for (size_t i = 0; i < 3; ++i) {
+    for (MaterialBatches::const_iterator iter = sources[i]->begin();
+         iter != sources[i]->end(); ++iter) {
+      const std::vector<GroupStart>& group_starts =
+          iter->second.group_starts();
+      for (size_t j = 0; j < group_starts.size(); ++j) {
+        const unsigned int group_line = group_starts[j].group_line;
+        const std::pair<std::map<std::string, unsigned int>::iterator, bool>
+            inserted = first_lines.insert(
+                std::make_pair(obj.LineToObject(group_line), group_line));
+        if (!inserted.second) {
+          inserted.first->second =
+              std::min(inserted.first->second, group_line);
+        }
+      }
+    }
+  }
+  std::vector<std::pair<unsigned int, std::string> > order;
+  for (std::map<std::string, unsigned int>::const_iterator iter =
+           first_lines.begin(); iter != first_lines.end(); ++iter) {
+    order.push_back(std::make_pair(iter->second, iter->first));
+  }
+  std::sort(order.begin(), order.end());
+  std::map<std::string, size_t> object_indices;
+  objects->resize(order.size());
+  for (size_t i = 0; i < order.size(); ++i) {
+    (*objects)[i].name = order[i].second;
+    object_indices[order[i].second] = i;
+  }
+
+  // Then move every group's primitives into its object.
+  for (size_t i = 0; i < 3; ++i) {
+    for (MaterialBatches::const_iterator iter = sources[i]->begin();
+         iter != sources[i]->end(); ++iter) {
+      const DrawBatch& batch = iter->second;
+      const std::vector<GroupStart>& group_starts = batch.group_starts();
+      const size_t num_indices = batch.draw_mesh().indices.size();
+      const size_t primitive_size = PrimitiveSize(batch.mode());
+      for (size_t j = 0; j < group_starts.size(); ++j) {
+        const GroupStart& group = group_starts[j];
+        const size_t end = (j + 1 < group_starts.size()) ?
+            group_starts[j + 1].offset : num_indices;
+        Object& object = (*objects)[
+            object_indices[obj.LineToObject(group.group_line)]];
+        DrawBatch& out = object.batches[batch.mode()][iter->first];
+        for (size_t offset = group.offset; offset < end;
+             offset += primitive_size) {
+          out.AddPrimitiveFrom(batch, offset, group.group_line);
+        }
+      }
+    }
+  }
+
+  // Group bounds only cover the vertices each group added first, so
+  // the objects' bounds come from their vertices.
+  for (size_t i = 0; i < objects->size(); ++i) {
+    Object& object = (*objects)[i];
+    object.bounds.Clear();
+    for (size_t j = 0; j < 3; ++j) {
+      for (MaterialBatches::const_iterator iter = object.batches[j].begin();
+           iter != object.batches[j].end(); ++iter) {
+        object.bounds.Enclose(iter->second.draw_mesh().attribs,
+                              iter->second.layout());
+      }
+    }
+  }
+}
+
+#endif  // WEBGL_LOADER_OBJECTS_H_
@@ -19,6 +19,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
+
 #include "base.h"
 
 // TODO: since most vertices are part of 6 faces, you can optimize
@@ -35,9 +37,12 @@ class VertexOptimizer {
     // float score;
   };
 
-  VertexOptimizer(const QuantizedAttribList& attribs)
+  // |stride| is the number of quantized words per vertex.
+  explicit VertexOptimizer(const QuantizedAttribList& attribs,
+                           size_t stride = 8)
       : attribs_(attribs),
-        per_vertex_(attribs_.size() / 8),
+        stride_(stride),
+        per_vertex_(attribs_.size() / stride),
         next_unused_index_(0)
   {
     // The cache has an extra slot allocated to simplify the logic in
@@ -103,8 +108,8 @@ class VertexOptimizer {
         // next_unused_index_ counter, but we must also copy the
         // corresponding attributes.  TODO: do quantization here?
         per_vertex_[index].output_index = next_unused_index_;
-        for (size_t j = 0; j < 8; ++j) {
-          mesh->attribs.push_back(attribs_[8*index + j]);
+        for (size_t j = 0; j < stride_; ++j) {
+          mesh->attribs.push_back(attribs_[stride_*index + j]);
         }
         mesh->indices.push_back(next_unused_index_++);
       }
@@ -265,9 +270,69 @@ class VertexOptimizer {
   }
 
   const QuantizedAttribList& attribs_;
+  const size_t stride_;
   std::vector<VertexData> per_vertex_;
   int cache_[kCacheSize + 1];
   uint16 next_unused_index_;
 };
 
+// Lines and points have no vertex cache to optimize for, so their
+// primitives keep the file's order and their vertices are only
+// renumbered in order of first use, which keeps the index high water
+// mark moving by one at a time. Meshes are split like VertexOptimizer's.
+class FirstUseOrderer {
+ public:
+  // |primitive_size| is the number of indices per primitive.
+  FirstUseOrderer(const QuantizedAttribList& attribs, size_t stride,
+                  size_t primitive_size)
+      : attribs_(attribs),
+        stride_(stride),
+        primitive_size_(primitive_size),
+        output_indices_(attribs.size() / stride),
+        next_unused_index_(0) {
+  }
+
+  void AddPrimitives(const int* indices, size_t length,
+                     WebGLMeshList* meshes) {
+    // Like VertexOptimizer, each call starts its vertices afresh.
+    std::fill(output_indices_.begin(), output_indices_.end(),
+              kMaxOutputIndex);
+    if (meshes->empty()) {
+      meshes->push_back(WebGLMesh());
+    }
+    WebGLMesh* mesh = &meshes->back();
+    for (size_t i = 0; i < length; i += primitive_size_) {
+      for (size_t j = 0; j < primitive_size_; ++j) {
+        const int index = indices[i + j];
+        uint16& output_index = output_indices_[index];
+        if (output_index == kMaxOutputIndex) {
+          output_index = next_unused_index_++;
+          mesh->attribs.insert(mesh->attribs.end(),
+                               &attribs_[stride_*index],
+                               &attribs_[stride_*index] + stride_);
+        }
+        mesh->indices.push_back(output_index);
+      }
+      // Check if there is room for another primitive.
+      if (next_unused_index_ > kMaxOutputIndex - primitive_size_) {
+        next_unused_index_ = 0;
+        meshes->push_back(WebGLMesh());
+        mesh = &meshes->back();
+        std::fill(output_indices_.begin(), output_indices_.end(),
+                  kMaxOutputIndex);
+      }
+    }
+  }
+
+ private:
+  // An enum, since std::fill takes it by reference.
+  enum { kMaxOutputIndex = 0xD800 };
+
+  const QuantizedAttribList& attribs_;
+  const size_t stride_;
+  const size_t primitive_size_;
+  std::vector<uint16> output_indices_;
+  uint16 next_unused_index_;
+};
+
 #endif  // WEBGL_LOADER_OPTIMIZE_H_
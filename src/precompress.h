@@ -0,0 +1,521 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You
+// may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied. See the License for the specific language governing
+// permissions and limitations under the License.
+
+#ifndef WEBGL_LOADER_PRECOMPRESS_H_
+#define WEBGL_LOADER_PRECOMPRESS_H_
+
+// Writes precompressed copies of the outputs (.gz, .br) and a tar
+// bundle of the payloads on worker threads, while the main thread keeps
+// encoding. The compressors are optional dependencies: build with
+// -D WITH_ZLIB -lz and/or -D WITH_BROTLI -lbrotlienc.
+
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <string>
+#include <vector>
+
+#ifdef WITH_ZLIB
+# include <zlib.h>
+#endif
+#ifdef WITH_BROTLI
+# include <brotli/encode.h>
+#endif
+#ifdef _WIN32
+# include <io.h>
+# include <process.h>
+#endif
+
+#include "base.h"
+#include "thread.h"
+
+static inline bool GzipAvailable() {
+#ifdef WITH_ZLIB
+  return true;
+#else
+  return false;
+#endif
+}
+
+static inline bool BrotliAvailable() {
+#ifdef WITH_BROTLI
+  return true;
+#else
+  return false;
+#endif
+}
+
+// Compresses |size| bytes at |data| into a single gzip member, like
+// gzip -9. Several members may simply be concatenated.
+static inline bool GzipCompress(const char* data, size_t size,
+                                std::vector<char>* out) {
+#ifdef WITH_ZLIB
+  z_stream strm;
+  memset(&strm, 0, sizeof(strm));
+  const int kGzipWindowBits = 15 + 16;
+  if (deflateInit2(&strm, Z_BEST_COMPRESSION, Z_DEFLATED, kGzipWindowBits,
+                   9, Z_DEFAULT_STRATEGY) != Z_OK) {
+    return false;
+  }
+  const size_t kMaxChunk = 1 << 30;  // avail_in is only a uInt.
+  out->resize(deflateBound(&strm, size < kMaxChunk ? size : kMaxChunk) + 64);
+  size_t written = 0;
+  int ret = Z_OK;
+  while (ret != Z_STREAM_END) {
+    if (strm.avail_in == 0) {
+      const size_t chunk = (size < kMaxChunk) ? size : kMaxChunk;
+      strm.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+      strm.avail_in = static_cast<uInt>(chunk);
+      data += chunk;
+      size -= chunk;
+    }
+    if (written == out->size()) {
+      out->resize(2 * out->size());
+    }
+    const size_t avail = out->size() - written;
+    strm.next_out = reinterpret_cast<Bytef*>(&(*out)[written]);
+    strm.avail_out = static_cast<uInt>(avail < kMaxChunk ? avail : kMaxChunk);
+    const uInt before = strm.avail_out;
+    ret = deflate(&strm, size ? Z_NO_FLUSH : Z_FINISH);
+    written += before - strm.avail_out;
+    if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+      deflateEnd(&strm);
+      return false;
+    }
+  }
+  deflateEnd(&strm);
+  out->resize(written);
+  return true;
+#else
+  return false;
+#endif
+}
+
+static inline bool BrotliCompress(const char* data, size_t size,
+                                  std::vector<char>* out) {
+#ifdef WITH_BROTLI
+  // Quality 11 is several times slower for a few percent on this kind
+  // of data.
+  const int kBrotliQuality = 9;
+  size_t out_size = BrotliEncoderMaxCompressedSize(size);
+  out->resize(out_size ? out_size : size + 1024);
+  out_size = out->size();
+  if (!BrotliEncoderCompress(kBrotliQuality, BROTLI_DEFAULT_WINDOW,
+                             BROTLI_MODE_GENERIC, size,
+                             reinterpret_cast<const uint8_t*>(data),
+                             &out_size,
+                             reinterpret_cast<uint8_t*>(&(*out)[0]))) {
+    return false;
+  }
+  out->resize(out_size);
+  return true;
+#else
+  return false;
+#endif
+}
+
+// A name next to |fn| to write it under before renaming it into place,
+// which differs between threads and between processes writing the same
+// file.
+static inline std::string TempFileName(const std::string& fn) {
+  static Mutex mutex;
+  static unsigned int count = 0;
+#ifdef _WIN32
+  const unsigned int pid = static_cast<unsigned int>(_getpid());
+#else
+  const unsigned int pid = static_cast<unsigned int>(getpid());
+#endif
+  char suffix[48];
+  {
+    MutexLock lock(&mutex);
+    snprintf(suffix, sizeof(suffix), ".tmp%u.%u", pid, count++);
+  }
+  return fn + suffix;
+}
+
+// Forces what has been written to |fp| out to the disk, so that a rename
+// over an existing file cannot leave it empty after a crash.
+static inline bool SyncFile(FILE* fp) {
+  if (fflush(fp) != 0) {
+    return false;
+  }
+#ifdef _WIN32
+  return _commit(_fileno(fp)) == 0;
+#else
+  return fsync(fileno(fp)) == 0;
+#endif
+}
+
+static inline bool RenameFile(const std::string& from, const std::string& to) {
+#ifdef _WIN32
+  return MoveFileExA(from.c_str(), to.c_str(),
+                     MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+  return rename(from.c_str(), to.c_str()) == 0;
+#endif
+}
+
+// Writes |size| bytes at |data| to |fn| in one unbuffered write under a
+// temporary name, syncs it, then renames that into place, so that readers
+// only ever see all of |fn| or its old contents.
+static inline bool WriteFile(const std::string& fn, const char* data,
+                             size_t size) {
+  const std::string temp = TempFileName(fn);
+  FILE* fp = fopen(temp.c_str(), "wb");
+  if (!fp) {
+    return false;
+  }
+  setvbuf(fp, NULL, _IONBF, 0);
+  const bool wrote = fwrite(data, 1, size, fp) == size && SyncFile(fp);
+  if (fclose(fp) != 0 || !wrote || !RenameFile(temp, fn)) {
+    remove(temp.c_str());
+    return false;
+  }
+  return true;
+}
+
+static inline bool ReadFile(const std::string& fn, std::vector<char>* out) {
+  FILE* fp = fopen(fn.c_str(), "rb");
+  if (!fp) {
+    return false;
+  }
+  out->clear();
+  char buffer[1 << 16];
+  size_t got;
+  while ((got = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+    out->insert(out->end(), buffer, buffer + got);
+  }
+  const bool failed = ferror(fp) != 0;
+  fclose(fp);
+  return !failed;
+}
+
+static const size_t kTarBlockSize = 512;
+
+static inline size_t TarPadding(size_t size) {
+  return (kTarBlockSize - size % kTarBlockSize) % kTarBlockSize;
+}
+
+// Numeric fields are octal, or base-256 when they do not fit (GNU).
+static inline void TarNumber(unsigned long long value, size_t width,
+                             char* field) {
+  const unsigned long long kOctalLimit = 1ULL << (3 * (width - 1));
+  if (value < kOctalLimit) {
+    for (size_t i = width - 1; i > 0; --i) {
+      field[i - 1] = '0' + (value & 7);
+      value >>= 3;
+    }
+    field[width - 1] = '\0';
+  } else {
+    for (size_t i = width; i > 1; --i) {
+      field[i - 1] = static_cast<char>(value & 0xFF);
+      value >>= 8;
+    }
+    field[0] = static_cast<char>(0x80);
+  }
+}
+
+static inline void AppendTarHeaderBlock(const std::string& name,
+                                        unsigned long long size,
+                                        char typeflag,
+                                        std::vector<char>* out) {
+  char header[kTarBlockSize];
+  memset(header, 0, sizeof(header));
+  memcpy(header, name.data(), name.size() < 100 ? name.size() : 100);
+  TarNumber(0644, 8, header + 100);     // mode
+  TarNumber(0, 8, header + 108);        // uid
+  TarNumber(0, 8, header + 116);        // gid
+  TarNumber(size, 12, header + 124);
+  TarNumber(time(NULL), 12, header + 136);
+  memset(header + 148, ' ', 8);         // chksum, while summing.
+  header[156] = typeflag;
+  memcpy(header + 257, "ustar", 6);
+  memcpy(header + 263, "00", 2);
+  unsigned int checksum = 0;
+  for (size_t i = 0; i < kTarBlockSize; ++i) {
+    checksum += static_cast<unsigned char>(header[i]);
+  }
+  TarNumber(checksum, 7, header + 148);
+  out->insert(out->end(), header, header + kTarBlockSize);
+}
+
+// Appends the header block(s) for a regular file. Names that do not fit
+// the 100 character field get a pax extended header.
+static inline void AppendTarHeader(const std::string& name,
+                                   unsigned long long size,
+                                   std::vector<char>* out) {
+  if (name.size() >= 100) {
+    const std::string kPath = " path=";
+    std::string record;
+    size_t length = kPath.size() + name.size() + 1;
+    for (;;) {
+      char digits[32];
+      sprintf(digits, SIZET_FORMAT, length);
+      const size_t total = strlen(digits) + kPath.size() + name.size() + 1;
+      if (total == length) {
+        record = digits + kPath + name + "\n";
+        break;
+      }
+      length = total;
+    }
+    AppendTarHeaderBlock("././@PaxHeader", record.size(), 'x', out);
+    out->insert(out->end(), record.begin(), record.end());
+    out->insert(out->end(), TarPadding(record.size()), '\0');
+  }
+  AppendTarHeaderBlock(name, size, '0', out);
+}
+
+class Precompressor {
+ public:
+  struct Options {
+    Options()
+        : gzip(false), brotli(false), tar_file(NULL), num_threads(0),
+          pool(NULL) {
+    }
+
+    bool gzip;
+    bool brotli;
+    const char* tar_file;  // Bundle of the payloads, NULL for none.
+    size_t num_threads;  // 0 for one per CPU.
+    // Workers shared with other Precompressors, used instead of
+    // num_threads of its own. Must outlive the Precompressor.
+    ThreadPool* pool;
+  };
+
+  explicit Precompressor(const Options& options)
+      : options_(options),
+        own_pool_(options.pool ? NULL :
+                  new ThreadPool(NumThreads(options), 2 * NumThreads(options))),
+        pool_(options.pool ? options.pool : own_pool_),
+        pending_(0),
+        tar_fp_(NULL),
+        tar_gz_fp_(NULL),
+        failed_(false) {
+    if (options_.tar_file) {
+      tar_fp_ = OpenOrFail(options_.tar_file);
+      if (options_.gzip) {
+        tar_gz_fp_ = OpenOrFail(std::string(options_.tar_file) + ".gz");
+      }
+    }
+  }
+
+  ~Precompressor() {
+    Finish();
+    delete own_pool_;
+  }
+
+  bool enabled() const {
+    return options_.gzip || options_.brotli || options_.tar_file;
+  }
+
+  // Queues compressed copies of |data|, which has just been written to
+  // |fn|, and adds it to the bundle. Takes the contents of |data|,
+  // leaving it empty.
+  void AddBuffer(const std::string& fn, std::vector<char>* data) {
+    if (!enabled()) return;
+    CompressTask* task = new CompressTask(this, fn, false, true);
+    task->data.swap(*data);
+    Queue(task);
+  }
+
+  // Queues compressed copies of the finished file |fn|, for outputs
+  // that are not kept in memory, and adds it to the bundle if |bundle|.
+  void AddFile(const std::string& fn, bool bundle = false) {
+    if (!options_.gzip && !options_.brotli && !(bundle && options_.tar_file)) {
+      return;
+    }
+    Queue(new CompressTask(this, fn, true, bundle));
+  }
+
+  // Waits for all queued work and completes the bundle. Returns false if
+  // anything could not be written.
+  bool Finish() {
+    MutexLock lock(&mutex_);
+    while (pending_) {
+      done_.Wait(&mutex_);
+    }
+    if (tar_fp_ || tar_gz_fp_) {
+      // The end of an archive is marked by two zero blocks.
+      const std::vector<char> trailer(2 * kTarBlockSize, '\0');
+      WriteToBundleLocked(trailer);
+      CloseOrFail(&tar_fp_, options_.tar_file);
+      if (tar_gz_fp_) {
+        CloseOrFail(&tar_gz_fp_, std::string(options_.tar_file) + ".gz");
+      }
+    }
+    return !failed_;
+  }
+
+ private:
+  class CompressTask : public ThreadPool::Task {
+   public:
+    CompressTask(Precompressor* owner, const std::string& fn, bool read,
+                 bool bundle)
+        : owner_(owner), fn_(fn), read_(read), bundle_(bundle) { }
+
+    virtual void Run() {
+      Compress();
+      owner_->TaskDone();
+    }
+
+    std::vector<char> data;
+
+   private:
+    void Compress() {
+      if (read_ && !ReadFile(fn_, &data)) {
+        owner_->Fail("could not read", fn_);
+        return;
+      }
+      std::vector<char> compressed;
+      std::vector<char> gzipped;
+      if (owner_->options_.gzip) {
+        if (!GzipCompress(Data(), data.size(), &gzipped) ||
+            !WriteFile(fn_ + ".gz", Data(gzipped), gzipped.size())) {
+          owner_->Fail("could not write", fn_ + ".gz");
+        }
+      }
+      if (owner_->options_.brotli) {
+        if (!BrotliCompress(Data(), data.size(), &compressed) ||
+            !WriteFile(fn_ + ".br", Data(compressed), compressed.size())) {
+          owner_->Fail("could not write", fn_ + ".br");
+        }
+      }
+      if (bundle_) {
+        owner_->AppendToBundle(StripLeadingDir(fn_.c_str()), data, gzipped);
+      }
+    }
+
+    const char* Data() const { return Data(data); }
+    static const char* Data(const std::vector<char>& v) {
+      return v.empty() ? "" : &v[0];
+    }
+
+    Precompressor* const owner_;
+    const std::string fn_;
+    const bool read_;
+    const bool bundle_;
+  };
+
+  static size_t NumThreads(const Options& options) {
+    return options.num_threads ? options.num_threads : NumCpus();
+  }
+
+  // A shared pool may be running other Precompressors' tasks too, so
+  // Finish() waits on its own count rather than for the pool to idle.
+  void Queue(CompressTask* task) {
+    {
+      MutexLock lock(&mutex_);
+      ++pending_;
+    }
+    pool_->Add(task);
+  }
+
+  void TaskDone() {
+    MutexLock lock(&mutex_);
+    if (--pending_ == 0) {
+      done_.Broadcast();
+    }
+  }
+
+  FILE* OpenOrFail(const std::string& fn) {
+    FILE* fp = fopen(fn.c_str(), "wb");
+    if (!fp) {
+      Fail("could not write", fn);
+    }
+    return fp;
+  }
+
+  void CloseOrFail(FILE** fp, const std::string& fn) {
+    if (*fp && fclose(*fp) != 0) {
+      failed_ = true;
+      fprintf(stderr, "ERROR: could not write %s\n", fn.c_str());
+    }
+    *fp = NULL;
+  }
+
+  void Fail(const char* why, const std::string& fn) {
+    MutexLock lock(&mutex_);
+    failed_ = true;
+    fprintf(stderr, "ERROR: %s %s\n", why, fn.c_str());
+  }
+
+  void AppendToBundle(const std::string& name, const std::vector<char>& data,
+                      const std::vector<char>& gzipped) {
+    if (!tar_fp_ && !tar_gz_fp_) return;
+    std::vector<char> header;
+    AppendTarHeader(name, data.size(), &header);
+    MutexLock lock(&mutex_);
+    AppendToBundleLocked(header, data, &gzipped);
+  }
+
+  // The .tar.gz is a sequence of gzip members: the compressed header,
+  // the payload's own .gz and the compressed padding, so each payload
+  // is only ever compressed once.
+  void AppendToBundleLocked(const std::vector<char>& header,
+                            const std::vector<char>& data,
+                            const std::vector<char>* gzipped) {
+    WriteToBundleLocked(header);
+    if (!data.empty()) {
+      WriteOrFailLocked(&tar_fp_, options_.tar_file, data);
+    }
+    if (gzipped && !gzipped->empty()) {
+      WriteOrFailLocked(&tar_gz_fp_, std::string(options_.tar_file) + ".gz",
+                        *gzipped);
+    }
+    const std::vector<char> padding(TarPadding(data.size()), '\0');
+    WriteToBundleLocked(padding);
+  }
+
+  // Writes |bytes| to the tar, and as a gzip member to the .tar.gz.
+  void WriteToBundleLocked(const std::vector<char>& bytes) {
+    if (bytes.empty()) return;
+    WriteOrFailLocked(&tar_fp_, options_.tar_file, bytes);
+    if (tar_gz_fp_) {
+      std::vector<char> member;
+      if (!GzipCompress(&bytes[0], bytes.size(), &member)) {
+        member.clear();
+      }
+      WriteOrFailLocked(&tar_gz_fp_, std::string(options_.tar_file) + ".gz",
+                        member);
+    }
+  }
+
+  // Appends |bytes| to the bundle |*fp|. A short write is reported, and
+  // the bundle closed, since what follows would land in the wrong place.
+  void WriteOrFailLocked(FILE** fp, const std::string& fn,
+                         const std::vector<char>& bytes) {
+    if (!*fp) return;
+    if (bytes.empty() ||
+        fwrite(&bytes[0], 1, bytes.size(), *fp) != bytes.size()) {
+      failed_ = true;
+      fprintf(stderr, "ERROR: could not write %s\n", fn.c_str());
+      fclose(*fp);
+      *fp = NULL;
+    }
+  }
+
+  const Options options_;
+  ThreadPool* const own_pool_;
+  ThreadPool* const pool_;
+  Mutex mutex_;  // Guards the bundle, pending_ and failed_.
+  CondVar done_;
+  size_t pending_;
+  FILE* tar_fp_;
+  FILE* tar_gz_fp_;
+  bool failed_;
+};
+
+#endif  // WEBGL_LOADER_PRECOMPRESS_H_
@@ -0,0 +1,407 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You
+// may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied. See the License for the specific language governing
+// permissions and limitations under the License.
+
+#ifndef WEBGL_LOADER_SHARD_H_
+#define WEBGL_LOADER_SHARD_H_
+
+// Sharded conversion, for OBJ files too big to convert on one machine.
+// -shards n plans the shards: one parse of the file writes out its
+// attributes, fixes the decodeParams of the whole model and cuts the
+// file at line starts into n byte ranges of about as many primitives
+// each, recording where the parse stood at each cut. Each -shard i then
+// parses just its range, taking up from there, and writes its payloads
+// and a partial manifest. -merge-shards combines those into the model's
+// manifest. The steps share nothing but files named after out.utf8, so
+// the shards can run as processes on any machines that see them.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "base.h"
+#include "mesh.h"
+#include "spill.h"
+
+// The plan -shards writes, and the attribute files next to it.
+static inline std::string ShardPlanName(const std::string& out_file) {
+  return out_file + ".shards";
+}
+
+static inline std::string ShardAttribName(const std::string& out_file,
+                                          const char* attrib) {
+  return ShardPlanName(out_file) + "." + attrib;
+}
+
+// The partial manifest of shard |shard|.
+static inline std::string ShardManifestName(const std::string& out_file,
+                                            size_t shard) {
+  char suffix[32];
+  snprintf(suffix, sizeof(suffix), ".shard" SIZET_FORMAT ".js", shard);
+  return out_file + suffix;
+}
+
+static const char* const kShardAttribs[] = {
+  "positions", "texcoords", "normals", "colors"
+};
+static const size_t kShardAttribDims[] = { 3, 2, 3, 3 };
+
+// The first line of the plan.
+static const char kShardPlanHeader[] = "objcompress shards 1";
+
+// Removes the attribute files once every shard is done with them.
+static inline void RemoveShardAttribs(const std::string& out_file) {
+  for (size_t i = 0; i < 4; ++i) {
+    remove(ShardAttribName(out_file, kShardAttribs[i]).c_str());
+  }
+}
+
+// Where each shard starts, and what they all share.
+struct ShardPlan {
+  ShardPlan() : colors(false) {
+    bounds.Clear();
+    for (size_t i = 0; i < 4; ++i) {
+      num_attribs[i] = 0;
+    }
+  }
+
+  // The decodeParams of every shard, for positions within |bounds|.
+  BoundsParams DecodeParams(const QuantizationBits& bits,
+                            bool oct_normals) const {
+    BoundsParams bounds_params = BoundsParams::FromBounds(bounds, bits);
+    bounds_params.octNormals = oct_normals;
+    bounds_params.colors = colors;
+    return bounds_params;
+  }
+
+  // Where shard |shard| ends.
+  uint64 End(size_t shard) const {
+    return (shard + 1 < starts.size()) ? starts[shard + 1].offset
+                                       : TextSource::kNoEnd;
+  }
+
+  void Serialize(std::string* text) const {
+    text->assign(kShardPlanHeader);
+    text->push_back('\n');
+    StringAppendF(text, "bounds %.9g %.9g %.9g %.9g %.9g %.9g %d\n",
+                  bounds.mins[0], bounds.mins[1], bounds.mins[2],
+                  bounds.maxes[0], bounds.maxes[1], bounds.maxes[2],
+                  colors ? 1 : 0);
+    StringAppendF(text, "attribs " SIZET_FORMAT " " SIZET_FORMAT " "
+                  SIZET_FORMAT " " SIZET_FORMAT "\n", num_attribs[0],
+                  num_attribs[1], num_attribs[2], num_attribs[3]);
+    for (size_t i = 0; i < starts.size(); ++i) {
+      const ObjParseState& state = starts[i];
+      StringAppendF(text, "shard %llu %u " SIZET_FORMAT " " SIZET_FORMAT
+                    " " SIZET_FORMAT " %d %u " SIZET_FORMAT "\n",
+                    static_cast<unsigned long long>(state.offset),
+                    state.line_num, state.num_positions,
+                    state.num_texcoords, state.num_normals,
+                    state.has_colors ? 1 : 0, state.group_line,
+                    state.group_names.size());
+      StringAppendF(text, "mtllib %s\nusemtl %s\nobject %s\n",
+                    state.mtllib.c_str(), state.material.c_str(),
+                    state.object.c_str());
+      for (size_t k = 0; k < state.group_names.size(); ++k) {
+        StringAppendF(text, "group %s\n", state.group_names[k].c_str());
+      }
+    }
+    for (std::map<std::string, int>::const_iterator iter =
+             group_counts.begin(); iter != group_counts.end(); ++iter) {
+      StringAppendF(text, "count %d %s\n", iter->second,
+                    iter->first.c_str());
+    }
+  }
+
+  // Reads what Serialize() wrote. Returns false if it is malformed or
+  // from another version.
+  bool Parse(const std::string& text) {
+    size_t pos = 0;
+    std::string line;
+    int has_colors = 0;
+    if (!NextLine(text, &pos, &line) || line != kShardPlanHeader ||
+        !NextLine(text, &pos, &line) ||
+        7 != sscanf(line.c_str(), "bounds %f %f %f %f %f %f %d",
+                    &bounds.mins[0], &bounds.mins[1], &bounds.mins[2],
+                    &bounds.maxes[0], &bounds.maxes[1], &bounds.maxes[2],
+                    &has_colors) ||
+        !NextLine(text, &pos, &line) ||
+        4 != sscanf(line.c_str(), "attribs " SIZET_FORMAT " " SIZET_FORMAT
+                    " " SIZET_FORMAT " " SIZET_FORMAT, &num_attribs[0],
+                    &num_attribs[1], &num_attribs[2], &num_attribs[3])) {
+      return false;
+    }
+    colors = has_colors != 0;
+    starts.clear();
+    group_counts.clear();
+    while (NextLine(text, &pos, &line)) {
+      if (0 == line.compare(0, 6, "shard ")) {
+        starts.push_back(ObjParseState());
+        ObjParseState& state = starts.back();
+        unsigned long long offset = 0;
+        int state_colors = 0;
+        size_t num_names = 0;
+        if (8 != sscanf(line.c_str(), "shard %llu %u " SIZET_FORMAT " "
+                        SIZET_FORMAT " " SIZET_FORMAT " %d %u "
+                        SIZET_FORMAT, &offset, &state.line_num,
+                        &state.num_positions, &state.num_texcoords,
+                        &state.num_normals, &state_colors,
+                        &state.group_line, &num_names) ||
+            !NextField(text, &pos, "mtllib ", &state.mtllib) ||
+            !NextField(text, &pos, "usemtl ", &state.material) ||
+            !NextField(text, &pos, "object ", &state.object)) {
+          return false;
+        }
+        state.offset = offset;
+        state.has_colors = state_colors != 0;
+        state.group_names.resize(num_names);
+        for (size_t k = 0; k < num_names; ++k) {
+          if (!NextField(text, &pos, "group ", &state.group_names[k])) {
+            return false;
+          }
+        }
+      } else if (0 == line.compare(0, 6, "count ")) {
+        char* end = NULL;
+        const int count = strtol(line.c_str() + 6, &end, 10);
+        if (*end != ' ') {
+          return false;
+        }
+        group_counts[end + 1] = count;
+      } else {
+        return false;
+      }
+    }
+    return !starts.empty();
+  }
+
+  // Positions only: the rest of the decodeParams do not depend on the
+  // bounds.
+  Bounds bounds;
+  bool colors;
+  // Positions, texcoords, normals and colors in the attribute files.
+  size_t num_attribs[4];
+  std::vector<ObjParseState> starts;
+  std::map<std::string, int> group_counts;
+
+ private:
+  static bool NextLine(const std::string& text, size_t* pos,
+                       std::string* line) {
+    if (*pos >= text.size()) {
+      return false;
+    }
+    size_t end = text.find('\n', *pos);
+    if (end == std::string::npos) {
+      end = text.size();
+    }
+    line->assign(text, *pos, end - *pos);
+    *pos = end + 1;
+    return true;
+  }
+
+  // Reads the next line, which must start with |name|, into |value|.
+  static bool NextField(const std::string& text, size_t* pos,
+                        const char* name, std::string* value) {
+    const size_t length = strlen(name);
+    if (!NextLine(text, pos, value) || value->compare(0, length, name)) {
+      return false;
+    }
+    value->erase(0, length);
+    return true;
+  }
+};
+
+// Plans the shards of a file of |size| bytes while it is parsed: its
+// attributes go to the attribute files, and the state of the parse is
+// taken at checkpoints, kCheckpointsPerShard per shard, of which the
+// cuts are those that even out the primitives.
+class ShardPlanner : public ObjSink {
+ public:
+  static const size_t kCheckpointsPerShard = 16;
+
+  ShardPlanner(const std::string& out_file, uint64 size, size_t num_shards)
+      : num_shards_(num_shards),
+        step_(size / (kCheckpointsPerShard * num_shards) + 1),
+        next_cut_(num_shards > 1 ? step_ : TextSource::kNoEnd),
+        num_primitives_(0) {
+    for (size_t i = 0; i < 4; ++i) {
+      files_[i] = new ScratchFile(ShardAttribName(out_file,
+                                                  kShardAttribs[i]));
+    }
+  }
+
+  ~ShardPlanner() {
+    for (size_t i = 0; i < 4; ++i) {
+      delete files_[i];
+    }
+  }
+
+  // Opens the attribute files. Returns false, naming the one that cannot
+  // be written in |error|.
+  bool Start(std::string* error) {
+    for (size_t i = 0; i < 4; ++i) {
+      if (!files_[i]->OpenForWrite(kWriteBuffer)) {
+        *error = "could not write " + files_[i]->name();
+        return false;
+      }
+    }
+    return true;
+  }
+
+  virtual void AddPosition(const float* position, const float* color) {
+    const float kWhite[3] = { 1.f, 1.f, 1.f };
+    // As in ObjSpill, colors are kept for all positions once one has
+    // them.
+    if (color && !plan_.colors) {
+      plan_.colors = true;
+      for (size_t i = 0; i < plan_.num_attribs[0]; ++i) {
+        files_[3]->Write(kWhite, sizeof(kWhite));
+      }
+      plan_.num_attribs[3] = plan_.num_attribs[0];
+    }
+    files_[0]->Write(position, 3 * sizeof(float));
+    ++plan_.num_attribs[0];
+    if (plan_.colors) {
+      files_[3]->Write(color ? color : kWhite, 3 * sizeof(float));
+      ++plan_.num_attribs[3];
+    }
+  }
+
+  virtual void AddTexCoord(const float* texcoord) {
+    files_[1]->Write(texcoord, 2 * sizeof(float));
+    ++plan_.num_attribs[1];
+  }
+
+  virtual void AddNormal(const float* normal) {
+    files_[2]->Write(normal, 3 * sizeof(float));
+    ++plan_.num_attribs[2];
+  }
+
+  virtual void AddPrimitive(const std::string& material,
+                            unsigned int group_line, PrimitiveMode mode,
+                            const int* indices) {
+    ++num_primitives_;
+    for (size_t i = 0; i < PrimitiveSize(mode); ++i) {
+      const size_t position = indices[3 * i] - 1;
+      if (position >= used_.size()) {
+        used_.resize(std::max(position + 1, 2 * used_.size()), false);
+      }
+      used_[position] = true;
+    }
+  }
+
+  virtual uint64 NextCut() const {
+    return next_cut_;
+  }
+
+  virtual void Cut(const ObjParseState& state) {
+    checkpoints_.push_back(state);
+    primitives_before_.push_back(num_primitives_);
+    while (next_cut_ <= state.offset) {
+      next_cut_ += step_;
+    }
+  }
+
+  // Closes the attribute files, keeping them for the shards, and plans
+  // the shards of |obj|, whose parse this followed.
+  bool Finish(const WavefrontObjFile& obj, ShardPlan* plan,
+              std::string* error) {
+    for (size_t i = 0; i < 4; ++i) {
+      if (!files_[i]->Close()) {
+        *error = "could not write " + files_[i]->name();
+        return false;
+      }
+      files_[i]->Keep();
+    }
+    // Like a whole conversion, the bounds only take the positions of the
+    // primitives.
+    MappedFile positions;
+    if (!positions.Open(files_[0]->name())) {
+      *error = "could not read " + files_[0]->name();
+      return false;
+    }
+    const float* floats = reinterpret_cast<const float*>(positions.data());
+    for (size_t i = 0; i < used_.size(); ++i) {
+      if (used_[i]) {
+        plan_.bounds.EncloseChannels(floats + 3 * i, 0, 3);
+      }
+    }
+    *plan = plan_;
+    plan->group_counts = obj.group_counts();
+    plan->starts.assign(1, ObjParseState());
+    // Shard i starts at the first checkpoint with i/n of the primitives
+    // before it.
+    size_t checkpoint = 0;
+    for (size_t i = 1; i < num_shards_; ++i) {
+      const uint64 target = (num_primitives_ * i + num_shards_ - 1) /
+          num_shards_;
+      while (checkpoint + 1 < checkpoints_.size() &&
+             primitives_before_[checkpoint] < target) {
+        ++checkpoint;
+      }
+      plan->starts.push_back(checkpoints_.empty() ? ObjParseState()
+                                                  : checkpoints_[checkpoint]);
+    }
+    return true;
+  }
+
+ private:
+  static const size_t kWriteBuffer = 1 << 20;
+
+  const size_t num_shards_;
+  const uint64 step_;
+  uint64 next_cut_;
+  uint64 num_primitives_;
+  ScratchFile* files_[4];
+  std::vector<bool> used_;  // Positions of primitives.
+  ShardPlan plan_;
+  std::vector<ObjParseState> checkpoints_;
+  std::vector<uint64> primitives_before_;
+};
+
+// Gets the start of shard |shard| of |plan| into |start|: its state,
+// and the attributes before it from the attribute files. Returns false,
+// describing why in |error|, if they cannot be read.
+static inline bool ReadShardStart(const ShardPlan& plan, size_t shard,
+                                  const std::string& out_file,
+                                  ObjParseStart* start, std::string* error) {
+  start->state = plan.starts[shard];
+  start->group_counts = plan.group_counts;
+  const ObjParseState& state = start->state;
+  const size_t counts[] = {
+    state.num_positions, state.num_texcoords, state.num_normals,
+    state.has_colors ? state.num_positions : 0
+  };
+  AttribList* attribs[] = {
+    &start->positions, &start->texcoords, &start->normals, &start->colors
+  };
+  for (size_t i = 0; i < 4; ++i) {
+    const std::string fn = ShardAttribName(out_file, kShardAttribs[i]);
+    const size_t size = counts[i] * kShardAttribDims[i];
+    MappedFile file;
+    if (!file.Open(fn) || file.size() != plan.num_attribs[i] *
+        kShardAttribDims[i] * sizeof(float) ||
+        counts[i] > plan.num_attribs[i]) {
+      *error = "could not read " + fn;
+      return false;
+    }
+    const float* floats = reinterpret_cast<const float*>(file.data());
+    attribs[i]->assign(floats, floats + size);
+  }
+  return true;
+}
+
+#endif  // WEBGL_LOADER_SHARD_H_
@@ -0,0 +1,163 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You
+// may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied. See the License for the specific language governing
+// permissions and limitations under the License.
+
+#ifndef WEBGL_LOADER_SHARED_H_
+#define WEBGL_LOADER_SHARED_H_
+
+#include <vector>
+
+#include "base.h"
+#include "mesh.h"
+#include "optimize.h"
+
+// Builds one vertex stream for all of a model's batches. Each batch is
+// widened to |layout|, quantized and ordered like WriteBatches does,
+// then every vertex is looked up by its quantized words, so vertices
+// that materials share (at seams between them, say) are stored once.
+// Vertices are numbered in order of first use across all batches and
+// the indices, appended batch after batch, need 32 bits.
+class SharedVertexBuilder {
+ public:
+  SharedVertexBuilder(VertexLayout layout, const BoundsParams& bounds_params)
+      : layout_(layout),
+        bounds_params_(bounds_params),
+        stride_(bounds_params.QuantizedStride(layout)),
+        num_vertices_(0),
+        table_(kInitialTableSize, kEmpty) {
+  }
+
+  // Appends the indices of |batch|, group by group, and returns the
+  // offset of its first index.
+  size_t Add(const DrawBatch& batch) {
+    const size_t first_index = indices_.size();
+    const DrawMesh& draw_mesh = batch.draw_mesh();
+    if (draw_mesh.indices.empty()) {
+      return first_index;
+    }
+    AttribList attribs;
+    attribs.reserve(draw_mesh.attribs.size() / LayoutStride(batch.layout()) *
+                    LayoutStride(layout_));
+    WidenAttribs(draw_mesh.attribs, batch.layout(), layout_, &attribs);
+    QuantizedAttribList quantized_attribs;
+    AttribsToQuantizedAttribs(attribs, layout_, bounds_params_,
+                              &quantized_attribs);
+
+    // The orderers split their output at 16 bits, which the shared
+    // indices do not care about, so their meshes are simply chained.
+    const std::vector<GroupStart>& group_starts = batch.group_starts();
+    const size_t primitive_size = PrimitiveSize(batch.mode());
+    std::vector<size_t> group_ends;
+    for (size_t i = 1; i < group_starts.size(); ++i) {
+      group_ends.push_back(group_starts[i].offset);
+    }
+    group_ends.push_back(draw_mesh.indices.size());
+    WebGLMeshList webgl_meshes;
+    if (batch.mode() == kTriangles) {
+      VertexOptimizer vertex_optimizer(quantized_attribs, stride_);
+      for (size_t i = 0; i < group_starts.size(); ++i) {
+        const size_t here = group_starts[i].offset;
+        vertex_optimizer.AddTriangles(&draw_mesh.indices[here],
+                                      group_ends[i] - here, &webgl_meshes);
+      }
+    } else {
+      FirstUseOrderer orderer(quantized_attribs, stride_, primitive_size);
+      for (size_t i = 0; i < group_starts.size(); ++i) {
+        const size_t here = group_starts[i].offset;
+        orderer.AddPrimitives(&draw_mesh.indices[here],
+                              group_ends[i] - here, &webgl_meshes);
+      }
+    }
+    for (size_t i = 0; i < webgl_meshes.size(); ++i) {
+      const WebGLMesh& mesh = webgl_meshes[i];
+      for (size_t j = 0; j < mesh.indices.size(); ++j) {
+        indices_.push_back(Intern(&mesh.attribs[stride_ * mesh.indices[j]]));
+      }
+    }
+    return first_index;
+  }
+
+  const QuantizedAttribList& attribs() const { return attribs_; }
+  const std::vector<uint32>& indices() const { return indices_; }
+  size_t stride() const { return stride_; }
+  size_t num_vertices() const { return num_vertices_; }
+
+ private:
+  static const size_t kInitialTableSize = 1024;  // A power of two.
+  // An enum, since std::vector's constructor takes it by reference.
+  enum { kEmpty = 0xFFFFFFFF };
+
+  // FNV-1a over the vertex's words.
+  uint32 Hash(const uint16* vertex) const {
+    uint32 hash = 2166136261u;
+    for (size_t i = 0; i < stride_; ++i) {
+      hash = (hash ^ vertex[i]) * 16777619u;
+    }
+    return hash;
+  }
+
+  bool Equal(const uint16* vertex, uint32 id) const {
+    const uint16* other = &attribs_[stride_ * id];
+    for (size_t i = 0; i < stride_; ++i) {
+      if (vertex[i] != other[i]) return false;
+    }
+    return true;
+  }
+
+  // Returns the id of |vertex|, adding it to the stream if it is new.
+  // The table is open addressed with linear probing and only holds ids;
+  // the words themselves live in |attribs_|.
+  uint32 Intern(const uint16* vertex) {
+    const size_t mask = table_.size() - 1;
+    size_t slot = Hash(vertex) & mask;
+    while (table_[slot] != kEmpty) {
+      if (Equal(vertex, table_[slot])) {
+        return table_[slot];
+      }
+      slot = (slot + 1) & mask;
+    }
+    const uint32 id = static_cast<uint32>(num_vertices_++);
+    table_[slot] = id;
+    attribs_.insert(attribs_.end(), vertex, vertex + stride_);
+    // Keep the table at most half full.
+    if (2 * num_vertices_ > table_.size()) {
+      Grow();
+    }
+    return id;
+  }
+
+  void Grow() {
+    std::vector<uint32> table(2 * table_.size(), kEmpty);
+    const size_t mask = table.size() - 1;
+    for (size_t i = 0; i < table_.size(); ++i) {
+      const uint32 id = table_[i];
+      if (id == kEmpty) continue;
+      size_t slot = Hash(&attribs_[stride_ * id]) & mask;
+      while (table[slot] != kEmpty) {
+        slot = (slot + 1) & mask;
+      }
+      table[slot] = id;
+    }
+    table_.swap(table);
+  }
+
+  const VertexLayout layout_;
+  const BoundsParams& bounds_params_;
+  const size_t stride_;
+  size_t num_vertices_;
+  QuantizedAttribList attribs_;
+  std::vector<uint32> indices_;
+  std::vector<uint32> table_;
+};
+
+#endif  // WEBGL_LOADER_SHARED_H_
@@ -0,0 +1,523 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You
+// may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied. See the License for the specific language governing
+// permissions and limitations under the License.
+
+#ifndef WEBGL_LOADER_SIMPLIFY_H_
+#define WEBGL_LOADER_SIMPLIFY_H_
+
+#include <math.h>
+
+#include <algorithm>
+#include <iterator>
+#include <queue>
+#include <vector>
+
+#include "base.h"
+#include "mesh.h"
+
+// Sum of squared distances to a set of planes (Garland and Heckbert,
+// "Surface Simplification Using Quadric Error Metrics").
+struct Quadric {
+  void Clear() {
+    a2 = ab = ac = ad = b2 = bc = bd = c2 = cd = d2 = 0;
+  }
+
+  // Adds the plane n.p + d = 0, |n| = 1.
+  void AddPlane(const float* n, float d, float weight) {
+    a2 += weight * n[0] * n[0];
+    ab += weight * n[0] * n[1];
+    ac += weight * n[0] * n[2];
+    ad += weight * n[0] * d;
+    b2 += weight * n[1] * n[1];
+    bc += weight * n[1] * n[2];
+    bd += weight * n[1] * d;
+    c2 += weight * n[2] * n[2];
+    cd += weight * n[2] * d;
+    d2 += weight * d * d;
+  }
+
+  void Add(const Quadric& that) {
+    a2 += that.a2; ab += that.ab; ac += that.ac; ad += that.ad;
+    b2 += that.b2; bc += that.bc; bd += that.bd;
+    c2 += that.c2; cd += that.cd;
+    d2 += that.d2;
+  }
+
+  float Evaluate(const float* p) const {
+    const float x = p[0], y = p[1], z = p[2];
+    const float error = a2*x*x + 2*ab*x*y + 2*ac*x*z + 2*ad*x +
+        b2*y*y + 2*bc*y*z + 2*bd*y +
+        c2*z*z + 2*cd*z +
+        d2;
+    return (error > 0) ? error : 0;
+  }
+
+  float a2, ab, ac, ad, b2, bc, bd, c2, cd, d2;
+};
+
+// How far (as a cosine) a single collapse may turn a triangle.
+static const float kMinNormalDot = 0.25f;
+
+// Simplifies one DrawBatch by collapsing edges into one of their
+// vertices, cheapest quadric error first. Since vertices only ever
+// move onto other vertices, every attribute is kept as is and the
+// result indexes into the original batch's vertices.
+//
+// Vertices split only by their normals (every corner of a flat-shaded
+// mesh is) are welded while simplifying, and each corner that moves
+// takes the copy of its new vertex whose normal is closest to its own.
+// Vertices on open edges (including texcoord and color seams, which
+// the flattener splits) and vertices shared by several groups never
+// move, so each triangle stays in its group and group outlines stay
+// put. Collapses that would turn a triangle too far in one step, or
+// past its original orientation, or pinch the surface into a
+// non-manifold one are skipped.
+//
+// Simplify() can be called with decreasing targets to get a chain of
+// levels of detail, taking a GetBatch() snapshot after each.
+class Simplifier {
+ public:
+  explicit Simplifier(const DrawBatch& batch)
+      : batch_(batch),
+        triangles_(batch.draw_mesh().indices),
+        num_alive_(0) {
+    const DrawMesh& draw_mesh = batch.draw_mesh();
+    const size_t stride = LayoutStride(batch.layout());
+    const size_t num_vertices = draw_mesh.attribs.size() / stride;
+    const size_t num_triangles = triangles_.size() / 3;
+
+    // Quadric errors are evaluated in floats, so measure them in a
+    // unit box.
+    Bounds bounds;
+    bounds.Clear();
+    bounds.Enclose(draw_mesh.attribs, batch.layout());
+    const float scale = bounds.UniformScale();
+    const float inv_scale = (scale > 0) ? 1 / scale : 1;
+    positions_.resize(3 * num_vertices);
+    for (size_t i = 0; i < num_vertices; ++i) {
+      for (size_t j = 0; j < 3; ++j) {
+        positions_[3*i + j] =
+            (draw_mesh.attribs[stride*i + j] - bounds.mins[j]) * inv_scale;
+      }
+    }
+
+    WeldNormalSplits();
+
+    alive_.resize(num_triangles, true);
+    original_normals_.resize(3 * num_triangles);
+    vertex_triangles_.resize(num_vertices);
+    quadrics_.resize(num_vertices);
+    for (size_t i = 0; i < num_vertices; ++i) {
+      quadrics_[i].Clear();
+    }
+    for (size_t t = 0; t < num_triangles; ++t) {
+      const int* tri = &triangles_[3*t];
+      float* normal = &original_normals_[3*t];
+      const float area = TriangleNormal(tri, normal);
+      if (tri[0] == tri[1] || tri[1] == tri[2] || tri[2] == tri[0]) {
+        alive_[t] = false;
+        continue;
+      }
+      ++num_alive_;
+      const float* p = &positions_[3*tri[0]];
+      const float d = -(normal[0]*p[0] + normal[1]*p[1] + normal[2]*p[2]);
+      for (size_t j = 0; j < 3; ++j) {
+        vertex_triangles_[tri[j]].push_back(static_cast<int>(t));
+        quadrics_[tri[j]].AddPlane(normal, d, area);
+      }
+    }
+
+    version_.resize(num_vertices, 0);
+    removed_.resize(num_vertices, false);
+    locked_.resize(num_vertices, false);
+    LockGroupBoundaries();
+    LockOpenEdges();
+
+    std::vector<int> neighbors;
+    for (size_t v = 0; v < num_vertices; ++v) {
+      GetNeighbors(v, &neighbors);
+      for (size_t i = 0; i < neighbors.size(); ++i) {
+        if (neighbors[i] > static_cast<int>(v)) {
+          PushEdge(v, neighbors[i]);
+        }
+      }
+    }
+  }
+
+  size_t num_triangles() const {
+    return num_alive_;
+  }
+
+  // Collapses edges until at most |target| triangles are left, or no
+  // collapse is allowed anymore. Returns the number of triangles left.
+  size_t Simplify(size_t target) {
+    std::vector<int> neighbors;
+    while (num_alive_ > target && !heap_.empty()) {
+      const Collapse collapse = heap_.top();
+      heap_.pop();
+      if (removed_[collapse.from] || removed_[collapse.to] ||
+          version_[collapse.from] != collapse.from_version ||
+          version_[collapse.to] != collapse.to_version) {
+        continue;  // Stale.
+      }
+      if (!CanCollapse(collapse.from, collapse.to)) {
+        // Maybe the other way around works.
+        if (!collapse.reversed && !locked_[collapse.to]) {
+          Collapse reverse = collapse;
+          std::swap(reverse.from, reverse.to);
+          std::swap(reverse.from_version, reverse.to_version);
+          reverse.cost = Cost(reverse.from, reverse.to);
+          reverse.reversed = true;
+          heap_.push(reverse);
+        }
+        continue;
+      }
+      DoCollapse(collapse.from, collapse.to);
+      GetNeighbors(collapse.to, &neighbors);
+      for (size_t i = 0; i < neighbors.size(); ++i) {
+        PushEdge(collapse.to, neighbors[i]);
+      }
+    }
+    return num_alive_;
+  }
+
+  // Adds the remaining triangles to |out|, group by group.
+  void GetBatch(DrawBatch* out) const {
+    const std::vector<GroupStart>& group_starts = batch_.group_starts();
+    const IndexList& original = batch_.draw_mesh().indices;
+    for (size_t i = 0; i < group_starts.size(); ++i) {
+      const size_t end = (i + 1 < group_starts.size()) ?
+          group_starts[i + 1].offset : triangles_.size();
+      for (size_t offset = group_starts[i].offset; offset < end;
+           offset += 3) {
+        if (alive_[offset / 3]) {
+          int corners[3];
+          for (size_t j = 0; j < 3; ++j) {
+            corners[j] = CornerCopy(triangles_[offset + j],
+                                    original[offset + j]);
+          }
+          out->AddTriangleFrom(batch_, corners, group_starts[i].group_line);
+        }
+      }
+    }
+  }
+
+ private:
+  struct Collapse {
+    // For a min-heap out of std::priority_queue.
+    bool operator<(const Collapse& that) const {
+      return cost > that.cost;
+    }
+
+    float cost;
+    int from, to;
+    unsigned int from_version, to_version;
+    bool reversed;
+  };
+
+  // Orders vertices by every attribute but their normals.
+  class WeldLess {
+   public:
+    WeldLess(const AttribList& attribs, VertexLayout layout)
+        : attribs_(attribs),
+          stride_(LayoutStride(layout)),
+          normals_begin_(LayoutHasTexcoords(layout) ? 5 : 3),
+          normals_end_(normals_begin_ + (LayoutHasNormals(layout) ? 3 : 0)) {
+    }
+
+    bool operator()(int a, int b) const {
+      const float* pa = &attribs_[stride_ * a];
+      const float* pb = &attribs_[stride_ * b];
+      for (size_t i = 0; i < stride_; ++i) {
+        if (i == normals_begin_) i = normals_end_;
+        if (i == stride_) break;
+        if (pa[i] != pb[i]) return pa[i] < pb[i];
+      }
+      return false;
+    }
+
+   private:
+    const AttribList& attribs_;
+    const size_t stride_;
+    const size_t normals_begin_, normals_end_;
+  };
+
+  // Points the triangles at the first of each set of vertices that
+  // only differ in their normals, linking the set in next_copy_.
+  void WeldNormalSplits() {
+    const size_t num_vertices = positions_.size() / 3;
+    weld_.resize(num_vertices);
+    next_copy_.assign(num_vertices, -1);
+    std::vector<int> order(num_vertices);
+    for (size_t i = 0; i < num_vertices; ++i) {
+      order[i] = static_cast<int>(i);
+    }
+    const WeldLess less(batch_.draw_mesh().attribs, batch_.layout());
+    std::sort(order.begin(), order.end(), less);
+    for (size_t begin = 0, end; begin < num_vertices; begin = end) {
+      for (end = begin + 1;
+           end < num_vertices && !less(order[begin], order[end]); ++end) { }
+      std::sort(order.begin() + begin, order.begin() + end);
+      for (size_t i = begin; i < end; ++i) {
+        weld_[order[i]] = order[begin];
+        if (i + 1 < end) {
+          next_copy_[order[i]] = order[i + 1];
+        }
+      }
+    }
+    for (size_t i = 0; i < triangles_.size(); ++i) {
+      triangles_[i] = weld_[triangles_[i]];
+    }
+  }
+
+  // The vertex to draw for a corner that was |original| and is now at
+  // the welded vertex |welded|: |original| if it has not moved, else the
+  // copy of |welded| with the normal closest to |original|'s.
+  int CornerCopy(int welded, int original) const {
+    if (weld_[original] == welded) {
+      return original;
+    }
+    const VertexLayout layout = batch_.layout();
+    if (!LayoutHasNormals(layout)) {
+      return welded;  // Its copies are all the same.
+    }
+    const size_t stride = LayoutStride(layout);
+    const size_t normal = LayoutHasTexcoords(layout) ? 5 : 3;
+    const AttribList& attribs = batch_.draw_mesh().attribs;
+    const float* want = &attribs[stride * original + normal];
+    int best = welded;
+    float best_dot = -2;
+    for (int copy = welded; copy != -1; copy = next_copy_[copy]) {
+      const float dot = Dot(want, &attribs[stride * copy + normal]);
+      if (dot > best_dot) {
+        best = copy;
+        best_dot = dot;
+      }
+    }
+    return best;
+  }
+
+  // Stores the unit normal of |tri| in |normal| and returns its area.
+  float TriangleNormal(const int* tri, float* normal) const {
+    return TriangleNormal(&positions_[3*tri[0]], &positions_[3*tri[1]],
+                          &positions_[3*tri[2]], normal);
+  }
+
+  static float TriangleNormal(const float* p0, const float* p1,
+                              const float* p2, float* normal) {
+    const float e1[3] = { p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2] };
+    const float e2[3] = { p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2] };
+    normal[0] = e1[1]*e2[2] - e1[2]*e2[1];
+    normal[1] = e1[2]*e2[0] - e1[0]*e2[2];
+    normal[2] = e1[0]*e2[1] - e1[1]*e2[0];
+    const float length = sqrtf(normal[0]*normal[0] + normal[1]*normal[1] +
+                               normal[2]*normal[2]);
+    if (length > 0) {
+      normal[0] /= length;
+      normal[1] /= length;
+      normal[2] /= length;
+    }
+    return length / 2;
+  }
+
+  static float Dot(const float* a, const float* b) {
+    return a[0]*b[0] + a[1]*b[1] + a[2]*b[2];
+  }
+
+  static bool Contains(const int* tri, int v) {
+    return tri[0] == v || tri[1] == v || tri[2] == v;
+  }
+
+  void LockGroupBoundaries() {
+    const std::vector<GroupStart>& group_starts = batch_.group_starts();
+    std::vector<int> group_of(vertex_triangles_.size(), -1);
+    for (size_t i = 0; i < group_starts.size(); ++i) {
+      const size_t end = (i + 1 < group_starts.size()) ?
+          group_starts[i + 1].offset : triangles_.size();
+      for (size_t offset = group_starts[i].offset; offset < end; ++offset) {
+        const int v = triangles_[offset];
+        if (group_of[v] == -1) {
+          group_of[v] = static_cast<int>(i);
+        } else if (group_of[v] != static_cast<int>(i)) {
+          locked_[v] = true;
+        }
+      }
+    }
+  }
+
+  // An edge is open if only one triangle uses it.
+  void LockOpenEdges() {
+    for (size_t v = 0; v < vertex_triangles_.size(); ++v) {
+      const std::vector<int>& around = vertex_triangles_[v];
+      for (size_t i = 0; i < around.size() && !locked_[v]; ++i) {
+        const int* tri = &triangles_[3*around[i]];
+        for (size_t j = 0; j < 3; ++j) {
+          if (tri[j] != static_cast<int>(v) &&
+              CountShared(v, tri[j]) == 1) {
+            locked_[v] = true;
+            locked_[tri[j]] = true;
+          }
+        }
+      }
+    }
+  }
+
+  // Returns the number of live triangles using both |u| and |v|.
+  size_t CountShared(int u, int v) const {
+    size_t count = 0;
+    const std::vector<int>& around = vertex_triangles_[u];
+    for (size_t i = 0; i < around.size(); ++i) {
+      if (alive_[around[i]] && Contains(&triangles_[3*around[i]], v)) {
+        ++count;
+      }
+    }
+    return count;
+  }
+
+  void GetNeighbors(int v, std::vector<int>* neighbors) const {
+    neighbors->clear();
+    const std::vector<int>& around = vertex_triangles_[v];
+    for (size_t i = 0; i < around.size(); ++i) {
+      if (!alive_[around[i]]) continue;
+      const int* tri = &triangles_[3*around[i]];
+      for (size_t j = 0; j < 3; ++j) {
+        if (tri[j] != v) {
+          neighbors->push_back(tri[j]);
+        }
+      }
+    }
+    std::sort(neighbors->begin(), neighbors->end());
+    neighbors->erase(std::unique(neighbors->begin(), neighbors->end()),
+                     neighbors->end());
+  }
+
+  float Cost(int from, int to) const {
+    Quadric quadric = quadrics_[from];
+    quadric.Add(quadrics_[to]);
+    return quadric.Evaluate(&positions_[3*to]);
+  }
+
+  // Queues the cheaper allowed direction of collapsing edge u-v.
+  void PushEdge(int u, int v) {
+    if (locked_[u] && locked_[v]) {
+      return;
+    }
+    Collapse collapse;
+    collapse.from = u;
+    collapse.to = v;
+    if (locked_[u]) {
+      std::swap(collapse.from, collapse.to);
+      collapse.cost = Cost(collapse.from, collapse.to);
+    } else if (locked_[v]) {
+      collapse.cost = Cost(u, v);
+    } else {
+      collapse.cost = Cost(u, v);
+      const float reverse_cost = Cost(v, u);
+      if (reverse_cost < collapse.cost) {
+        std::swap(collapse.from, collapse.to);
+        collapse.cost = reverse_cost;
+      }
+    }
+    collapse.from_version = version_[collapse.from];
+    collapse.to_version = version_[collapse.to];
+    collapse.reversed = false;
+    heap_.push(collapse);
+  }
+
+  bool CanCollapse(int from, int to) const {
+    if (locked_[from]) {
+      return false;
+    }
+    // Link condition: the only vertices next to both ends must be the
+    // far corners of the triangles on the edge, or the collapse would
+    // glue two sheets of the surface together.
+    std::vector<int> from_neighbors, to_neighbors, common;
+    GetNeighbors(from, &from_neighbors);
+    GetNeighbors(to, &to_neighbors);
+    std::set_intersection(from_neighbors.begin(), from_neighbors.end(),
+                          to_neighbors.begin(), to_neighbors.end(),
+                          std::back_inserter(common));
+    const size_t shared = CountShared(from, to);
+    if (shared == 0 || common.size() != shared) {
+      return false;
+    }
+    // No triangle moving along may turn over.
+    const std::vector<int>& around = vertex_triangles_[from];
+    for (size_t i = 0; i < around.size(); ++i) {
+      if (!alive_[around[i]]) continue;
+      const int* tri = &triangles_[3*around[i]];
+      if (Contains(tri, to)) continue;
+      const float* p[3];
+      for (size_t j = 0; j < 3; ++j) {
+        p[j] = &positions_[3*((tri[j] == from) ? to : tri[j])];
+      }
+      float before[3], after[3];
+      TriangleNormal(tri, before);
+      TriangleNormal(p[0], p[1], p[2], after);
+      if (Dot(before, after) < kMinNormalDot ||
+          Dot(&original_normals_[3*around[i]], after) < 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void DoCollapse(int from, int to) {
+    std::vector<int>& to_triangles = vertex_triangles_[to];
+    std::vector<int>& from_triangles = vertex_triangles_[from];
+    for (size_t i = 0; i < from_triangles.size(); ++i) {
+      const int t = from_triangles[i];
+      if (!alive_[t]) continue;
+      int* tri = &triangles_[3*t];
+      if (Contains(tri, to)) {
+        alive_[t] = false;
+        --num_alive_;
+        continue;
+      }
+      for (size_t j = 0; j < 3; ++j) {
+        if (tri[j] == from) {
+          tri[j] = to;
+        }
+      }
+      to_triangles.push_back(t);
+    }
+    std::vector<int>().swap(from_triangles);
+    size_t live = 0;
+    for (size_t i = 0; i < to_triangles.size(); ++i) {
+      if (alive_[to_triangles[i]]) {
+        to_triangles[live++] = to_triangles[i];
+      }
+    }
+    to_triangles.resize(live);
+    quadrics_[to].Add(quadrics_[from]);
+    removed_[from] = true;
+    ++version_[to];
+  }
+
+  const DrawBatch& batch_;
+  IndexList triangles_;  // Three welded vertex indices per triangle.
+  std::vector<int> weld_;  // The welded vertex of each vertex.
+  std::vector<int> next_copy_;  // The next vertex welded with it, or -1.
+  std::vector<bool> alive_;
+  size_t num_alive_;
+  std::vector<float> positions_;
+  std::vector<float> original_normals_;
+  std::vector<std::vector<int> > vertex_triangles_;
+  std::vector<Quadric> quadrics_;
+  std::vector<unsigned int> version_;
+  std::vector<bool> removed_;
+  std::vector<bool> locked_;
+  std::priority_queue<Collapse> heap_;
+};
+
+#endif  // WEBGL_LOADER_SIMPLIFY_H_
@@ -0,0 +1,746 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You
+// may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied. See the License for the specific language governing
+// permissions and limitations under the License.
+
+#ifndef WEBGL_LOADER_SPILL_H_
+#define WEBGL_LOADER_SPILL_H_
+
+// Out-of-core conversion (-spill), for OBJ files bigger than memory.
+// The parser hands the attributes and primitives to an ObjSpill, which
+// writes them to scratch files. The triangles are then sorted on disk
+// into the octree cells of -tiles (runs sorted in memory, then merged)
+// and read back a tile at a time, taking just the attributes each tile
+// uses from the memory-mapped scratch files.
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+# include <windows.h>
+#else
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <map>
+#include <queue>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "base.h"
+#include "mesh.h"
+#include "tiles.h"
+
+// What a conversion holds at once with -spill, unless -memory says.
+const size_t kDefaultSpillMemory = 1024 << 20;
+
+// Roughly what a triangle of a tile costs from its record to its
+// payload, to size the tiles to the memory.
+const size_t kSpillBytesPerTriangle = 512;
+
+// A read-only mapping of a whole file.
+class MappedFile {
+ public:
+  MappedFile() : data_(NULL), size_(0) { }
+
+  ~MappedFile() {
+    Close();
+  }
+
+  // Returns false if |fn| cannot be mapped. An empty file maps to no
+  // data.
+  bool Open(const std::string& fn) {
+    Close();
+#ifdef _WIN32
+    HANDLE file = CreateFileA(fn.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                              NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
+                              NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+      return false;
+    }
+    LARGE_INTEGER size;
+    bool ok = GetFileSizeEx(file, &size) != 0;
+    if (ok && size.QuadPart > 0) {
+      HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0,
+                                          NULL);
+      ok = mapping != NULL;
+      if (ok) {
+        // The view keeps the mapping open.
+        data_ = static_cast<const char*>(
+            MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        CloseHandle(mapping);
+        ok = data_ != NULL;
+        size_ = ok ? static_cast<size_t>(size.QuadPart) : 0;
+      }
+    }
+    CloseHandle(file);
+    return ok;
+#else
+    const int fd = open(fn.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat info;
+    bool ok = fstat(fd, &info) == 0;
+    if (ok && info.st_size > 0) {
+      void* data = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      ok = data != MAP_FAILED;
+      if (ok) {
+        data_ = static_cast<const char*>(data);
+        size_ = info.st_size;
+      }
+    }
+    close(fd);
+    return ok;
+#endif
+  }
+
+  void Close() {
+    if (data_) {
+#ifdef _WIN32
+      UnmapViewOfFile(data_);
+#else
+      munmap(const_cast<char*>(data_), size_);
+#endif
+    }
+    data_ = NULL;
+    size_ = 0;
+  }
+
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  MappedFile(const MappedFile&);
+  void operator=(const MappedFile&);
+
+  const char* data_;
+  size_t size_;
+};
+
+// A scratch file, written front to back and then read back or mapped,
+// and removed when done with unless kept.
+class ScratchFile {
+ public:
+  explicit ScratchFile(const std::string& fn)
+      : fn_(fn), fp_(NULL), failed_(false), keep_(false) {
+  }
+
+  ~ScratchFile() {
+    Close();
+    if (!keep_) {
+      remove(fn_.c_str());
+    }
+  }
+
+  const std::string& name() const { return fn_; }
+
+  // Leaves the file for another process.
+  void Keep() { keep_ = true; }
+
+  // Reads and writes go through a buffer of |buffer_size| bytes.
+  bool OpenForWrite(size_t buffer_size) {
+    return Open("wb", buffer_size);
+  }
+
+  bool OpenForRead(size_t buffer_size) {
+    return Open("rb", buffer_size);
+  }
+
+  void Write(const void* data, size_t size) {
+    if (fp_ && fwrite(data, 1, size, fp_) != size) {
+      failed_ = true;
+    }
+  }
+
+  // False at the end of the file, or if it cannot be read.
+  bool Read(void* data, size_t size) {
+    if (!fp_) {
+      return false;
+    }
+    if (fread(data, 1, size, fp_) != size) {
+      failed_ = failed_ || ferror(fp_) != 0;
+      return false;
+    }
+    return true;
+  }
+
+  // Returns false if anything could not be written or read.
+  bool Close() {
+    if (fp_ && fclose(fp_) != 0) {
+      failed_ = true;
+    }
+    fp_ = NULL;
+    return !failed_;
+  }
+
+ private:
+  ScratchFile(const ScratchFile&);
+  void operator=(const ScratchFile&);
+
+  bool Open(const char* mode, size_t buffer_size) {
+    Close();
+    fp_ = fopen(fn_.c_str(), mode);
+    if (!fp_) {
+      failed_ = true;
+      return false;
+    }
+    setvbuf(fp_, NULL, _IOFBF, buffer_size);
+    return true;
+  }
+
+  const std::string fn_;
+  FILE* fp_;
+  bool failed_;
+  bool keep_;
+};
+
+// A primitive waiting on disk: its indices as the OBJ has them (0 for
+// none), and what it goes into.
+struct SpillRecord {
+  uint64 order;  // in the OBJ, to keep ties in order.
+  uint32 cell;  // the octree cell of its centroid, at full depth.
+  uint32 material;  // into the spill's materials.
+  uint32 group_line;
+  uint32 mode;
+  int indices[9];
+
+  bool operator<(const SpillRecord& that) const {
+    return (cell != that.cell) ? cell < that.cell : order < that.order;
+  }
+};
+
+// Orders records as they are in the OBJ.
+struct SpillRecordOrderLess {
+  bool operator()(const SpillRecord& a, const SpillRecord& b) const {
+    return a.order < b.order;
+  }
+};
+
+// The next record of each sorted run, for merging them.
+typedef std::pair<SpillRecord, size_t> SpillRunHead;
+
+// Makes a min-heap of the run heads.
+struct SpillRunHeadGreater {
+  bool operator()(const SpillRunHead& a, const SpillRunHead& b) const {
+    return b.first < a.first;
+  }
+};
+
+// The scratch files of one conversion, which are named after |prefix|.
+// Triangles are bucketed into the same octree as TileBuilder's, with
+// cells split while they have more than a tile's triangles, so the
+// tiles come out just like -tiles makes them. Lines and points are
+// read back into memory, as -tiles leaves them in the model's urls.
+class ObjSpill : public ObjSink {
+ public:
+  static const size_t kMaxDepth = TileBuilder::kMaxDepth;
+
+  // |memory| bytes, or kDefaultSpillMemory for 0, bound the sort runs
+  // and the tiles.
+  ObjSpill(const std::string& prefix, size_t memory)
+      : memory_(memory ? memory : kDefaultSpillMemory),
+        positions_(prefix + ".positions"),
+        texcoords_(prefix + ".texcoords"),
+        normals_(prefix + ".normals"),
+        colors_(prefix + ".colors"),
+        triangles_(prefix + ".triangles"),
+        others_(prefix + ".primitives"),
+        sorted_(prefix + ".sorted"),
+        prefix_(prefix),
+        num_positions_(0),
+        num_primitives_(0),
+        num_triangles_(0),
+        has_colors_(false),
+        max_triangles_(1),
+        half_(0),
+        have_next_(false) {
+    bounds_.Clear();
+    for (size_t i = 0; i < kMaxDepth; ++i) {
+      prefixes_[i] = 0;
+      counts_[i] = 0;
+    }
+  }
+
+  // The tile size that fits the memory.
+  size_t max_tile_triangles() const {
+    return std::max<size_t>(memory_ / kSpillBytesPerTriangle, 1);
+  }
+
+  size_t num_triangles() const { return num_triangles_; }
+  bool has_colors() const { return has_colors_; }
+
+  // The bounds of the triangles' vertices, once sorted.
+  const Bounds& bounds() const { return bounds_; }
+
+  // Opens the scratch files for the parse. Returns false, naming the
+  // one that cannot be written in |error|.
+  bool Start(std::string* error) {
+    ScratchFile* files[] = {
+      &positions_, &texcoords_, &normals_, &colors_, &triangles_, &others_
+    };
+    for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); ++i) {
+      if (!files[i]->OpenForWrite(kWriteBuffer)) {
+        *error = "could not write " + files[i]->name();
+        return false;
+      }
+    }
+    return true;
+  }
+
+  virtual void AddPosition(const float* position, const float* color) {
+    const float kWhite[3] = { 1.f, 1.f, 1.f };
+    // Colors are kept for all positions once one has them, white for
+    // those without.
+    if (color && !has_colors_) {
+      has_colors_ = true;
+      for (size_t i = 0; i < num_positions_; ++i) {
+        colors_.Write(kWhite, sizeof(kWhite));
+      }
+    }
+    positions_.Write(position, 3 * sizeof(float));
+    if (has_colors_) {
+      colors_.Write(color ? color : kWhite, 3 * sizeof(float));
+    }
+    ++num_positions_;
+  }
+
+  virtual void AddTexCoord(const float* texcoord) {
+    texcoords_.Write(texcoord, 2 * sizeof(float));
+  }
+
+  virtual void AddNormal(const float* normal) {
+    normals_.Write(normal, 3 * sizeof(float));
+  }
+
+  virtual void AddPrimitive(const std::string& material,
+                            unsigned int group_line, PrimitiveMode mode,
+                            const int* indices) {
+    SpillRecord record;
+    memset(&record, 0, sizeof(record));
+    record.order = num_primitives_++;
+    std::map<std::string, uint32>::iterator found =
+        material_ids_.find(material);
+    if (found == material_ids_.end()) {
+      found = material_ids_.insert(std::make_pair(
+          material, static_cast<uint32>(materials_.size()))).first;
+      materials_.push_back(material);
+    }
+    record.material = found->second;
+    record.group_line = group_line;
+    record.mode = mode;
+    memcpy(record.indices, indices, 3 * PrimitiveSize(mode) * sizeof(int));
+    if (mode == kTriangles) {
+      triangles_.Write(&record, sizeof(record));
+      ++num_triangles_;
+    } else {
+      others_.Write(&record, sizeof(record));
+    }
+  }
+
+  // Finishes the scratch files once parsed, and maps the attributes.
+  bool Finish(std::string* error) {
+    ScratchFile* files[] = {
+      &positions_, &texcoords_, &normals_, &colors_, &triangles_, &others_
+    };
+    for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); ++i) {
+      if (!files[i]->Close()) {
+        *error = "could not write " + files[i]->name();
+        return false;
+      }
+    }
+    if (!positions_map_.Open(positions_.name()) ||
+        !texcoords_map_.Open(texcoords_.name()) ||
+        !normals_map_.Open(normals_.name()) ||
+        !colors_map_.Open(colors_.name())) {
+      *error = "could not map the attributes in " + prefix_ + ".*";
+      return false;
+    }
+    return true;
+  }
+
+  // Builds the batches of the lines and points, in memory.
+  bool ReadOthers(MaterialBatches* line_batches,
+                  MaterialBatches* point_batches, std::string* error) {
+    std::vector<SpillRecord> records;
+    SpillRecord record;
+    if (!others_.OpenForRead(kReadBuffer)) {
+      *error = "could not read " + others_.name();
+      return false;
+    }
+    while (others_.Read(&record, sizeof(record))) {
+      records.push_back(record);
+    }
+    if (!others_.Close()) {
+      *error = "could not read " + others_.name();
+      return false;
+    }
+    MaterialBatches* batches[] = { NULL, line_batches, point_batches };
+    AddToBatches(records, batches);
+    return true;
+  }
+
+  // Sorts the triangles into the octree cells of tiles of at most
+  // |max_triangles|: runs of what fits in memory are sorted and then
+  // merged. Also finds the bounds of their vertices.
+  bool Sort(size_t max_triangles, std::string* error) {
+    max_triangles_ = max_triangles ? max_triangles : 1;
+    if (!EncloseTriangles()) {
+      *error = "could not read " + triangles_.name();
+      return false;
+    }
+    half_ = bounds_.UniformScale() / 2;
+    for (size_t i = 0; i < 3; ++i) {
+      center_[i] = bounds_.mins[i] + half_;
+    }
+
+    const size_t run_size = std::max<size_t>(
+        memory_ / 2 / sizeof(SpillRecord), 1);
+    std::vector<SpillRecord> run;
+    run.reserve(std::min(run_size, num_triangles_));
+    std::vector<ScratchFile*> runs;
+    bool ok = triangles_.OpenForRead(kReadBuffer);
+    SpillRecord record;
+    bool more = ok;
+    while (more) {
+      run.clear();
+      while (run.size() < run_size &&
+             (more = triangles_.Read(&record, sizeof(record)))) {
+        record.cell = Cell(record);
+        run.push_back(record);
+      }
+      if (run.empty()) break;
+      std::sort(run.begin(), run.end());
+      char suffix[32];
+      snprintf(suffix, sizeof(suffix), ".run" SIZET_FORMAT, runs.size());
+      runs.push_back(new ScratchFile(prefix_ + suffix));
+      ok = ok && runs.back()->OpenForWrite(kWriteBuffer);
+      for (size_t i = 0; ok && i < run.size(); ++i) {
+        runs.back()->Write(&run[i], sizeof(run[i]));
+      }
+      ok = runs.back()->Close() && ok;
+    }
+    ok = triangles_.Close() && ok;
+    std::vector<SpillRecord>().swap(run);
+    if (ok) {
+      ok = Merge(runs);
+    }
+    for (size_t i = 0; i < runs.size(); ++i) {
+      delete runs[i];
+    }
+    if (!ok) {
+      *error = "could not sort the triangles in " + prefix_ + ".*";
+      return false;
+    }
+    CloseCells(0);
+    have_next_ = sorted_.OpenForRead(kReadBuffer) &&
+        sorted_.Read(&next_, sizeof(next_));
+    return true;
+  }
+
+  // Reads the next tile into |tile|. Returns false after the last.
+  bool NextTile(Tile* tile) {
+    tile->path.clear();
+    tile->batches.clear();
+    if (!have_next_) {
+      return false;
+    }
+    const size_t depth = LeafDepth(next_.cell);
+    const uint32 leaf = next_.cell >> Shift(depth);
+    for (size_t i = 0; i < depth; ++i) {
+      tile->path.push_back(static_cast<char>(
+          '0' + ((next_.cell >> Shift(i + 1)) & 7)));
+    }
+    tile_records_.clear();
+    do {
+      tile_records_.push_back(next_);
+      have_next_ = sorted_.Read(&next_, sizeof(next_));
+    } while (have_next_ && LeafDepth(next_.cell) == depth &&
+             (next_.cell >> Shift(depth)) == leaf);
+    std::sort(tile_records_.begin(), tile_records_.end(),
+              SpillRecordOrderLess());
+    MaterialBatches* batches[] = { &tile->batches, NULL, NULL };
+    AddToBatches(tile_records_, batches);
+    tile->bounds.Clear();
+    for (MaterialBatches::const_iterator iter = tile->batches.begin();
+         iter != tile->batches.end(); ++iter) {
+      tile->bounds.Enclose(iter->second.draw_mesh().attribs,
+                           iter->second.layout());
+    }
+    return true;
+  }
+
+  // Returns false if the sorted triangles could not all be read.
+  bool Close() {
+    return sorted_.Close();
+  }
+
+ private:
+  static const size_t kWriteBuffer = 1 << 20;
+  static const size_t kReadBuffer = 1 << 20;
+
+  static size_t Shift(size_t depth) {
+    return 3 * (kMaxDepth - depth);
+  }
+
+  static uint64 CellKey(size_t depth, uint32 prefix) {
+    return (static_cast<uint64>(depth) << 32) | prefix;
+  }
+
+  const float* Position(int index) const {
+    return reinterpret_cast<const float*>(positions_map_.data()) +
+        3 * (index - 1);
+  }
+
+  // The cell of the record's centroid, as TileBuilder::Split would
+  // find it: three bits per level, x in the lowest.
+  uint32 Cell(const SpillRecord& record) const {
+    float centroid[3];
+    for (size_t j = 0; j < 3; ++j) {
+      float sum = 0;
+      for (size_t k = 0; k < 3; ++k) {
+        sum += Position(record.indices[3 * k])[j];
+      }
+      centroid[j] = sum / 3;
+    }
+    float center[3] = { center_[0], center_[1], center_[2] };
+    float half = half_;
+    uint32 cell = 0;
+    for (size_t depth = 0; depth < kMaxDepth; ++depth) {
+      int octant = 0;
+      for (int j = 0; j < 3; ++j) {
+        if (centroid[j] >= center[j]) {
+          octant |= 1 << j;
+        }
+      }
+      cell = (cell << 3) | octant;
+      const float quarter = half / 2;
+      for (int j = 0; j < 3; ++j) {
+        center[j] += (octant & (1 << j)) ? quarter : -quarter;
+      }
+      half = quarter;
+    }
+    return cell;
+  }
+
+  // Encloses every vertex of the triangles, with just the attributes
+  // it has.
+  bool EncloseTriangles() {
+    if (!triangles_.OpenForRead(kReadBuffer)) {
+      return false;
+    }
+    const float* texcoords =
+        reinterpret_cast<const float*>(texcoords_map_.data());
+    const float* normals = reinterpret_cast<const float*>(normals_map_.data());
+    const float* colors = reinterpret_cast<const float*>(colors_map_.data());
+    SpillRecord record;
+    while (triangles_.Read(&record, sizeof(record))) {
+      for (size_t i = 0; i < 9; i += 3) {
+        const int* vertex = &record.indices[i];
+        bounds_.EncloseChannels(Position(vertex[0]), 0, 3);
+        if (vertex[1]) {
+          bounds_.EncloseChannels(texcoords + 2 * (vertex[1] - 1), 3, 5);
+        }
+        if (vertex[2]) {
+          bounds_.EncloseChannels(normals + 3 * (vertex[2] - 1), 5, 8);
+        }
+        if (has_colors_) {
+          bounds_.EncloseChannels(colors + 3 * (vertex[0] - 1), 8,
+                                  kNumChannels);
+        }
+      }
+    }
+    return triangles_.Close();
+  }
+
+  // Merges the sorted |runs| into sorted_, counting the triangles of
+  // every cell on the way.
+  bool Merge(const std::vector<ScratchFile*>& runs) {
+    typedef SpillRunHead Head;
+    const size_t buffer = std::max<size_t>(
+        memory_ / 4 / std::max<size_t>(runs.size(), 1), 1 << 16);
+    std::priority_queue<Head, std::vector<Head>, SpillRunHeadGreater> heads;
+    bool ok = sorted_.OpenForWrite(kWriteBuffer);
+    for (size_t i = 0; ok && i < runs.size(); ++i) {
+      Head head;
+      head.second = i;
+      ok = runs[i]->OpenForRead(buffer);
+      if (ok && runs[i]->Read(&head.first, sizeof(head.first))) {
+        heads.push(head);
+      }
+    }
+    while (ok && !heads.empty()) {
+      Head head = heads.top();
+      heads.pop();
+      CountCell(head.first.cell);
+      sorted_.Write(&head.first, sizeof(head.first));
+      if (runs[head.second]->Read(&head.first, sizeof(head.first))) {
+        heads.push(head);
+      }
+    }
+    for (size_t i = 0; i < runs.size(); ++i) {
+      ok = runs[i]->Close() && ok;
+    }
+    return sorted_.Close() && ok;
+  }
+
+  // Counts a triangle in every cell containing |cell|, which come in
+  // order. Cells left behind are done.
+  void CountCell(uint32 cell) {
+    size_t depth = 0;
+    while (depth < kMaxDepth && counts_[depth] &&
+           (cell >> Shift(depth)) == prefixes_[depth]) {
+      ++depth;
+    }
+    CloseCells(depth);
+    for (size_t i = depth; i < kMaxDepth; ++i) {
+      prefixes_[i] = cell >> Shift(i);
+    }
+    for (size_t i = 0; i < kMaxDepth; ++i) {
+      ++counts_[i];
+    }
+  }
+
+  // Cells at |depth| and below that have too many triangles are split.
+  void CloseCells(size_t depth) {
+    for (size_t i = depth; i < kMaxDepth; ++i) {
+      if (counts_[i] > max_triangles_) {
+        split_.insert(CellKey(i, prefixes_[i]));
+      }
+      counts_[i] = 0;
+    }
+  }
+
+  // The depth of the tile holding |cell|.
+  size_t LeafDepth(uint32 cell) const {
+    size_t depth = 0;
+    while (depth < kMaxDepth &&
+           split_.count(CellKey(depth, cell >> Shift(depth)))) {
+      ++depth;
+    }
+    return depth;
+  }
+
+  // Adds |records| to the batch of their material in |batches|, indexed
+  // by mode. Their attributes are copied into local lists, numbered in
+  // order of index.
+  void AddToBatches(const std::vector<SpillRecord>& records,
+                    MaterialBatches* batches[3]) {
+    std::vector<int> used[3];
+    for (size_t i = 0; i < records.size(); ++i) {
+      const SpillRecord& record = records[i];
+      for (size_t j = 0; j < 3 * PrimitiveSize(
+               static_cast<PrimitiveMode>(record.mode)); ++j) {
+        if (record.indices[j]) {
+          used[j % 3].push_back(record.indices[j]);
+        }
+      }
+    }
+    for (size_t i = 0; i < 3; ++i) {
+      std::sort(used[i].begin(), used[i].end());
+      used[i].erase(std::unique(used[i].begin(), used[i].end()),
+                    used[i].end());
+    }
+    Gather(used[0], positions_map_, 3, &local_positions_);
+    Gather(used[1], texcoords_map_, 2, &local_texcoords_);
+    Gather(used[2], normals_map_, 3, &local_normals_);
+    if (has_colors_) {
+      Gather(used[0], colors_map_, 3, &local_colors_);
+    } else {
+      local_colors_.clear();
+    }
+    for (size_t i = 0; i < records.size(); ++i) {
+      const SpillRecord& record = records[i];
+      const PrimitiveMode mode = static_cast<PrimitiveMode>(record.mode);
+      MaterialBatches* mode_batches = batches[mode];
+      const std::string& material = materials_[record.material];
+      MaterialBatches::iterator iter = mode_batches->find(material);
+      if (iter == mode_batches->end()) {
+        iter = mode_batches->insert(
+            std::make_pair(material, DrawBatch())).first;
+        iter->second.Init(&local_positions_, &local_texcoords_,
+                          &local_normals_, &local_colors_);
+      }
+      int indices[9] = { 0 };
+      for (size_t j = 0; j < 3 * PrimitiveSize(mode); ++j) {
+        const std::vector<int>& list = used[j % 3];
+        if (record.indices[j]) {
+          indices[j] = 1 + static_cast<int>(
+              std::lower_bound(list.begin(), list.end(), record.indices[j]) -
+              list.begin());
+        }
+      }
+      if (mode == kTriangles) {
+        iter->second.AddTriangle(record.group_line, indices);
+      } else if (mode == kLines) {
+        iter->second.AddLine(record.group_line, indices);
+      } else {
+        iter->second.AddPoint(record.group_line, indices);
+      }
+    }
+    for (size_t i = 0; i < 3; ++i) {
+      if (!batches[i]) continue;
+      for (MaterialBatches::iterator iter = batches[i]->begin();
+           iter != batches[i]->end(); ++iter) {
+        iter->second.ReleaseFlattener();
+      }
+    }
+  }
+
+  // Copies the |dim| floats of every 1-based index in |used| from
+  // |source|.
+  static void Gather(const std::vector<int>& used, const MappedFile& source,
+                     size_t dim, AttribList* out) {
+    const float* floats = reinterpret_cast<const float*>(source.data());
+    out->resize(dim * used.size());
+    for (size_t i = 0; i < used.size(); ++i) {
+      memcpy(&(*out)[dim * i], floats + dim * (used[i] - 1),
+             dim * sizeof(float));
+    }
+  }
+
+  const size_t memory_;
+  ScratchFile positions_, texcoords_, normals_, colors_;
+  ScratchFile triangles_, others_, sorted_;
+  const std::string prefix_;
+  size_t num_positions_;
+  uint64 num_primitives_;
+  size_t num_triangles_;
+  bool has_colors_;
+  std::vector<std::string> materials_;
+  std::map<std::string, uint32> material_ids_;
+  MappedFile positions_map_, texcoords_map_, normals_map_, colors_map_;
+
+  // The octree, and the cells split for having too many triangles.
+  size_t max_triangles_;
+  Bounds bounds_;
+  float center_[3];
+  float half_;
+  uint32 prefixes_[kMaxDepth];
+  size_t counts_[kMaxDepth];
+  std::set<uint64> split_;
+
+  // The next tile's first record, and the last tile's records and
+  // attributes.
+  SpillRecord next_;
+  bool have_next_;
+  std::vector<SpillRecord> tile_records_;
+  AttribList local_positions_, local_texcoords_, local_normals_;
+  AttribList local_colors_;
+};
+
+#endif  // WEBGL_LOADER_SPILL_H_
@@ -0,0 +1,220 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You
+// may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied. See the License for the specific language governing
+// permissions and limitations under the License.
+
+#ifndef WEBGL_LOADER_THREAD_H_
+#define WEBGL_LOADER_THREAD_H_
+
+// Minimal threading on top of pthreads (winpthreads with MinGW-w64),
+// so build with -pthread.
+
+#include <pthread.h>
+#ifdef _WIN32
+# include <windows.h>
+#else
+# include <unistd.h>
+#endif
+
+#include <deque>
+#include <vector>
+
+#include "base.h"
+
+static inline size_t NumCpus() {
+#ifdef _WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  const long count = info.dwNumberOfProcessors;
+#else
+  const long count = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  return (count > 0) ? static_cast<size_t>(count) : 1;
+}
+
+class Mutex {
+ public:
+  Mutex() { pthread_mutex_init(&mutex_, NULL); }
+  ~Mutex() { pthread_mutex_destroy(&mutex_); }
+
+  void Lock() { pthread_mutex_lock(&mutex_); }
+  void Unlock() { pthread_mutex_unlock(&mutex_); }
+
+ private:
+  friend class CondVar;
+  Mutex(const Mutex&);
+  void operator=(const Mutex&);
+
+  pthread_mutex_t mutex_;
+};
+
+class MutexLock {
+ public:
+  explicit MutexLock(Mutex* mutex) : mutex_(mutex) { mutex_->Lock(); }
+  ~MutexLock() { mutex_->Unlock(); }
+
+ private:
+  MutexLock(const MutexLock&);
+  void operator=(const MutexLock&);
+
+  Mutex* const mutex_;
+};
+
+class CondVar {
+ public:
+  CondVar() { pthread_cond_init(&cond_, NULL); }
+  ~CondVar() { pthread_cond_destroy(&cond_); }
+
+  void Wait(Mutex* mutex) { pthread_cond_wait(&cond_, &mutex->mutex_); }
+  void Signal() { pthread_cond_signal(&cond_); }
+  void Broadcast() { pthread_cond_broadcast(&cond_); }
+
+ private:
+  CondVar(const CondVar&);
+  void operator=(const CondVar&);
+
+  pthread_cond_t cond_;
+};
+
+// A fixed set of worker threads running queued tasks in FIFO order.
+// Add() blocks while |max_pending| tasks are waiting, which bounds the
+// memory held by queued work.
+class ThreadPool {
+ public:
+  class Task {
+   public:
+    virtual ~Task() { }
+    virtual void Run() = 0;
+  };
+
+  ThreadPool(size_t num_threads, size_t max_pending)
+      : max_pending_(max_pending ? max_pending : 1),
+        running_(0),
+        shutdown_(false) {
+    threads_.resize(num_threads ? num_threads : 1);
+    for (size_t i = 0; i < threads_.size(); ++i) {
+      CHECK(0 == pthread_create(&threads_[i], NULL, &ThreadPool::Main, this));
+    }
+  }
+
+  // Runs everything still queued before returning.
+  ~ThreadPool() {
+    {
+      MutexLock lock(&mutex_);
+      shutdown_ = true;
+      work_.Broadcast();
+    }
+    for (size_t i = 0; i < threads_.size(); ++i) {
+      pthread_join(threads_[i], NULL);
+    }
+  }
+
+  size_t num_threads() const { return threads_.size(); }
+
+  // Takes ownership of |task|.
+  void Add(Task* task) {
+    MutexLock lock(&mutex_);
+    while (queue_.size() >= max_pending_) {
+      space_.Wait(&mutex_);
+    }
+    queue_.push_back(task);
+    work_.Signal();
+  }
+
+  // Blocks until every added task has finished.
+  void Wait() {
+    MutexLock lock(&mutex_);
+    while (!queue_.empty() || running_) {
+      idle_.Wait(&mutex_);
+    }
+  }
+
+ private:
+  ThreadPool(const ThreadPool&);
+  void operator=(const ThreadPool&);
+
+  static void* Main(void* arg) {
+    static_cast<ThreadPool*>(arg)->Loop();
+    return NULL;
+  }
+
+  void Loop() {
+    MutexLock lock(&mutex_);
+    for (;;) {
+      while (queue_.empty() && !shutdown_) {
+        work_.Wait(&mutex_);
+      }
+      if (queue_.empty()) {
+        return;
+      }
+      Task* task = queue_.front();
+      queue_.pop_front();
+      ++running_;
+      space_.Signal();
+      mutex_.Unlock();
+      task->Run();
+      delete task;
+      mutex_.Lock();
+      --running_;
+      if (queue_.empty() && !running_) {
+        idle_.Broadcast();
+      }
+    }
+  }
+
+  const size_t max_pending_;
+  std::vector<pthread_t> threads_;
+  std::deque<Task*> queue_;
+  size_t running_;
+  bool shutdown_;
+  Mutex mutex_;
+  CondVar work_, space_, idle_;
+};
+
+// Admits work while the memory it says it needs fits within a total, to
+// bound what runs side by side. Work needing more than the total waits
+// for everything else and then runs alone.
+class MemoryBudget {
+ public:
+  explicit MemoryBudget(size_t total) : total_(total), used_(0) { }
+
+  // Blocks until |bytes| fit, and returns what was reserved, which must
+  // be given back to Release().
+  size_t Acquire(size_t bytes) {
+    if (bytes > total_) {
+      bytes = total_;
+    }
+    MutexLock lock(&mutex_);
+    while (used_ + bytes > total_) {
+      freed_.Wait(&mutex_);
+    }
+    used_ += bytes;
+    return bytes;
+  }
+
+  void Release(size_t bytes) {
+    MutexLock lock(&mutex_);
+    used_ -= bytes;
+    freed_.Broadcast();
+  }
+
+ private:
+  MemoryBudget(const MemoryBudget&);
+  void operator=(const MemoryBudget&);
+
+  const size_t total_;
+  size_t used_;
+  Mutex mutex_;
+  CondVar freed_;
+};
+
+#endif  // WEBGL_LOADER_THREAD_H_
@@ -0,0 +1,155 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You
+// may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied. See the License for the specific language governing
+// permissions and limitations under the License.
+
+#ifndef WEBGL_LOADER_TILES_H_
+#define WEBGL_LOADER_TILES_H_
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "base.h"
+#include "mesh.h"
+
+// A leaf of the octree: the triangles whose centroids fall into one
+// cell, batched by material like the whole model, and the bounds of
+// their vertices (which may stick out of the cell).
+struct Tile {
+  std::string path;  // octant digits from the root, "" for the root.
+  Bounds bounds;
+  MaterialBatches batches;
+};
+
+// A deque, so adding tiles never copies the ones already built.
+typedef std::deque<Tile> TileList;
+
+// Buckets triangles into an octree over a cube enclosing the model,
+// splitting cells until at most |max_triangles| are left in each or
+// kMaxDepth is reached. Each tile can then be quantized within its own
+// bounds and downloaded on its own.
+class TileBuilder {
+ public:
+  static const size_t kMaxDepth = 10;
+
+  TileBuilder(const MaterialBatches& batches, size_t max_triangles)
+      : batches_(batches),
+        max_triangles_(max_triangles ? max_triangles : 1) {
+  }
+
+  void Build(TileList* tiles) const {
+    Bounds bounds;
+    bounds.Clear();
+    std::vector<TriangleRef> triangles;
+    for (MaterialBatches::const_iterator iter = batches_.begin();
+         iter != batches_.end(); ++iter) {
+      const DrawBatch& batch = iter->second;
+      const DrawMesh& draw_mesh = batch.draw_mesh();
+      bounds.Enclose(draw_mesh.attribs, batch.layout());
+      const std::vector<GroupStart>& group_starts = batch.group_starts();
+      const size_t stride = LayoutStride(batch.layout());
+      for (size_t i = 0; i < group_starts.size(); ++i) {
+        const size_t end = (i + 1 < group_starts.size()) ?
+            group_starts[i + 1].offset : draw_mesh.indices.size();
+        for (size_t offset = group_starts[i].offset; offset < end;
+             offset += 3) {
+          TriangleRef triangle;
+          triangle.batch = iter;
+          triangle.group_line = group_starts[i].group_line;
+          triangle.offset = offset;
+          for (size_t j = 0; j < 3; ++j) {
+            float sum = 0;
+            for (size_t k = 0; k < 3; ++k) {
+              sum += draw_mesh.attribs[
+                  stride * draw_mesh.indices[offset + k] + j];
+            }
+            triangle.centroid[j] = sum / 3;
+          }
+          triangles.push_back(triangle);
+        }
+      }
+    }
+    if (triangles.empty()) {
+      return;
+    }
+    const float half = bounds.UniformScale() / 2;
+    const float center[3] = {
+      bounds.mins[0] + half, bounds.mins[1] + half, bounds.mins[2] + half
+    };
+    Split(&triangles, center, half, "", tiles);
+  }
+
+ private:
+  struct TriangleRef {
+    MaterialBatches::const_iterator batch;
+    unsigned int group_line;
+    size_t offset;  // into the batch's indices.
+    float centroid[3];
+  };
+
+  void Split(std::vector<TriangleRef>* triangles, const float* center,
+             float half, const std::string& path, TileList* tiles) const {
+    if (triangles->size() <= max_triangles_ || path.size() >= kMaxDepth) {
+      AddTile(*triangles, path, tiles);
+      return;
+    }
+    // Octant bit 0 is x, 1 is y and 2 is z. A stable partition keeps
+    // each group's triangles together and in order.
+    std::vector<TriangleRef> octants[8];
+    for (size_t i = 0; i < triangles->size(); ++i) {
+      const TriangleRef& triangle = (*triangles)[i];
+      int octant = 0;
+      for (int j = 0; j < 3; ++j) {
+        if (triangle.centroid[j] >= center[j]) {
+          octant |= 1 << j;
+        }
+      }
+      octants[octant].push_back(triangle);
+    }
+    std::vector<TriangleRef>().swap(*triangles);
+    const float quarter = half / 2;
+    for (int octant = 0; octant < 8; ++octant) {
+      if (octants[octant].empty()) continue;
+      float child_center[3];
+      for (int j = 0; j < 3; ++j) {
+        child_center[j] = center[j] +
+            ((octant & (1 << j)) ? quarter : -quarter);
+      }
+      Split(&octants[octant], child_center, quarter,
+            path + static_cast<char>('0' + octant), tiles);
+    }
+  }
+
+  void AddTile(const std::vector<TriangleRef>& triangles,
+               const std::string& path, TileList* tiles) const {
+    tiles->push_back(Tile());
+    Tile& tile = tiles->back();
+    tile.path = path;
+    for (size_t i = 0; i < triangles.size(); ++i) {
+      const TriangleRef& triangle = triangles[i];
+      tile.batches[triangle.batch->first].AddTriangleFrom(
+          triangle.batch->second, triangle.offset, triangle.group_line);
+    }
+    tile.bounds.Clear();
+    for (MaterialBatches::const_iterator iter = tile.batches.begin();
+         iter != tile.batches.end(); ++iter) {
+      tile.bounds.Enclose(iter->second.draw_mesh().attribs,
+                          iter->second.layout());
+    }
+  }
+
+  const MaterialBatches& batches_;
+  const size_t max_triangles_;
+};
+
+#endif  // WEBGL_LOADER_TILES_H_
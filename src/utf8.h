@@ -24,7 +24,7 @@ const uint16 kUtf8MoreBytesMask = 0x3F;
 const char kUtf8TwoBytePrefix = (char)0xC0; //static_cast<char>(0xC0);
 const char kUtf8ThreeBytePrefix = (char)0xE0; //static_cast<char>(0xE0);
 
-bool Uint16ToUtf8(uint16 word, std::vector<char>* utf8) {
+static inline bool Uint16ToUtf8(uint16 word, std::vector<char>* utf8) {
   if (word < 0x80) {
     utf8->push_back(static_cast<char>(word));
   } else if (word < 0x800) {
@@ -49,4 +49,29 @@ bool Uint16ToUtf8(uint16 word, std::vector<char>* utf8) {
   return true;
 }
 
+// The reverse of Uint16ToUtf8: decodes the word at |utf8|, which has
+// |size| bytes left, into |word|. Returns the bytes it took, or 0 if
+// they are not a word Uint16ToUtf8 writes.
+static inline size_t Utf8ToUint16(const char* utf8, size_t size, uint16* word) {
+  const unsigned char* bytes = reinterpret_cast<const unsigned char*>(utf8);
+  if (size >= 1 && bytes[0] < 0x80) {
+    *word = bytes[0];
+    return 1;
+  } else if (size >= 2 && (bytes[0] & 0xE0) == 0xC0) {
+    *word = static_cast<uint16>(((bytes[0] & 0x1F) << 6) |
+                                (bytes[1] & kUtf8MoreBytesMask));
+    return 2;
+  } else if (size >= 3 && (bytes[0] & 0xF0) == 0xE0) {
+    uint16 decoded = static_cast<uint16>(
+        ((bytes[0] & 0x0F) << 12) | ((bytes[1] & kUtf8MoreBytesMask) << 6) |
+        (bytes[2] & kUtf8MoreBytesMask));
+    if (decoded >= 0xE000) {
+      decoded -= 0x0800;
+    }
+    *word = decoded;
+    return 3;
+  }
+  return 0;
+}
+
 #endif  // WEBGL_LOADER_UTF8_H_
@@ -0,0 +1,102 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You
+// may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied. See the License for the specific language governing
+// permissions and limitations under the License.
+
+#ifndef WEBGL_LOADER_WRITER_H_
+#define WEBGL_LOADER_WRITER_H_
+
+// Writes the payloads on a thread of their own, so that a slow disk
+// (or network filesystem) is written while the next batch is encoded
+// instead of in between. Build with -pthread.
+
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+#include "base.h"
+#include "precompress.h"
+#include "thread.h"
+
+class AsyncWriter {
+ public:
+  // Every file written is handed on to |precompressor|, which must
+  // outlive the writer. At most |max_pending| files wait to be written,
+  // which bounds the memory they hold; Add() blocks past that.
+  AsyncWriter(Precompressor* precompressor, size_t max_pending)
+      : precompressor_(precompressor),
+        failed_(false),
+        pool_(1, max_pending) {
+  }
+
+  ~AsyncWriter() {
+    Finish();
+  }
+
+  // Queues |data| to be written to |fn|, taking its contents and leaving
+  // it empty. Its compressed copies are bundled unless it is |unbundled|.
+  void Add(const std::string& fn, std::vector<char>* data,
+           bool unbundled = false) {
+    WriteTask* task = new WriteTask(this, fn, unbundled);
+    task->data.swap(*data);
+    pool_.Add(task);
+  }
+
+  // Waits for every queued file. Returns false if any could not be
+  // written; each of those is reported on STDERR.
+  bool Finish() {
+    pool_.Wait();
+    MutexLock lock(&mutex_);
+    return !failed_;
+  }
+
+ private:
+  AsyncWriter(const AsyncWriter&);
+  void operator=(const AsyncWriter&);
+
+  class WriteTask : public ThreadPool::Task {
+   public:
+    WriteTask(AsyncWriter* owner, const std::string& fn, bool unbundled)
+        : owner_(owner), fn_(fn), unbundled_(unbundled) { }
+
+    virtual void Run() {
+      if (!WriteFile(fn_, data.empty() ? NULL : &data[0], data.size())) {
+        owner_->Fail(fn_);
+      } else if (unbundled_) {
+        owner_->precompressor_->AddFile(fn_);
+      } else {
+        owner_->precompressor_->AddBuffer(fn_, &data);
+      }
+    }
+
+    std::vector<char> data;
+
+   private:
+    AsyncWriter* const owner_;
+    const std::string fn_;
+    const bool unbundled_;
+  };
+
+  void Fail(const std::string& fn) {
+    MutexLock lock(&mutex_);
+    failed_ = true;
+    fprintf(stderr, "ERROR: could not write %s\n", fn.c_str());
+  }
+
+  Precompressor* const precompressor_;
+  Mutex mutex_;  // Guards failed_.
+  bool failed_;
+  ThreadPool pool_;
+};
+
+#endif  // WEBGL_LOADER_WRITER_H_